@@ -0,0 +1,227 @@
+/*
+ * Fast String Matcher Library Approximate Search Benchmark
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Times fsmtrie_search_approx_ctx() on a trie of random domain names with the
+ * edit distance matrix, with the Levenshtein automaton and with an index of
+ * deletions up to a distance of two (of the first 8 bytes of keys), searching
+ * for keys of the trie with one character replaced. The first two tries
+ * answer a distance of one by the same direct lookups, the index trie walks
+ * the trie with the matrix beyond a distance of two. The queries are searched
+ * for one at a time and, on the first trie, as a batch with
+ * fsmtrie_search_approx_batch().
+ *
+ * usage: approx [keys [queries [max dist]]]
+ */
+
+#include <time.h>
+
+#include <fsmtrie/fsmtrie.h>
+
+static void approx_count(const char *str, int dist, void *data)
+{
+	(*(unsigned long *)data)++;
+}
+
+static void approx_batch_count(size_t key, const char *str, int dist,
+		void *data)
+{
+	(*(unsigned long *)data)++;
+}
+
+static unsigned int rnd(unsigned int *seed)
+{
+	*seed = *seed * 1103515245 + 12345;
+	return (*seed / 65536);
+}
+
+static fsmtrie_t trie_new(bool automaton, int index, char **keys, int nkeys)
+{
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	int n;
+
+	if ((opt = fsmtrie_opt_init()) == NULL)
+	{
+		fprintf(stderr, "fsmtrie_opt_init() failed\n");
+		return (NULL);
+	}
+	fsmtrie_opt_set_mode(opt, fsmtrie_mode_eascii);
+	fsmtrie_opt_set_maxlength(opt, 64);
+	fsmtrie_opt_set_approx_automaton(opt, automaton);
+	fsmtrie_opt_set_approx_index(opt, index);
+	fsmtrie_opt_set_approx_index_prefix(opt, 8);
+	fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf));
+	fsmtrie_opt_destroy(&opt);
+	if (fsmtrie == NULL)
+	{
+		fprintf(stderr, "fsmtrie_init() failed: %s\n", err_buf);
+		return (NULL);
+	}
+
+	for (n = 0; n < nkeys; n++)
+	{
+		if (fsmtrie_insert(fsmtrie, keys[n], NULL) != 1)
+		{
+			fprintf(stderr, "fsmtrie_insert() failed: %s\n",
+					fsmtrie_get_error(fsmtrie));
+			fsmtrie_destroy(&fsmtrie);
+			return (NULL);
+		}
+	}
+	if (!fsmtrie_compile(fsmtrie))
+	{
+		fprintf(stderr, "fsmtrie_compile() failed: %s\n",
+				fsmtrie_get_error(fsmtrie));
+		fsmtrie_destroy(&fsmtrie);
+		return (NULL);
+	}
+	return (fsmtrie);
+}
+
+/* CPU time per query in microseconds */
+static double run(fsmtrie_t fsmtrie, fsmtrie_asearch_ctx_t ctx,
+		char **queries, int nqueries, int dist, unsigned long *matches)
+{
+	clock_t start = clock();
+	int n;
+
+	*matches = 0;
+	for (n = 0; n < nqueries; n++)
+	{
+		fsmtrie_search_approx_ctx(fsmtrie, ctx, queries[n],
+				strlen(queries[n]), dist, approx_count,
+				matches);
+	}
+	return ((double)(clock() - start) / CLOCKS_PER_SEC * 1e6 / nqueries);
+}
+
+/* CPU time per query in microseconds, searching for all queries at once */
+static double run_batch(fsmtrie_t fsmtrie, char **queries, int nqueries,
+		int dist, unsigned long *matches)
+{
+	clock_t start = clock();
+
+	*matches = 0;
+	fsmtrie_search_approx_batch(fsmtrie, (const char * const *)queries,
+			nqueries, dist, approx_batch_count, matches);
+	return ((double)(clock() - start) / CLOCKS_PER_SEC * 1e6 / nqueries);
+}
+
+int main(int argc, char **argv)
+{
+	int nkeys = argc > 1 ? atoi(argv[1]) : 100000;
+	int nqueries = argc > 2 ? atoi(argv[2]) : 1000;
+	int max_dist = argc > 3 ? atoi(argv[3]) : 3;
+	unsigned int seed = 1;
+	unsigned long matches, matches_lev, matches_idx, matches_batch;
+	fsmtrie_t fsmtrie, fsmtrie_lev, fsmtrie_idx;
+	fsmtrie_asearch_ctx_t ctx;
+	char **keys, **queries;
+	int n, m, len, dist;
+	double us, us_lev, us_idx, us_batch;
+
+	if (nkeys < 1 || nqueries < 1 || nqueries > nkeys)
+	{
+		fprintf(stderr, "usage: %s [keys [queries [max dist]]]\n",
+				argv[0]);
+		return (EXIT_FAILURE);
+	}
+
+	keys = calloc(nkeys, sizeof (*keys));
+	queries = calloc(nqueries, sizeof (*queries));
+	ctx = fsmtrie_asearch_ctx_init();
+	if (keys == NULL || queries == NULL || ctx == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return (EXIT_FAILURE);
+	}
+	for (n = 0; n < nkeys; n++)
+	{
+		len = 6 + rnd(&seed) % 12;
+		if ((keys[n] = malloc(len + sizeof (".com"))) == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			return (EXIT_FAILURE);
+		}
+		for (m = 0; m < len; m++)
+		{
+			keys[n][m] = 'a' + rnd(&seed) % 26;
+		}
+		strcpy(&keys[n][len], ".com");
+		if (n < nqueries)
+		{
+			if ((queries[n] = strdup(keys[n])) == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				return (EXIT_FAILURE);
+			}
+			queries[n][rnd(&seed) % len] = 'x';
+		}
+	}
+
+	if ((fsmtrie = trie_new(false, 0, keys, nkeys)) == NULL ||
+			(fsmtrie_lev = trie_new(true, 0, keys, nkeys)) == NULL ||
+			(fsmtrie_idx = trie_new(false, 2, keys, nkeys)) == NULL)
+	{
+		return (EXIT_FAILURE);
+	}
+
+	printf("%d keys, %d queries, CPU time per query\n", nkeys, nqueries);
+	for (dist = 0; dist <= max_dist; dist++)
+	{
+		us = run(fsmtrie, ctx, queries, nqueries, dist, &matches);
+		us_lev = run(fsmtrie_lev, ctx, queries, nqueries, dist,
+				&matches_lev);
+		us_idx = run(fsmtrie_idx, ctx, queries, nqueries, dist,
+				&matches_idx);
+		us_batch = run_batch(fsmtrie, queries, nqueries, dist,
+				&matches_batch);
+		printf("dist %d: matrix %10.1f us, automaton %10.1f us "
+				"(%.2fx), index %10.1f us (%.2fx), "
+				"batch %10.1f us (%.2fx), %lu matches\n", dist,
+				us, us_lev, us / us_lev, us_idx, us / us_idx,
+				us_batch, us / us_batch, matches);
+		if (matches != matches_lev || matches != matches_idx ||
+				matches != matches_batch)
+		{
+			fprintf(stderr, "engines disagree: %lu, %lu, %lu, %lu "
+					"matches\n", matches, matches_lev,
+					matches_idx, matches_batch);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_destroy(&fsmtrie_lev);
+	fsmtrie_destroy(&fsmtrie_idx);
+	fsmtrie_asearch_ctx_destroy(&ctx);
+	for (n = 0; n < nkeys; n++)
+	{
+		free(keys[n]);
+	}
+	for (n = 0; n < nqueries; n++)
+	{
+		free(queries[n]);
+	}
+	free(keys);
+	free(queries);
+
+	return (EXIT_SUCCESS);
+}
@@ -0,0 +1,435 @@
+/*
+ * Fast String Matcher Batched Approximate Search Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * A batch of queries is sorted into a query trie, and the trie is walked
+ * once for all of them. Where a single search keeps a DP column over the
+ * positions of its key, the batch keeps one over the nodes of the query
+ * trie: the entry of a query node is the (optimal string alignment)
+ * distance of its prefix to the trie prefix walked, and queries sharing a
+ * prefix share the entries of its nodes, computed once per trie node.
+ *
+ * Columns are sparse, holding only the nodes within the distance bound. The
+ * next column follows from the previous two: a node is reached by an
+ * insertion from itself, a match or substitution from its parent, a
+ * transposition from its grandparent and a deletion from its parent in the
+ * same column, the last being propagated down the query trie until it runs
+ * out of bounds.
+ */
+
+/* \cond */
+/* a query trie node, nodes are numbered in preorder */
+struct _fsmtrie_qnode
+{
+	uint32_t end;			/* past the last node of the subtree */
+	uint32_t qfirst;		/* first query ending here, sorted */
+	uint32_t qcnt;			/* number of queries ending here */
+	uint8_t label;			/* byte of the edge into the node */
+};
+
+/* a query sorted into the query trie */
+struct _fsmtrie_query
+{
+	const char *key;
+	size_t idx;			/* position in the batch */
+};
+
+/* a column entry */
+struct _fsmtrie_qent
+{
+	uint32_t q;			/* query node */
+	int dist;			/* distance of its prefix */
+};
+
+/* a column, a slice of the entries of the walk */
+struct _fsmtrie_qcol
+{
+	size_t start;
+	size_t len;
+};
+
+struct _fsmtrie_abatch
+{
+	struct _fsmtrie_qnode *nodes;
+	uint32_t nnodes;
+	struct _fsmtrie_query *queries;
+	size_t maxlen;			/* length of the longest query */
+	int k;				/* distance bound */
+
+	/* the column being computed, by query node */
+	int *dist;
+	uint32_t *stamp;		/* token if the node is in the column */
+	uint32_t token;
+
+	struct fsmtrie_buf ents;	/* entries of the columns of the walk */
+	struct fsmtrie_buf work;	/* nodes whose deletions to propagate */
+};
+/* \endcond */
+
+static int
+_fsmtrie_query_cmp(const void *a, const void *b)
+{
+	return (strcmp(((const struct _fsmtrie_query *)a)->key,
+				((const struct _fsmtrie_query *)b)->key));
+}
+
+/* sort the queries and build their trie */
+static bool
+_fsmtrie_abatch_init(struct _fsmtrie_abatch *b, const char * const *keys,
+		size_t nkeys)
+{
+	const unsigned char *key, *prev = (const unsigned char *)"";
+	uint32_t *path, *parent, n;
+	size_t i, len, bytes = 0, lcp;
+
+	if ((b->queries = malloc((nkeys ? nkeys : 1) *
+					sizeof (*b->queries))) == NULL)
+	{
+		return (false);
+	}
+	for (i = 0; i < nkeys; i++)
+	{
+		b->queries[i].key = keys[i];
+		b->queries[i].idx = i;
+		len = strlen(keys[i]);
+		bytes += len;
+		b->maxlen = len > b->maxlen ? len : b->maxlen;
+	}
+	if (bytes >= UINT32_MAX || nkeys >= UINT32_MAX)
+	{
+		errno = ENOMEM;
+		return (false);
+	}
+	qsort(b->queries, nkeys, sizeof (*b->queries), _fsmtrie_query_cmp);
+
+	b->nodes = calloc(bytes + 1, sizeof (*b->nodes));
+	b->dist = malloc((bytes + 1) * sizeof (*b->dist));
+	b->stamp = calloc(bytes + 1, sizeof (*b->stamp));
+	parent = malloc((bytes + 1) * sizeof (*parent));
+	path = malloc((b->maxlen + 1) * sizeof (*path));
+	if (b->nodes == NULL || b->dist == NULL || b->stamp == NULL ||
+			parent == NULL || path == NULL)
+	{
+		free(parent);
+		free(path);
+		return (false);
+	}
+
+	/* a query adds the nodes past its common prefix with the previous */
+	path[0] = 0;
+	b->nnodes = 1;
+	for (i = 0; i < nkeys; i++)
+	{
+		key = (const unsigned char *)b->queries[i].key;
+		for (lcp = 0; key[lcp] != '\0' && key[lcp] == prev[lcp]; lcp++)
+			;
+		for (; key[lcp] != '\0'; lcp++)
+		{
+			n = b->nnodes++;
+			b->nodes[n].label = key[lcp];
+			parent[n] = path[lcp];
+			path[lcp + 1] = n;
+		}
+		n = path[lcp];
+		if (b->nodes[n].qcnt++ == 0)
+		{
+			b->nodes[n].qfirst = i;
+		}
+		prev = key;
+	}
+
+	/* subtree sizes first, children follow their parent */
+	for (n = 0; n < b->nnodes; n++)
+	{
+		b->nodes[n].end = 1;
+	}
+	for (n = b->nnodes - 1; n > 0; n--)
+	{
+		b->nodes[parent[n]].end += b->nodes[n].end;
+	}
+	for (n = 0; n < b->nnodes; n++)
+	{
+		b->nodes[n].end += n;
+	}
+
+	free(parent);
+	free(path);
+	return (true);
+}
+
+static void
+_fsmtrie_abatch_free(struct _fsmtrie_abatch *b)
+{
+	free(b->nodes);
+	free(b->queries);
+	free(b->dist);
+	free(b->stamp);
+	free(b->ents.p);
+	free(b->work.p);
+}
+
+/* lower the distance of node q in the column at col to d */
+static bool
+_fsmtrie_abatch_relax(struct _fsmtrie_abatch *b, struct _fsmtrie_qcol *col,
+		size_t *nwork, uint32_t q, int d)
+{
+	struct _fsmtrie_qent *ents;
+	uint32_t *work;
+
+	if (d > b->k || (b->stamp[q] == b->token && b->dist[q] <= d))
+	{
+		return (true);
+	}
+	if (b->stamp[q] != b->token)
+	{
+		ents = _fsmtrie_buf_reserve(&b->ents,
+				(col->start + col->len + 1) * sizeof (*ents));
+		if (ents == NULL)
+		{
+			return (false);
+		}
+		ents[col->start + col->len++].q = q;
+		b->stamp[q] = b->token;
+	}
+	b->dist[q] = d;
+
+	/* deletions from q may be in bounds */
+	if (d < b->k)
+	{
+		work = _fsmtrie_buf_reserve(&b->work,
+				(*nwork + 1) * sizeof (*work));
+		if (work == NULL)
+		{
+			return (false);
+		}
+		work[(*nwork)++] = q;
+	}
+
+	return (true);
+}
+
+/*
+ * Compute column next, following col and prev, the one before, by trie
+ * character c, c_prev being the character before. A negative c computes the
+ * column of the trie root from empty ones.
+ */
+static bool
+_fsmtrie_abatch_step(struct _fsmtrie_abatch *b,
+		const struct _fsmtrie_qcol *prev,
+		const struct _fsmtrie_qcol *col, struct _fsmtrie_qcol *next,
+		int c, int c_prev)
+{
+	const struct _fsmtrie_qnode *nodes = b->nodes;
+	struct _fsmtrie_qent e, *ents;
+	uint32_t q, ch, gch;
+	size_t i, nwork = 0;
+	int d;
+
+	if (++b->token == 0)
+	{
+		memset(b->stamp, 0, b->nnodes * sizeof (*b->stamp));
+		b->token = 1;
+	}
+	next->start = col->start + col->len;
+	next->len = 0;
+
+	/* against the empty trie prefix, only deletions reach a node */
+	if (c < 0 && !_fsmtrie_abatch_relax(b, next, &nwork, 0, 0))
+	{
+		return (false);
+	}
+
+	/* entries move as the buffer grows, copy them out */
+	for (i = 0; i < col->len; i++)
+	{
+		e = ((struct _fsmtrie_qent *)b->ents.p)[col->start + i];
+		if (!_fsmtrie_abatch_relax(b, next, &nwork, e.q, e.dist + 1))
+		{
+			return (false);
+		}
+		for (ch = e.q + 1; ch < nodes[e.q].end; ch = nodes[ch].end)
+		{
+			d = e.dist + (nodes[ch].label != c);
+			if (!_fsmtrie_abatch_relax(b, next, &nwork, ch, d))
+			{
+				return (false);
+			}
+		}
+	}
+
+	for (i = 0; i < prev->len; i++)
+	{
+		e = ((struct _fsmtrie_qent *)b->ents.p)[prev->start + i];
+		if (e.dist >= b->k)
+		{
+			continue;
+		}
+		for (ch = e.q + 1; ch < nodes[e.q].end; ch = nodes[ch].end)
+		{
+			if (nodes[ch].label != c)
+			{
+				continue;
+			}
+			for (gch = ch + 1; gch < nodes[ch].end;
+					gch = nodes[gch].end)
+			{
+				if (nodes[gch].label == c_prev &&
+						!_fsmtrie_abatch_relax(b, next,
+							&nwork, gch,
+							e.dist + 1))
+				{
+					return (false);
+				}
+			}
+		}
+	}
+
+	/* nodes are queued again whenever their distance drops */
+	while (nwork > 0)
+	{
+		q = ((uint32_t *)b->work.p)[--nwork];
+		d = b->dist[q] + 1;
+		for (ch = q + 1; ch < nodes[q].end; ch = nodes[ch].end)
+		{
+			if (!_fsmtrie_abatch_relax(b, next, &nwork, ch, d))
+			{
+				return (false);
+			}
+		}
+	}
+
+	ents = b->ents.p;
+	for (i = 0; i < next->len; i++)
+	{
+		ents[next->start + i].dist = b->dist[ents[next->start + i].q];
+	}
+
+	return (true);
+}
+
+static bool
+_fsmtrie_abatch_walk(struct _fsmtrie_abatch *b,
+		const struct fsmtrie_view *view, uint32_t depth,
+		void (*cb)(size_t, const char *, int, void *), void *cbdata)
+{
+	const struct _fsmtrie_qnode *qn;
+	const struct _fsmtrie_qent *e;
+	struct _fsmtrie_qcol *cols;
+	fsmtrie_ref_t *nodes, node, child;
+	int *chars, c, i;
+	uint32_t n;
+	size_t j;
+	bool ok = false;
+
+	/* no query is within the bound of a trie prefix this much longer */
+	if ((size_t)depth > b->maxlen + b->k)
+	{
+		depth = b->maxlen + b->k;
+	}
+
+	/* the column of depth i is cols[i + 1], cols[0] is empty */
+	cols = calloc((size_t)depth + 3, sizeof (*cols));
+	nodes = malloc(((size_t)depth + 1) * sizeof (*nodes));
+	chars = malloc(((size_t)depth + 1) * sizeof (*chars));
+	if (cols == NULL || nodes == NULL || chars == NULL ||
+			!_fsmtrie_abatch_step(b, &cols[0], &cols[0], &cols[1],
+				-1, -1))
+	{
+		goto out;
+	}
+
+	node = _fsmtrie_view_root(view);
+	nodes[0] = FSMTRIE_REF_NONE;
+	chars[0] = 0;
+	i = 0;
+
+	while (node != FSMTRIE_REF_NONE)
+	{
+		for (c = _fsmtrie_view_next(view, node, chars[i], &child);
+				c >= 0;
+				c = _fsmtrie_view_next(view, node, c + 1, &child))
+		{
+			if (!_fsmtrie_abatch_step(b, &cols[i], &cols[i + 1],
+						&cols[i + 2], c,
+						i > 0 ? chars[i - 1] - 1 : -1))
+			{
+				goto out;
+			}
+			if (cols[i + 2].len == 0)
+			{
+				continue;
+			}
+
+			if (_fsmtrie_view_leaf(view, child))
+			{
+				e = (const struct _fsmtrie_qent *)b->ents.p +
+					cols[i + 2].start;
+				for (j = 0; j < cols[i + 2].len; j++)
+				{
+					qn = &b->nodes[e[j].q];
+					for (n = 0; n < qn->qcnt; n++)
+					{
+						cb(b->queries[qn->qfirst +
+								n].idx,
+							_fsmtrie_view_str(view,
+								child),
+							e[j].dist, cbdata);
+					}
+				}
+			}
+
+			if (i < (int)depth)
+			{
+				chars[i++] = c + 1;
+				nodes[i] = node;
+				node = child;
+				c = -1;
+				chars[i] = 0;
+			}
+		}
+
+		node = nodes[i--];
+	}
+	ok = true;
+
+out:
+	free(cols);
+	free(nodes);
+	free(chars);
+	return (ok);
+}
+
+bool
+_fsmtrie_approx_batch(const struct fsmtrie_view *view,
+		const char * const *keys, size_t nkeys, int max_dist,
+		uint32_t depth, void (*cb)(size_t, const char *, int, void *),
+		void *cbdata)
+{
+	struct _fsmtrie_abatch b;
+	bool ok;
+
+	memset(&b, 0, sizeof (b));
+	b.k = max_dist;
+	ok = _fsmtrie_abatch_init(&b, keys, nkeys) &&
+		_fsmtrie_abatch_walk(&b, view, depth, cb, cbdata);
+	_fsmtrie_abatch_free(&b);
+
+	return (ok);
+}
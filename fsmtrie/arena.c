@@ -0,0 +1,260 @@
+/*
+ * Fast String Matcher Node Arena Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/* \cond */
+/*
+ * Every node, child table and leaf string of a trie is carved out of slabs
+ * owned by the trie's arena. Objects are grouped into size classes of
+ * FSMTRIE_ARENA_GRAIN bytes and every class bump allocates from slabs of its
+ * own, so nodes and tables of the same kind end up packed next to each
+ * other. Freed objects (such as child tables replaced by a larger kind) go
+ * onto a per-class free list for reuse. Objects larger than the largest
+ * class get a slab of their own.
+ *
+ * Destroying the arena releases the slabs wholesale; nothing inside them is
+ * ever visited.
+ */
+struct fsmtrie_slab
+{
+	struct fsmtrie_slab *next;	/* all slabs of the arena */
+	struct fsmtrie_slab *prev;	/* only maintained for big slabs */
+	size_t size;			/* usable size */
+	uint8_t big;			/* holds a single oversized object */
+	uint8_t pad[7];
+};
+/* \endcond */
+
+/* size of a class by index */
+#define FSMTRIE_ARENA_CLASS_SIZE(n)	(((n) + 1) * FSMTRIE_ARENA_GRAIN)
+
+/* data area of a slab */
+#define FSMTRIE_SLAB_DATA(s)	((uint8_t *)(s) + sizeof (struct fsmtrie_slab))
+
+static size_t
+_fsmtrie_arena_class(size_t size)
+{
+	if (size == 0)
+	{
+		size = 1;
+	}
+	return ((size - 1) / FSMTRIE_ARENA_GRAIN);
+}
+
+static void *
+_fsmtrie_arena_big(struct fsmtrie_arena *a, size_t size)
+{
+	struct fsmtrie_slab *s;
+
+	s = calloc(1, sizeof (*s) + size);
+	if (s == NULL)
+	{
+		return (NULL);
+	}
+	s->size = size;
+	s->big = 1;
+	s->next = a->slabs;
+	if (a->slabs != NULL)
+	{
+		a->slabs->prev = s;
+	}
+	a->slabs = s;
+	a->bytes += size;
+
+	return (FSMTRIE_SLAB_DATA(s));
+}
+
+void *
+_fsmtrie_arena_alloc(struct fsmtrie_arena *a, size_t size)
+{
+	struct fsmtrie_slab *s;
+	size_t csize, ssize;
+	void *p;
+	size_t n;
+
+	n = _fsmtrie_arena_class(size);
+	if (n >= FSMTRIE_ARENA_CLASSES)
+	{
+		return (_fsmtrie_arena_big(a, size));
+	}
+	csize = FSMTRIE_ARENA_CLASS_SIZE(n);
+
+	/* reuse a freed object of this class if there is one */
+	if ((p = a->free[n]) != NULL)
+	{
+		a->free[n] = *(void **)p;
+		memset(p, 0, csize);
+		return (p);
+	}
+
+	if (a->cur[n] == NULL || a->cur[n] + csize > a->end[n])
+	{
+		/* slabs start small and double up to FSMTRIE_ARENA_SLAB so
+		 * small tries don't pay for a large slab per class.
+		 */
+		ssize = FSMTRIE_ARENA_SLAB_FIRST << a->grow[n];
+		if (ssize < FSMTRIE_ARENA_SLAB)
+		{
+			a->grow[n]++;
+		}
+		if (ssize < csize * FSMTRIE_ARENA_SLAB_MIN)
+		{
+			ssize = csize * FSMTRIE_ARENA_SLAB_MIN;
+		}
+		s = calloc(1, sizeof (*s) + ssize);
+		if (s == NULL)
+		{
+			return (NULL);
+		}
+		s->size = ssize;
+		s->next = a->slabs;
+		if (a->slabs != NULL)
+		{
+			a->slabs->prev = s;
+		}
+		a->slabs = s;
+		a->bytes += ssize;
+		a->cur[n] = FSMTRIE_SLAB_DATA(s);
+		a->end[n] = FSMTRIE_SLAB_DATA(s) + ssize;
+	}
+
+	/* slabs are calloc()ed, bump allocated memory is already zeroed */
+	p = a->cur[n];
+	a->cur[n] += csize;
+
+	return (p);
+}
+
+void
+_fsmtrie_arena_free(struct fsmtrie_arena *a, void *p, size_t size)
+{
+	struct fsmtrie_slab *s;
+	size_t n;
+
+	if (p == NULL)
+	{
+		return;
+	}
+
+	n = _fsmtrie_arena_class(size);
+	if (n >= FSMTRIE_ARENA_CLASSES)
+	{
+		/* oversized objects own their slab, unlink and release it */
+		s = (struct fsmtrie_slab *)((uint8_t *)p - sizeof (*s));
+		if (s->prev != NULL)
+		{
+			s->prev->next = s->next;
+		}
+		else
+		{
+			a->slabs = s->next;
+		}
+		if (s->next != NULL)
+		{
+			s->next->prev = s->prev;
+		}
+		a->bytes -= s->size;
+		free(s);
+		return;
+	}
+
+	*(void **)p = a->free[n];
+	a->free[n] = p;
+}
+
+void *
+_fsmtrie_arena_realloc(struct fsmtrie_arena *a, void *p, size_t old_size,
+		size_t new_size)
+{
+	void *np;
+
+	if (p != NULL && _fsmtrie_arena_class(old_size) ==
+			_fsmtrie_arena_class(new_size) &&
+			_fsmtrie_arena_class(new_size) < FSMTRIE_ARENA_CLASSES)
+	{
+		/* still fits its class */
+		if (new_size > old_size)
+		{
+			memset((uint8_t *)p + old_size, 0, new_size - old_size);
+		}
+		return (p);
+	}
+
+	if ((np = _fsmtrie_arena_alloc(a, new_size)) == NULL)
+	{
+		return (NULL);
+	}
+	if (p != NULL)
+	{
+		memcpy(np, p, old_size < new_size ? old_size : new_size);
+		_fsmtrie_arena_free(a, p, old_size);
+	}
+
+	return (np);
+}
+
+char *
+_fsmtrie_arena_strdup(struct fsmtrie_arena *a, const char *str)
+{
+	size_t len;
+	char *p;
+
+	len = strlen(str) + 1;
+	if ((p = _fsmtrie_arena_alloc(a, len)) == NULL)
+	{
+		return (NULL);
+	}
+	memcpy(p, str, len);
+
+	return (p);
+}
+
+void
+_fsmtrie_arena_merge(struct fsmtrie_arena *dst, struct fsmtrie_arena *src)
+{
+	struct fsmtrie_slab *s;
+
+	/* the rest of src's current slabs and its free objects go unused */
+	if (src->slabs != NULL)
+	{
+		for (s = src->slabs; s->next != NULL; s = s->next)
+			;
+		s->next = dst->slabs;
+		if (dst->slabs != NULL)
+		{
+			dst->slabs->prev = s;
+		}
+		dst->slabs = src->slabs;
+		dst->bytes += src->bytes;
+	}
+	memset(src, 0, sizeof (*src));
+}
+
+void
+_fsmtrie_arena_destroy(struct fsmtrie_arena *a)
+{
+	struct fsmtrie_slab *s, *next;
+
+	for (s = a->slabs; s != NULL; s = next)
+	{
+		next = s->next;
+		free(s);
+	}
+	memset(a, 0, sizeof (*a));
+}
@@ -100,6 +100,66 @@ sim_row_last(struct sim_row *row, int *index, int *value)
 	return ((row->len > 0) && sim_row_elem(row, row->len-1, index, value));
 }
 
+void *
+_fsmtrie_buf_reserve(struct fsmtrie_buf *b, size_t size)
+{
+	size_t new_size;
+	void *p;
+
+	if (size <= b->size)
+	{
+		return (b->p);
+	}
+	for (new_size = b->size ? b->size : 64; new_size < size; new_size *= 2)
+		;
+	if ((p = realloc(b->p, new_size)) == NULL)
+	{
+		return (NULL);
+	}
+	b->p = p;
+	b->size = new_size;
+
+	return (p);
+}
+
+static void
+_fsmtrie_asearch_ctx_free(struct fsmtrie_asearch_ctx *ctx)
+{
+	free(ctx->stack.p);
+	free(ctx->matrix.p);
+	free(ctx->edits.p);
+	free(ctx->cand.p);
+	free(ctx->lev_states.p);
+	free(ctx->lev_delta.p);
+	free(ctx->lev_hash[0].p);
+	free(ctx->lev_hash[1].p);
+	free(ctx->lev_key.p);
+}
+
+/*
+ * Carve the per depth arrays of a walk down to depth out of the context's
+ * stack, each entry of the first being size bytes (a multiple of the
+ * alignment of fsmtrie_ref_t).
+ */
+static void *
+_fsmtrie_asearch_stack(struct fsmtrie_asearch_ctx *ctx, uint32_t depth,
+		size_t size, fsmtrie_ref_t **nodes, int **chars)
+{
+	size_t n = (size_t)depth + 1;
+	uint8_t *p;
+
+	p = _fsmtrie_buf_reserve(&ctx->stack,
+			n * (size + sizeof (**nodes) + sizeof (**chars)));
+	if (p == NULL)
+	{
+		return (NULL);
+	}
+	*nodes = (fsmtrie_ref_t *)(p + n * size);
+	*chars = (int *)(p + n * (size + sizeof (**nodes)));
+
+	return (p);
+}
+
 /*
  * Traverse the trie searching for elements with an edit distance of
  * at most max_dist from the supplied key. The edit distance implemented
@@ -107,64 +167,55 @@ sim_row_last(struct sim_row *row, int *index, int *value)
  * in which transposition of adjacent characters are counted as a single
  * edit, rather than a deletion and insertion in standard Levenshtein.
  */
-int
-fsmtrie_search_approx(struct fsmtrie *f, const char *key, int max_dist,
+static bool
+_fsmtrie_approx_sim(struct fsmtrie_asearch_ctx *ctx,
+		const struct fsmtrie_view *view, const unsigned char *key_u,
+		int keylen, int max_dist, uint32_t depth,
 		void (*cb)(const char *, int, void *), void *cbdata)
 {
-	const unsigned char *key_u = (unsigned char *)key;
+	/* a row holds the key prefixes within max_dist of the trie prefix */
+	size_t per = max_dist < 0 ? 0 : max_dist < keylen ?
+		2 * (size_t)max_dist + 1 : (size_t)keylen + 1;
+	size_t mlen = per * ((size_t)depth + 1);
 
-	if (f->max_len == 0)
-	{
-		snprintf(f->err_buf,
-			sizeof (f->err_buf),
-			"%s() requires fsmtrie to be initialized with max_len",
-			__func__);
-                return (-1);
-	}
-
-	if (f->mode == fsmtrie_mode_token)
-	{
-		snprintf(f->err_buf,
-			sizeof (f->err_buf),
-			"%s() is incompatible with %s mode fsmtrie",
-			__func__, _mode_to_str(f->mode));
-                return (-1);
-	}
-
-	int keylen = strlen(key);
-	int mlen = (2 * max_dist + 1) * (f->max_len + 1);
-
-	struct sim_entry matrix[mlen], *end = &matrix[mlen];
-	struct sim_row rows[f->max_len + 1];
+	struct sim_entry *matrix, *end;
+	struct sim_row *rows;
 
 	/* node and character stacks */
-	fsmtrie_node_t *nodes[f->max_len + 1];
-	unsigned char chars[keylen + 1];
+	fsmtrie_ref_t *nodes;
+	/* next code point to visit at every depth, up to 256 */
+	int *chars;
 
 	int c, i, j, k, index, value;
-	fsmtrie_node_t *node, *child;
+	fsmtrie_ref_t node, child;
+
+	matrix = _fsmtrie_buf_reserve(&ctx->matrix, mlen * sizeof (*matrix));
+	rows = _fsmtrie_asearch_stack(ctx, depth, sizeof (*rows), &nodes,
+			&chars);
+	if (matrix == NULL || rows == NULL)
+	{
+		return (false);
+	}
+	end = &matrix[mlen];
 
 	sim_row_first(&rows[0], &matrix[0]);
 
-	for (j = 0; j <= max_dist && j < (int)f->max_len; j++)
+	for (j = 0; j <= max_dist && j <= keylen; j++)
 	{
 		assert(sim_row_append(&rows[0], end, j, j));
 	}
 
-	node = f->root;
-	nodes[0] = NULL;
+	node = _fsmtrie_view_root(view);
+	nodes[0] = FSMTRIE_REF_NONE;
 	chars[0] = 0;
 	i = 0;
 
-	while (node)
+	while (node != FSMTRIE_REF_NONE)
 	{
-		for (c = chars[i]; c < f->nrnodes; c++)
+		for (c = _fsmtrie_view_next(view, node, chars[i], &child);
+				c >= 0;
+				c = _fsmtrie_view_next(view, node, c + 1, &child))
 		{
-			if (node->nodes[c] == NULL)
-			{
-				continue;
-			}
-			child = node->nodes[c];
 
 			assert(sim_row_next(&rows[i], &rows[i+1], end));
 
@@ -179,7 +230,8 @@ fsmtrie_search_approx(struct fsmtrie *f, const char *key, int max_dist,
 					j++)
 			{
 				int lindex, lvalue;
-				int cost = (c == key_u[index])? 0 : 1;
+				int cost = (index < keylen &&
+						c == key_u[index]) ? 0 : 1;
 				int dist = value + cost;
 
 				/* adjacent previous element in next row. */
@@ -207,7 +259,7 @@ fsmtrie_search_approx(struct fsmtrie *f, const char *key, int max_dist,
 				/* Count a transposition as a single change
 				 * from the previous element in the previous
 				 * row. */
-				if (i > 0 && index > 0 &&
+				if (i > 0 && index > 0 && index < keylen &&
 					(key_u[index] == chars[i-1] - 1) &&
 					(key_u[index-1] == c))
 				{
@@ -247,7 +299,7 @@ fsmtrie_search_approx(struct fsmtrie *f, const char *key, int max_dist,
 				continue;
 			}
 
-			if (child->type & FSMTRIE_NODE_LEAF)
+			if (_fsmtrie_view_leaf(view, child))
 			{
 				/* Adding this character results in a string
 				   which was inserted into the trie, and at
@@ -259,13 +311,15 @@ fsmtrie_search_approx(struct fsmtrie *f, const char *key, int max_dist,
 				{
 					if (index == keylen)
 					{
-						cb(child->str, value, cbdata);
+						cb(_fsmtrie_view_str(view,
+								child), value,
+								cbdata);
 					}
 				}
 			}
 
 
-			if (i < (int)f->max_len)
+			if (i < (int)depth)
 			{
 				/* If the child node could have children,
 				   save our current node and character,
@@ -274,13 +328,669 @@ fsmtrie_search_approx(struct fsmtrie *f, const char *key, int max_dist,
 				chars[i++] = c + 1;
 				nodes[i] = node;
 				node = child;
-				c = 0;
+				c = -1;
 				chars[i] = 0;
 			}
 		}
 
 		/* done iterating, restore the previous (parent) node. */
 		node = nodes[i--];
-        }
-	return (1);
+	}
+
+	return (true);
+}
+
+/*
+ * Keys of up to 64 bytes are matched bit-parallel instead (Myers' algorithm
+ * with Hyyrö's extension to transpositions): a whole column of the DP
+ * matrix, the distances of every key prefix to the trie prefix, is kept as
+ * bit vectors of the +1 and -1 differences between adjacent entries, and
+ * extending the trie prefix by a character takes a few word operations
+ * regardless of the distance bound.
+ */
+#define FSMTRIE_APPROX_BV_MAX	64
+
+/* \cond */
+/* DP column of one trie depth */
+struct _fsmtrie_bv
+{
+	uint64_t vp, vn;		/* entries one above/below previous */
+	uint64_t d0;			/* entries equal to the diagonal one */
+	uint64_t pm;			/* key positions of the edge character */
+	int score;			/* distance of the whole key */
+	int lo;				/* first entry that may be in bounds */
+	int dlo;			/* its value */
+};
+/* \endcond */
+
+/* difference of entry j + 1 over entry j of a column, given its deltas */
+static inline int
+_fsmtrie_bv_delta(uint64_t p, uint64_t n, int j)
+{
+	return ((int)((p >> j) & 1) - (int)((n >> j) & 1));
+}
+
+/*
+ * Extend the trie prefix of column s, at depth - 1, by a character found in
+ * the key at the positions set in pm. Returns whether any key prefix is
+ * still within max_dist of the trie prefix, that is whether it may lead to
+ * matches.
+ */
+static inline bool
+_fsmtrie_bv_step(const struct _fsmtrie_bv *s, struct _fsmtrie_bv *next,
+		uint64_t pm, int depth, int keylen, int max_dist)
+{
+	uint64_t vp = s->vp, vn = s->vn, d0, hp, hn, x;
+	int j, hi, d;
+
+	/* a transposition continues a match of the previous character */
+	d0 = ((((~s->d0) & pm) << 1) & s->pm) |
+		(((pm & vp) + vp) ^ vp) | pm | vn;
+	hp = vn | ~(d0 | vp);
+	hn = d0 & vp;
+	next->score = s->score + _fsmtrie_bv_delta(hp, hn, keylen - 1);
+
+	/* the empty key prefix is one further away at every depth */
+	x = (hp << 1) | 1;
+	next->vn = x & d0;
+	next->vp = (hn << 1) | ~(x | d0);
+	next->d0 = d0;
+	next->pm = pm;
+
+	/*
+	 * Only key prefixes whose length differs from the depth by at most
+	 * max_dist can be in bounds. The first of them moves down the
+	 * diagonal once the depth exceeds max_dist, its value follows from
+	 * the horizontal difference to the previous column and a vertical
+	 * one.
+	 */
+	d = s->dlo + (s->lo == 0 ? 1 : _fsmtrie_bv_delta(hp, hn, s->lo - 1));
+	next->lo = s->lo;
+	if (depth > max_dist)
+	{
+		if (s->lo == keylen)
+		{
+			return (false);
+		}
+		d += _fsmtrie_bv_delta(next->vp, next->vn, next->lo++);
+	}
+	next->dlo = d;
+
+	hi = depth + max_dist < keylen ? depth + max_dist : keylen;
+	for (j = next->lo; d > max_dist; j++)
+	{
+		if (j >= hi)
+		{
+			return (false);
+		}
+		d += _fsmtrie_bv_delta(next->vp, next->vn, j);
+	}
+
+	return (true);
+}
+
+static bool
+_fsmtrie_approx_bv(struct fsmtrie_asearch_ctx *ctx,
+		const struct fsmtrie_view *view, const unsigned char *key_u,
+		int keylen, int max_dist, uint32_t depth,
+		void (*cb)(const char *, int, void *), void *cbdata)
+{
+	uint64_t peq[256];
+	struct _fsmtrie_bv *cols;
+	fsmtrie_ref_t *nodes;
+	int *chars;
+	int c, i;
+	fsmtrie_ref_t node, child;
+
+	cols = _fsmtrie_asearch_stack(ctx, depth, sizeof (*cols), &nodes,
+			&chars);
+	if (cols == NULL)
+	{
+		return (false);
+	}
+
+	/* key positions of every character */
+	memset(peq, 0, sizeof (peq));
+	for (i = 0; i < keylen; i++)
+	{
+		peq[key_u[i]] |= (uint64_t)1 << i;
+	}
+
+	/* against the empty trie prefix, entry j is j */
+	cols[0].vp = ~(uint64_t)0;
+	cols[0].vn = 0;
+	cols[0].d0 = 0;
+	cols[0].pm = 0;
+	cols[0].score = keylen;
+	cols[0].lo = 0;
+	cols[0].dlo = 0;
+
+	node = _fsmtrie_view_root(view);
+	nodes[0] = FSMTRIE_REF_NONE;
+	chars[0] = 0;
+	i = 0;
+
+	while (node != FSMTRIE_REF_NONE)
+	{
+		for (c = _fsmtrie_view_next(view, node, chars[i], &child);
+				c >= 0;
+				c = _fsmtrie_view_next(view, node, c + 1, &child))
+		{
+			if (!_fsmtrie_bv_step(&cols[i], &cols[i + 1], peq[c],
+						i + 1, keylen, max_dist))
+			{
+				continue;
+			}
+
+			if (cols[i + 1].score <= max_dist &&
+					_fsmtrie_view_leaf(view, child))
+			{
+				cb(_fsmtrie_view_str(view, child),
+						cols[i + 1].score, cbdata);
+			}
+
+			if (i < (int)depth)
+			{
+				chars[i++] = c + 1;
+				nodes[i] = node;
+				node = child;
+				c = -1;
+				chars[i] = 0;
+			}
+		}
+
+		node = nodes[i--];
+	}
+
+	return (true);
+}
+
+/*
+ * A distance of one needs no matrix: the strings one edit away from the key
+ * share a prefix of the key up to the edit and the rest of the key after
+ * it. Walking the key's path, every child of a node on it is tried as a
+ * substitution or an insertion there, and the rest of the key is looked up
+ * below it; deletions and transpositions look up the rest of the key past
+ * the edited characters. The strings found are then sorted into the order a
+ * walk of the trie would report them in, the same string found by different
+ * edits (e.g., in runs of a character) only once.
+ */
+#define FSMTRIE_EDIT_NONE	0	/* the key itself */
+#define FSMTRIE_EDIT_SUB	1
+#define FSMTRIE_EDIT_INS	2
+#define FSMTRIE_EDIT_DEL	3
+#define FSMTRIE_EDIT_SWAP	4	/* transposition of pos and pos + 1 */
+
+/* \cond */
+/* a trie string at most one edit away from the key */
+struct _fsmtrie_edit
+{
+	fsmtrie_ref_t node;
+	uint32_t pos;			/* position of the edit */
+	uint8_t type;			/* FSMTRIE_EDIT_* */
+	uint8_t c;			/* code point substituted or inserted */
+};
+/* \endcond */
+
+/* code point p of the string of edit e, -1 past its end */
+static inline int
+_fsmtrie_edit_char(const unsigned char *key, int keylen,
+		const struct _fsmtrie_edit *e, int p)
+{
+	int i = e->pos;
+
+	if (p < i)
+	{
+		return (key[p]);
+	}
+	switch (e->type)
+	{
+		case FSMTRIE_EDIT_SUB:
+			return (p == i ? e->c : p < keylen ? key[p] : -1);
+		case FSMTRIE_EDIT_INS:
+			return (p == i ? e->c : p <= keylen ? key[p - 1] : -1);
+		case FSMTRIE_EDIT_DEL:
+			return (p + 1 < keylen ? key[p + 1] : -1);
+		case FSMTRIE_EDIT_SWAP:
+			return (p == i ? key[i + 1] : p == i + 1 ? key[i] :
+					p < keylen ? key[p] : -1);
+		default:
+			return (p < keylen ? key[p] : -1);
+	}
+}
+
+static int
+_fsmtrie_edit_cmp(const unsigned char *key, int keylen,
+		const struct _fsmtrie_edit *a, const struct _fsmtrie_edit *b)
+{
+	int p, ca, cb;
+
+	/* both strings start with the key up to the first edit */
+	p = a->pos < b->pos ? a->pos : b->pos;
+	do
+	{
+		ca = _fsmtrie_edit_char(key, keylen, a, p);
+		cb = _fsmtrie_edit_char(key, keylen, b, p);
+		p++;
+	} while (ca == cb && ca >= 0);
+
+	return (ca - cb);
+}
+
+/* follow key from node n, FSMTRIE_REF_NONE if it leaves the trie */
+static fsmtrie_ref_t
+_fsmtrie_edit_walk(const struct fsmtrie_view *view, fsmtrie_ref_t n,
+		const unsigned char *key, int len)
+{
+	int i;
+
+	for (i = 0; i < len && n != FSMTRIE_REF_NONE; i++)
+	{
+		n = _fsmtrie_view_child(view, n, key[i]);
+	}
+	return (n);
+}
+
+/* \cond */
+/* edits found so far */
+struct _fsmtrie_edits
+{
+	struct fsmtrie_buf *buf;
+	struct _fsmtrie_edit *e;
+	size_t n;
+	size_t size;
+};
+/* \endcond */
+
+/* record edit (type, pos, c) if it ends at a leaf */
+static bool
+_fsmtrie_edit_add(const struct fsmtrie_view *view, struct _fsmtrie_edits *ed,
+		fsmtrie_ref_t n, int type, int pos, int c)
+{
+	if (n == FSMTRIE_REF_NONE || !_fsmtrie_view_leaf(view, n))
+	{
+		return (true);
+	}
+
+	/* room for a merge sort's copy too */
+	if (ed->n == ed->size)
+	{
+		ed->size = ed->size ? ed->size * 2 : 64;
+		ed->e = _fsmtrie_buf_reserve(ed->buf,
+				2 * ed->size * sizeof (*ed->e));
+		if (ed->e == NULL)
+		{
+			return (false);
+		}
+	}
+	ed->e[ed->n].node = n;
+	ed->e[ed->n].pos = pos;
+	ed->e[ed->n].type = type;
+	ed->e[ed->n].c = c;
+	ed->n++;
+
+	return (true);
+}
+
+/* sort e[0..n) by their strings, bottom-up through tmp */
+static struct _fsmtrie_edit *
+_fsmtrie_edit_sort(const unsigned char *key, int keylen,
+		struct _fsmtrie_edit *e, struct _fsmtrie_edit *tmp, size_t n)
+{
+	struct _fsmtrie_edit *from = e, *to = tmp, *swap;
+	size_t w, lo, mid, hi, a, b, k;
+
+	for (w = 1; w < n; w *= 2)
+	{
+		for (lo = 0; lo < n; lo += 2 * w)
+		{
+			mid = lo + w < n ? lo + w : n;
+			hi = lo + 2 * w < n ? lo + 2 * w : n;
+			for (a = lo, b = mid, k = lo; k < hi; k++)
+			{
+				if (a < mid && (b == hi || _fsmtrie_edit_cmp(
+							key, keylen, &from[a],
+							&from[b]) <= 0))
+				{
+					to[k] = from[a++];
+				}
+				else
+				{
+					to[k] = from[b++];
+				}
+			}
+		}
+		swap = from;
+		from = to;
+		to = swap;
+	}
+	return (from);
+}
+
+static bool
+_fsmtrie_approx_one(struct fsmtrie_asearch_ctx *ctx,
+		const struct fsmtrie_view *view, const unsigned char *key_u,
+		int keylen, void (*cb)(const char *, int, void *),
+		void *cbdata)
+{
+	struct _fsmtrie_edits ed = { &ctx->edits, NULL, 0, 0 };
+	struct _fsmtrie_edit *e;
+	fsmtrie_ref_t node, child, n;
+	size_t k;
+	int i, c;
+
+	node = _fsmtrie_view_root(view);
+	for (i = 0; i <= keylen && node != FSMTRIE_REF_NONE; i++)
+	{
+		/* the root is never reported */
+		if (i == keylen && i > 0 &&
+				!_fsmtrie_edit_add(view, &ed, node,
+					FSMTRIE_EDIT_NONE, i, 0))
+		{
+			return (false);
+		}
+		if (i < keylen && keylen > 1)
+		{
+			n = _fsmtrie_edit_walk(view, node, &key_u[i + 1],
+					keylen - i - 1);
+			if (!_fsmtrie_edit_add(view, &ed, n, FSMTRIE_EDIT_DEL,
+						i, 0))
+			{
+				return (false);
+			}
+		}
+
+		for (c = _fsmtrie_view_next(view, node, 0, &child); c >= 0;
+				c = _fsmtrie_view_next(view, node, c + 1, &child))
+		{
+			n = _fsmtrie_edit_walk(view, child, &key_u[i],
+					keylen - i);
+			if (!_fsmtrie_edit_add(view, &ed, n, FSMTRIE_EDIT_INS,
+						i, c))
+			{
+				return (false);
+			}
+			if (i == keylen || c == key_u[i])
+			{
+				continue;
+			}
+			n = _fsmtrie_edit_walk(view, child, &key_u[i + 1],
+					keylen - i - 1);
+			if (!_fsmtrie_edit_add(view, &ed, n, FSMTRIE_EDIT_SUB,
+						i, c))
+			{
+				return (false);
+			}
+			if (i + 1 < keylen && c == key_u[i + 1])
+			{
+				n = _fsmtrie_edit_walk(view, child, &key_u[i],
+						1);
+				if (n != FSMTRIE_REF_NONE)
+				{
+					n = _fsmtrie_edit_walk(view, n,
+							&key_u[i + 2],
+							keylen - i - 2);
+				}
+				if (!_fsmtrie_edit_add(view, &ed, n,
+							FSMTRIE_EDIT_SWAP, i,
+							0))
+				{
+					return (false);
+				}
+			}
+		}
+
+		if (i < keylen)
+		{
+			node = _fsmtrie_view_child(view, node, key_u[i]);
+		}
+	}
+
+	e = _fsmtrie_edit_sort(key_u, keylen, ed.e, ed.e + ed.size, ed.n);
+	for (k = 0; k < ed.n; k++)
+	{
+		if (k > 0 && _fsmtrie_edit_cmp(key_u, keylen, &e[k - 1],
+					&e[k]) == 0)
+		{
+			continue;
+		}
+		cb(_fsmtrie_view_str(view, e[k].node),
+				e[k].type != FSMTRIE_EDIT_NONE, cbdata);
+	}
+
+	return (true);
+}
+
+static int
+_fsmtrie_search_approx(struct fsmtrie *f, struct fsmtrie_asearch_ctx *ctx,
+		const char *key, size_t len, int max_dist,
+		void (*cb)(const char *, int, void *), void *cbdata,
+		const char *func)
+{
+	const unsigned char *key_u = (unsigned char *)key;
+	struct fsmtrie_view view;
+	struct fsmtrie_rcu_pin pin;
+	const struct fsmtrie_symdel *sd;
+	uint32_t depth;
+	bool ok;
+
+	if (f->mode == fsmtrie_mode_token)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+			func, _mode_to_str(f->mode));
+		return (-1);
+	}
+
+	if (f->dawg != NULL && !_fsmtrie_dawg_seal(f))
+	{
+		/* error set by _fsmtrie_dawg_seal() */
+		return (-1);
+	}
+
+	/* walk live tries, images and DAWGs alike */
+	_fsmtrie_rcu_enter(f, &pin);
+	_fsmtrie_view_init(&view, f);
+
+	/*
+	 * No walk goes deeper than the deepest node. In RCU mode, nodes of
+	 * the version pinned were added before it was published.
+	 */
+	depth = __atomic_load_n(&f->depth, __ATOMIC_RELAXED);
+
+	/* built by fsmtrie_compile(), possibly while searching */
+	sd = __atomic_load_n(&f->symdel, __ATOMIC_ACQUIRE);
+
+	if (sd != NULL && max_dist > 0 && max_dist <= sd->max_dist)
+	{
+		ok = _fsmtrie_approx_symdel(ctx, sd, key_u, len, max_dist, cb,
+				cbdata);
+	}
+	else if (max_dist == 1)
+	{
+		ok = _fsmtrie_approx_one(ctx, &view, key_u, len, cb, cbdata);
+	}
+	else if ((f->flags & FSMTRIE_APPROX_LEV) &&
+			max_dist <= FSMTRIE_APPROX_LEV_MAX)
+	{
+		ok = _fsmtrie_approx_lev(ctx, &view, key_u, len, max_dist,
+				depth, cb, cbdata);
+	}
+	else if (len > 0 && len <= FSMTRIE_APPROX_BV_MAX)
+	{
+		ok = _fsmtrie_approx_bv(ctx, &view, key_u, len, max_dist,
+				depth, cb, cbdata);
+	}
+	else
+	{
+		ok = _fsmtrie_approx_sim(ctx, &view, key_u, len, max_dist,
+				depth, cb, cbdata);
+	}
+
+	if (!ok)
+	{
+		_fsmtrie_error(f, "can't allocate search space: %s",
+				strerror(errno));
+	}
+	_fsmtrie_rcu_exit(&pin);
+	return (ok ? 1 : -1);
+}
+
+/* search with scratch space of its own, freed again */
+static int
+_fsmtrie_search_approx_once(struct fsmtrie *f, const char *key, size_t len,
+		int max_dist, void (*cb)(const char *, int, void *),
+		void *cbdata, const char *func)
+{
+	struct fsmtrie_asearch_ctx ctx;
+	int rc;
+
+	memset(&ctx, 0, sizeof (ctx));
+	rc = _fsmtrie_search_approx(f, &ctx, key, len, max_dist, cb, cbdata,
+			func);
+	_fsmtrie_asearch_ctx_free(&ctx);
+
+	return (rc);
+}
+
+int
+fsmtrie_search_approx(struct fsmtrie *f, const char *key, int max_dist,
+		void (*cb)(const char *, int, void *), void *cbdata)
+{
+	return (_fsmtrie_search_approx_once(f, key, strlen(key), max_dist, cb,
+				cbdata, __func__));
+}
+
+int
+fsmtrie_search_approx_n(struct fsmtrie *f, const char *key, size_t keylen,
+		int max_dist, void (*cb)(const char *, int, void *),
+		void *cbdata)
+{
+	return (_fsmtrie_search_approx_once(f, key, keylen, max_dist, cb,
+				cbdata, __func__));
+}
+
+/* a match of one key of a batch searched for on its own */
+struct _fsmtrie_batch_key
+{
+	void (*cb)(size_t, const char *, int, void *);
+	void *cbdata;
+	size_t key;
+};
+
+static void
+_fsmtrie_batch_key_report(const char *str, int dist, void *data)
+{
+	struct _fsmtrie_batch_key *bk = data;
+
+	bk->cb(bk->key, str, dist, bk->cbdata);
+}
+
+int
+fsmtrie_search_approx_batch(struct fsmtrie *f, const char * const *keys,
+		size_t nkeys, int max_dist,
+		void (*cb)(size_t, const char *, int, void *), void *cbdata)
+{
+	struct fsmtrie_asearch_ctx ctx;
+	struct _fsmtrie_batch_key bk;
+	struct fsmtrie_view view;
+	struct fsmtrie_rcu_pin pin;
+	const struct fsmtrie_symdel *sd;
+	int rc = 1;
+	bool ok;
+
+	if (f == NULL)
+	{
+		return (-1);
+	}
+	if (f->mode == fsmtrie_mode_token)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+			__func__, _mode_to_str(f->mode));
+		return (-1);
+	}
+	for (bk.key = 0; bk.key < nkeys; bk.key++)
+	{
+		if (keys[bk.key] == NULL)
+		{
+			_fsmtrie_error(f, "empty key");
+			return (-1);
+		}
+	}
+	if (max_dist < 0)
+	{
+		return (1);
+	}
+	if (f->dawg != NULL && !_fsmtrie_dawg_seal(f))
+	{
+		/* error set by _fsmtrie_dawg_seal() */
+		return (-1);
+	}
+
+	/*
+	 * Direct lookups beat the walk, whatever is shared: keys go on their
+	 * own where fsmtrie_search_approx() doesn't walk the trie either.
+	 */
+	sd = __atomic_load_n(&f->symdel, __ATOMIC_ACQUIRE);
+	if (max_dist == 1 || (sd != NULL && max_dist > 0 &&
+				max_dist <= sd->max_dist))
+	{
+		memset(&ctx, 0, sizeof (ctx));
+		bk.cb = cb;
+		bk.cbdata = cbdata;
+		for (bk.key = 0; bk.key < nkeys && rc == 1; bk.key++)
+		{
+			rc = _fsmtrie_search_approx(f, &ctx, keys[bk.key],
+					strlen(keys[bk.key]), max_dist,
+					_fsmtrie_batch_key_report, &bk,
+					__func__);
+		}
+		_fsmtrie_asearch_ctx_free(&ctx);
+		return (rc);
+	}
+
+	_fsmtrie_rcu_enter(f, &pin);
+	_fsmtrie_view_init(&view, f);
+	ok = _fsmtrie_approx_batch(&view, keys, nkeys, max_dist,
+			__atomic_load_n(&f->depth, __ATOMIC_RELAXED), cb,
+			cbdata);
+	_fsmtrie_rcu_exit(&pin);
+	if (!ok)
+	{
+		_fsmtrie_error(f, "can't allocate search space: %s",
+				strerror(errno));
+	}
+
+	return (ok ? 1 : -1);
+}
+
+struct fsmtrie_asearch_ctx *
+fsmtrie_asearch_ctx_init(void)
+{
+	return (calloc(1, sizeof (struct fsmtrie_asearch_ctx)));
+}
+
+int
+fsmtrie_search_approx_ctx(struct fsmtrie *f, struct fsmtrie_asearch_ctx *ctx,
+		const char *key, size_t keylen, int max_dist,
+		void (*cb)(const char *, int, void *), void *cbdata)
+{
+	if (ctx == NULL)
+	{
+		_fsmtrie_error(f, "%s() requires a search context", __func__);
+		return (-1);
+	}
+
+	return (_fsmtrie_search_approx(f, ctx, key, keylen, max_dist, cb,
+				cbdata, __func__));
+}
+
+void
+fsmtrie_asearch_ctx_destroy(struct fsmtrie_asearch_ctx **ctx)
+{
+	if (*ctx != NULL)
+	{
+		_fsmtrie_asearch_ctx_free(*ctx);
+		free(*ctx);
+		*ctx = NULL;
+	}
 }
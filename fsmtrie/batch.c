@@ -0,0 +1,343 @@
+/*
+ * Fast String Matcher Batched Search Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * A single lookup is a chain of dependent loads, each of which is likely a
+ * cache miss on a large trie. Batched searches keep FSMTRIE_BATCH_WINDOW
+ * lookups in flight and advance them round robin, one step each, prefetching
+ * whatever the next step of a lookup is going to read. By the time a lookup
+ * comes around again its data has (hopefully) arrived, and the misses of the
+ * lookups in the window overlap instead of adding up.
+ *
+ * The window is kept small enough for the prefetched lines to still be in
+ * the L1 cache when they are used.
+ */
+#define FSMTRIE_BATCH_WINDOW	16
+
+/* \cond */
+struct _fsmtrie_batch_slot
+{
+	size_t idx;			/* key being looked up */
+	fsmtrie_node_t *node;		/* current node, NULL if slot idle */
+	const unsigned char *p;		/* next byte of key */
+	size_t pos;			/* next token of key */
+	bool tab;			/* node's child table was prefetched */
+};
+/* \endcond */
+
+static void
+_fsmtrie_batch_done(struct _fsmtrie_batch_slot *slot,
+		const fsmtrie_node_t *node, bool pm, int *results,
+		const char **strs)
+{
+	if (node != NULL && (node->type & FSMTRIE_NODE_LEAF))
+	{
+		results[slot->idx] = 1;
+		if (strs != NULL)
+		{
+			strs[slot->idx] = node->str;
+		}
+	}
+	else
+	{
+		results[slot->idx] = (node != NULL && pm) ? 1 : 0;
+		if (strs != NULL)
+		{
+			strs[slot->idx] = NULL;
+		}
+	}
+	slot->node = NULL;
+}
+
+static bool
+_fsmtrie_batch_check(struct fsmtrie *f, bool token, const char *func)
+{
+	if (_fsmtrie_root(f) == NULL && f->img == NULL && f->dawg == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (false);
+	}
+
+	if ((f->mode == fsmtrie_mode_token) != token)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				func, _mode_to_str(f->mode));
+		return (false);
+	}
+
+	return (true);
+}
+
+int
+fsmtrie_search_batch(struct fsmtrie *f, const char * const *keys,
+		size_t nkeys, int *results, const char **strs)
+{
+	struct _fsmtrie_batch_slot slots[FSMTRIE_BATCH_WINDOW], *slot;
+	fsmtrie_node_t *root, *child;
+	struct fsmtrie_rcu_pin pin;
+	size_t next, active, n;
+	bool pm, err = false;
+	const char *str;
+
+	if (f == NULL)
+	{
+		return (-1);
+	}
+	if (!_fsmtrie_batch_check(f, false, __func__))
+	{
+		return (-1);
+	}
+
+	/*
+	 * Images and DAWGs are compact already, search them one key at a
+	 * time.
+	 */
+	if (f->img != NULL || f->dawg != NULL)
+	{
+		for (n = 0; n < nkeys; n++)
+		{
+			if (keys[n] == NULL)
+			{
+				_fsmtrie_error(f, "empty key");
+				results[n] = -1;
+			}
+			else if (f->img != NULL)
+			{
+				results[n] = _fsmtrie_image_search(f, keys[n],
+						strlen(keys[n]), &str);
+			}
+			else
+			{
+				results[n] = _fsmtrie_dawg_search(f, keys[n],
+						strlen(keys[n]), &str);
+			}
+			if (strs != NULL)
+			{
+				strs[n] = results[n] == 1 ? str : NULL;
+			}
+			err |= results[n] < 0;
+		}
+		return (err ? -1 : 1);
+	}
+
+	pm = (f->flags & FSMTRIE_PM_OK) != 0;
+	memset(slots, 0, sizeof (slots));
+	next = 0;
+	active = 0;
+	_fsmtrie_rcu_enter(f, &pin);
+	root = _fsmtrie_root(f);
+
+	do
+	{
+		for (n = 0; n < FSMTRIE_BATCH_WINDOW; n++)
+		{
+			slot = &slots[n];
+
+			/* start the next lookup in an idle slot */
+			if (slot->node == NULL)
+			{
+				if (next == nkeys)
+				{
+					continue;
+				}
+				slot->idx = next++;
+				if (keys[slot->idx] == NULL)
+				{
+					_fsmtrie_error(f, "empty key");
+					results[slot->idx] = -1;
+					if (strs != NULL)
+					{
+						strs[slot->idx] = NULL;
+					}
+					err = true;
+					continue;
+				}
+				slot->p = (const unsigned char *)
+					keys[slot->idx];
+				slot->node = root;
+				slot->tab = false;
+				active++;
+			}
+
+			if (*slot->p == '\0')
+			{
+				_fsmtrie_batch_done(slot, slot->node, pm,
+						results, strs);
+				active--;
+				continue;
+			}
+			if ((int)*slot->p > f->nrnodes - 1)
+			{
+				_fsmtrie_error(f,
+					"key value \"%d\" out of range",
+					(int)*slot->p);
+				results[slot->idx] = -1;
+				if (strs != NULL)
+				{
+					strs[slot->idx] = NULL;
+				}
+				slot->node = NULL;
+				err = true;
+				active--;
+				continue;
+			}
+
+			/*
+			 * Each step of a lookup takes two rounds: one to
+			 * fetch the node's child table, one to look up the
+			 * child in it and fetch the child.
+			 */
+			if (!slot->tab)
+			{
+				if (slot->node->tab == NULL)
+				{
+					_fsmtrie_batch_done(slot, NULL, pm,
+							results, strs);
+					active--;
+					continue;
+				}
+				FSMTRIE_PREFETCH(slot->node->tab);
+				slot->tab = true;
+				continue;
+			}
+
+			child = _fsmtrie_child(slot->node, *slot->p);
+			slot->tab = false;
+			if (child == NULL)
+			{
+				_fsmtrie_batch_done(slot, NULL, pm, results,
+						strs);
+				active--;
+				continue;
+			}
+			FSMTRIE_PREFETCH(child);
+			slot->node = child;
+			slot->p++;
+		}
+	} while (active > 0 || next < nkeys);
+	_fsmtrie_rcu_exit(&pin);
+
+	return (err ? -1 : 1);
+}
+
+int
+fsmtrie_search_token_batch(struct fsmtrie *f, const uint32_t * const *keys,
+		const size_t *keylens, size_t nkeys, int *results,
+		const char **strs)
+{
+	struct _fsmtrie_batch_slot slots[FSMTRIE_BATCH_WINDOW], *slot;
+	fsmtrie_node_t *child;
+	size_t next, active, n;
+	bool err = false;
+	const char *str;
+
+	if (f == NULL)
+	{
+		return (-1);
+	}
+	if (!_fsmtrie_batch_check(f, true, __func__))
+	{
+		return (-1);
+	}
+
+	if (f->img != NULL)
+	{
+		for (n = 0; n < nkeys; n++)
+		{
+			if (keys[n] == NULL || keylens[n] == 0)
+			{
+				_fsmtrie_error(f, "empty key or keylen");
+				results[n] = -1;
+			}
+			else
+			{
+				results[n] = _fsmtrie_image_search_token(f,
+						keys[n], keylens[n], &str);
+			}
+			if (strs != NULL)
+			{
+				strs[n] = results[n] == 1 ? str : NULL;
+			}
+			err |= results[n] < 0;
+		}
+		return (err ? -1 : 1);
+	}
+
+	memset(slots, 0, sizeof (slots));
+	next = 0;
+	active = 0;
+
+	do
+	{
+		for (n = 0; n < FSMTRIE_BATCH_WINDOW; n++)
+		{
+			slot = &slots[n];
+
+			if (slot->node == NULL)
+			{
+				if (next == nkeys)
+				{
+					continue;
+				}
+				slot->idx = next++;
+				if (keys[slot->idx] == NULL ||
+						keylens[slot->idx] == 0)
+				{
+					_fsmtrie_error(f,
+							"empty key or keylen");
+					results[slot->idx] = -1;
+					if (strs != NULL)
+					{
+						strs[slot->idx] = NULL;
+					}
+					err = true;
+					continue;
+				}
+				slot->pos = 0;
+				slot->node = f->root;
+				active++;
+			}
+
+			if (slot->pos == keylens[slot->idx])
+			{
+				_fsmtrie_batch_done(slot, slot->node, false,
+						results, strs);
+				active--;
+				continue;
+			}
+
+			/* token children are inline, one round per step */
+			child = _fsmtrie_token_child(f, slot->node,
+					keys[slot->idx][slot->pos]);
+			if (child == NULL)
+			{
+				_fsmtrie_batch_done(slot, NULL, false, results,
+						strs);
+				active--;
+				continue;
+			}
+			FSMTRIE_PREFETCH(child);
+			slot->node = child;
+			slot->pos++;
+		}
+	} while (active > 0 || next < nkeys);
+
+	return (err ? -1 : 1);
+}
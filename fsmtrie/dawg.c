@@ -0,0 +1,716 @@
+/*
+ * Fast String Matcher DAWG Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * Daciuk's incremental construction of a minimal acyclic automaton from
+ * sorted keys (Daciuk, Mihov, Watson and Watson, "Incremental Construction
+ * of Minimal Acyclic Finite-State Automata", 2000).
+ *
+ * The states on the path of the last key inserted are the only ones that
+ * may still change, they are kept aside in the build state, one per depth.
+ * Once the next key leaves that path, no later key can reach below the
+ * point where it does, so the states past it are final: each is looked up
+ * in the register of final states, deepest first, and replaced by the
+ * equivalent state found there (same acceptance, same transitions to the
+ * same states) or registered itself. The automaton is minimal once the
+ * whole path, the root included, is registered.
+ *
+ * A state's transition counts (see struct fsmtrie_dawg) are fixed when the
+ * transition is added: every key below the earlier transitions has been
+ * inserted by then.
+ */
+
+/* \cond */
+/* a transition of a state on the path of the last key */
+struct _fsmtrie_dawg_arc
+{
+	uint32_t target;		/* state, once registered */
+	uint32_t before;		/* keys numbered before the transition */
+	uint8_t label;
+};
+
+/* a state on the path of the last key */
+struct _fsmtrie_dawg_pstate
+{
+	struct _fsmtrie_dawg_arc *arcs;
+	uint16_t narcs, aarcs;
+	bool accept;
+	uint32_t count;			/* keys at or below the state */
+};
+
+struct fsmtrie_dawg_build
+{
+	struct _fsmtrie_dawg_pstate *path;	/* one state per depth */
+	size_t apath;
+	size_t plen;			/* length of the last key */
+	uint32_t *reg;			/* register of final states */
+	uint32_t mask;			/* number of slots - 1 */
+	uint32_t nreg;
+};
+/* \endcond */
+
+#define FSMTRIE_DAWG_FNV_BASIS	14695981039346656037ULL
+#define FSMTRIE_DAWG_FNV_PRIME	1099511628211ULL
+#define FSMTRIE_DAWG_REG_MIN	1024	/* initial register slots */
+
+/* continue hash h over a transition */
+static inline uint64_t
+_fsmtrie_dawg_hash(uint64_t h, uint8_t label, uint32_t target)
+{
+	h = (h ^ label) * FSMTRIE_DAWG_FNV_PRIME;
+	return ((h ^ target) * FSMTRIE_DAWG_FNV_PRIME);
+}
+
+/* first register slot of a state hashing to h */
+static inline uint32_t
+_fsmtrie_dawg_slot(const struct fsmtrie_dawg_build *b, uint64_t h)
+{
+	return ((uint32_t)(h ^ (h >> 32)) & b->mask);
+}
+
+static uint64_t
+_fsmtrie_dawg_hash_state(const struct fsmtrie_dawg *d, uint32_t s)
+{
+	const struct fsmtrie_dstate *state = &d->states[s];
+	uint64_t h = FSMTRIE_DAWG_FNV_BASIS ^ state->accept;
+	uint32_t t;
+
+	for (t = state->first; t < state->first + state->ntrans; t++)
+	{
+		h = _fsmtrie_dawg_hash(h, d->labels[t], d->targets[t]);
+	}
+	return (h);
+}
+
+static uint64_t
+_fsmtrie_dawg_hash_pstate(const struct _fsmtrie_dawg_pstate *ps)
+{
+	uint64_t h = FSMTRIE_DAWG_FNV_BASIS ^ ps->accept;
+	uint16_t i;
+
+	for (i = 0; i < ps->narcs; i++)
+	{
+		h = _fsmtrie_dawg_hash(h, ps->arcs[i].label,
+				ps->arcs[i].target);
+	}
+	return (h);
+}
+
+static bool
+_fsmtrie_dawg_equal(const struct fsmtrie_dawg *d, uint32_t s,
+		const struct _fsmtrie_dawg_pstate *ps)
+{
+	const struct fsmtrie_dstate *state = &d->states[s];
+	uint16_t i;
+
+	if (state->accept != ps->accept || state->ntrans != ps->narcs)
+	{
+		return (false);
+	}
+	for (i = 0; i < ps->narcs; i++)
+	{
+		if (d->labels[state->first + i] != ps->arcs[i].label ||
+				d->targets[state->first + i] !=
+				ps->arcs[i].target)
+		{
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/* double the register, rehashing every state in it */
+static bool
+_fsmtrie_dawg_rehash(struct fsmtrie_dawg *d, struct fsmtrie_dawg_build *b)
+{
+	uint32_t *old = b->reg, n, i;
+	size_t size = old != NULL ? ((size_t)b->mask + 1) * 2 :
+		FSMTRIE_DAWG_REG_MIN;
+
+	if (size > (size_t)UINT32_MAX + 1)
+	{
+		errno = EFBIG;
+		return (false);
+	}
+	if ((b->reg = malloc(size * sizeof (*b->reg))) == NULL)
+	{
+		b->reg = old;
+		return (false);
+	}
+	memset(b->reg, 0xff, size * sizeof (*b->reg));
+	b->mask = size - 1;
+
+	for (n = 0; old != NULL && n < size / 2; n++)
+	{
+		if (old[n] == FSMTRIE_INONE)
+		{
+			continue;
+		}
+		i = _fsmtrie_dawg_slot(b, _fsmtrie_dawg_hash_state(d, old[n]));
+		while (b->reg[i] != FSMTRIE_INONE)
+		{
+			i = (i + 1) & b->mask;
+		}
+		b->reg[i] = old[n];
+	}
+	free(old);
+
+	return (true);
+}
+
+/* capacity for at least n elements, doubling alloc, 0 if too many */
+static uint32_t
+_fsmtrie_dawg_cap(uint32_t alloc, size_t n)
+{
+	size_t cap;
+
+	/* FSMTRIE_INONE isn't a valid state or transition */
+	if (n > UINT32_MAX - 1)
+	{
+		errno = EFBIG;
+		return (0);
+	}
+	for (cap = alloc ? alloc : 64; cap < n; cap *= 2)
+		;
+	return (cap > UINT32_MAX - 1 ? UINT32_MAX - 1 : cap);
+}
+
+/* make room for one more state with ntrans transitions */
+static bool
+_fsmtrie_dawg_reserve(struct fsmtrie_dawg *d, uint16_t ntrans)
+{
+	size_t need = (size_t)d->ntrans + ntrans;
+	uint32_t cap;
+	void *p;
+
+	if (d->nstates == d->astates)
+	{
+		cap = _fsmtrie_dawg_cap(d->astates, (size_t)d->nstates + 1);
+		if (cap == 0 || (p = realloc(d->states,
+						cap * sizeof (*d->states))) ==
+				NULL)
+		{
+			return (false);
+		}
+		d->states = p;
+		d->astates = cap;
+	}
+	if (need <= d->atrans)
+	{
+		return (true);
+	}
+
+	/* the arrays keep their contents if any of them fails */
+	if ((cap = _fsmtrie_dawg_cap(d->atrans, need)) == 0 ||
+			(p = realloc(d->labels, cap * sizeof (*d->labels))) ==
+			NULL)
+	{
+		return (false);
+	}
+	d->labels = p;
+	if ((p = realloc(d->targets, cap * sizeof (*d->targets))) == NULL)
+	{
+		return (false);
+	}
+	d->targets = p;
+	if ((p = realloc(d->before, cap * sizeof (*d->before))) == NULL)
+	{
+		return (false);
+	}
+	d->before = p;
+	d->atrans = cap;
+
+	return (true);
+}
+
+/*
+ * Replace a state of the path by its equivalent in the register, or
+ * register it. Returns the state or FSMTRIE_INONE if out of memory.
+ */
+static uint32_t
+_fsmtrie_dawg_register(struct fsmtrie_dawg *d, struct fsmtrie_dawg_build *b,
+		struct _fsmtrie_dawg_pstate *ps)
+{
+	struct fsmtrie_dstate *state;
+	uint64_t h = _fsmtrie_dawg_hash_pstate(ps);
+	uint32_t i, s;
+	uint16_t n;
+
+	/* keep the register at most half full */
+	if (b->nreg + 1 > b->mask / 2 && !_fsmtrie_dawg_rehash(d, b))
+	{
+		return (FSMTRIE_INONE);
+	}
+
+	for (i = _fsmtrie_dawg_slot(b, h); (s = b->reg[i]) != FSMTRIE_INONE;
+			i = (i + 1) & b->mask)
+	{
+		if (_fsmtrie_dawg_equal(d, s, ps))
+		{
+			ps->narcs = 0;
+			return (s);
+		}
+	}
+
+	if (!_fsmtrie_dawg_reserve(d, ps->narcs))
+	{
+		return (FSMTRIE_INONE);
+	}
+
+	s = d->nstates++;
+	state = &d->states[s];
+	state->first = d->ntrans;
+	state->ntrans = ps->narcs;
+	state->accept = ps->accept;
+	state->pad = 0;
+	for (n = 0; n < ps->narcs; n++, d->ntrans++)
+	{
+		d->labels[d->ntrans] = ps->arcs[n].label;
+		d->targets[d->ntrans] = ps->arcs[n].target;
+		d->before[d->ntrans] = ps->arcs[n].before;
+	}
+	ps->narcs = 0;
+
+	b->reg[i] = s;
+	b->nreg++;
+
+	return (s);
+}
+
+/* register the states of the path deeper than depth */
+static bool
+_fsmtrie_dawg_unwind(struct fsmtrie_dawg *d, struct fsmtrie_dawg_build *b,
+		size_t depth)
+{
+	struct _fsmtrie_dawg_pstate *parent;
+	uint32_t s;
+
+	for (; b->plen > depth; b->plen--)
+	{
+		s = _fsmtrie_dawg_register(d, b, &b->path[b->plen]);
+		if (s == FSMTRIE_INONE)
+		{
+			return (false);
+		}
+		parent = &b->path[b->plen - 1];
+		parent->arcs[parent->narcs - 1].target = s;
+	}
+	return (true);
+}
+
+/* make room for the path of a key of length len */
+static bool
+_fsmtrie_dawg_path_grow(struct fsmtrie_dawg_build *b, size_t len)
+{
+	struct _fsmtrie_dawg_pstate *path;
+	size_t apath;
+
+	if (len < b->apath)
+	{
+		return (true);
+	}
+	for (apath = b->apath ? b->apath : 64; apath <= len; apath *= 2)
+		;
+	if ((path = realloc(b->path, apath * sizeof (*path))) == NULL)
+	{
+		return (false);
+	}
+	memset(&path[b->apath], 0, (apath - b->apath) * sizeof (*path));
+	b->path = path;
+	b->apath = apath;
+
+	return (true);
+}
+
+/* make room for a transition of a state of the path */
+static bool
+_fsmtrie_dawg_arc_reserve(struct _fsmtrie_dawg_pstate *ps)
+{
+	struct _fsmtrie_dawg_arc *arcs;
+	uint16_t aarcs;
+
+	if (ps->narcs < ps->aarcs)
+	{
+		return (true);
+	}
+	aarcs = ps->aarcs ? ps->aarcs * 2 : 2;
+	if ((arcs = realloc(ps->arcs, aarcs * sizeof (*arcs))) == NULL)
+	{
+		return (false);
+	}
+	ps->arcs = arcs;
+	ps->aarcs = aarcs;
+
+	return (true);
+}
+
+/* the label of the last transition of a state of the path */
+static inline uint8_t
+_fsmtrie_dawg_arc_last(const struct _fsmtrie_dawg_pstate *ps)
+{
+	return (ps->arcs[ps->narcs - 1].label);
+}
+
+/* add the leaf string of key nkeys, see struct fsmtrie_dawg */
+static bool
+_fsmtrie_dawg_str_add(struct fsmtrie_dawg *d, const char *str)
+{
+	size_t len, need;
+	uint32_t cap;
+	void *p;
+
+	if (str == NULL)
+	{
+		/* keys without a string past the last one need no entry */
+		return (true);
+	}
+
+	len = strlen(str);
+	need = d->strs_len + (d->nkeys - d->nstrs) + len + 2;
+	if (need > d->strs_size)
+	{
+		size_t size;
+
+		for (size = d->strs_size ? d->strs_size : 4096; size < need;
+				size *= 2)
+			;
+		if ((p = realloc(d->strs, size)) == NULL)
+		{
+			return (false);
+		}
+		d->strs = p;
+		d->strs_size = size;
+	}
+	if (d->nkeys / FSMTRIE_DAWG_SBLOCK >= d->asoff)
+	{
+		cap = _fsmtrie_dawg_cap(d->asoff,
+				d->nkeys / FSMTRIE_DAWG_SBLOCK + 1);
+		if (cap == 0 || (p = realloc(d->soff,
+						cap * sizeof (*d->soff))) ==
+				NULL)
+		{
+			return (false);
+		}
+		d->soff = p;
+		d->asoff = cap;
+	}
+
+	for (; d->nstrs <= d->nkeys; d->nstrs++)
+	{
+		if (d->nstrs % FSMTRIE_DAWG_SBLOCK == 0)
+		{
+			d->soff[d->nstrs / FSMTRIE_DAWG_SBLOCK] = d->strs_len;
+		}
+		if (d->nstrs < d->nkeys)
+		{
+			d->strs[d->strs_len++] = 0;
+		}
+	}
+	d->strs[d->strs_len++] = 1;
+	memcpy(&d->strs[d->strs_len], str, len + 1);
+	d->strs_len += len + 1;
+
+	return (true);
+}
+
+static void
+_fsmtrie_dawg_build_free(struct fsmtrie_dawg_build *b)
+{
+	size_t n;
+
+	for (n = 0; n < b->apath; n++)
+	{
+		free(b->path[n].arcs);
+	}
+	free(b->path);
+	free(b->reg);
+	free(b);
+}
+
+struct fsmtrie_dawg *
+_fsmtrie_dawg_new(void)
+{
+	struct fsmtrie_dawg *d;
+
+	if ((d = calloc(1, sizeof (*d))) == NULL)
+	{
+		return (NULL);
+	}
+	if ((d->build = calloc(1, sizeof (*d->build))) == NULL ||
+			!_fsmtrie_dawg_path_grow(d->build, 0) ||
+			!_fsmtrie_dawg_rehash(d, d->build))
+	{
+		_fsmtrie_dawg_free(d);
+		return (NULL);
+	}
+
+	return (d);
+}
+
+void
+_fsmtrie_dawg_free(struct fsmtrie_dawg *d)
+{
+	if (d == NULL)
+	{
+		return;
+	}
+	if (d->build != NULL)
+	{
+		_fsmtrie_dawg_build_free(d->build);
+	}
+	free(d->states);
+	free(d->labels);
+	free(d->targets);
+	free(d->before);
+	free(d->strs);
+	free(d->soff);
+	free(d);
+}
+
+/*
+ * XXX: As with _fsmtrie_insert(), running out of memory mid-way through
+ * adding a key may leave the path of the last key half updated.
+ */
+bool
+_fsmtrie_dawg_insert(struct fsmtrie *f, const char *key, size_t keylen,
+		const char *str, const char *func)
+{
+	struct fsmtrie_dawg *d = f->dawg;
+	struct fsmtrie_dawg_build *b = d->build;
+	const unsigned char *p = (const unsigned char *)key;
+	struct _fsmtrie_dawg_pstate *ps;
+	size_t cp, n;
+
+	if (b == NULL)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with a sealed DAWG"
+				" fsmtrie", func);
+		return (false);
+	}
+
+	/* the prefix shared with the last key, whose path is kept */
+	for (cp = 0; cp < b->plen && cp < keylen &&
+			p[cp] == _fsmtrie_dawg_arc_last(&b->path[cp]); cp++)
+		;
+	if (d->nkeys > 0 && cp == keylen && cp == b->plen)
+	{
+		/* a duplicate key, same as _fsmtrie_insert() */
+		return (true);
+	}
+	if (cp < b->plen && (cp == keylen ||
+				p[cp] < _fsmtrie_dawg_arc_last(&b->path[cp])))
+	{
+		_fsmtrie_error(f, "%s() requires keys in ascending order in a"
+				" DAWG fsmtrie", func);
+		return (false);
+	}
+	if (d->nkeys == UINT32_MAX - 1)
+	{
+		_fsmtrie_error(f, "can't add key: %s", strerror(EFBIG));
+		return (false);
+	}
+
+	/* the states below the shared prefix are final now */
+	if (!_fsmtrie_dawg_path_grow(b, keylen))
+	{
+		goto nomem;
+	}
+	for (n = cp; n < keylen; n++)
+	{
+		if (!_fsmtrie_dawg_arc_reserve(&b->path[n]))
+		{
+			goto nomem;
+		}
+	}
+	if (!_fsmtrie_dawg_unwind(d, b, cp) || !_fsmtrie_dawg_str_add(d, str))
+	{
+		goto nomem;
+	}
+
+	for (n = cp; n < keylen; n++)
+	{
+		ps = &b->path[n];
+		ps->arcs[ps->narcs].label = p[n];
+		ps->arcs[ps->narcs].target = FSMTRIE_INONE;
+		ps->arcs[ps->narcs].before = ps->count;
+		ps->narcs++;
+		b->path[n + 1].accept = false;
+		b->path[n + 1].count = 0;
+	}
+	b->path[keylen].accept = true;
+	for (n = 0; n <= keylen; n++)
+	{
+		b->path[n].count++;
+	}
+	b->plen = keylen;
+
+	d->nkeys++;
+	f->key_cnt++;
+	/* the states registered and those of the path */
+	f->node_cnt = d->nstates + keylen + 1;
+	if (keylen > f->depth)
+	{
+		f->depth = keylen;
+	}
+	return (true);
+
+nomem:
+	_fsmtrie_error(f, "can't add DAWG state: %s", strerror(errno));
+	return (false);
+}
+
+/* give back the room arrays were grown by */
+static void
+_fsmtrie_dawg_shrink(void **p, size_t size)
+{
+	void *q;
+
+	if (size > 0 && (q = realloc(*p, size)) != NULL)
+	{
+		*p = q;
+	}
+}
+
+bool
+_fsmtrie_dawg_seal(struct fsmtrie *f)
+{
+	struct fsmtrie_dawg *d = f->dawg;
+	struct fsmtrie_dawg_build *b;
+	bool ok = true;
+
+	if (__atomic_load_n(&d->build, __ATOMIC_ACQUIRE) == NULL)
+	{
+		return (true);
+	}
+
+	/* concurrent searches may race to get here, only one seals */
+	pthread_mutex_lock(&f->lock);
+	if ((b = d->build) != NULL)
+	{
+		if (_fsmtrie_dawg_unwind(d, b, 0) &&
+				(d->root = _fsmtrie_dawg_register(d, b,
+					&b->path[0])) != FSMTRIE_INONE)
+		{
+			_fsmtrie_dawg_build_free(b);
+			_fsmtrie_dawg_shrink((void **)&d->states,
+					d->nstates * sizeof (*d->states));
+			_fsmtrie_dawg_shrink((void **)&d->labels,
+					d->ntrans * sizeof (*d->labels));
+			_fsmtrie_dawg_shrink((void **)&d->targets,
+					d->ntrans * sizeof (*d->targets));
+			_fsmtrie_dawg_shrink((void **)&d->before,
+					d->ntrans * sizeof (*d->before));
+			_fsmtrie_dawg_shrink((void **)&d->strs, d->strs_len);
+			_fsmtrie_dawg_shrink((void **)&d->soff,
+					(d->nstrs + FSMTRIE_DAWG_SBLOCK - 1) /
+					FSMTRIE_DAWG_SBLOCK * sizeof (*d->soff));
+			f->node_cnt = d->nstates;
+			__atomic_store_n(&d->build, NULL, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			_fsmtrie_error(f, "can't seal DAWG: %s",
+					strerror(errno));
+			ok = false;
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return (ok);
+}
+
+int
+_fsmtrie_dawg_search(struct fsmtrie *f, const char *key, size_t keylen,
+		const char **str)
+{
+	const struct fsmtrie_dawg *d = f->dawg;
+	const unsigned char *p, *end;
+	uint32_t s, t, num = 0;
+
+	*str = NULL;
+	if (!_fsmtrie_dawg_seal(f))
+	{
+		/* error set by _fsmtrie_dawg_seal() */
+		return (-1);
+	}
+
+	end = (const unsigned char *)key + keylen;
+	for (p = (const unsigned char *)key, s = d->root; p < end; p++)
+	{
+		if ((int)*p > f->nrnodes - 1)
+		{
+			_fsmtrie_error(f, "key value \"%d\" out of range",
+				(int)*p);
+			return (-1);
+		}
+		if ((t = _fsmtrie_dawg_trans(d, s, *p)) == FSMTRIE_INONE)
+		{
+			/* no match */
+			return (0);
+		}
+		num += d->before[t];
+		s = d->targets[t];
+	}
+	if (d->states[s].accept)
+	{
+		*str = _fsmtrie_dawg_str(d, num);
+		return (1);
+	}
+
+	return ((f->flags & FSMTRIE_PM_OK) ? 1 : 0);
+}
+
+/* recursively print leaves to stdout, see _fsmtrie_print_leaves() */
+static void
+_fsmtrie_dawg_print_state(const struct fsmtrie_dawg *d, uint32_t s,
+		uint32_t num)
+{
+	const struct fsmtrie_dstate *state = &d->states[s];
+	const char *str;
+	uint32_t t;
+
+	for (t = state->first; t < state->first + state->ntrans; t++)
+	{
+		_fsmtrie_dawg_print_state(d, d->targets[t],
+				num + d->before[t]);
+	}
+	if (state->accept && (str = _fsmtrie_dawg_str(d, num)) != NULL)
+	{
+		printf("%s\n", str);
+	}
+}
+
+void
+_fsmtrie_dawg_print_leaves(struct fsmtrie *f)
+{
+	const struct fsmtrie_dawg *d = f->dawg;
+	const struct fsmtrie_dstate *root;
+	uint32_t t;
+
+	if (!_fsmtrie_dawg_seal(f))
+	{
+		return;
+	}
+	root = &d->states[d->root];
+	for (t = root->first; t < root->first + root->ntrans; t++)
+	{
+		_fsmtrie_dawg_print_state(d, d->targets[t], d->before[t]);
+	}
+}
@@ -0,0 +1,365 @@
+/*
+ * Fast String Matcher Key Deletion Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * Deleting a key clears the leaf flag of its node and frees the node's
+ * string. The nodes at the end of the key's path that are then left without
+ * a key and without children are pruned: the deepest node of the path that
+ * stays loses one child and everything below it is freed.
+ */
+
+/* free an arena object no longer in the trie, RCU readers may still see it */
+static void
+_fsmtrie_delete_release(struct fsmtrie *f, void *p, size_t size)
+{
+	if (f->rcu != NULL)
+	{
+		_fsmtrie_rcu_unlink(f, p, size);
+	}
+	else
+	{
+		_fsmtrie_arena_free(&f->arena, p, size);
+	}
+}
+
+/* free a pruned node along with its child table and links */
+static void
+_fsmtrie_delete_node(struct fsmtrie *f, fsmtrie_node_t *node)
+{
+	if (node->tab != NULL)
+	{
+		_fsmtrie_delete_release(f, node->tab,
+				_fsmtrie_tab_size(node->tab->kind));
+	}
+	if (f->rcu != NULL)
+	{
+		_fsmtrie_rcu_unlink_node(f, node);
+		return;
+	}
+	if (node->aux.tree != NULL)
+	{
+		_fsmtrie_arena_free(&f->arena, node->aux.tree,
+				sizeof (*node->aux.tree));
+	}
+	_fsmtrie_arena_free(&f->arena, node, sizeof (*node));
+}
+
+static int
+_fsmtrie_delete(struct fsmtrie *f, const char *key, size_t keylen,
+		const char *func)
+{
+	const unsigned char *p = (const unsigned char *)key;
+	fsmtrie_node_t **nodes, *node, *leaf;
+	size_t n, keep;
+	int rc = -1;
+
+	if (f->img != NULL)
+	{
+		_fsmtrie_error(f,
+				"%s() is incompatible with a read-only fsmtrie",
+				func);
+		return (-1);
+	}
+	if (f->dawg != NULL)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with DAWG fsmtries",
+				func);
+		return (-1);
+	}
+	if (f->root == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (-1);
+	}
+	if (f->mode != fsmtrie_mode_ascii && f->mode != fsmtrie_mode_eascii)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				func, _mode_to_str(f->mode));
+		return (-1);
+	}
+	if (key == NULL)
+	{
+		_fsmtrie_error(f, "empty key");
+		return (-1);
+	}
+
+	if ((nodes = malloc((keylen + 1) * sizeof (*nodes))) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate path: %s", strerror(errno));
+		return (-1);
+	}
+
+	/* nothing is copied for keys that aren't there */
+	nodes[0] = _fsmtrie_wroot(f);
+	for (n = 0; n < keylen; n++)
+	{
+		if ((nodes[n + 1] = _fsmtrie_child(nodes[n], p[n])) == NULL)
+		{
+			rc = 0;
+			goto out;
+		}
+	}
+	if ((nodes[keylen]->type & FSMTRIE_NODE_LEAF) == 0)
+	{
+		rc = 0;
+		goto out;
+	}
+
+	/* nodes[keep + 1] and below are pruned, the root always stays */
+	for (keep = keylen; keep > 0; keep--)
+	{
+		node = nodes[keep];
+		if (node->tab != NULL && node->tab->cnt > (keep < keylen))
+		{
+			break;
+		}
+		if (keep < keylen && (node->type & FSMTRIE_NODE_LEAF))
+		{
+			break;
+		}
+	}
+
+	/* RCU deletes copy the path down to the node losing a child */
+	if (f->rcu != NULL)
+	{
+		for (n = 0; n <= keep; n++)
+		{
+			node = _fsmtrie_rcu_own(f, n > 0 ? nodes[n - 1] : NULL,
+					n > 0 ? p[n - 1] : 0, nodes[n]);
+			if (node == NULL)
+			{
+				_fsmtrie_error(f, "can't copy node: %s",
+						strerror(errno));
+				goto out;
+			}
+			nodes[n] = node;
+		}
+	}
+
+	/* a pruned leaf of an RCU trie is still published, leave it be */
+	leaf = nodes[keylen];
+	if (leaf->str != NULL)
+	{
+		_fsmtrie_delete_release(f, leaf->str, strlen(leaf->str) + 1);
+	}
+	if (f->rcu == NULL || keep == keylen)
+	{
+		leaf->type &= ~FSMTRIE_NODE_LEAF;
+		leaf->str = NULL;
+	}
+	if (f->rcu != NULL)
+	{
+		_fsmtrie_rcu_key(leaf)->type &= ~FSMTRIE_NODE_LEAF;
+	}
+
+	/* like inserts, RCU tries show the new links once published */
+	if (f->flags & FSMTRIE_AC_LINKS)
+	{
+		_fsmtrie_ac_del(f, leaf, &nodes[keep + 1], keylen - keep);
+	}
+	if (f->rcu == NULL && ((f->flags & FSMTRIE_AC_LINKS) == 0 ||
+				(f->flags & FSMTRIE_AC_DFA)))
+	{
+		f->flags &= ~FSMTRIE_AC_COMPILED;
+	}
+
+	if (keep < keylen)
+	{
+		_fsmtrie_tab_del(&f->arena, nodes[keep], p[keep]);
+		for (n = keep + 1; n <= keylen; n++)
+		{
+			_fsmtrie_delete_node(f, nodes[n]);
+			f->node_cnt--;
+		}
+		/* scanners may have stopped at a node just freed */
+		if (f->rcu == NULL)
+		{
+			f->prunes++;
+		}
+	}
+	_fsmtrie_symdel_drop(f);
+	f->key_cnt--;
+	rc = 1;
+
+out:
+	free(nodes);
+	return (rc);
+}
+
+int
+fsmtrie_delete(struct fsmtrie *f, const char *key)
+{
+	if (f == NULL)
+	{
+		return (-1);
+	}
+
+	return (_fsmtrie_delete(f, key, key != NULL ? strlen(key) : 0,
+				__func__));
+}
+
+int
+fsmtrie_delete_n(struct fsmtrie *f, const char *key, size_t keylen)
+{
+	if (f == NULL)
+	{
+		return (-1);
+	}
+
+	return (_fsmtrie_delete(f, key, keylen, __func__));
+}
+
+/* number of children of a token node */
+static size_t
+_fsmtrie_token_cnt(const struct fsmtrie *f, const fsmtrie_node_t *node)
+{
+	return (node == f->root ? f->nrnodes : node->nnodes);
+}
+
+int
+fsmtrie_delete_token(struct fsmtrie *f, const uint32_t *key, size_t keylen)
+{
+	fsmtrie_node_t **nodes, *node, *shrunk;
+	size_t n, keep, idx, cnt;
+	int rc = 0;
+
+	if (f == NULL)
+	{
+		return (-1);
+	}
+	if (f->img != NULL)
+	{
+		_fsmtrie_error(f,
+				"%s() is incompatible with a read-only fsmtrie",
+				__func__);
+		return (-1);
+	}
+	if (f->root == NULL && f->dawg == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (-1);
+	}
+	if (key == NULL || keylen == 0)
+	{
+		_fsmtrie_error(f, "empty key or keylen");
+		return (-1);
+	}
+	if (f->mode != fsmtrie_mode_token)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				__func__, _mode_to_str(f->mode));
+		return (-1);
+	}
+
+	if ((nodes = malloc((keylen + 1) * sizeof (*nodes))) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate path: %s", strerror(errno));
+		return (-1);
+	}
+
+	nodes[0] = f->root;
+	for (n = 0; n < keylen; n++)
+	{
+		nodes[n + 1] = _fsmtrie_token_child(f, nodes[n], key[n]);
+		if (nodes[n + 1] == NULL)
+		{
+			goto out;
+		}
+	}
+	if ((nodes[keylen]->type & FSMTRIE_NODE_LEAF) == 0)
+	{
+		goto out;
+	}
+
+	node = nodes[keylen];
+	node->type &= ~(FSMTRIE_NODE_LEAF | FSMTRIE_NODE_OUTPUT);
+	if (node->str != NULL)
+	{
+		_fsmtrie_arena_free(&f->arena, node->str, strlen(node->str) + 1);
+		node->str = NULL;
+	}
+
+	/* nodes[keep + 1] and below are pruned, the root always stays */
+	for (keep = keylen; keep > 0; keep--)
+	{
+		node = nodes[keep];
+		if (node->nnodes > (keep < keylen) ||
+				(node->type & FSMTRIE_NODE_LEAF))
+		{
+			break;
+		}
+	}
+
+	if (keep < keylen)
+	{
+		node = nodes[keep];
+		cnt = _fsmtrie_token_cnt(f, node);
+		(void)_fsmtrie_get_token_idx(&f->arena, &node, cnt, key[keep],
+				false, &idx);
+		memmove(&node->nodes[idx], &node->nodes[idx + 1],
+				sizeof (*node->nodes) * (cnt - idx - 1));
+		if (keep == 0)
+		{
+			f->nrnodes--;
+		}
+		else
+		{
+			node->nnodes--;
+		}
+
+		/* give the slot back, keeping the node if that fails */
+		shrunk = _fsmtrie_arena_realloc(&f->arena, node,
+				_fsmtrie_token_node_size(cnt),
+				_fsmtrie_token_node_size(cnt - 1));
+		if (shrunk != NULL && shrunk != node)
+		{
+			if (keep == 0)
+			{
+				f->root = shrunk;
+			}
+			else
+			{
+				(void)_fsmtrie_get_token_idx(&f->arena,
+						&nodes[keep - 1],
+						_fsmtrie_token_cnt(f,
+							nodes[keep - 1]),
+						key[keep - 1], false, &idx);
+				nodes[keep - 1]->nodes[idx] = shrunk;
+			}
+		}
+
+		for (n = keep + 1; n <= keylen; n++)
+		{
+			_fsmtrie_arena_free(&f->arena, nodes[n],
+					_fsmtrie_token_node_size(
+						nodes[n]->nnodes));
+		}
+	}
+
+	/* token tries count one node per key, see fsmtrie_insert_token() */
+	f->node_cnt--;
+	f->flags &= ~FSMTRIE_AC_COMPILED;
+	f->key_cnt--;
+	rc = 1;
+
+out:
+	free(nodes);
+	return (rc);
+}
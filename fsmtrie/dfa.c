@@ -0,0 +1,264 @@
+/*
+ * Fast String Matcher Aho-Corasick DFA Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+void
+_fsmtrie_dfa_free(struct fsmtrie_dfa *dfa)
+{
+	if (dfa == NULL)
+	{
+		return;
+	}
+	free(dfa->delta);
+	free(dfa->nodes);
+	free(dfa);
+}
+
+/*
+ * Give bytes whose columns of the table are identical a single class, and
+ * drop the classes of no byte. cls maps each byte to its column of the w0
+ * columns wide table, which is replaced by one of dfa->nclasses columns.
+ * Returns false, leaving the table as is, if that can't be allocated.
+ */
+static bool
+_fsmtrie_dfa_merge(struct fsmtrie_dfa *dfa, fsmtrie_node_t * const *order,
+		const uint16_t *cls, uint32_t w0)
+{
+	uint32_t hash[257], src[256], *delta, *from, *to, w, n, k;
+	int16_t id[257];
+	int c, j;
+
+	/* FNV-1a of every column, to skip most of the comparisons */
+	for (j = 0; j < (int)w0; j++)
+	{
+		hash[j] = 2166136261u;
+		for (n = 0; n < dfa->nstates; n++)
+		{
+			hash[j] = (hash[j] ^ dfa->delta[n * w0 + j]) * 16777619u;
+		}
+		id[j] = -1;
+	}
+
+	/* classes in byte order, the first of the matching columns wins */
+	w = 0;
+	for (c = 0; c < 256; c++)
+	{
+		if (id[cls[c]] >= 0)
+		{
+			continue;
+		}
+		for (k = 0; k < w; k++)
+		{
+			if (hash[src[k]] != hash[cls[c]])
+			{
+				continue;
+			}
+			for (n = 0; n < dfa->nstates; n++)
+			{
+				if (dfa->delta[n * w0 + src[k]] !=
+						dfa->delta[n * w0 + cls[c]])
+				{
+					break;
+				}
+			}
+			if (n == dfa->nstates)
+			{
+				break;
+			}
+		}
+		if (k == w)
+		{
+			src[w++] = cls[c];
+		}
+		id[cls[c]] = k;
+	}
+
+	if ((delta = malloc(dfa->nstates * w * sizeof (*delta))) == NULL)
+	{
+		return (false);
+	}
+	for (n = 0; n < dfa->nstates; n++)
+	{
+		from = &dfa->delta[n * w0];
+		to = &delta[n * w];
+		for (k = 0; k < w; k++)
+		{
+			to[k] = from[src[k]] / w0 * w;
+		}
+		order[n]->state = order[n]->state / w0 * w;
+	}
+	free(dfa->delta);
+	dfa->delta = delta;
+	for (c = 0; c < 256; c++)
+	{
+		dfa->classes[c] = id[cls[c]];
+	}
+	dfa->nclasses = w;
+	dfa->start = dfa->start / w0 * w;
+	dfa->mlim = dfa->mlim / w0 * w;
+
+	return (true);
+}
+
+/*
+ * Build the DFA of an ASCII or EASCII trie whose suffix links are up to date.
+ * Returns false (and leaves f->dfa unset) if the table would be too large or
+ * can't be allocated, or the trie has more nodes than counted, in which case
+ * substring search follows suffix links.
+ */
+bool
+_fsmtrie_dfa_build(struct fsmtrie *f)
+{
+	struct fsmtrie_dfa *dfa;
+	fsmtrie_node_t **order, *root, *node, *child;
+	size_t n, nout, head, tail, nstates;
+	uint32_t *row, id, k, w0;
+	uint16_t cls[256];
+	uint8_t used[256];
+	int c;
+
+	_fsmtrie_dfa_free(f->dfa);
+	f->dfa = NULL;
+
+	if ((dfa = calloc(1, sizeof (*dfa))) == NULL)
+	{
+		return (false);
+	}
+
+	/*
+	 * Gather the nodes in breadth-first order, so a node's suffix is
+	 * always seen before the node itself, and note which bytes are used
+	 * as labels.
+	 */
+	nstates = f->node_cnt + 1;
+	if ((order = malloc(nstates * sizeof (*order))) == NULL)
+	{
+		free(dfa);
+		return (false);
+	}
+	memset(used, 0, sizeof (used));
+	root = _fsmtrie_wroot(f);
+	order[0] = root;
+	nout = 0;
+	for (head = 0, tail = 1; head < tail; head++)
+	{
+		node = order[head];
+		if (head > 0 && (node->type & FSMTRIE_NODE_OUTPUT))
+		{
+			nout++;
+		}
+		for (c = _fsmtrie_child_next(node, 0, &child); c >= 0;
+				c = _fsmtrie_child_next(node, c + 1, &child))
+		{
+			if (tail == nstates)
+			{
+				free(order);
+				free(dfa);
+				return (false);
+			}
+			order[tail++] = child;
+			used[c] = 1;
+		}
+	}
+	nstates = tail;
+
+	/* to start with, a column per label byte and one for the others */
+	for (c = 0, k = 1; c < 256; c++)
+	{
+		cls[c] = used[c] ? k++ : 0;
+	}
+	w0 = k;
+
+	if ((uint64_t)nstates * w0 > UINT32_MAX)
+	{
+		free(order);
+		free(dfa);
+		return (false);
+	}
+	dfa->nstates = nstates;
+	dfa->delta = malloc(nstates * w0 * sizeof (*dfa->delta));
+	dfa->nodes = malloc(nstates * sizeof (*dfa->nodes));
+	if (dfa->delta == NULL || dfa->nodes == NULL)
+	{
+		free(order);
+		_fsmtrie_dfa_free(dfa);
+		return (false);
+	}
+
+	/* number the states, outputs first */
+	id = 0;
+	for (n = 1; n < nstates; n++)
+	{
+		if (order[n]->type & FSMTRIE_NODE_OUTPUT)
+		{
+			dfa->nodes[id] = order[n];
+			order[n]->state = id++ * w0;
+		}
+	}
+	dfa->mlim = id * w0;
+	for (n = 0; n < nstates; n++)
+	{
+		if (n == 0 || (order[n]->type & FSMTRIE_NODE_OUTPUT) == 0)
+		{
+			dfa->nodes[id] = order[n];
+			order[n]->state = id++ * w0;
+		}
+	}
+	dfa->start = root->state;
+
+	/*
+	 * A missing transition behaves like the same transition out of the
+	 * node's suffix, so each row starts out as a copy of the suffix's
+	 * row (the root's starts out pointing back to the root) and is then
+	 * overwritten with the node's own children.
+	 */
+	for (n = 0; n < nstates; n++)
+	{
+		node = order[n];
+		row = &dfa->delta[node->state];
+		if (n == 0)
+		{
+			for (k = 0; k < w0; k++)
+			{
+				row[k] = dfa->start;
+			}
+		}
+		else
+		{
+			memcpy(row, &dfa->delta[node->suffix->state],
+					w0 * sizeof (*row));
+		}
+		for (c = _fsmtrie_child_next(node, 0, &child); c >= 0;
+				c = _fsmtrie_child_next(node, c + 1, &child))
+		{
+			row[cls[c]] = child->state;
+		}
+	}
+
+	if (!_fsmtrie_dfa_merge(dfa, order, cls, w0))
+	{
+		free(order);
+		_fsmtrie_dfa_free(dfa);
+		return (false);
+	}
+	free(order);
+	f->dfa = dfa;
+
+	return (true);
+}
@@ -20,31 +20,51 @@
 
 /* export */
 
+size_t
+_fsmtrie_token_node_size(size_t nnodes)
+{
+	if (nnodes < FSMTRIE_SIZE_TOKEN)
+	{
+		nnodes = FSMTRIE_SIZE_TOKEN;
+	}
+	return (sizeof (fsmtrie_node_t) + sizeof (fsmtrie_node_t *) * nnodes);
+}
+
 /* create a new empty trie node */
 static fsmtrie_node_t *
-_fsmtrie_node_new(fsmtrie_mode mode, uint8_t flags, uint16_t *pnnodes)
+_fsmtrie_node_new(struct fsmtrie_arena *a, fsmtrie_mode mode, uint8_t flags,
+		uint16_t *pnnodes)
 {
 	fsmtrie_node_t *result;
 	size_t nnodes, alloc_size;
 
+	/* ASCII and EASCII children live in a separately allocated child
+	 * table that grows on demand, token children are kept inline.
+	 */
 	switch (mode)
 	{
 		case fsmtrie_mode_ascii:
 			nnodes = FSMTRIE_SIZE_ASCII;
+			alloc_size = sizeof (fsmtrie_node_t);
 			break;
 		case fsmtrie_mode_eascii:
 			nnodes = FSMTRIE_SIZE_EASCII;
+			alloc_size = sizeof (fsmtrie_node_t);
 			break;
 		case fsmtrie_mode_token:
 			nnodes = FSMTRIE_SIZE_TOKEN;
+			alloc_size = _fsmtrie_token_node_size(nnodes);
 			break;
 		default:
 			/* this should never happen */
 			return (NULL);
 	}
 
-	alloc_size = sizeof (fsmtrie_node_t) * (nnodes + 1);
-	result = (fsmtrie_node_t *)calloc(1, alloc_size);
+	result = (fsmtrie_node_t *)_fsmtrie_arena_alloc(a, alloc_size);
+	if (result == NULL)
+	{
+		return (NULL);
+	}
 	result->mode = mode;
 	result->flags = flags;
 
@@ -65,7 +85,7 @@ fsmtrie_error(struct fsmtrie *f)
 const char *
 fsmtrie_get_error(struct fsmtrie *f)
 {
-	return (f->err_buf);
+	return (_fsmtrie_get_error(f));
 }
 
 struct fsmtrie *
@@ -73,8 +93,8 @@ fsmtrie_init(struct fsmtrie_opt *o, char *err_buf, size_t err_buf_len)
 {
 	struct fsmtrie *f;
 	fsmtrie_mode mode;
-	uint8_t flags;
-	uint32_t max_len;
+	uint8_t flags, approx_index;
+	uint32_t max_len, approx_prefix;
 
 	f = calloc(1, sizeof (struct fsmtrie));
 	if (f == NULL)
@@ -89,19 +109,57 @@ fsmtrie_init(struct fsmtrie_opt *o, char *err_buf, size_t err_buf_len)
 		mode = fsmtrie_mode_ascii;
 		flags = 0;
 		max_len = 0;
+		approx_index = 0;
+		approx_prefix = 0;
 	}
 	else
 	{
 		max_len = o->max_len;
 		mode = o->mode;
 		flags = o->flags;
+		approx_index = o->approx_index;
+		approx_prefix = o->approx_prefix;
+	}
+
+	if ((flags & FSMTRIE_RCU) && approx_index > 0)
+	{
+		snprintf(err_buf, err_buf_len,
+				"approximate search index not allowed for RCU"
+				" fsmtries");
+		free(f);
+		return (NULL);
+	}
+	if ((flags & FSMTRIE_DAWG) && (flags & FSMTRIE_RCU))
+	{
+		snprintf(err_buf, err_buf_len,
+				"DAWG not allowed for RCU fsmtries");
+		free(f);
+		return (NULL);
 	}
 
 	switch (mode)
 	{
 		case fsmtrie_mode_ascii:
 		case fsmtrie_mode_eascii:
-			f->root = _fsmtrie_node_new(mode, flags, &f->nrnodes);
+			if (flags & FSMTRIE_DAWG)
+			{
+				/* the DAWG takes the place of the root */
+				if ((f->dawg = _fsmtrie_dawg_new()) == NULL)
+				{
+					snprintf(err_buf, err_buf_len,
+							"can't allocate DAWG:"
+							" %s", strerror(errno));
+					free(f);
+					return (NULL);
+				}
+				f->nrnodes = mode == fsmtrie_mode_ascii ?
+					FSMTRIE_SIZE_ASCII :
+					FSMTRIE_SIZE_EASCII;
+				f->node_cnt = 1;
+				break;
+			}
+			f->root = _fsmtrie_node_new(&f->arena, mode, flags,
+					&f->nrnodes);
 			break;
 		case fsmtrie_mode_token:
 			if (flags & FSMTRIE_PM_OK)
@@ -112,7 +170,24 @@ fsmtrie_init(struct fsmtrie_opt *o, char *err_buf, size_t err_buf_len)
 				free(f);
 				return (NULL);
 			}
-			f->root = _fsmtrie_node_new(mode, flags, NULL);
+			if (flags & FSMTRIE_RCU)
+			{
+				snprintf(err_buf, err_buf_len,
+						"RCU not allowed for token"
+						" fsmtries");
+				free(f);
+				return (NULL);
+			}
+			if (flags & FSMTRIE_DAWG)
+			{
+				snprintf(err_buf, err_buf_len,
+						"DAWG not allowed for token"
+						" fsmtries");
+				free(f);
+				return (NULL);
+			}
+			f->root = _fsmtrie_node_new(&f->arena, mode, flags,
+					NULL);
 			f->nrnodes = 0;
 			break;
 		default:
@@ -122,7 +197,7 @@ fsmtrie_init(struct fsmtrie_opt *o, char *err_buf, size_t err_buf_len)
 			return (NULL);
 	}
 
-	if (f->root == NULL)
+	if (f->root == NULL && f->dawg == NULL)
 	{
 		snprintf(err_buf, err_buf_len, "can't allocate root node: %s",
 				strerror(errno));
@@ -133,6 +208,17 @@ fsmtrie_init(struct fsmtrie_opt *o, char *err_buf, size_t err_buf_len)
 	f->max_len = max_len;
 	f->mode = mode;
 	f->flags = flags;
+	f->approx_index = approx_index;
+	f->approx_prefix = approx_prefix;
+	pthread_mutex_init(&f->lock, NULL);
+
+	if ((flags & FSMTRIE_RCU) && !_fsmtrie_rcu_init(f))
+	{
+		snprintf(err_buf, err_buf_len, "can't allocate RCU state: %s",
+				strerror(errno));
+		fsmtrie_destroy(&f);
+		return (NULL);
+	}
 
 	return (f);
 }
@@ -259,47 +345,258 @@ fsmtrie_opt_get_partialmatch(struct fsmtrie_opt *o, bool *on)
 }
 
 bool
-fsmtrie_key_validate_ascii(struct fsmtrie *f, const char *key)
+fsmtrie_opt_set_dfa(struct fsmtrie_opt *o, bool on)
 {
-	size_t n;
-	const unsigned char *p;
+	if (o == NULL)
+	{
+		return (false);
+	}
 
-	if (f == NULL)
+	if (on == true)
+	{
+		o->flags |= FSMTRIE_AC_DFA;
+	}
+	else
+	{
+		o->flags &= ~FSMTRIE_AC_DFA;
+	}
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_get_dfa(struct fsmtrie_opt *o, bool *on)
+{
+	if (o == NULL)
 	{
 		return (false);
 	}
-	if (f->root == NULL)
+
+	*on = (o->flags & FSMTRIE_AC_DFA) != 0;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_set_rcu(struct fsmtrie_opt *o, bool on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	if (on == true)
+	{
+		o->flags |= FSMTRIE_RCU;
+	}
+	else
+	{
+		o->flags &= ~FSMTRIE_RCU;
+	}
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_get_rcu(struct fsmtrie_opt *o, bool *on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	*on = (o->flags & FSMTRIE_RCU) != 0;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_set_approx_automaton(struct fsmtrie_opt *o, bool on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	if (on == true)
+	{
+		o->flags |= FSMTRIE_APPROX_LEV;
+	}
+	else
+	{
+		o->flags &= ~FSMTRIE_APPROX_LEV;
+	}
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_get_approx_automaton(struct fsmtrie_opt *o, bool *on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	*on = (o->flags & FSMTRIE_APPROX_LEV) != 0;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_set_approx_index(struct fsmtrie_opt *o, int max_dist)
+{
+	if (o == NULL || max_dist < 0 || max_dist > FSMTRIE_APPROX_INDEX_MAX)
+	{
+		return (false);
+	}
+
+	o->approx_index = max_dist;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_get_approx_index(struct fsmtrie_opt *o, int *max_dist)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	*max_dist = o->approx_index;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_set_approx_index_prefix(struct fsmtrie_opt *o, uint32_t len)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	o->approx_prefix = len;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_get_approx_index_prefix(struct fsmtrie_opt *o, uint32_t *len)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	*len = o->approx_prefix;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_set_double_array(struct fsmtrie_opt *o, bool on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	if (on == true)
+	{
+		o->flags |= FSMTRIE_DOUBLE_ARRAY;
+	}
+	else
+	{
+		o->flags &= ~FSMTRIE_DOUBLE_ARRAY;
+	}
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_get_double_array(struct fsmtrie_opt *o, bool *on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	*on = (o->flags & FSMTRIE_DOUBLE_ARRAY) != 0;
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_set_dawg(struct fsmtrie_opt *o, bool on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	if (on == true)
+	{
+		o->flags |= FSMTRIE_DAWG;
+	}
+	else
+	{
+		o->flags &= ~FSMTRIE_DAWG;
+	}
+
+	return (true);
+}
+
+bool
+fsmtrie_opt_get_dawg(struct fsmtrie_opt *o, bool *on)
+{
+	if (o == NULL)
+	{
+		return (false);
+	}
+
+	*on = (o->flags & FSMTRIE_DAWG) != 0;
+
+	return (true);
+}
+
+/* validate a key of a specified length, see fsmtrie_key_validate_ascii() */
+static bool
+_fsmtrie_key_validate(struct fsmtrie *f, const char *key, size_t keylen)
+{
+	size_t n;
+	const unsigned char *p;
+
+	if (_fsmtrie_root(f) == NULL && f->img == NULL && f->dawg == NULL)
 	{
-		snprintf(f->err_buf, sizeof (f->err_buf), "uninitialized trie");
+		_fsmtrie_error(f, "uninitialized trie");
 		return (false);
 	}
 
 	if (key == NULL)
 	{
-		snprintf(f->err_buf, sizeof (f->err_buf), "empty key");
+		_fsmtrie_error(f, "empty key");
 		return (false);
 	}
 
 	if (f->max_len > 0)
 	{
-		if ((n = strlen(key)) > f->max_len)
+		if (keylen > f->max_len)
 		{
-			snprintf(f->err_buf, sizeof (f->err_buf),
-					"key too long (%ld > %d)",
-					n, f->max_len);
+			_fsmtrie_error(f, "key too long (%ld > %d)",
+					keylen, f->max_len);
 			return (false);
 		}
 	}
 	if (f->mode == fsmtrie_mode_ascii)
 	{
-		for (n = 0, p = (unsigned char *)key; *p; n++, p++)
+		for (n = 0, p = (unsigned char *)key; n < keylen; n++, p++)
 		{
 			/* store only ASCII code points */
 			if ((int)*p < 0 || (int)*p > f->nrnodes - 1)
 			{
-				snprintf(f->err_buf,
-						sizeof (f->err_buf),
-					"\"%d\" value at position %ld"
+				_fsmtrie_error(f, "\"%d\" value at position %ld"
 					" out of range", (int)*p, n);
 				return (false);
 			}
@@ -308,6 +605,17 @@ fsmtrie_key_validate_ascii(struct fsmtrie *f, const char *key)
 	return (true);
 }
 
+bool
+fsmtrie_key_validate_ascii(struct fsmtrie *f, const char *key)
+{
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	return (_fsmtrie_key_validate(f, key, key != NULL ? strlen(key) : 0));
+}
+
 bool
 fsmtrie_insert_ascii(struct fsmtrie *f, const char *key, const char *str)
 {
@@ -320,70 +628,153 @@ fsmtrie_insert_eascii(struct fsmtrie *f, const char *key, const char *str)
 	return (fsmtrie_insert(f, key, str));
 }
 
+fsmtrie_node_t *
+_fsmtrie_node_add(struct fsmtrie *f, fsmtrie_node_t *parent, unsigned int c)
+{
+	fsmtrie_node_t *node;
+
+	/* create a new node at the code point's index */
+	node = _fsmtrie_node_new(&f->arena, f->mode, f->flags, NULL);
+	if (node != NULL)
+	{
+		node->depth = parent->depth + 1;
+	}
+	if (node == NULL || (f->rcu != NULL &&
+				!_fsmtrie_rcu_node(f, parent, c, node)))
+	{
+		_fsmtrie_error(f, "can't add node: %s", strerror(errno));
+		_fsmtrie_arena_free(&f->arena, node, sizeof (*node));
+		return (NULL);
+	}
+	if (!_fsmtrie_tab_add(&f->arena, parent, c, node))
+	{
+		_fsmtrie_error(f, "can't add node: %s", strerror(errno));
+		if (f->rcu != NULL)
+		{
+			_fsmtrie_rcu_unlink_node(f, node);
+		}
+		else
+		{
+			_fsmtrie_arena_free(&f->arena, node, sizeof (*node));
+		}
+		return (NULL);
+	}
+	f->node_cnt++;
+	if (node->depth > f->depth)
+	{
+		/* read by RCU searches, see _fsmtrie_search_approx() */
+		__atomic_store_n(&f->depth, node->depth, __ATOMIC_RELAXED);
+	}
+
+	return (node);
+}
+
 /*
  * XXX: In the unlikely event we return false mid-way through adding a key
  * the library will leave an unfinished insertion in the trie which amounts to
  * a sort of memory leak. But if the process runs out of memory, you probably
  * have bigger problems.
  */
-bool
-fsmtrie_insert(struct fsmtrie *f, const char *key, const char *str)
+static bool
+_fsmtrie_insert(struct fsmtrie *f, const char *key, size_t keylen,
+		const char *str, const char *func)
 {
-	int len;
-	const unsigned char *p;
-	fsmtrie_node_t *node_p;
+	const unsigned char *p, *end, *added_p = NULL;
+	fsmtrie_node_t *root, *node_p, *next_p, *added = NULL;
 
-	if (f == NULL)
+	if (f->img != NULL)
 	{
+		_fsmtrie_error(f,
+				"%s() is incompatible with a read-only fsmtrie",
+				func);
 		return (false);
 	}
-	if (f->root == NULL)
+	if (f->root == NULL && f->dawg == NULL)
 	{
-		snprintf(f->err_buf, sizeof (f->err_buf),
-				"uninitialized trie");
+		_fsmtrie_error(f, "uninitialized trie");
 		return (false);
 	}
 
 	if (f->mode != fsmtrie_mode_ascii && f->mode != fsmtrie_mode_eascii)
 	{
-		snprintf(f->err_buf,
-				sizeof (f->err_buf),
-				"%s() is incompatible with %s mode fsmtrie",
-				__func__, _mode_to_str(f->mode));
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				func, _mode_to_str(f->mode));
 		return (false);
 	}
 
 	/* Validate the string before adding to trie to avoid partial adds
 	 * when encountering invalid code points mid way through a key.
 	 */
-	if (!fsmtrie_key_validate_ascii(f, key))
+	if (!_fsmtrie_key_validate(f, key, keylen))
 	{
-		/* f->err_buf set by fsmtrie_key_validate_ascii() */
+		/* error set by _fsmtrie_key_validate() */
 		return (false);
 	}
 
+	if (f->dawg != NULL)
+	{
+		return (_fsmtrie_dawg_insert(f, key, keylen, str, func));
+	}
+
+	end = (const unsigned char *)key + keylen;
+	root = _fsmtrie_wroot(f);
+	if (f->rcu != NULL)
+	{
+		/* duplicates leave the trie alone, don't copy their path */
+		for (p = (unsigned char *)key, node_p = root;
+				node_p != NULL && p < end; p++)
+		{
+			node_p = _fsmtrie_child(node_p, *p);
+		}
+		if (node_p != NULL && (node_p->type & FSMTRIE_NODE_LEAF))
+		{
+			return (true);
+		}
+		if ((root = _fsmtrie_rcu_own(f, NULL, 0, root)) == NULL)
+		{
+			_fsmtrie_error(f, "can't copy node: %s",
+					strerror(errno));
+			return (false);
+		}
+	}
+
 	/* Walk the trie from the root, adding the key char by char. Duplicate
-	 * keys will not be re-added.
+	 * keys will not be re-added. In RCU mode every node on the way is
+	 * copied unless it was created since the last fsmtrie_publish().
 	 */
-	for (p = (unsigned char *)key, node_p = f->root; *p; p++)
+	for (p = (unsigned char *)key, node_p = root; p < end; p++)
 	{
-		if (node_p->nodes[(int)*p] == NULL)
+		next_p = _fsmtrie_child(node_p, *p);
+		if (next_p != NULL && f->rcu != NULL)
 		{
-			/* create a new node at the code point's index */
-			node_p->nodes[(int)*p] =
-				_fsmtrie_node_new(f->mode, f->flags, NULL);
-			node_p->nodes[(int)*p]->nnodes = f->nrnodes;
-			if (node_p->nodes[(int)*p] == NULL)
+			next_p = _fsmtrie_rcu_own(f, node_p, *p, next_p);
+			if (next_p == NULL)
 			{
-				snprintf(f->err_buf,
-						sizeof (f->err_buf),
-						"can't add node: %s",
+				_fsmtrie_error(f, "can't copy node: %s",
 						strerror(errno));
 				return (false);
 			}
-			f->node_cnt++;
 		}
-		node_p = node_p->nodes[(int)*p];
+		else if (next_p == NULL)
+		{
+			if ((next_p = _fsmtrie_node_add(f, node_p, *p)) == NULL)
+			{
+				/* error set by _fsmtrie_node_add() */
+				if (f->rcu == NULL)
+				{
+					f->flags &= ~(FSMTRIE_AC_LINKS |
+							FSMTRIE_AC_COMPILED);
+				}
+				return (false);
+			}
+			if (added == NULL)
+			{
+				/* where the new part of the key starts */
+				added = node_p;
+				added_p = p;
+			}
+		}
+		node_p = next_p;
 	}
 
 	if (node_p->type & FSMTRIE_NODE_LEAF)
@@ -400,27 +791,65 @@ fsmtrie_insert(struct fsmtrie *f, const char *key, const char *str)
 	 * from "dogs" if *not* allowing partial matches (FSMTRIE_PM_OK).
 	 */
 	node_p->type |= (FSMTRIE_NODE_LEAF | FSMTRIE_NODE_OUTPUT);
+	if (f->rcu != NULL)
+	{
+		_fsmtrie_rcu_key(node_p)->type |= (FSMTRIE_NODE_LEAF |
+				FSMTRIE_NODE_OUTPUT);
+	}
+	_fsmtrie_symdel_drop(f);
+	/* Once a trie has Aho-Corasick links, inserts update the few links
+	 * the new key affects rather than having them all recomputed; only a
+	 * DFA needs to be rebuilt. RCU tries have no DFA and readers only see
+	 * the links once fsmtrie_publish() is called.
+	 */
+	if (f->flags & FSMTRIE_AC_LINKS)
+	{
+		_fsmtrie_ac_add(f, added, added_p, end, node_p);
+	}
+	if (f->rcu == NULL && ((f->flags & FSMTRIE_AC_LINKS) == 0 ||
+				(f->flags & FSMTRIE_AC_DFA)))
+	{
+		f->flags &= ~FSMTRIE_AC_COMPILED;
+	}
 	if (str)
 	{
-		len = strlen(str) + 1;
-		node_p->str = calloc(1, len);
+		node_p->str = _fsmtrie_arena_strdup(&f->arena, str);
 		if (node_p->str == NULL)
 		{
-			snprintf(f->err_buf,
-					sizeof (f->err_buf),
-					"can't add node str: %s",
+			_fsmtrie_error(f, "can't add node str: %s",
 					strerror(errno));
 			return (false);
 		}
-		strlcpy(node_p->str, str, len);
 	}
-	/* The trie needs Aho-Corasick info updated after insertion. */
-	f->flags &= ~FSMTRIE_AC_COMPILED;
 
 	f->key_cnt++;
 	return (true);
 }
 
+bool
+fsmtrie_insert(struct fsmtrie *f, const char *key, const char *str)
+{
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	return (_fsmtrie_insert(f, key, key != NULL ? strlen(key) : 0, str,
+				__func__));
+}
+
+bool
+fsmtrie_insert_n(struct fsmtrie *f, const char *key, size_t keylen,
+		const char *str)
+{
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	return (_fsmtrie_insert(f, key, keylen, str, __func__));
+}
+
 /*
  * Use a binary search to find the specified token inside an array of token
  * nodes. If do_insert is set, resize the nodes group and insert the new node
@@ -428,11 +857,11 @@ fsmtrie_insert(struct fsmtrie *f, const char *key, const char *str)
  *
  * If not NULL, store the resulting index into the address of pidx.
  */
-static int
-_fsmtrie_get_token_idx(fsmtrie_node_t **nodep, size_t nodecnt, uint32_t token,
-		bool do_insert, size_t *pidx)
+int
+_fsmtrie_get_token_idx(struct fsmtrie_arena *a, fsmtrie_node_t **nodep,
+		size_t nodecnt, uint32_t token, bool do_insert, size_t *pidx)
 {
-	size_t alloc_size;
+	fsmtrie_node_t *grown;
 	ssize_t slow, shigh, sidx;
 
 	slow = 0;
@@ -489,11 +918,17 @@ _fsmtrie_get_token_idx(fsmtrie_node_t **nodep, size_t nodecnt, uint32_t token,
 		return (-1);
 	}
 
-	alloc_size = sizeof(*nodep) + (sizeof(**nodep) * (nodecnt + 1));
-	*nodep = realloc(*nodep, alloc_size);
+	grown = _fsmtrie_arena_realloc(a, *nodep,
+			_fsmtrie_token_node_size(nodecnt),
+			_fsmtrie_token_node_size(nodecnt + 1));
+	if (grown == NULL)
+	{
+		return (-1);
+	}
+	*nodep = grown;
 	memmove(&((*nodep)->nodes[sidx + 1]),
 			&((*nodep)->nodes[sidx]),
-			sizeof(**nodep) * (nodecnt - sidx));
+			sizeof(*(*nodep)->nodes) * (nodecnt - sidx));
 	(*nodep)->nodes[sidx] = NULL;
 
 	if (pidx)
@@ -515,23 +950,27 @@ fsmtrie_insert_token(struct fsmtrie *f, uint32_t *tkey, size_t nkey, const char
 {
 	fsmtrie_node_t *node_p, *last_parent;
 	size_t tokidx, last_idx;
-	int len;
 
 	if (f == NULL)
 	{
 		return (false);
 	}
-	if (f->root == NULL)
+	if (f->img != NULL)
 	{
-		snprintf(f->err_buf, sizeof (f->err_buf), "uninitialized trie");
+		_fsmtrie_error(f,
+				"%s() is incompatible with a read-only fsmtrie",
+				__func__);
+		return (false);
+	}
+	if (f->root == NULL && f->dawg == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
 		return (false);
 	}
 
 	if (f->mode != fsmtrie_mode_token)
 	{
-		snprintf(f->err_buf,
-				sizeof (f->err_buf),
-				"%s() is incompatible with %s mode fsmtrie",
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
 				__func__, _mode_to_str(f->mode));
 		return (false);
 	}
@@ -540,8 +979,7 @@ fsmtrie_insert_token(struct fsmtrie *f, uint32_t *tkey, size_t nkey, const char
 	{
 		if (nkey > f->max_len)
 		{
-			snprintf(f->err_buf, sizeof (f->err_buf),
-					"token string too long (%ld > %d)",
+			_fsmtrie_error(f, "token string too long (%ld > %d)",
 					nkey, f->max_len);
 			return (false);
 		}
@@ -559,31 +997,33 @@ fsmtrie_insert_token(struct fsmtrie *f, uint32_t *tkey, size_t nkey, const char
 
 		nnodes = (last_parent == NULL) ? f->nrnodes :
 			node_pp->nnodes;
-		ires = _fsmtrie_get_token_idx(&node_pp, nnodes, tkey[tokidx],
-				true, &nidx);
+		ires = _fsmtrie_get_token_idx(&f->arena, &node_pp, nnodes,
+				tkey[tokidx], true, &nidx);
 
 		if (ires < 0)
 		{
-			snprintf(f->err_buf, sizeof (f->err_buf),
-					"can't insert token into node");
+			_fsmtrie_error(f, "can't insert token into node");
 			return (false);
 		}
 		else if (ires > 0)
 		{
 			/* create a new node at the code point's index */
-			node_pp->nodes[nidx] = _fsmtrie_node_new(node_pp->mode,
-					node_pp->flags, NULL);
+			node_pp->nodes[nidx] = _fsmtrie_node_new(&f->arena,
+					node_pp->mode, node_pp->flags, NULL);
 
 			if (node_pp->nodes[nidx] == NULL)
 			{
-				snprintf(f->err_buf,
-						sizeof (f->err_buf),
-						"can't add node: %s",
+				_fsmtrie_error(f, "can't add node: %s",
 						strerror(errno));
 				return (false);
 			}
 
 			node_pp->nodes[nidx]->tval = tkey[tokidx];
+			node_pp->nodes[nidx]->depth = tokidx + 1;
+			if (tokidx + 1 > f->depth)
+			{
+				f->depth = tokidx + 1;
+			}
 			node_pp->nodes[nidx]->mode = f->mode;
 			node_pp->nodes[nidx]->flags = f->flags;
 
@@ -630,17 +1070,13 @@ fsmtrie_insert_token(struct fsmtrie *f, uint32_t *tkey, size_t nkey, const char
 	node_p->type |= (FSMTRIE_NODE_LEAF | FSMTRIE_NODE_OUTPUT);
 	if (str)
 	{
-		len = strlen(str) + 1;
-		node_p->str = calloc(1, len);
+		node_p->str = _fsmtrie_arena_strdup(&f->arena, str);
 		if (node_p->str == NULL)
 		{
-			snprintf(f->err_buf,
-					sizeof (f->err_buf),
-					"can't add node str: %s",
+			_fsmtrie_error(f, "can't add node str: %s",
 					strerror(errno));
 			return (false);
 		}
-		strlcpy(node_p->str, str, len);
 	}
 	f->node_cnt++;
 	/* The trie needs Aho-Corasick info updated after insertion. */
@@ -655,15 +1091,24 @@ static void
 _fsmtrie_print_leaves(fsmtrie_node_t *node, unsigned int depth)
 {
 	int n;
-	fsmtrie_node_t *node_p;
+	fsmtrie_node_t *node_p, *child;
 
-	for (n = 0, node_p = node; n < node->nnodes; n++)
+	node_p = node;
+	if (node_p->mode == fsmtrie_mode_token)
 	{
-		if (node_p->nodes[n] != NULL)
+		for (n = 0; n < node->nnodes; n++)
 		{
 			_fsmtrie_print_leaves(node_p->nodes[n], depth + 1);
 		}
 	}
+	else
+	{
+		for (n = _fsmtrie_child_next(node_p, 0, &child); n >= 0;
+				n = _fsmtrie_child_next(node_p, n + 1, &child))
+		{
+			_fsmtrie_print_leaves(child, depth + 1);
+		}
+	}
 	if (node_p->mode == fsmtrie_mode_token)
 	{
 		size_t q;
@@ -693,83 +1138,86 @@ void
 fsmtrie_print_leaves(struct fsmtrie *f)
 {
 	int n;
-	fsmtrie_node_t *node_p;
+	fsmtrie_node_t *node_p, *child;
+	struct fsmtrie_rcu_pin pin;
 
 	if (f == NULL)
 	{
 		return;
 	}
-	if (f->root == NULL)
+	if (f->img != NULL)
 	{
-		snprintf(f->err_buf, sizeof (f->err_buf), "uninitialized trie");
+		_fsmtrie_image_print_leaves(f);
 		return;
 	}
-
-	for (n = 0, node_p = f->root; n < f->nrnodes; n++)
+	if (f->dawg != NULL)
 	{
-		if (node_p->nodes[n] != NULL)
-		{
-			_fsmtrie_print_leaves(node_p->nodes[n], 1);
-		}
+		_fsmtrie_dawg_print_leaves(f);
+		return;
+	}
+	if (_fsmtrie_root(f) == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return;
 	}
-}
-
-/* recursively free trie branches */
-static void
-_fsmtrie_release_branch(fsmtrie_node_t *node)
-{
-	int n;
-	fsmtrie_node_t *node_p;
 
-	for (n = 0, node_p = node; n < node->nnodes; n++)
+	node_p = f->root;
+	if (f->mode == fsmtrie_mode_token)
 	{
-		if (node_p->nodes[n])
+		for (n = 0; n < f->nrnodes; n++)
 		{
-			_fsmtrie_release_branch(node_p->nodes[n]);
+			_fsmtrie_print_leaves(node_p->nodes[n], 1);
 		}
+		return;
 	}
-	if ((node_p->type & FSMTRIE_NODE_LEAF) && node_p->str != NULL)
+	_fsmtrie_rcu_enter(f, &pin);
+	node_p = _fsmtrie_root(f);
+	for (n = _fsmtrie_child_next(node_p, 0, &child); n >= 0;
+			n = _fsmtrie_child_next(node_p, n + 1, &child))
 	{
-		free(node_p->str);
-		node_p->str = NULL;
+		_fsmtrie_print_leaves(child, 1);
 	}
-	free(node);
+	_fsmtrie_rcu_exit(&pin);
 }
 
 void
 fsmtrie_free(struct fsmtrie *f)
 {
-	int n;
-	fsmtrie_node_t *root;
-
-	if (f == NULL || f->root == NULL)
+	if (f == NULL)
 	{
 		return;
 	}
-
-	root = f->root;
-
-	/* Freeing the trie is recursive. Walk from the root, each time a node
-	 * is encountered, call the recursive freeing function. When the node
-	 * list is exhausted, free it.
-	 */
-	for (n = 0; n < f->nrnodes; n++)
+	if (f->img != NULL)
 	{
-		if (root->nodes[n] != NULL)
-		{
-			_fsmtrie_release_branch(root->nodes[n]);
-		}
+		_fsmtrie_image_close(f->img);
+		_fsmtrie_symdel_drop(f);
+		f->img = NULL;
+		f->node_cnt = 0;
+		return;
 	}
-
-	if (root->str != NULL)
+	if (f->dawg != NULL)
+	{
+		_fsmtrie_dawg_free(f->dawg);
+		_fsmtrie_symdel_drop(f);
+		f->dawg = NULL;
+		f->node_cnt = 0;
+		return;
+	}
+	if (f->root == NULL)
 	{
-		free(root->str);
-		root->str = NULL;
+		return;
 	}
 
-	/* free top-level node */
-	free(root);
+	/* Every node, child table and leaf string was allocated from the
+	 * trie's arena, so releasing the arena's slabs frees the whole trie
+	 * without walking it.
+	 */
+	_fsmtrie_rcu_free(f);
+	_fsmtrie_arena_destroy(&f->arena);
+	_fsmtrie_dfa_free(f->dfa);
+	_fsmtrie_symdel_drop(f);
 
+	f->dfa = NULL;
 	f->root = NULL;
 	f->node_cnt = 0;
 }
@@ -777,7 +1225,12 @@ fsmtrie_free(struct fsmtrie *f)
 void
 fsmtrie_destroy(struct fsmtrie **f)
 {
+	if (*f == NULL)
+	{
+		return;
+	}
 	fsmtrie_free(*f);
+	pthread_mutex_destroy(&(*f)->lock);
 
 	free(*f);
 	*f = NULL;
@@ -795,39 +1248,17 @@ fsmtrie_search_eascii(struct fsmtrie *f, const char *key, const char **str)
 	return (fsmtrie_search(f, key, str));
 }
 
-int
-fsmtrie_search(struct fsmtrie *f, const char *key, const char **str)
+/* walk a live trie from root, see fsmtrie_search() */
+static int
+_fsmtrie_search_walk(struct fsmtrie *f, fsmtrie_node_t *root, const char *key,
+		size_t keylen, const char **str)
 {
-	const unsigned char *p;
+	const unsigned char *p, *end;
 	fsmtrie_node_t *node_p;
 
-	if (f == NULL)
-	{
-		return (-1);
-	}
-	if (f->root == NULL)
-	{
-		snprintf(f->err_buf, sizeof (f->err_buf), "uninitialized trie");
-		return (-1);
-	}
-
-	if (key == NULL)
-	{
-		snprintf(f->err_buf, sizeof (f->err_buf), "empty key");
-		return (-1);
-	}
-
-	if (f->mode != fsmtrie_mode_ascii && f->mode != fsmtrie_mode_eascii)
-	{
-		snprintf(f->err_buf,
-				sizeof (f->err_buf),
-				"%s() is incompatible with %s mode fsmtrie",
-				__func__, _mode_to_str(f->mode));
-		return (-1);
-	}
-
 	*str = NULL;
-	for (p = (const unsigned char *)key, node_p = f->root; *p; p++)
+	end = (const unsigned char *)key + keylen;
+	for (p = (const unsigned char *)key, node_p = root; p < end; p++)
 	{
 		/* same check fsmtrie_key_validate_ascii() does but we don't
 		 * want to walk the entire key twice so we don't call the
@@ -835,19 +1266,15 @@ fsmtrie_search(struct fsmtrie *f, const char *key, const char **str)
 		 */
 		if ((int)*p < 0 || (int)*p > f->nrnodes - 1)
 		{
-			snprintf(f->err_buf,
-				sizeof (f->err_buf),
-				"key value \"%d\" out of range",
+			_fsmtrie_error(f, "key value \"%d\" out of range",
 				(int)*p);
 			return (-1);
 		}
-		if (node_p->nodes[(int)*p] == NULL)
+		if ((node_p = _fsmtrie_child(node_p, *p)) == NULL)
 		{
 			/* no match */
 			return (0);
 		}
-
-		node_p = node_p->nodes[(int)*p];
 	}
 	if (node_p->type & FSMTRIE_NODE_LEAF)
 	{
@@ -862,12 +1289,107 @@ fsmtrie_search(struct fsmtrie *f, const char *key, const char **str)
 	return (0);
 }
 
+static int
+_fsmtrie_search(struct fsmtrie *f, const char *key, size_t keylen,
+		const char **str, const char *func)
+{
+	struct fsmtrie_rcu_pin pin;
+	int ret;
+
+	if (_fsmtrie_root(f) == NULL && f->img == NULL && f->dawg == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (-1);
+	}
+
+	if (key == NULL)
+	{
+		_fsmtrie_error(f, "empty key");
+		return (-1);
+	}
+
+	if (f->mode != fsmtrie_mode_ascii && f->mode != fsmtrie_mode_eascii)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				func, _mode_to_str(f->mode));
+		return (-1);
+	}
+
+	if (f->img != NULL)
+	{
+		return (_fsmtrie_image_search(f, key, keylen, str));
+	}
+	if (f->dawg != NULL)
+	{
+		return (_fsmtrie_dawg_search(f, key, keylen, str));
+	}
+
+	_fsmtrie_rcu_enter(f, &pin);
+	ret = _fsmtrie_search_walk(f, _fsmtrie_root(f), key, keylen, str);
+	_fsmtrie_rcu_exit(&pin);
+
+	return (ret);
+}
+
+int
+fsmtrie_search(struct fsmtrie *f, const char *key, const char **str)
+{
+	if (f == NULL)
+	{
+		return (-1);
+	}
+
+	return (_fsmtrie_search(f, key, key != NULL ? strlen(key) : 0, str,
+				__func__));
+}
+
+int
+fsmtrie_search_n(struct fsmtrie *f, const char *key, size_t keylen,
+		const char **str)
+{
+	if (f == NULL)
+	{
+		return (-1);
+	}
+
+	return (_fsmtrie_search(f, key, keylen, str, __func__));
+}
+
+/* Find the child of a token node using a binary search */
+fsmtrie_node_t *
+_fsmtrie_token_child(const struct fsmtrie *f, const fsmtrie_node_t *node,
+		uint32_t token)
+{
+	size_t lo, hi, mid, nnodes;
+
+	nnodes = (node == f->root) ? f->nrnodes : node->nnodes;
+	lo = 0;
+	hi = nnodes;
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (node->nodes[mid]->tval < token)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+
+	if (lo < nnodes && node->nodes[lo]->tval == token)
+	{
+		return (node->nodes[lo]);
+	}
+	return (NULL);
+}
+
 /* Search for a specified token array using a binary search */
 int
 fsmtrie_search_token(struct fsmtrie *f, const uint32_t *key, size_t keylen,
 		const char **str)
 {
-	uint32_t pkey;
 	fsmtrie_node_t *node_p;
 	size_t keyidx;
 
@@ -875,74 +1397,38 @@ fsmtrie_search_token(struct fsmtrie *f, const uint32_t *key, size_t keylen,
 	{
 		return (-1);
 	}
-	if (f->root == NULL)
+	if (f->root == NULL && f->img == NULL && f->dawg == NULL)
 	{
-		snprintf(f->err_buf, sizeof (f->err_buf), "uninitialized trie");
+		_fsmtrie_error(f, "uninitialized trie");
 		return (-1);
 	}
 
 	if (key == NULL || keylen == 0)
 	{
-		snprintf(f->err_buf,
-				sizeof (f->err_buf),
-				"empty key or keylen");
+		_fsmtrie_error(f, "empty key or keylen");
 		return (-1);
 	}
 
 	if (f->mode != fsmtrie_mode_token)
 	{
-		snprintf(f->err_buf,
-				sizeof (f->err_buf),
-				"%s() is incompatible with %s mode fsmtrie",
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
 				__func__, _mode_to_str(f->mode));
 		return (-1);
 	}
 
+	if (f->img != NULL)
+	{
+		return (_fsmtrie_image_search_token(f, key, keylen, str));
+	}
+
 	for (keyidx = 0, node_p = f->root, *str = NULL; keyidx < keylen;
 			keyidx++)
 	{
-		size_t nnodes;
-		ssize_t slow, shigh, sidx;
-
-		nnodes = (node_p == f->root) ? f->nrnodes : node_p->nnodes;
-		pkey = key[keyidx];
-
-		slow = 0;
-		shigh = nnodes - 1;
-		sidx = nnodes == 0 ? -1 : 0;
-
-		while (sidx != -1)
-		{
-			unsigned int sval;
-
-			sidx = ((shigh - slow) + 1) / 2 + slow;
-			sval = node_p->nodes[sidx]->tval;
-
-			if ((sval == pkey) || (slow == shigh))
-			{
-				break;
-			}
-			else if (sval < pkey)
-			{
-				slow = sidx + 1;
-			}
-			else if (sval > pkey)
-			{
-				shigh = sidx - 1;
-			}
-
-			if ((slow > shigh) || (shigh < slow))
-			{
-				break;
-			}
-		}
-
-		if ((sidx == -1) || (node_p->nodes[sidx]->tval != pkey))
+		if ((node_p = _fsmtrie_token_child(f, node_p, key[keyidx])) ==
+				NULL)
 		{
 			return (0);
 		}
-
-		node_p = node_p->nodes[sidx];
 	}
 	if (node_p->type & FSMTRIE_NODE_LEAF)
 	{
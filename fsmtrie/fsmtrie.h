@@ -50,6 +50,9 @@ enum fsmtrie_mode
 typedef enum fsmtrie_mode fsmtrie_mode;
 typedef struct fsmtrie * fsmtrie_t;
 typedef struct fsmtrie_opt * fsmtrie_opt_t;
+typedef struct fsmtrie_scanner * fsmtrie_scanner_t;
+typedef struct fsmtrie_asearch_ctx * fsmtrie_asearch_ctx_t;
+typedef struct fsmtrie_louds * fsmtrie_louds_t;
 /* \endcond */
 
 /**
@@ -67,9 +70,10 @@ typedef struct fsmtrie_opt * fsmtrie_opt_t;
  *  token mode is intended for the storage and retrieval of 32-bit wide token
  *  "strings".
  *
- *  At its core, the `fsmtrie` library builds a simple non-space optimized
- *  trie that can store an arbitrary number of keys of arbitrary maximum
- *  length.
+ *  At its core, the `fsmtrie` library builds a simple trie that can store an
+ *  arbitrary number of keys of arbitrary maximum length. ASCII and extended
+ *  ASCII nodes size their child tables to the number of children they
+ *  actually have (4, 16, 48 or a full table), so sparse tries stay small.
  *
  *  For ASCII and extended ASCII fsmtries, insertion and lookup efficient with
  *  worst case running times of `O(M)` where M is the maximum key length.
@@ -93,6 +97,18 @@ typedef struct fsmtrie_opt * fsmtrie_opt_t;
  *  for in whole only. Specifics on search functions, including their running
  *  times, is below.
  *
+ *  An fsmtrie may be searched by any number of threads at once, provided
+ *  none of them modifies it at the same time: inserts and deletes must be
+ *  serialized by the caller against each other and against searches.
+ *  Substring search compiles the trie the first time it is needed, which is
+ *  safe to race; call fsmtrie_compile() after the last insert to take that
+ *  cost up front. Error messages are kept per thread.
+ *
+ *  Tries that are updated while they are being searched can be initialized
+ *  in RCU mode (see fsmtrie_opt_set_rcu()): a single writer inserts keys and
+ *  publishes them with fsmtrie_publish() while any number of threads keep
+ *  searching, without locks, the version that was published last.
+ *
  * @{
  */
 
@@ -110,8 +126,8 @@ typedef struct fsmtrie_opt * fsmtrie_opt_t;
  *
  *  MODE|OPTIONS ALLOWED|INSERT FUNCTION|SEARCH FUNCTION(S)
  *  ----|-------------|---------------|---------------
- *  \p fsmtrie_mode_ascii|partial match, max length|fsmtrie_insert()|fsmtrie_search(), fsmtrie_search_approx(), fsmtrie_search_substring()
- *  \p fsmtrie_mode_eascii|partial match, max length|fsmtrie_insert()|fsmtrie_search(), fsmtrie_search_approx(), fsmtrie_search_substring()
+ *  \p fsmtrie_mode_ascii|partial match, max length|fsmtrie_insert()|fsmtrie_search(), fsmtrie_search_approx(), fsmtrie_search_substring(), fsmtrie_scanner_init()
+ *  \p fsmtrie_mode_eascii|partial match, max length|fsmtrie_insert()|fsmtrie_search(), fsmtrie_search_approx(), fsmtrie_search_substring(), fsmtrie_scanner_init()
  *  \p fsmtrie_mode_token|max length|fsmtrie_insert_token()|fsmtrie_search_token()
  *
  *  It is an error to use a different insert or search function other than
@@ -242,6 +258,270 @@ bool fsmtrie_opt_set_partialmatch(fsmtrie_opt_t opt, bool on);
  */
 bool fsmtrie_opt_get_partialmatch(fsmtrie_opt_t opt, bool *on);
 
+/**
+ *  Set the DFA flag. Enabling this option makes fsmtrie_search_substring()
+ *  run on a full Aho-Corasick transition table instead of following suffix
+ *  links on every mismatch, so each byte of the subject string costs exactly
+ *  one table lookup. The table is built along with the rest of the
+ *  Aho-Corasick metadata, i.e. on the first substring search after an insert.
+ *
+ *  The table holds one row per trie node and one column per distinct byte
+ *  used in the inserted keys (plus one for all other bytes), so it is best
+ *  suited to tries over a limited alphabet. If the table can't be built,
+ *  substring search silently falls back to suffix links.
+ *
+ *  Note this option is only supported by ASCII and extended ASCII fsmtries,
+ *  and has no effect on RCU fsmtries, which always follow suffix links.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on true to build the transition table
+ *
+ *  \retval true option was set
+ *  \retval false option was not able to be set (opt was invalid)
+ */
+bool fsmtrie_opt_set_dfa(fsmtrie_opt_t opt, bool on);
+
+/**
+ *  Get the DFA status.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on will be true if the DFA is enabled
+ *
+ *  \retval true successful call, check on
+ *  \retval false failure, opt was invalid
+ */
+bool fsmtrie_opt_get_dfa(fsmtrie_opt_t opt, bool *on);
+
+/**
+ *  Set the RCU (read-copy-update) flag. Enabling this option lets a single
+ *  writer thread insert keys while other threads search the fsmtrie, none of
+ *  them taking a lock or waiting for another.
+ *
+ *  Searches only ever see the version of the trie that was published last.
+ *  Inserts copy the nodes they would modify instead (nodes created since the
+ *  last publication are modified in place), including the nodes whose
+ *  substring search links the new key changes, and the keys inserted become
+ *  visible to searches when the writer calls fsmtrie_publish(), which
+ *  switches searches over to the new version at once. Nodes replaced by
+ *  copies are freed once no search started before the switch is still
+ *  running, so the memory overhead is bounded by the paths copied between
+ *  two publications. Every node also has a writer-side twin holding its
+ *  links, so nodes take about twice the memory they take in a compiled
+ *  fsmtrie without RCU.
+ *
+ *  Scanners (see fsmtrie_scanner_init()) that were fed under a previous
+ *  version start over at the root of the new one, so matches spanning the
+ *  publication may be missed.
+ *
+ *  Insert and delete functions, fsmtrie_publish(), fsmtrie_save() and
+ *  fsmtrie_destroy() are writer functions and must not be called
+ *  concurrently with each other.
+ *
+ *  Note this option is only supported by ASCII and extended ASCII fsmtries.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on true to enable RCU updates
+ *
+ *  \retval true option was set
+ *  \retval false option was not able to be set (opt was invalid)
+ */
+bool fsmtrie_opt_set_rcu(fsmtrie_opt_t opt, bool on);
+
+/**
+ *  Get the RCU status.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on will be true if RCU updates are enabled
+ *
+ *  \retval true successful call, check on
+ *  \retval false failure, opt was invalid
+ */
+bool fsmtrie_opt_get_rcu(fsmtrie_opt_t opt, bool *on);
+
+/**
+ *  Set the approximate search automaton flag. Enabling this option makes
+ *  fsmtrie_search_approx() compile the key and distance into a deterministic
+ *  Levenshtein automaton and walk the trie along it, instead of computing
+ *  the edit distance matrix row by row at every node. The automaton tells
+ *  apart only the bytes of the key; once a byte outside the key can't lead
+ *  to a match, only the children labelled with key bytes still in reach are
+ *  visited.
+ *
+ *  The automaton is built lazily during the search, one state per distinct
+ *  set of distances to the key, and pays off where many trie prefixes share
+ *  them, typically at a distance of two; at larger distances the matrix is
+ *  about as fast (see bench/approx.c). Matches and their distances are the
+ *  same with either engine. A distance of one is always searched by direct
+ *  lookups of the key's one-edit variants instead (see
+ *  fsmtrie_search_approx()), distances above 254 always by the matrix and
+ *  distances within that of an approximate search index by the index (see
+ *  fsmtrie_opt_set_approx_index()).
+ *
+ *  Note this option is only supported by ASCII and extended ASCII fsmtries.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on true to search by automaton
+ *
+ *  \retval true option was set
+ *  \retval false option was not able to be set (opt was invalid)
+ */
+bool fsmtrie_opt_set_approx_automaton(fsmtrie_opt_t opt, bool on);
+
+/**
+ *  Get the approximate search automaton status.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on will be true if approximate search is by automaton
+ *
+ *  \retval true successful call, check on
+ *  \retval false failure, opt was invalid
+ */
+bool fsmtrie_opt_get_approx_automaton(fsmtrie_opt_t opt, bool *on);
+
+/**
+ *  Set the maximum distance of the approximate search index. With a
+ *  distance above 0, fsmtrie_compile() builds an index of every string
+ *  obtained by deleting up to that many characters from a key, and
+ *  fsmtrie_search_approx() answers searches within that distance by looking
+ *  up the key's own deletion variants in the index and checking the
+ *  distance of the few keys listed under them, rather than by walking the
+ *  trie. The cost is memory: a key of length n has about n variants for a
+ *  distance of one and n * n / 2 for a distance of two. Variants are kept
+ *  as 64-bit hashes in an open addressing table, at most half full, so
+ *  every distinct variant takes 28 to 52 bytes (two to four slots of 12
+ *  bytes plus the offset of its list of keys), and every key listed under
+ *  a variant another 4 bytes. Building the index takes 8 more bytes per
+ *  listed key and 4 per variant for a while. See
+ *  fsmtrie_opt_set_approx_index_prefix() to bound it.
+ *
+ *  The index is only built by fsmtrie_compile() and dropped by any insert or
+ *  delete; until the trie is compiled again, searches walk the trie. The
+ *  index isn't saved with fsmtrie_save(), fsmtrie_freeze() rebuilds it.
+ *
+ *  Note this option is only supported by ASCII and extended ASCII fsmtries
+ *  and not allowed for RCU fsmtries.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] max_dist deletions indexed per key, 0 (no index) to 2
+ *
+ *  \retval true option was set
+ *  \retval false option was not able to be set (opt or max_dist was invalid)
+ */
+bool fsmtrie_opt_set_approx_index(fsmtrie_opt_t opt, int max_dist);
+
+/**
+ *  Get the maximum distance of the approximate search index.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] max_dist will be the deletions indexed per key, 0 if none
+ *
+ *  \retval true successful call, check max_dist
+ *  \retval false failure, opt was invalid
+ */
+bool fsmtrie_opt_get_approx_index(fsmtrie_opt_t opt, int *max_dist);
+
+/**
+ *  Set the number of leading key bytes the approximate search index varies
+ *  (see fsmtrie_opt_set_approx_index()). Only deletions among the first
+ *  len bytes of keys and search keys are indexed and looked up, which
+ *  bounds the size of the index for long keys, at the cost of more keys to
+ *  check per search, the keys sharing a variant of their prefix. Searches
+ *  find the same matches either way.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] len prefix length, 0 (the default) to index whole keys
+ *
+ *  \retval true option was set
+ *  \retval false option was not able to be set (opt was invalid)
+ */
+bool fsmtrie_opt_set_approx_index_prefix(fsmtrie_opt_t opt, uint32_t len);
+
+/**
+ *  Get the number of leading key bytes the approximate search index varies.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] len will be the prefix length, 0 for whole keys
+ *
+ *  \retval true successful call, check len
+ *  \retval false failure, opt was invalid
+ */
+bool fsmtrie_opt_get_approx_index_prefix(fsmtrie_opt_t opt, uint32_t *len);
+
+/**
+ *  Set the double array status. Images of an fsmtrie with a double array
+ *  (written by fsmtrie_save() or made by fsmtrie_freeze()) carry a
+ *  double-array index of their transitions: a base for every node and an
+ *  array of slots, the child of a node labelled c being the one in the slot
+ *  at its base plus c. Every step of fsmtrie_search(),
+ *  fsmtrie_search_substring() and the lookups of fsmtrie_search_approx() is
+ *  then a single array access whatever the number of children, where images
+ *  otherwise search the labels of the children. The array adds about 8
+ *  bytes per node to the image. Live fsmtries are not affected.
+ *
+ *  Note this option is only supported by ASCII and extended ASCII fsmtries.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on true to give images a double array
+ *
+ *  \retval true option was set
+ *  \retval false option was not able to be set (opt was invalid)
+ */
+bool fsmtrie_opt_set_double_array(fsmtrie_opt_t opt, bool on);
+
+/**
+ *  Get the double array status.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on will be true if images carry a double array
+ *
+ *  \retval true successful call, check on
+ *  \retval false failure, opt was invalid
+ */
+bool fsmtrie_opt_get_double_array(fsmtrie_opt_t opt, bool *on);
+
+/**
+ *  Set the DAWG status. An fsmtrie with this option keeps its keys in a
+ *  minimal deterministic acyclic automaton (a DAWG) rather than a tree:
+ *  keys sharing a suffix share the nodes that spell it, so key sets with
+ *  many common endings (domain names ending in ".com", URLs) take a fraction
+ *  of the nodes of a trie. Leaf strings are numbered along with the keys
+ *  (the number of a key is counted along its path) and kept in one block.
+ *
+ *  Keys must be inserted in ascending order (sorted by unsigned byte value,
+ *  as by `LC_ALL=C sort`) with fsmtrie_insert(), fsmtrie_insert_n() or the
+ *  bulk load functions, which fail for keys out of order; duplicates are
+ *  ignored like in fsmtrie_insert(). The automaton is minimized as keys come
+ *  in and completed by fsmtrie_compile() or the first search, after which
+ *  inserts fail.
+ *
+ *  fsmtrie_search(), fsmtrie_search_batch(), fsmtrie_search_approx() and
+ *  their variants work as on any fsmtrie, as does the approximate search
+ *  index (see fsmtrie_opt_set_approx_index()). Substring search, scanners,
+ *  deletes, merges and fsmtrie_save() are not supported: a node of a DAWG
+ *  no longer stands for a single key prefix.
+ *
+ *  Note this option is only supported by ASCII and extended ASCII fsmtries,
+ *  and not by RCU fsmtries.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on true to keep keys in a DAWG
+ *
+ *  \retval true option was set
+ *  \retval false option was not able to be set (opt was invalid)
+ */
+bool fsmtrie_opt_set_dawg(fsmtrie_opt_t opt, bool on);
+
+/**
+ *  Get the DAWG status.
+ *
+ *  \param[in] opt valid fsmtrie options object
+ *  \param[in] on will be true if keys are kept in a DAWG
+ *
+ *  \retval true successful call, check on
+ *  \retval false failure, opt was invalid
+ */
+bool fsmtrie_opt_get_dawg(fsmtrie_opt_t opt, bool *on);
+
 /**
  *  Validate that a string contains only 7-bit ASCII characters and if
  *  `max_len` was set, is less than or equal to the `max_len` parameter
@@ -264,6 +544,9 @@ bool fsmtrie_key_validate_ascii(fsmtrie_t fsmtrie, const char *key);
  *  a string can be specified to copy to the leaf node; ostensibly this should
  *  be the key itself.
  *
+ *  Keys of a DAWG fsmtrie must be inserted in ascending order, see
+ *  fsmtrie_opt_set_dawg().
+ *
  *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
  *
  *  \param[in] fsmtrie valid fsmtrie object
@@ -282,6 +565,169 @@ bool fsmtrie_insert_eascii(fsmtrie_t fsmtrie, const char *key,
 		const char *str);
 /* \endcond */
 
+/**
+ *  Insert a key of a specified length into a specified fsmtrie. Unlike
+ *  fsmtrie_insert(), the key need not be NUL-terminated and may contain NUL
+ *  bytes, so arbitrary binary keys can be stored in \p fsmtrie_mode_eascii
+ *  fsmtries.
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] key key to add
+ *  \param[in] keylen length of key in bytes
+ *  \param[in] str optional string to copy to leaf node
+ *
+ *  \retval true key was inserted
+ *  \retval false key was not inserted, call fsmtrie_get_error() to get the
+ *  reason
+ */
+bool fsmtrie_insert_n(fsmtrie_t fsmtrie, const char *key, size_t keylen,
+		const char *str);
+
+/**
+ *  Insert keys supplied in sorted order into a specified fsmtrie. Each key
+ *  continues from where its common prefix with the previous key ends, only
+ *  the rest of it is validated and added, which makes loading a large sorted
+ *  key set considerably faster than calling fsmtrie_insert() for every key.
+ *  The trie need not be empty.
+ *
+ *  Keys must be sorted by unsigned byte value (as by `LC_ALL=C sort`);
+ *  duplicates are allowed and ignored like in fsmtrie_insert().
+ *
+ *  Substring search metadata is not built along the way, suffix links point
+ *  at keys that come later in sorted order. Searches compile the trie as
+ *  usual, or call fsmtrie_compile() once the load is done.
+ *
+ *  The key callback has the following prototype:
+ *
+ *  `static int cb(const char **key, size_t *keylen, const char **str,
+ *  void *data);`
+ *
+ *  where:
+ *	* \p key receives the next key, which need not be NUL-terminated and
+ *	only has to stay valid until the next call
+ *	* \p keylen receives the length of the key in bytes
+ *	* \p str receives the optional string to copy to the leaf node
+ *	* \p data user supplied data
+ *
+ *  and returns 1 if it supplied a key, 0 if there are no more keys and -1 to
+ *  abort the load.
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] cb key callback function, called until it returns 0 or -1
+ *  \param[in] cbdata data passed to key callback function
+ *
+ *  \retval true all keys were inserted
+ *  \retval false loading stopped at an invalid or out of order key, a
+ *  failing callback or an allocation error, call fsmtrie_get_error() to get
+ *  the reason. The keys before that point were inserted.
+ */
+bool fsmtrie_bulk_load(fsmtrie_t fsmtrie,
+		int (*cb)(const char **, size_t *, const char **, void *),
+		void *cbdata);
+
+/**
+ *  Insert an array of sorted keys into a specified fsmtrie, see
+ *  fsmtrie_bulk_load().
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] keys array of strings to add
+ *  \param[in] strs optional array of nkeys strings to copy to the leaf nodes
+ *  \param[in] nkeys number of elements in keys
+ *
+ *  \retval true all keys were inserted
+ *  \retval false not all keys were inserted, call fsmtrie_get_error() to
+ *  get the reason
+ */
+bool fsmtrie_bulk_load_array(fsmtrie_t fsmtrie, const char * const *keys,
+		const char * const *strs, size_t nkeys);
+
+/**
+ *  Insert sorted keys read from a file descriptor into a specified fsmtrie,
+ *  one key per line, see fsmtrie_bulk_load(). Empty lines are skipped, the
+ *  last line need not end with a newline. Reads until end of file.
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] fd file descriptor to read keys from
+ *
+ *  \retval true all keys were inserted
+ *  \retval false not all keys were inserted, call fsmtrie_get_error() to
+ *  get the reason
+ */
+bool fsmtrie_bulk_load_fd(fsmtrie_t fsmtrie, int fd);
+
+/**
+ *  Insert an array of keys into a specified fsmtrie using several threads.
+ *  The keys are partitioned by their first byte, each thread builds a trie
+ *  of its own from whole partitions and these tries are merged into
+ *  \p fsmtrie at the end, see fsmtrie_merge(). Keys need not be sorted.
+ *
+ *  If a key can't be inserted, \p fsmtrie is left as it was.
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries that
+ *  don't use RCU.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] keys array of strings to add
+ *  \param[in] strs optional array of nkeys strings to copy to the leaf nodes
+ *  \param[in] nkeys number of elements in keys
+ *  \param[in] nthreads number of threads to use, 0 for one per online CPU
+ *
+ *  \retval true all keys were inserted
+ *  \retval false keys were not inserted, call fsmtrie_get_error() to get
+ *  the reason
+ */
+bool fsmtrie_insert_parallel(fsmtrie_t fsmtrie, const char * const *keys,
+		const char * const *strs, size_t nkeys, unsigned int nthreads);
+
+/**
+ *  Insert an array of token keys into a specified fsmtrie using several
+ *  threads, partitioned by their first token, see fsmtrie_insert_parallel().
+ *
+ *  Valid for \p fsmtrie_mode_token fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] keys array of token strings to add
+ *  \param[in] keylens array of nkeys key lengths in tokens
+ *  \param[in] strs optional array of nkeys strings to copy to the leaf nodes
+ *  \param[in] nkeys number of elements in keys
+ *  \param[in] nthreads number of threads to use, 0 for one per online CPU
+ *
+ *  \retval true all keys were inserted
+ *  \retval false keys were not inserted, call fsmtrie_get_error() to get
+ *  the reason
+ */
+bool fsmtrie_insert_token_parallel(fsmtrie_t fsmtrie,
+		const uint32_t * const *keys, const size_t *keylens,
+		const char * const *strs, size_t nkeys, unsigned int nthreads);
+
+/**
+ *  Merge the keys of one fsmtrie into another without inserting them again:
+ *  the parts of \p src that \p dst lacks are moved over as they are. Keys
+ *  in both keep the string of \p dst.
+ *
+ *  \p src is destroyed and set to NULL whenever the merge gets under way,
+ *  even if it then fails (which leaves part of its keys in \p dst).
+ *
+ *  Both fsmtries must have the same mode and neither may be an image or use
+ *  RCU. If \p dst has a maximum key length, \p src must have one no larger.
+ *
+ *  \param[in] dst valid fsmtrie object to merge keys into
+ *  \param[in,out] src pointer to the fsmtrie object to take keys from
+ *
+ *  \retval true keys were merged
+ *  \retval false keys were not (all) merged, call fsmtrie_get_error() on
+ *  \p dst to get the reason
+ */
+bool fsmtrie_merge(fsmtrie_t dst, fsmtrie_t *src);
+
 
 /**
  *  Insert a 32-bit wide token key into a specified fsmtrie.
@@ -300,6 +746,61 @@ bool fsmtrie_insert_eascii(fsmtrie_t fsmtrie, const char *key,
 bool fsmtrie_insert_token(fsmtrie_t fsmtrie, uint32_t *tkey, size_t nkey,
 		const char *str);
 
+/**
+ *  Delete a key from a specified fsmtrie, freeing its string. Nodes that are
+ *  left without keys below them are freed as well, so a trie that had keys
+ *  inserted and deleted again takes no more memory than one that never held
+ *  them.
+ *
+ *  Substring search metadata is updated along with the trie. Scanners (see
+ *  fsmtrie_scanner_init()) that were fed before a delete freed nodes start
+ *  over at the root, so matches spanning the delete may be missed. In RCU
+ *  mode the key stays visible to searches until the next fsmtrie_publish().
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] key key to delete
+ *
+ *  \retval 1 key was deleted
+ *  \retval 0 key not in trie
+ *  \retval -1 error deleting, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_delete(fsmtrie_t fsmtrie, const char *key);
+
+/**
+ *  Delete a key of a specified length from a specified fsmtrie, see
+ *  fsmtrie_delete() and fsmtrie_insert_n().
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] key key to delete
+ *  \param[in] keylen length of key in bytes
+ *
+ *  \retval 1 key was deleted
+ *  \retval 0 key not in trie
+ *  \retval -1 error deleting, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_delete_n(fsmtrie_t fsmtrie, const char *key, size_t keylen);
+
+/**
+ *  Delete a 32-bit wide token key from a specified fsmtrie, see
+ *  fsmtrie_delete().
+ *
+ *  Valid for \p fsmtrie_mode_token fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] key an array of 32-bit token values to delete
+ *  \param[in] keylen the number of elements in the token key array
+ *
+ *  \retval 1 key was deleted
+ *  \retval 0 key not in trie
+ *  \retval -1 error deleting, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_delete_token(fsmtrie_t fsmtrie, const uint32_t *key,
+		size_t keylen);
+
 /* @cond */
 /*
  *  Decommission a specified fsmtrie, freeing only the held memory internal
@@ -351,6 +852,26 @@ int fsmtrie_search_eascii(fsmtrie_t fsmtrie, const char *key,
 		const char **str);
 /* \endcond */
 
+/**
+ *  Search a specified fsmtrie for a key of a specified length, see
+ *  fsmtrie_search(). The key need not be NUL-terminated and may contain NUL
+ *  bytes.
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] key key to search for
+ *  \param[in] keylen length of key in bytes
+ *  \param[out] str if key is found in a leaf node, str is a pointer to string
+ *  stored at insertion time or NULL if no string is found
+ *
+ *  \retval 1 key exists in trie
+ *  \retval 0 key not in trie
+ *  \retval -1 error searching, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_search_n(fsmtrie_t fsmtrie, const char *key, size_t keylen,
+		const char **str);
+
 /**
  *  Search a specified fsmtrie for a token key. If key is found, str may point
  *  to the string stored at insertion time.
@@ -370,10 +891,66 @@ int fsmtrie_search_eascii(fsmtrie_t fsmtrie, const char *key,
 int fsmtrie_search_token(fsmtrie_t fsmtrie, const uint32_t *key,
 		size_t keylen, const char **str);
 
+/**
+ *  Search a specified fsmtrie for many keys at once. The result of each
+ *  lookup is the same as that of fsmtrie_search() for the same key, but the
+ *  lookups are advanced in lock-step with the nodes each of them needs next
+ *  being prefetched, so the memory latency of independent lookups overlaps.
+ *  On tries that don't fit in the CPU cache this is considerably faster than
+ *  calling fsmtrie_search() in a loop.
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] keys array of strings to search for
+ *  \param[in] nkeys number of elements in keys
+ *  \param[out] results array of nkeys elements, receives the return value
+ *  fsmtrie_search() would have returned for each key
+ *  \param[out] strs optional array of nkeys elements, receives the string
+ *  fsmtrie_search() would have returned for each key
+ *
+ *  \retval 1 all keys were searched for
+ *  \retval -1 error searching for at least one key (its result is -1), call
+ *  fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_search_batch(fsmtrie_t fsmtrie, const char * const *keys,
+		size_t nkeys, int *results, const char **strs);
+
+/**
+ *  Search a specified fsmtrie for many token keys at once, see
+ *  fsmtrie_search_batch() and fsmtrie_search_token().
+ *
+ *  Valid for \p fsmtrie_mode_token fsmtries.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] keys array of token keys to search for
+ *  \param[in] keylens array of nkeys elements, the number of tokens in each
+ *  key
+ *  \param[in] nkeys number of elements in keys
+ *  \param[out] results array of nkeys elements, receives the return value
+ *  fsmtrie_search_token() would have returned for each key
+ *  \param[out] strs optional array of nkeys elements, receives the string
+ *  fsmtrie_search_token() would have returned for each key
+ *
+ *  \retval 1 all keys were searched for
+ *  \retval -1 error searching for at least one key (its result is -1), call
+ *  fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_search_token_batch(fsmtrie_t fsmtrie,
+		const uint32_t * const *keys, const size_t *keylens,
+		size_t nkeys, int *results, const char **strs);
+
 /**
  * Search a specified fsmtrie for approximately matching keys that differ by at
  * most \p dist characters (this is a bounded edit distance search).
  *
+ * Matches are reported in the order of their keys in the trie, each once.
+ * A \p dist of 1 is answered without computing edit distances, by looking
+ * up the key with one character substituted, inserted, deleted or swapped
+ * with the next one at every position. Tries compiled with an approximate
+ * search index answer distances up to that of the index by looking up the
+ * key's deletion variants instead (see fsmtrie_opt_set_approx_index()).
+ *
  * Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
  *
  * The callback has the following prototype:
@@ -397,6 +974,109 @@ int fsmtrie_search_token(fsmtrie_t fsmtrie, const uint32_t *key,
 int fsmtrie_search_approx(fsmtrie_t fsmtrie, const char *key, int dist,
 		void (*cb)(const char *, int, void *), void *cbdata);
 
+/**
+ * Search a specified fsmtrie for approximately matching keys of a key of a
+ * specified length, see fsmtrie_search_approx(). The key need not be
+ * NUL-terminated and may contain NUL bytes.
+ *
+ * Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ * \param[in] fsmtrie valid fsmtrie object
+ * \param[in] key key to search for
+ * \param[in] keylen length of key in bytes
+ * \param[in] dist maximum allowed edit distance from key
+ * \param[in] cb match callback function, called when a match is detected
+ * \param[in] cbdata data passed to match callback function
+ *
+ *  \retval 1 function completed normally
+ *  \retval -1 error searching, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_search_approx_n(fsmtrie_t fsmtrie, const char *key,
+		size_t keylen, int dist,
+		void (*cb)(const char *, int, void *), void *cbdata);
+
+/**
+ * Search a specified fsmtrie for approximately matching keys of many keys at
+ * once. Each key finds the same matches as with fsmtrie_search_approx(), but
+ * the keys are sorted into a trie of their own and the fsmtrie is walked once
+ * for all of them, the edit distances of a prefix shared by several keys
+ * being computed once for all of them. This pays off for many keys with
+ * common prefixes (such as "www." or "mail." in domain names) and small
+ * distances. The matches of a key are reported in the order of their keys in
+ * the trie, each once, but interleaved with those of other keys. Distances
+ * fsmtrie_search_approx() answers by direct lookups (a \p dist of 1, and
+ * those within the approximate search index) are looked up key by key.
+ *
+ * Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ * The callback has the following prototype:
+ *
+ *`static void cb(size_t key, const char *str, int dist, void *data);`
+ *
+ * where:
+ * 	* \p key the index in keys of the key matched
+ * 	* \p str a pointer to the trie string that matched
+ *	* \p dist the "edit distance" between str and the key
+ *	* \p data user supplied data
+ *
+ * \param[in] fsmtrie valid fsmtrie object
+ * \param[in] keys array of strings to search for
+ * \param[in] nkeys number of elements in keys
+ * \param[in] dist maximum allowed edit distance from each key
+ * \param[in] cb match callback function, called when a match is detected
+ * \param[in] cbdata data passed to match callback function
+ *
+ *  \retval 1 function completed normally
+ *  \retval -1 error searching, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_search_approx_batch(fsmtrie_t fsmtrie, const char * const *keys,
+		size_t nkeys, int dist,
+		void (*cb)(size_t, const char *, int, void *), void *cbdata);
+
+/**
+ * Initialize an approximate search context. A context holds the scratch
+ * space of fsmtrie_search_approx_ctx(), which grows as needed and is kept
+ * for the next search, so searches through the same context don't
+ * allocate memory once it has grown large enough. fsmtrie_search_approx()
+ * and fsmtrie_search_approx_n() allocate and free their scratch space on
+ * every call instead.
+ *
+ * A context may be used with any number of fsmtries, but by one search at a
+ * time: threads searching concurrently need a context each.
+ *
+ * \returns a valid context or NULL if out of memory
+ */
+fsmtrie_asearch_ctx_t fsmtrie_asearch_ctx_init(void);
+
+/**
+ * Search a specified fsmtrie for approximately matching keys of a key of a
+ * specified length, like fsmtrie_search_approx_n(), using the scratch space
+ * of a search context.
+ *
+ * Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ * \param[in] fsmtrie valid fsmtrie object
+ * \param[in] ctx valid search context, not in use by another search
+ * \param[in] key key to search for
+ * \param[in] keylen length of key in bytes
+ * \param[in] dist maximum allowed edit distance from key
+ * \param[in] cb match callback function, called when a match is detected
+ * \param[in] cbdata data passed to match callback function
+ *
+ *  \retval 1 function completed normally
+ *  \retval -1 error searching, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_search_approx_ctx(fsmtrie_t fsmtrie, fsmtrie_asearch_ctx_t ctx,
+		const char *key, size_t keylen, int dist,
+		void (*cb)(const char *, int, void *), void *cbdata);
+
+/**
+ * Destroy an approximate search context and free its scratch space.
+ *
+ * \param[in] ctx pointer to valid search context, will be set to NULL
+ */
+void fsmtrie_asearch_ctx_destroy(fsmtrie_asearch_ctx_t *ctx);
+
 /**
  * Search a specified fsmtrie for matching substrings.
  *
@@ -405,7 +1085,10 @@ int fsmtrie_search_approx(fsmtrie_t fsmtrie, const char *key, int dist,
  * Uses Aho-Corasick for substring matching. The first time this function is
  * called, it incurs a performance penalty relative to the size of the fsmtrie
  * as it must first (and only once) compile a finite state machine building
- * links between various internal nodes.
+ * links between various internal nodes. Later inserts update only the links
+ * the new key affects, so interleaving inserts and searches doesn't redo
+ * the whole compilation (except for the DFA, see fsmtrie_opt_set_dfa(),
+ * which is rebuilt by the next search).
  *
  * The time complexity of Aho-Corasick is linear in the length of the strings
  * plus the length of the searched text plus the number of output matches:
@@ -417,7 +1100,7 @@ int fsmtrie_search_approx(fsmtrie_t fsmtrie, const char *key, int dist,
  *
  * where:
  *	* \p str a pointer to the trie string that matched
- *	* \p off zero-indexed offset of str inside the search term
+ *	* \p off zero-indexed offset of the matching key inside the search term
  *	* \p data user supplied data
  *
  * \param[in] fsmtrie valid fsmtrie object
@@ -432,12 +1115,352 @@ int fsmtrie_search_substring(fsmtrie_t fsmtrie, const char *str,
 		void (*cb)(const char *, int, void *), void *cbdata);
 
 /**
- *  Cull the last error message from the library.
+ * Search a subject of a specified length for matching substrings, see
+ * fsmtrie_search_substring(). The subject need not be NUL-terminated and may
+ * contain NUL bytes.
+ *
+ * Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries.
+ *
+ * \param[in] fsmtrie valid fsmtrie object
+ * \param[in] str subject to search
+ * \param[in] len length of str in bytes
+ * \param[in] cb match callback function, called when a match is detected
+ * \param[in] cbdata data passed to match callback function
+ *
+ *  \retval 1 function completed normally
+ *  \retval -1 error searching, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_search_substring_n(fsmtrie_t fsmtrie, const char *str,
+		size_t len, void (*cb)(const char *, int, void *),
+		void *cbdata);
+
+/**
+ * Compile a specified fsmtrie for substring search, see
+ * fsmtrie_search_substring(). Searches compile the trie themselves the first
+ * time they need to, so calling this function is optional; doing so once
+ * after the last insert moves the cost of compiling out of the first search.
+ * It is safe to call concurrently with searches.
+ *
+ * Tries with an approximate search index (see fsmtrie_opt_set_approx_index())
+ * build it here, unless it is up to date.
+ *
+ * Images are always compiled and token fsmtries have nothing to compile,
+ * for those this function does nothing.
+ *
+ * \param[in] fsmtrie valid fsmtrie object
+ *
+ *  \retval true fsmtrie is compiled
+ *  \retval false error, call fsmtrie_get_error() to get the reason
+ */
+bool fsmtrie_compile(fsmtrie_t fsmtrie);
+
+/**
+ * Publish the keys inserted into an RCU fsmtrie since the last call, see
+ * fsmtrie_opt_set_rcu(). Inserts and deletes already updated the new
+ * version, so switching to it takes constant time, unless one of them
+ * inserted the empty key or ran out of memory updating substring search
+ * links: the new version is then relinked as a whole first, in time
+ * proportional to the size of the trie. Searches that started before the
+ * call finish on the previous version, searches that start after it see the
+ * new one. Memory retired by earlier publications is freed here once no
+ * search can see it anymore.
+ *
+ * Calling this function without having inserted anything only frees retired
+ * memory.
+ *
+ * \param[in] fsmtrie valid RCU fsmtrie object
+ *
+ *  \retval true new version is visible to searches
+ *  \retval false error, call fsmtrie_get_error() to get the reason
+ */
+bool fsmtrie_publish(fsmtrie_t fsmtrie);
+
+/**
+ * Initialize a streaming substring scanner for a specified fsmtrie.
+ *
+ * A scanner performs the same search as fsmtrie_search_substring(), but over
+ * a subject that arrives in pieces: it keeps the Aho-Corasick state and the
+ * number of bytes consumed between calls to fsmtrie_scanner_feed(), so
+ * matches spanning the boundary between two buffers are found and match
+ * offsets are relative to the start of the whole stream. Buffers are
+ * scanned in place and may contain any byte values, including NUL.
+ *
+ * The callback has the following prototype:
+ *
+ * `static void cb(const char *str, uint64_t off, void *data);`
+ *
+ * where:
+ *	* \p str a pointer to the trie string that matched
+ *	* \p off zero-indexed offset of the matching key in the stream
+ *	* \p data user supplied data
+ *
+ * The fsmtrie must outlive the scanner. Keys inserted while a scanner is in
+ * use are matched from the next byte fed on, matches that started before the
+ * insert may be missed.
+ *
+ * Note this function is only supported by ASCII and extended ASCII
+ * fsmtries.
+ *
+ * \param[in] fsmtrie valid fsmtrie object
+ * \param[in] cb match callback function, called when a match is detected
+ * \param[in] cbdata data passed to match callback function
+ *
+ * \returns a valid scanner or NULL, call fsmtrie_get_error() to get the
+ * reason
+ */
+fsmtrie_scanner_t fsmtrie_scanner_init(fsmtrie_t fsmtrie,
+		void (*cb)(const char *, uint64_t, void *), void *cbdata);
+
+/**
+ * Scan the next piece of the stream.
+ *
+ * \param[in] scanner valid scanner object
+ * \param[in] buf next bytes of the stream
+ * \param[in] len number of bytes in buf
+ *
+ *  \retval 1 function completed normally
+ *  \retval -1 error searching, call fsmtrie_get_error() to get the reason
+ */
+int fsmtrie_scanner_feed(fsmtrie_scanner_t scanner, const void *buf,
+		size_t len);
+
+/**
+ * Reset a scanner to the start of a new stream: the automaton returns to the
+ * root and the stream offset to zero.
+ *
+ * \param[in] scanner valid scanner object
+ */
+void fsmtrie_scanner_reset(fsmtrie_scanner_t scanner);
+
+/**
+ * Get the number of bytes fed to a scanner since it was initialized or
+ * reset.
+ *
+ * \param[in] scanner valid scanner object
+ *
+ * \returns stream offset
+ */
+uint64_t fsmtrie_scanner_get_offset(fsmtrie_scanner_t scanner);
+
+/**
+ * Destroy a scanner.
+ *
+ * \param[in] scanner pointer to valid scanner object, will be set to NULL
+ */
+void fsmtrie_scanner_destroy(fsmtrie_scanner_t *scanner);
+
+/**
+ *  Save a specified fsmtrie to a file as a trie image that can later be
+ *  searched in place with fsmtrie_open_mmap().
+ *
+ *  The image is relocatable: it contains no pointers, only offsets, and it
+ *  includes the compiled Aho-Corasick metadata used by
+ *  fsmtrie_search_substring() (which is compiled first if need be). Images
+ *  are written in host byte order and can only be opened on hosts with the
+ *  same byte order.
+ *
+ *  The image is written to a temporary file which is then renamed to \p path,
+ *  so processes that have a previous image at \p path mapped are not
+ *  disturbed.
+ *
+ *  Valid for all fsmtrie modes.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *  \param[in] path file to write the image to
+ *
+ *  \retval true image was written
+ *  \retval false image was not written, call fsmtrie_get_error() to get the
+ *  reason
+ */
+bool fsmtrie_save(fsmtrie_t fsmtrie, const char *path);
+
+/**
+ *  Open a trie image written by fsmtrie_save() by mapping it into memory.
+ *
+ *  The returned fsmtrie is read-only and is searched directly against the
+ *  mapped pages: opening it costs a single `mmap()` and one pass over the
+ *  node records, and processes mapping the same image share one copy of it
+ *  in the page cache. fsmtrie_search(), fsmtrie_search_token(),
+ *  fsmtrie_search_approx() and fsmtrie_search_substring() work as they do
+ *  on the fsmtrie the image was saved from. Insert functions fail.
+ *
+ *  The header and every node record are checked when opening, and an image
+ *  whose sections or indices are out of bounds fails to open.
+ *
+ *  Release the fsmtrie with fsmtrie_destroy(), which also unmaps the image.
+ *
+ *  \param[in] path image file to open
+ *  \param[out] err_buf if something goes wrong, this will contain the reason
+ *  \param[in] err_buf_len size of err_buf
+ *
+ *  \returns a valid pointer to a read-only fsmtrie or NULL and err_buf will
+ *  contain the reason
+ */
+fsmtrie_t fsmtrie_open_mmap(const char *path, char *err_buf,
+		size_t err_buf_len);
+
+/**
+ *  Freeze a specified fsmtrie: convert it into the read-only trie image
+ *  fsmtrie_save() would write, held in memory, and free the nodes it was
+ *  built from.
+ *
+ *  Nodes of an image carry 32-bit indices rather than pointers, the labels
+ *  of their children are stored contiguously in a separate array and leaf
+ *  strings are packed into one block, so a frozen fsmtrie takes a fraction
+ *  of the memory of the one it was built from and searches touch fewer
+ *  cache lines. fsmtrie_search(), fsmtrie_search_token(),
+ *  fsmtrie_search_approx(), fsmtrie_search_substring() and their variants
+ *  work as they did before; insert and delete functions fail from now on.
+ *  Scanners fed before start over at the root. An approximate search index
+ *  is rebuilt for the frozen fsmtrie if it had been compiled.
+ *
+ *  Freezing an image is a no-op, freezing a DAWG fsmtrie (see
+ *  fsmtrie_opt_set_dawg()) completes it like fsmtrie_compile() does.
+ *
+ *  Valid for all fsmtrie modes, but not for RCU fsmtries, which readers
+ *  may be searching while the nodes are freed.
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *
+ *  \retval true fsmtrie is frozen
+ *  \retval false fsmtrie was not frozen (or frozen but its approximate
+ *  search index could not be rebuilt), call fsmtrie_get_error() to get the
+ *  reason
+ */
+bool fsmtrie_freeze(fsmtrie_t fsmtrie);
+
+/**
+ *  Export a specified fsmtrie as a succinct LOUDS trie, for deployments
+ *  where memory is tight.
+ *
+ *  The trie is encoded as a level-order unary degree sequence: nodes are
+ *  numbered in breadth-first order and each contributes one bit per child
+ *  plus one, so the shape of the trie takes two bits per node. Child lookups
+ *  are done with rank and select over that bit vector, whose directories add
+ *  about a quarter of a bit per node. Labels take a byte per node, leaves a
+ *  bit, and leaf strings are copied into one block. No pointers or indices
+ *  are stored, so a LOUDS trie is a fraction of the size of even a frozen
+ *  fsmtrie (see fsmtrie_freeze()), at the cost of slower searches.
+ *
+ *  The LOUDS trie is a copy: it does not change with the fsmtrie, which can
+ *  be destroyed right after the export.
+ *
+ *  Valid for \p fsmtrie_mode_ascii and \p fsmtrie_mode_eascii fsmtries, of
+ *  any kind (live, images or DAWGs).
+ *
+ *  \param[in] fsmtrie valid fsmtrie object
+ *
+ *  \returns a valid LOUDS trie or NULL, call fsmtrie_get_error() to get the
+ *  reason
+ */
+fsmtrie_louds_t fsmtrie_louds_export(fsmtrie_t fsmtrie);
+
+/**
+ *  Search a LOUDS trie for a key, see fsmtrie_search(). Partial matches are
+ *  reported if \p FSMTRIE_PM_OK was set on the fsmtrie it was exported
+ *  from. Bytes no key contains, such as bytes above 127 in an ASCII trie,
+ *  simply don't match.
+ *
+ *  \param[in] louds valid LOUDS trie
+ *  \param[in] key string to search for
+ *  \param[out] str if key is found in a leaf node, str is a pointer to string
+ *  stored at insertion time or NULL if no string is found
+ *
+ *  \retval 1 key exists in trie
+ *  \retval 0 key not in trie
+ *  \retval -1 invalid arguments
+ */
+int fsmtrie_louds_search(fsmtrie_louds_t louds, const char *key,
+		const char **str);
+
+/**
+ *  Search a LOUDS trie for a key of a specified length, see
+ *  fsmtrie_louds_search(). The key need not be NUL-terminated and may
+ *  contain NUL bytes.
+ *
+ *  \param[in] louds valid LOUDS trie
+ *  \param[in] key key to search for
+ *  \param[in] keylen length of key in bytes
+ *  \param[out] str if key is found in a leaf node, str is a pointer to string
+ *  stored at insertion time or NULL if no string is found
+ *
+ *  \retval 1 key exists in trie
+ *  \retval 0 key not in trie
+ *  \retval -1 invalid arguments
+ */
+int fsmtrie_louds_search_n(fsmtrie_louds_t louds, const char *key,
+		size_t keylen, const char **str);
+
+/**
+ *  Search a string for substrings matching keys of a LOUDS trie, see
+ *  fsmtrie_search_substring(). The callback is called for the same matches,
+ *  but in order of offset, and for matches at the same offset shortest
+ *  first.
+ *
+ *  A LOUDS trie holds no Aho-Corasick failure links, so the trie is walked
+ *  from every offset of \p str in turn: the search takes time proportional
+ *  to the length of \p str times the length of the longest key.
+ *
+ *  \param[in] louds valid LOUDS trie
+ *  \param[in] str string to search
+ *  \param[in] cb match callback function, called when a match is detected
+ *  \param[in] cbdata data passed to match callback function
+ *
+ *  \retval 1 function completed normally
+ *  \retval -1 invalid arguments
+ */
+int fsmtrie_louds_search_substring(fsmtrie_louds_t louds, const char *str,
+		void (*cb)(const char *, int, void *), void *cbdata);
+
+/**
+ *  Search a subject of a specified length for matching substrings, see
+ *  fsmtrie_louds_search_substring(). The subject need not be NUL-terminated
+ *  and may contain NUL bytes.
+ *
+ *  \param[in] louds valid LOUDS trie
+ *  \param[in] str subject to search
+ *  \param[in] len length of str in bytes
+ *  \param[in] cb match callback function, called when a match is detected
+ *  \param[in] cbdata data passed to match callback function
+ *
+ *  \retval 1 function completed normally
+ *  \retval -1 invalid arguments
+ */
+int fsmtrie_louds_search_substring_n(fsmtrie_louds_t louds, const char *str,
+		size_t len, void (*cb)(const char *, int, void *),
+		void *cbdata);
+
+/**
+ *  Get node count of a LOUDS trie.
+ *
+ *  \param[in] louds valid LOUDS trie
+ */
+uint32_t fsmtrie_louds_get_nodecnt(fsmtrie_louds_t louds);
+
+/**
+ *  Get the number of bytes of memory a LOUDS trie takes.
+ *
+ *  \param[in] louds valid LOUDS trie
+ */
+size_t fsmtrie_louds_get_size(fsmtrie_louds_t louds);
+
+/**
+ *  Destroy a LOUDS trie.
+ *
+ *  \param[in] louds pointer to valid LOUDS trie, will be set to NULL
+ */
+void fsmtrie_louds_destroy(fsmtrie_louds_t *louds);
+
+/**
+ *  Cull the last error message from the library. Errors are kept per
+ *  thread, this returns the last error the calling thread got from a
+ *  function called on \p fsmtrie.
  *
  *  \param[in] fsmtrie valid fsmtrie object
  *
- *  \returns pointer to a string containing the last error message or NULL if
- *  there was none.
+ *  \returns pointer to a string containing the last error message or an
+ *  empty string if there was none. The string is only valid until the
+ *  calling thread's next call into the library.
  */
 const char *fsmtrie_get_error(fsmtrie_t fsmtrie);
 
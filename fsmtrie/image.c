@@ -0,0 +1,1068 @@
+/*
+ * Fast String Matcher Trie Image Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "private.h"
+
+/* \cond */
+/*
+ * Rendering a live trie as an image is a breadth-first traversal that
+ * assigns every node its image index. The children of each node are
+ * appended to the traversal in label order, which is what makes them
+ * contiguous in the image.
+ */
+struct _fsmtrie_image_build
+{
+	fsmtrie_node_t **order;		/* live node of every image node */
+	struct fsmtrie_inode *nodes;	/* image node records */
+	uint32_t *labels;		/* label of every image node */
+	size_t cnt, size;		/* used and allocated entries */
+	uint64_t strs_len;		/* size of all leaf strings */
+	uint32_t *bases;		/* double array, if built */
+	uint32_t *slots;
+	size_t nslots;
+};
+
+/* maps live nodes to image indices */
+struct _fsmtrie_image_ref
+{
+	const fsmtrie_node_t *node;
+	uint32_t idx;
+};
+
+/* an image rendered into memory by fsmtrie_freeze() */
+struct _fsmtrie_image_mem
+{
+	uint8_t *buf;
+	size_t len, size;
+};
+/* \endcond */
+
+/* round up to a multiple of 8 */
+#define FSMTRIE_IMAGE_ALIGN(n)	(((n) + 7) & ~(uint64_t)7)
+
+/* frozen images start on a cache line */
+#define FSMTRIE_IMAGE_LINE	64
+
+static bool
+_fsmtrie_image_append(struct _fsmtrie_image_build *b, fsmtrie_node_t *node,
+		uint32_t label)
+{
+	size_t size;
+	void *p;
+
+	if (b->cnt == b->size)
+	{
+		size = b->size ? b->size * 2 : 1024;
+		if ((p = realloc(b->order, size * sizeof (*b->order))) == NULL)
+		{
+			return (false);
+		}
+		b->order = p;
+		if ((p = realloc(b->nodes, size * sizeof (*b->nodes))) == NULL)
+		{
+			return (false);
+		}
+		b->nodes = p;
+		if ((p = realloc(b->labels, size * sizeof (*b->labels))) ==
+				NULL)
+		{
+			return (false);
+		}
+		b->labels = p;
+		b->size = size;
+	}
+	if (b->cnt >= FSMTRIE_INONE)
+	{
+		/* indices are 32 bits wide */
+		errno = EFBIG;
+		return (false);
+	}
+
+	b->order[b->cnt] = node;
+	b->labels[b->cnt] = label;
+	b->cnt++;
+
+	return (true);
+}
+
+static int
+_fsmtrie_image_ref_cmp(const void *a, const void *b)
+{
+	const struct _fsmtrie_image_ref *ra = a, *rb = b;
+
+	if (ra->node < rb->node)
+	{
+		return (-1);
+	}
+	return (ra->node > rb->node);
+}
+
+static bool
+_fsmtrie_image_layout(struct fsmtrie *f, struct _fsmtrie_image_build *b)
+{
+	struct _fsmtrie_image_ref *refs, key, *ref;
+	fsmtrie_node_t *node, *child;
+	struct fsmtrie_inode *inode;
+	uint64_t gen;
+	size_t i, n;
+	int c;
+
+	if (!_fsmtrie_image_append(b, f->root, 0))
+	{
+		return (false);
+	}
+
+	for (i = 0; i < b->cnt; i++)
+	{
+		node = b->order[i];
+		inode = &b->nodes[i];
+
+		memset(inode, 0, sizeof (*inode));
+		inode->child = b->cnt;
+		inode->type = node->type;
+		inode->depth = node->depth;
+		inode->suffix = FSMTRIE_INONE;
+		inode->dict = FSMTRIE_INONE;
+		inode->str = FSMTRIE_INONE;
+
+		if (f->mode == fsmtrie_mode_token)
+		{
+			n = (node == f->root) ? f->nrnodes : node->nnodes;
+			for (c = 0; c < (int)n; c++)
+			{
+				if (!_fsmtrie_image_append(b, node->nodes[c],
+							node->nodes[c]->tval))
+				{
+					return (false);
+				}
+			}
+		}
+		else
+		{
+			for (c = _fsmtrie_child_next(node, 0, &child); c >= 0;
+					c = _fsmtrie_child_next(node, c + 1,
+						&child))
+			{
+				if (!_fsmtrie_image_append(b, child, c))
+				{
+					return (false);
+				}
+			}
+		}
+		/* _fsmtrie_image_append() may have moved the records */
+		inode = &b->nodes[i];
+		inode->nchild = b->cnt - inode->child;
+
+		if ((node->type & FSMTRIE_NODE_LEAF) && node->str != NULL)
+		{
+			if (b->strs_len >= FSMTRIE_INONE)
+			{
+				errno = EFBIG;
+				return (false);
+			}
+			inode->str = b->strs_len;
+			b->strs_len += strlen(node->str) + 1;
+		}
+	}
+
+	if (f->mode == fsmtrie_mode_token)
+	{
+		return (true);
+	}
+
+	/* translate Aho-Corasick links into image indices */
+	gen = f->rcu != NULL ? f->rcu->snap->gen : 0;
+	refs = calloc(b->cnt, sizeof (*refs));
+	if (refs == NULL)
+	{
+		return (false);
+	}
+	for (i = 0; i < b->cnt; i++)
+	{
+		refs[i].node = b->order[i];
+		refs[i].idx = i;
+	}
+	qsort(refs, b->cnt, sizeof (*refs), _fsmtrie_image_ref_cmp);
+	for (i = 0; i < b->cnt; i++)
+	{
+		key.node = _fsmtrie_link(b->order[i]->suffix, gen);
+		if (key.node != NULL)
+		{
+			ref = bsearch(&key, refs, b->cnt, sizeof (*refs),
+					_fsmtrie_image_ref_cmp);
+			assert(ref != NULL);
+			b->nodes[i].suffix = ref->idx;
+		}
+		key.node = _fsmtrie_link(b->order[i]->dict, gen);
+		if (key.node != NULL)
+		{
+			ref = bsearch(&key, refs, b->cnt, sizeof (*refs),
+					_fsmtrie_image_ref_cmp);
+			assert(ref != NULL);
+			b->nodes[i].dict = ref->idx;
+		}
+	}
+	free(refs);
+
+	return (true);
+}
+
+/* the first free slot from i on, skipping runs of used slots */
+static size_t
+_fsmtrie_image_da_free(uint32_t *skip, size_t i)
+{
+	while (skip[i] != i)
+	{
+		skip[i] = skip[skip[i]];
+		i = skip[i];
+	}
+	return (i);
+}
+
+/*
+ * Place the children of every node in the double array, first fit: the base
+ * of a node is the lowest one whose slots for the labels of its children are
+ * all free. Only bases putting the first child into a free slot are tried,
+ * and runs of used slots are skipped over, so the dense front of the array
+ * costs little to get past.
+ */
+static bool
+_fsmtrie_image_da(struct _fsmtrie_image_build *b)
+{
+	struct fsmtrie_buf slots = { NULL, 0 }, skips = { NULL, 0 };
+	size_t i, j, pos, base, used = 256, first = 0, size = 0, grow;
+	const struct fsmtrie_inode *inode;
+	const uint32_t *labels;
+	uint32_t *slot = NULL, *skip = NULL;
+	bool ok = false;
+
+	if ((b->bases = calloc(b->cnt, sizeof (*b->bases))) == NULL)
+	{
+		return (false);
+	}
+
+	for (i = 0; i < b->cnt; i++)
+	{
+		inode = &b->nodes[i];
+		if (inode->nchild == 0)
+		{
+			continue;
+		}
+		labels = &b->labels[inode->child];
+
+		pos = first > labels[0] ? first : labels[0];
+		for (pos = size ? _fsmtrie_image_da_free(skip, pos) : pos; ;
+				pos = _fsmtrie_image_da_free(skip, pos + 1))
+		{
+			/* every byte past a base has a slot, the last is free */
+			base = pos - labels[0];
+			if (base + 257 > size)
+			{
+				grow = size ? size * 2 : 1024;
+				grow = base + 257 > grow ? base + 257 : grow;
+				if (grow > (size_t)UINT32_MAX)
+				{
+					/* bases are 32 bits wide */
+					errno = EFBIG;
+					goto out;
+				}
+				slot = _fsmtrie_buf_reserve(&slots,
+						grow * sizeof (*slot));
+				skip = _fsmtrie_buf_reserve(&skips,
+						grow * sizeof (*skip));
+				if (slot == NULL || skip == NULL)
+				{
+					goto out;
+				}
+				for (j = size; j < grow; j++)
+				{
+					slot[j] = FSMTRIE_INONE;
+					skip[j] = j;
+				}
+				size = grow;
+			}
+			for (j = 0; j < inode->nchild &&
+					slot[base + labels[j]] == FSMTRIE_INONE;
+					j++)
+				;
+			if (j == inode->nchild)
+			{
+				break;
+			}
+		}
+
+		b->bases[i] = base;
+		for (j = 0; j < inode->nchild; j++)
+		{
+			slot[base + labels[j]] = inode->child + j;
+			skip[base + labels[j]] = base + labels[j] + 1;
+		}
+		first = _fsmtrie_image_da_free(skip, first);
+		used = base + 256 > used ? base + 256 : used;
+	}
+
+	/* a root without children still needs its 256 slots */
+	if (used > size && (slot = _fsmtrie_buf_reserve(&slots,
+					used * sizeof (*slot))) == NULL)
+	{
+		goto out;
+	}
+	for (j = size; j < used; j++)
+	{
+		slot[j] = FSMTRIE_INONE;
+	}
+
+	b->slots = slots.p;
+	b->nslots = used;
+	slots.p = NULL;
+	ok = true;
+out:
+	free(slots.p);
+	free(skips.p);
+	return (ok);
+}
+
+static void
+_fsmtrie_image_build_free(struct _fsmtrie_image_build *b)
+{
+	free(b->order);
+	free(b->nodes);
+	free(b->labels);
+	free(b->bases);
+	free(b->slots);
+}
+
+/*
+ * Render a live trie as an image, handing the image to out() piece by piece.
+ * Returns false with errno set on failure.
+ */
+static bool
+_fsmtrie_image_write(struct fsmtrie *f,
+		bool (*out)(void *ctx, const void *buf, size_t len), void *ctx)
+{
+	static const uint8_t zero[8];
+	struct _fsmtrie_image_build b;
+	struct fsmtrie_image_hdr hdr;
+	size_t i, lsize;
+	uint64_t off;
+	bool ok = false;
+
+	/* images always carry Aho-Corasick metadata */
+	if (f->mode != fsmtrie_mode_token && !_fsmtrie_ac_ensure(f))
+	{
+		/* errno set by _fsmtrie_ac_compile() */
+		return (false);
+	}
+
+	memset(&b, 0, sizeof (b));
+	if (!_fsmtrie_image_layout(f, &b))
+	{
+		goto done;
+	}
+	if ((f->flags & FSMTRIE_DOUBLE_ARRAY) &&
+			f->mode != fsmtrie_mode_token && !_fsmtrie_image_da(&b))
+	{
+		goto done;
+	}
+
+	lsize = (f->mode == fsmtrie_mode_token) ? sizeof (uint32_t) :
+		sizeof (uint8_t);
+
+	memset(&hdr, 0, sizeof (hdr));
+	memcpy(hdr.magic, FSMTRIE_IMAGE_MAGIC, sizeof (FSMTRIE_IMAGE_MAGIC));
+	hdr.version = FSMTRIE_IMAGE_VERSION;
+	hdr.byteorder = FSMTRIE_IMAGE_BYTEORDER;
+	hdr.mode = f->mode;
+	hdr.flags = f->flags & ~(FSMTRIE_RCU | FSMTRIE_AC_LINKS);
+	hdr.max_len = f->max_len;
+	hdr.nrnodes = f->nrnodes;
+	hdr.node_cnt = f->node_cnt;
+	hdr.key_cnt = f->key_cnt;
+	hdr.nnodes = b.cnt;
+	hdr.nodes_off = sizeof (hdr);
+	hdr.labels_off = FSMTRIE_IMAGE_ALIGN(hdr.nodes_off +
+			b.cnt * sizeof (struct fsmtrie_inode));
+	hdr.strs_off = FSMTRIE_IMAGE_ALIGN(hdr.labels_off + b.cnt * lsize);
+	hdr.strs_len = b.strs_len;
+	hdr.size = hdr.strs_off + hdr.strs_len;
+	if (b.slots != NULL)
+	{
+		hdr.da_off = FSMTRIE_IMAGE_ALIGN(hdr.size);
+		hdr.da_slots = b.nslots;
+		hdr.size = hdr.da_off + (b.cnt + b.nslots) * sizeof (uint32_t);
+	}
+
+	if (!out(ctx, &hdr, sizeof (hdr)) ||
+			!out(ctx, b.nodes, b.cnt * sizeof (*b.nodes)))
+	{
+		goto done;
+	}
+	off = hdr.nodes_off + b.cnt * sizeof (*b.nodes);
+	if (!out(ctx, zero, hdr.labels_off - off))
+	{
+		goto done;
+	}
+	for (i = 0; i < b.cnt; i++)
+	{
+		uint8_t label = b.labels[i];
+
+		if (!out(ctx, lsize == 1 ? (void *)&label :
+					(void *)&b.labels[i], lsize))
+		{
+			goto done;
+		}
+	}
+	off = hdr.labels_off + b.cnt * lsize;
+	if (!out(ctx, zero, hdr.strs_off - off))
+	{
+		goto done;
+	}
+	for (i = 0; i < b.cnt; i++)
+	{
+		if (b.nodes[i].str != FSMTRIE_INONE &&
+				!out(ctx, b.order[i]->str,
+					strlen(b.order[i]->str) + 1))
+		{
+			goto done;
+		}
+	}
+	if (b.slots != NULL)
+	{
+		off = hdr.strs_off + hdr.strs_len;
+		if (!out(ctx, zero, hdr.da_off - off) ||
+				!out(ctx, b.bases, b.cnt * sizeof (*b.bases)) ||
+				!out(ctx, b.slots, b.nslots * sizeof (*b.slots)))
+		{
+			goto done;
+		}
+	}
+	ok = true;
+done:
+	_fsmtrie_image_build_free(&b);
+	return (ok);
+}
+
+static bool
+_fsmtrie_image_fwrite(void *ctx, const void *buf, size_t len)
+{
+	return (len == 0 || fwrite(buf, len, 1, (FILE *)ctx) == 1);
+}
+
+bool
+fsmtrie_save(struct fsmtrie *f, const char *path)
+{
+	char *tmp;
+	size_t len;
+	FILE *fp;
+	bool ok;
+	int fd;
+
+	if (f == NULL)
+	{
+		return (false);
+	}
+	if (f->dawg != NULL)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with DAWG fsmtries",
+				__func__);
+		return (false);
+	}
+	if (f->root == NULL && f->img == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (false);
+	}
+	if (path == NULL)
+	{
+		_fsmtrie_error(f, "empty path");
+		return (false);
+	}
+
+	/* Write to a temporary file and rename it into place so processes
+	 * that have the previous image mapped keep a consistent copy.
+	 */
+	len = strlen(path) + sizeof (".XXXXXX");
+	if ((tmp = malloc(len)) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate path: %s", strerror(errno));
+		return (false);
+	}
+	snprintf(tmp, len, "%s.XXXXXX", path);
+	if ((fd = mkstemp(tmp)) == -1)
+	{
+		_fsmtrie_error(f, "can't create \"%s\": %s", tmp,
+				strerror(errno));
+		free(tmp);
+		return (false);
+	}
+	(void)fchmod(fd, 0644);
+	if ((fp = fdopen(fd, "w")) == NULL)
+	{
+		_fsmtrie_error(f,
+				"can't open \"%s\": %s", tmp, strerror(errno));
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return (false);
+	}
+
+	if (f->img != NULL)
+	{
+		ok = _fsmtrie_image_fwrite(fp, f->img->hdr, f->img->hdr->size);
+	}
+	else
+	{
+		ok = _fsmtrie_image_write(f, _fsmtrie_image_fwrite, fp);
+	}
+	if (fclose(fp) != 0)
+	{
+		ok = false;
+	}
+	if (ok && rename(tmp, path) == -1)
+	{
+		ok = false;
+	}
+	if (!ok)
+	{
+		_fsmtrie_error(f, "can't write \"%s\": %s", path,
+				strerror(errno));
+		unlink(tmp);
+	}
+	free(tmp);
+
+	return (ok);
+}
+
+/*
+ * Check the node records of an image attached to img, so that searches can
+ * follow its indices unchecked: the children of every node are one level
+ * deeper and come right after the children of the nodes before it, as
+ * breadth-first order lays them out; suffix and dictionary links lead back
+ * to nodes before; leaf strings start within the strings, which end with a
+ * NUL; and the double array, if any, has room for every byte past every
+ * base and its slots are empty or hold a node.
+ */
+static bool
+_fsmtrie_image_check(const struct fsmtrie_image *img)
+{
+	const struct fsmtrie_image_hdr *hdr = img->hdr;
+	const struct fsmtrie_inode *node;
+	uint64_t i, c, next;
+
+	if (img->nodes[0].depth != 0 || (hdr->strs_len > 0 &&
+				img->strs[hdr->strs_len - 1] != '\0'))
+	{
+		return (false);
+	}
+	for (i = 0, next = 1; i < hdr->nnodes; i++)
+	{
+		node = &img->nodes[i];
+		if ((i > 0 && i >= next) || node->child != next ||
+				node->nchild > hdr->nnodes - next ||
+				(node->suffix != FSMTRIE_INONE &&
+				 node->suffix >= i) ||
+				(node->dict != FSMTRIE_INONE &&
+				 node->dict >= i) ||
+				(node->str != FSMTRIE_INONE &&
+				 node->str >= hdr->strs_len))
+		{
+			return (false);
+		}
+		for (c = next, next += node->nchild; c < next; c++)
+		{
+			if (img->nodes[c].depth != node->depth + 1)
+			{
+				return (false);
+			}
+		}
+		if (img->da_base != NULL &&
+				img->da_base[i] + (uint64_t)255 >= hdr->da_slots)
+		{
+			return (false);
+		}
+	}
+	for (i = 0; img->da_base != NULL && i < hdr->da_slots; i++)
+	{
+		if (img->da_slot[i] != FSMTRIE_INONE &&
+				img->da_slot[i] >= hdr->nnodes)
+		{
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+/*
+ * Check the header and section bounds of an image, point img at its
+ * sections and check the node records, see _fsmtrie_image_check().
+ */
+static bool
+_fsmtrie_image_attach(struct fsmtrie_image *img, const void *buf, size_t len,
+		char *err_buf, size_t err_buf_len)
+{
+	const struct fsmtrie_image_hdr *hdr = buf;
+	uint64_t lsize;
+
+	if (len < sizeof (*hdr) ||
+			memcmp(hdr->magic, FSMTRIE_IMAGE_MAGIC,
+				sizeof (FSMTRIE_IMAGE_MAGIC)) != 0)
+	{
+		snprintf(err_buf, err_buf_len, "not an fsmtrie image");
+		return (false);
+	}
+	if (hdr->byteorder != FSMTRIE_IMAGE_BYTEORDER)
+	{
+		snprintf(err_buf, err_buf_len,
+				"fsmtrie image has foreign byte order");
+		return (false);
+	}
+	if (hdr->version != FSMTRIE_IMAGE_VERSION)
+	{
+		snprintf(err_buf, err_buf_len,
+				"unsupported fsmtrie image version %u",
+				hdr->version);
+		return (false);
+	}
+	if (hdr->mode != fsmtrie_mode_ascii &&
+			hdr->mode != fsmtrie_mode_eascii &&
+			hdr->mode != fsmtrie_mode_token)
+	{
+		snprintf(err_buf, err_buf_len,
+				"unrecognized mode \"%u\"", hdr->mode);
+		return (false);
+	}
+
+	lsize = (hdr->mode == fsmtrie_mode_token) ? sizeof (uint32_t) :
+		sizeof (uint8_t);
+	if (hdr->size != len || hdr->nnodes == 0 ||
+			hdr->nnodes >= FSMTRIE_INONE ||
+			hdr->nodes_off < sizeof (*hdr) || hdr->nodes_off > len ||
+			hdr->nodes_off % 8 != 0 ||
+			hdr->labels_off < hdr->nodes_off + hdr->nnodes *
+			sizeof (struct fsmtrie_inode) || hdr->labels_off > len ||
+			hdr->strs_off < hdr->labels_off + hdr->nnodes * lsize ||
+			hdr->strs_off > len || hdr->strs_len > len ||
+			hdr->strs_off + hdr->strs_len > len)
+	{
+		snprintf(err_buf, err_buf_len, "truncated fsmtrie image");
+		return (false);
+	}
+	if (hdr->da_off != 0 && (hdr->mode == fsmtrie_mode_token ||
+				hdr->da_off % 8 != 0 || hdr->da_slots < 256 ||
+				hdr->da_off > len || hdr->da_slots > len ||
+				hdr->da_off < hdr->strs_off + hdr->strs_len ||
+				hdr->da_off + (hdr->nnodes + hdr->da_slots) *
+				sizeof (uint32_t) > len))
+	{
+		snprintf(err_buf, err_buf_len, "truncated fsmtrie image");
+		return (false);
+	}
+
+	memset(img, 0, sizeof (*img));
+	img->hdr = hdr;
+	img->nodes = (const void *)((const uint8_t *)buf + hdr->nodes_off);
+	if (hdr->mode == fsmtrie_mode_token)
+	{
+		img->tlabels = (const void *)((const uint8_t *)buf +
+				hdr->labels_off);
+	}
+	else
+	{
+		img->labels = (const uint8_t *)buf + hdr->labels_off;
+	}
+	img->strs = (const char *)buf + hdr->strs_off;
+	if (hdr->da_off != 0)
+	{
+		img->da_base = (const void *)((const uint8_t *)buf +
+				hdr->da_off);
+		img->da_slot = img->da_base + hdr->nnodes;
+	}
+	if (!_fsmtrie_image_check(img))
+	{
+		snprintf(err_buf, err_buf_len, "corrupt fsmtrie image");
+		return (false);
+	}
+
+	return (true);
+}
+
+struct fsmtrie *
+fsmtrie_open_mmap(const char *path, char *err_buf, size_t err_buf_len)
+{
+	struct fsmtrie_image *img;
+	struct fsmtrie *f;
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (path == NULL)
+	{
+		snprintf(err_buf, err_buf_len, "empty path");
+		return (NULL);
+	}
+	if ((fd = open(path, O_RDONLY)) == -1)
+	{
+		snprintf(err_buf, err_buf_len, "can't open \"%s\": %s", path,
+				strerror(errno));
+		return (NULL);
+	}
+	if (fstat(fd, &st) == -1)
+	{
+		snprintf(err_buf, err_buf_len, "can't stat \"%s\": %s", path,
+				strerror(errno));
+		close(fd);
+		return (NULL);
+	}
+	if (st.st_size == 0)
+	{
+		snprintf(err_buf, err_buf_len, "not an fsmtrie image");
+		close(fd);
+		return (NULL);
+	}
+
+	/* Shared read-only mappings of the same file share page cache. */
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+	{
+		snprintf(err_buf, err_buf_len, "can't map \"%s\": %s", path,
+				strerror(errno));
+		return (NULL);
+	}
+
+	f = calloc(1, sizeof (struct fsmtrie));
+	img = calloc(1, sizeof (struct fsmtrie_image));
+	if (f == NULL || img == NULL)
+	{
+		snprintf(err_buf, err_buf_len, "can't allocate fsmtrie: %s",
+				strerror(errno));
+		free(f);
+		free(img);
+		munmap(map, st.st_size);
+		return (NULL);
+	}
+	if (!_fsmtrie_image_attach(img, map, st.st_size, err_buf,
+				err_buf_len))
+	{
+		free(f);
+		free(img);
+		munmap(map, st.st_size);
+		return (NULL);
+	}
+	img->map = map;
+	img->map_len = st.st_size;
+
+	f->img = img;
+	f->mode = img->hdr->mode;
+	f->flags = img->hdr->flags;
+	f->max_len = img->hdr->max_len;
+	f->nrnodes = img->hdr->nrnodes;
+	f->node_cnt = img->hdr->node_cnt;
+	f->key_cnt = img->hdr->key_cnt;
+	/* nodes are stored breadth-first, the last one is the deepest */
+	f->depth = img->nodes[img->hdr->nnodes - 1].depth;
+	pthread_mutex_init(&f->lock, NULL);
+
+	return (f);
+}
+
+static bool
+_fsmtrie_image_mwrite(void *ctx, const void *buf, size_t len)
+{
+	struct _fsmtrie_image_mem *m = ctx;
+	void *p;
+
+	/* the header comes first and knows the size of the whole image */
+	if (m->buf == NULL)
+	{
+		m->size = ((const struct fsmtrie_image_hdr *)buf)->size;
+		if ((errno = posix_memalign(&p, FSMTRIE_IMAGE_LINE,
+						m->size)) != 0)
+		{
+			return (false);
+		}
+		m->buf = p;
+	}
+	if (len > m->size - m->len)
+	{
+		errno = EFBIG;
+		return (false);
+	}
+	memcpy(m->buf + m->len, buf, len);
+	m->len += len;
+
+	return (true);
+}
+
+bool
+fsmtrie_freeze(struct fsmtrie *f)
+{
+	struct _fsmtrie_image_mem m;
+	struct fsmtrie_image *img;
+	char err_buf[BUFSIZ];
+	bool indexed;
+
+	if (f == NULL)
+	{
+		return (false);
+	}
+	if (f->img != NULL)
+	{
+		/* images are read-only already */
+		return (true);
+	}
+	if (f->dawg != NULL)
+	{
+		/* as are DAWGs once sealed */
+		return (_fsmtrie_dawg_seal(f));
+	}
+	if (f->root == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (false);
+	}
+	if (f->rcu != NULL)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with RCU fsmtries",
+				__func__);
+		return (false);
+	}
+
+	memset(&m, 0, sizeof (m));
+	if ((img = calloc(1, sizeof (*img))) == NULL ||
+			!_fsmtrie_image_write(f, _fsmtrie_image_mwrite, &m))
+	{
+		_fsmtrie_error(f, "can't freeze fsmtrie: %s",
+				strerror(errno));
+		free(img);
+		free(m.buf);
+		return (false);
+	}
+	if (!_fsmtrie_image_attach(img, m.buf, m.len, err_buf,
+				sizeof (err_buf)))
+	{
+		_fsmtrie_error(f, "can't freeze fsmtrie: %s", err_buf);
+		free(img);
+		free(m.buf);
+		return (false);
+	}
+	img->buf = m.buf;
+
+	/* the live trie goes, the approximate search index is rebuilt */
+	indexed = f->symdel != NULL;
+	fsmtrie_free(f);
+	f->img = img;
+	f->flags = img->hdr->flags;
+	f->node_cnt = img->hdr->node_cnt;
+
+	return (!indexed || _fsmtrie_symdel_build(f));
+}
+
+void
+_fsmtrie_image_close(struct fsmtrie_image *img)
+{
+	if (img->map != NULL)
+	{
+		munmap(img->map, img->map_len);
+	}
+	free(img->buf);
+	free(img);
+}
+
+int
+_fsmtrie_image_search(struct fsmtrie *f, const char *key, size_t keylen,
+		const char **str)
+{
+	const struct fsmtrie_image *img = f->img;
+	const unsigned char *p, *end;
+	uint32_t n;
+
+	*str = NULL;
+	end = (const unsigned char *)key + keylen;
+	for (p = (const unsigned char *)key, n = 0; p < end; p++)
+	{
+		if ((int)*p > f->nrnodes - 1)
+		{
+			_fsmtrie_error(f, "key value \"%d\" out of range",
+				(int)*p);
+			return (-1);
+		}
+		if ((n = _fsmtrie_image_child(img, n, *p)) == FSMTRIE_INONE)
+		{
+			/* no match */
+			return (0);
+		}
+	}
+	if (img->nodes[n].type & FSMTRIE_NODE_LEAF)
+	{
+		*str = _fsmtrie_image_str(img, n);
+	}
+
+	if ((f->flags & FSMTRIE_PM_OK) ? true :
+			(img->nodes[n].type & FSMTRIE_NODE_LEAF))
+	{
+		return (1);
+	}
+	return (0);
+}
+
+int
+_fsmtrie_image_search_token(struct fsmtrie *f, const uint32_t *key,
+		size_t keylen, const char **str)
+{
+	const struct fsmtrie_image *img = f->img;
+	const struct fsmtrie_inode *node;
+	uint32_t n, lo, hi, mid;
+	size_t keyidx;
+
+	*str = NULL;
+	for (keyidx = 0, n = 0; keyidx < keylen; keyidx++)
+	{
+		node = &img->nodes[n];
+		for (lo = 0, hi = node->nchild; lo < hi; )
+		{
+			mid = lo + (hi - lo) / 2;
+			if (img->tlabels[node->child + mid] < key[keyidx])
+			{
+				lo = mid + 1;
+			}
+			else
+			{
+				hi = mid;
+			}
+		}
+		if (lo == node->nchild ||
+				img->tlabels[node->child + lo] != key[keyidx])
+		{
+			return (0);
+		}
+		n = node->child + lo;
+	}
+	if (img->nodes[n].type & FSMTRIE_NODE_LEAF)
+	{
+		*str = _fsmtrie_image_str(img, n);
+		return (1);
+	}
+
+	return (0);
+}
+
+void
+_fsmtrie_image_scan(struct fsmtrie_scanner *s, const unsigned char *buf,
+		size_t len)
+{
+	const struct fsmtrie_image *img = s->f->img;
+	const char *mstr;
+	uint32_t node, next, n;
+	uint64_t end;
+	size_t i;
+
+	node = s->inode;
+	for (i = 0; i < len; i++)
+	{
+		/*
+		 * If our current path does not continue, walk the list of
+		 * suffixes to find the next node. If no suffixes continue
+		 * with the next character, restart at the root.
+		 */
+		next = _fsmtrie_image_child(img, node, buf[i]);
+		while (next == FSMTRIE_INONE)
+		{
+			node = img->nodes[node].suffix;
+			if (node == FSMTRIE_INONE)
+			{
+				next = 0;
+			}
+			else
+			{
+				next = _fsmtrie_image_child(img, node, buf[i]);
+			}
+		}
+		node = next;
+
+		if ((img->nodes[node].type & FSMTRIE_NODE_OUTPUT) == 0)
+		{
+			continue;
+		}
+		end = s->off + i + 1;
+		n = (img->nodes[node].type & FSMTRIE_NODE_LEAF) ? node :
+			img->nodes[node].dict;
+		for (; n != FSMTRIE_INONE; n = img->nodes[n].dict)
+		{
+			mstr = _fsmtrie_image_str(img, n);
+			s->cb(mstr, end - img->nodes[n].depth, s->cbdata);
+		}
+	}
+	s->inode = node;
+}
+
+/* recursively print image leaves to stdout, see _fsmtrie_print_leaves() */
+static void
+_fsmtrie_image_print_node(const struct fsmtrie_image *img, uint32_t n,
+		fsmtrie_mode mode, unsigned int depth)
+{
+	const struct fsmtrie_inode *node = &img->nodes[n];
+	const char *str;
+	uint32_t i;
+
+	for (i = 0; i < node->nchild; i++)
+	{
+		_fsmtrie_image_print_node(img, node->child + i, mode,
+				depth + 1);
+	}
+	if (mode == fsmtrie_mode_token)
+	{
+		for (i = 0; i < depth - 1; i++)
+		{
+			printf(" ");
+		}
+	}
+	str = _fsmtrie_image_str(img, n);
+	if ((node->type & FSMTRIE_NODE_LEAF) && str != NULL)
+	{
+		if (mode == fsmtrie_mode_token)
+		{
+			printf("%u = [%s]\n", img->tlabels[n], str);
+		}
+		else
+		{
+			printf("%s\n", str);
+		}
+	}
+	else if (mode == fsmtrie_mode_token)
+	{
+		printf("%u\n", img->tlabels[n]);
+	}
+}
+
+void
+_fsmtrie_image_print_leaves(struct fsmtrie *f)
+{
+	const struct fsmtrie_inode *root = &f->img->nodes[0];
+	uint32_t i;
+
+	for (i = 0; i < root->nchild; i++)
+	{
+		_fsmtrie_image_print_node(f->img, root->child + i, f->mode, 1);
+	}
+}
@@ -0,0 +1,442 @@
+/*
+ * Fast String Matcher Levenshtein Automaton Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * The key and distance bound are compiled into a deterministic automaton
+ * over trie prefixes: a state is the DP column of the key against the prefix
+ * read so far, entries beyond the bound all counted as one over it, plus
+ * what the previous column offers to a transposition with the next
+ * character. Only the key's bytes are told apart, all other bytes act alike,
+ * so a state has one transition per distinct key byte plus one.
+ *
+ * States are built lazily, the first time the trie walk needs them, and
+ * interned so that every prefix ending in the same column shares them (and
+ * their transitions). Once no byte outside the key leads anywhere, only the
+ * children labelled with key bytes still in reach are looked up, instead of
+ * visiting every child of the node.
+ */
+
+/* \cond */
+struct _fsmtrie_lev
+{
+	struct fsmtrie_asearch_ctx *ctx;	/* owns the buffers below */
+	int keylen;
+	int k;				/* bound, larger entries are k + 1 */
+	int nclasses;			/* distinct key bytes + 1 */
+	uint16_t cls[256];		/* class of every byte, 0 if not in key */
+	uint8_t bytes[256];		/* byte of class n + 1 */
+	uint16_t *kcls;			/* class of every key position */
+	size_t ssize;			/* state size: column, transpositions */
+	uint8_t *states;
+	int32_t *delta;			/* transitions, -1 if not built yet */
+	uint32_t nstates;
+	uint32_t size;			/* states allocated */
+	uint32_t *hash;			/* state + 1 by state hash, 0 if free */
+	uint32_t hsize;
+	int hbuf;			/* context buffer of hash */
+	uint8_t *next;			/* state being built */
+};
+
+/* DFS stack entry */
+struct _fsmtrie_lev_frame
+{
+	fsmtrie_ref_t node;
+	uint32_t state;
+	int pos;			/* next code point or class, -1 first */
+	bool sparse;			/* look up key bytes only */
+	uint64_t live[4];		/* classes in reach if sparse, by n - 1 */
+};
+/* \endcond */
+
+/* state 0 rejects everything */
+#define FSMTRIE_LEV_DEAD	0
+
+static uint32_t
+_fsmtrie_lev_hash(const uint8_t *s, size_t len)
+{
+	uint32_t h = 2166136261U;
+	size_t n;
+
+	for (n = 0; n < len; n++)
+	{
+		h = (h ^ s[n]) * 16777619U;
+	}
+	return (h);
+}
+
+static bool
+_fsmtrie_lev_rehash(struct _fsmtrie_lev *l)
+{
+	uint32_t *hash, hsize = l->hsize ? l->hsize * 2 : 64, n, h;
+	int hbuf = l->hash != NULL ? !l->hbuf : 0;
+
+	hash = _fsmtrie_buf_reserve(&l->ctx->lev_hash[hbuf],
+			hsize * sizeof (*hash));
+	if (hash == NULL)
+	{
+		return (false);
+	}
+	memset(hash, 0, hsize * sizeof (*hash));
+	for (n = 0; n < l->nstates; n++)
+	{
+		h = _fsmtrie_lev_hash(&l->states[n * l->ssize], l->ssize);
+		for (h &= hsize - 1; hash[h] != 0; h = (h + 1) & (hsize - 1))
+			;
+		hash[h] = n + 1;
+	}
+	l->hash = hash;
+	l->hsize = hsize;
+	l->hbuf = hbuf;
+
+	return (true);
+}
+
+/* look up state s, adding it if it's new; returns -1 if out of memory */
+static int32_t
+_fsmtrie_lev_intern(struct _fsmtrie_lev *l, const uint8_t *s)
+{
+	uint32_t h, size, n;
+	uint8_t *states;
+	int32_t *delta;
+
+	h = _fsmtrie_lev_hash(s, l->ssize) & (l->hsize - 1);
+	for (; l->hash[h] != 0; h = (h + 1) & (l->hsize - 1))
+	{
+		n = l->hash[h] - 1;
+		if (memcmp(&l->states[n * l->ssize], s, l->ssize) == 0)
+		{
+			return (n);
+		}
+	}
+
+	if (l->nstates == l->size)
+	{
+		size = l->size ? l->size * 2 : 64;
+		states = _fsmtrie_buf_reserve(&l->ctx->lev_states,
+				size * l->ssize);
+		if (states == NULL)
+		{
+			return (-1);
+		}
+		l->states = states;
+		delta = _fsmtrie_buf_reserve(&l->ctx->lev_delta,
+				size * l->nclasses * sizeof (*delta));
+		if (delta == NULL)
+		{
+			return (-1);
+		}
+		memset(&delta[l->size * l->nclasses], 0xff, (size - l->size) *
+				l->nclasses * sizeof (*delta));
+		l->delta = delta;
+		l->size = size;
+	}
+	memcpy(&l->states[l->nstates * l->ssize], s, l->ssize);
+	l->hash[h] = ++l->nstates;
+
+	if (l->nstates * 2 > l->hsize && !_fsmtrie_lev_rehash(l))
+	{
+		return (-1);
+	}
+	return (l->nstates - 1);
+}
+
+/*
+ * Follow the transition of state from on a byte of class x, building the
+ * target state if needed. Returns -1 if out of memory.
+ */
+static int32_t
+_fsmtrie_lev_step(struct _fsmtrie_lev *l, uint32_t from, int x)
+{
+	const uint8_t *cur, *tr;
+	uint8_t *next = l->next, *ntr = l->next + l->keylen + 1;
+	int32_t to;
+	int j, v, k1 = l->k + 1;
+	bool live;
+
+	if ((to = l->delta[from * l->nclasses + x]) >= 0)
+	{
+		return (to);
+	}
+
+	/* entry j is the distance of the key prefix of length j */
+	cur = &l->states[from * l->ssize];
+	tr = cur + l->keylen + 1;
+	next[0] = cur[0] < k1 ? cur[0] + 1 : k1;
+	live = next[0] < k1;
+	ntr[0] = ntr[1] = k1;
+	for (j = 1; j <= l->keylen; j++)
+	{
+		v = cur[j - 1] + (x == 0 || l->kcls[j - 1] != x);
+		if (cur[j] + 1 < v)
+		{
+			v = cur[j] + 1;
+		}
+		if (next[j - 1] + 1 < v)
+		{
+			v = next[j - 1] + 1;
+		}
+		if (j >= 2 && x != 0 && l->kcls[j - 2] == x && tr[j] < v)
+		{
+			v = tr[j];
+		}
+		next[j] = v < k1 ? v : k1;
+		live |= next[j] < k1;
+
+		/* a swap with the next character continues from here */
+		if (j >= 2)
+		{
+			ntr[j] = x != 0 && l->kcls[j - 1] == x &&
+				cur[j - 2] < l->k ? cur[j - 2] + 1 : k1;
+		}
+	}
+
+	to = live ? _fsmtrie_lev_intern(l, next) : FSMTRIE_LEV_DEAD;
+	if (to >= 0)
+	{
+		l->delta[from * l->nclasses + x] = to;
+	}
+	return (to);
+}
+
+/* distance of the whole key in state s */
+static inline int
+_fsmtrie_lev_dist(const struct _fsmtrie_lev *l, uint32_t s)
+{
+	return (l->states[s * l->ssize + l->keylen]);
+}
+
+static bool
+_fsmtrie_lev_init(struct _fsmtrie_lev *l, struct fsmtrie_asearch_ctx *ctx,
+		const unsigned char *key, int keylen, int k)
+{
+	int j, c, k1 = k + 1;
+
+	memset(l, 0, sizeof (*l));
+	l->ctx = ctx;
+	l->keylen = keylen;
+	l->k = k;
+	l->ssize = 2 * (size_t)(keylen + 1);
+
+	/* classes in byte order, so a walk over them is in code point order */
+	for (j = 0; j < keylen; j++)
+	{
+		l->cls[key[j]] = 1;
+	}
+	l->nclasses = 1;
+	for (c = 0; c < 256; c++)
+	{
+		if (l->cls[c])
+		{
+			l->bytes[l->nclasses - 1] = c;
+			l->cls[c] = l->nclasses++;
+		}
+	}
+
+	l->kcls = _fsmtrie_buf_reserve(&ctx->lev_key,
+			keylen * sizeof (*l->kcls) + l->ssize);
+	if (l->kcls == NULL || !_fsmtrie_lev_rehash(l))
+	{
+		return (false);
+	}
+	l->next = (uint8_t *)&l->kcls[keylen];
+	for (j = 0; j < keylen; j++)
+	{
+		l->kcls[j] = l->cls[key[j]];
+	}
+
+	/* the dead state, then the start state: entry j is j */
+	memset(l->next, k1, l->ssize);
+	if (_fsmtrie_lev_intern(l, l->next) != FSMTRIE_LEV_DEAD)
+	{
+		return (false);
+	}
+	for (j = 0; j <= keylen && j < k1; j++)
+	{
+		l->next[j] = j;
+	}
+	return (_fsmtrie_lev_intern(l, l->next) == 1);
+}
+
+/*
+ * Decide how to visit the children of the node of frame fr. A byte outside
+ * the key raises every entry of the column by one, so it leads on only while
+ * some entry is below the bound. Once none is, a key byte leads on only if
+ * it matches at an entry on the bound or completes a transposition.
+ */
+static void
+_fsmtrie_lev_enter(const struct _fsmtrie_lev *l, struct _fsmtrie_lev_frame *fr)
+{
+	const uint8_t *cur = &l->states[fr->state * l->ssize];
+	const uint8_t *tr = cur + l->keylen + 1;
+	int j, x;
+
+	for (j = 0; j <= l->keylen; j++)
+	{
+		if (cur[j] < l->k)
+		{
+			fr->sparse = false;
+			fr->pos = 0;
+			return;
+		}
+	}
+
+	memset(fr->live, 0, sizeof (fr->live));
+	for (j = 0; j < l->keylen; j++)
+	{
+		if (cur[j] <= l->k)
+		{
+			x = l->kcls[j] - 1;
+			fr->live[x / 64] |= (uint64_t)1 << (x % 64);
+		}
+		if (j >= 2 && tr[j] <= l->k)
+		{
+			x = l->kcls[j - 2] - 1;
+			fr->live[x / 64] |= (uint64_t)1 << (x % 64);
+		}
+	}
+	fr->sparse = true;
+	fr->pos = 1;
+}
+
+/*
+ * Find the next child of the node of frame fr the automaton doesn't reject,
+ * returns its label, -1 if there is none or -2 if out of memory.
+ */
+static int
+_fsmtrie_lev_child(const struct fsmtrie_view *view, struct _fsmtrie_lev *l,
+		struct _fsmtrie_lev_frame *fr, fsmtrie_ref_t *child,
+		uint32_t *state)
+{
+	int32_t to;
+	int c, x;
+
+	if (fr->sparse)
+	{
+		for (; fr->pos < l->nclasses; fr->pos++)
+		{
+			x = fr->pos - 1;
+			if ((fr->live[x / 64] & ((uint64_t)1 << (x % 64))) == 0)
+			{
+				continue;
+			}
+			if ((to = _fsmtrie_lev_step(l, fr->state, fr->pos)) < 0)
+			{
+				return (-2);
+			}
+			if (to == FSMTRIE_LEV_DEAD)
+			{
+				continue;
+			}
+			c = l->bytes[fr->pos - 1];
+			*child = _fsmtrie_view_child(view, fr->node, c);
+			if (*child != FSMTRIE_REF_NONE)
+			{
+				fr->pos++;
+				*state = to;
+				return (c);
+			}
+		}
+		return (-1);
+	}
+
+	while ((c = _fsmtrie_view_next(view, fr->node, fr->pos, child)) >= 0)
+	{
+		fr->pos = c + 1;
+		if ((to = _fsmtrie_lev_step(l, fr->state, l->cls[c])) < 0)
+		{
+			return (-2);
+		}
+		if (to != FSMTRIE_LEV_DEAD)
+		{
+			*state = to;
+			return (c);
+		}
+	}
+	return (-1);
+}
+
+bool
+_fsmtrie_approx_lev(struct fsmtrie_asearch_ctx *ctx,
+		const struct fsmtrie_view *view, const unsigned char *key,
+		int keylen, int max_dist, uint32_t depth,
+		void (*cb)(const char *, int, void *), void *cbdata)
+{
+	struct _fsmtrie_lev l;
+	struct _fsmtrie_lev_frame *stack, *fr;
+	fsmtrie_ref_t child;
+	uint32_t state;
+	int i, c;
+
+	if (max_dist < 0)
+	{
+		return (true);
+	}
+
+	stack = _fsmtrie_buf_reserve(&ctx->stack,
+			((size_t)depth + 1) * sizeof (*stack));
+	if (stack == NULL || !_fsmtrie_lev_init(&l, ctx, key, keylen, max_dist))
+	{
+		return (false);
+	}
+
+	fr = &stack[0];
+	fr->node = _fsmtrie_view_root(view);
+	fr->state = 1;
+	fr->pos = -1;
+	i = 0;
+	for (;;)
+	{
+		if (fr->pos < 0)
+		{
+			_fsmtrie_lev_enter(&l, fr);
+		}
+
+		if ((c = _fsmtrie_lev_child(view, &l, fr, &child, &state)) < 0)
+		{
+			if (c == -2)
+			{
+				return (false);
+			}
+			if (i == 0)
+			{
+				break;
+			}
+			fr = &stack[--i];
+			continue;
+		}
+
+		if (_fsmtrie_view_leaf(view, child) &&
+				_fsmtrie_lev_dist(&l, state) <= max_dist)
+		{
+			cb(_fsmtrie_view_str(view, child),
+					_fsmtrie_lev_dist(&l, state), cbdata);
+		}
+
+		if (i < (int)depth)
+		{
+			fr = &stack[++i];
+			fr->node = child;
+			fr->state = state;
+			fr->pos = -1;
+		}
+	}
+
+	return (true);
+}
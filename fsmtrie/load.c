@@ -0,0 +1,420 @@
+/*
+ * Fast String Matcher Bulk Loading Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * Sorted keys share their prefix with the key before them, and a key only
+ * ever adds children to the right of the path of the previous key. The
+ * loader keeps that path (its nodes and code points) on a stack: a key
+ * starts from the node its common prefix with the previous key ends at,
+ * only the rest of the key is validated, and below a node created by the
+ * load itself there is nothing to look up since all of its children are
+ * smaller than the code point being added.
+ */
+
+/* initial read size of fsmtrie_bulk_load_fd(), doubled for longer lines */
+#define FSMTRIE_LOAD_BUFSIZ	(1 << 20)
+
+/* \cond */
+/* key source of fsmtrie_bulk_load_array() */
+struct _fsmtrie_load_array
+{
+	const char * const *keys;
+	const char * const *strs;
+	size_t nkeys;
+	size_t n;			/* next key */
+};
+
+/* key source of fsmtrie_bulk_load_fd() */
+struct _fsmtrie_load_fd
+{
+	int fd;
+	char *buf;
+	size_t size;			/* allocated */
+	size_t len;			/* read so far */
+	size_t pos;			/* start of next line */
+	bool eof;
+	int err;			/* errno of a failed read */
+};
+/* \endcond */
+
+static bool
+_fsmtrie_load_grow(struct fsmtrie *f, fsmtrie_node_t ***nodes,
+		unsigned char **path, size_t *size, size_t len)
+{
+	fsmtrie_node_t **n;
+	unsigned char *p;
+	size_t new_size;
+
+	if (len < *size)
+	{
+		return (true);
+	}
+	for (new_size = *size ? *size : 64; new_size <= len; new_size *= 2)
+		;
+	if ((n = realloc(*nodes, new_size * sizeof (*n))) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate path: %s", strerror(errno));
+		return (false);
+	}
+	*nodes = n;
+	if ((p = realloc(*path, new_size)) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate path: %s", strerror(errno));
+		return (false);
+	}
+	*path = p;
+	*size = new_size;
+
+	return (true);
+}
+
+static bool
+_fsmtrie_bulk_load(struct fsmtrie *f,
+		int (*cb)(const char **, size_t *, const char **, void *),
+		void *cbdata, const char *func)
+{
+	fsmtrie_node_t **nodes = NULL, *node, *next, *added;
+	unsigned char *path = NULL;
+	const unsigned char *key, *added_p;
+	const char *k, *str;
+	size_t size = 0, plen = 0, fresh = SIZE_MAX, nkeys, keylen, lcp, n;
+	bool ok = false;
+	int rc;
+
+	if (f->img != NULL)
+	{
+		_fsmtrie_error(f,
+				"%s() is incompatible with a read-only fsmtrie",
+				func);
+		return (false);
+	}
+	if (f->root == NULL && f->dawg == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (false);
+	}
+	if (f->mode != fsmtrie_mode_ascii && f->mode != fsmtrie_mode_eascii)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				func, _mode_to_str(f->mode));
+		return (false);
+	}
+
+	if (!_fsmtrie_load_grow(f, &nodes, &path, &size, 0))
+	{
+		return (false);
+	}
+	nodes[0] = _fsmtrie_wroot(f);
+	if (f->rcu != NULL)
+	{
+		nodes[0] = _fsmtrie_rcu_own(f, NULL, 0, nodes[0]);
+		if (nodes[0] == NULL)
+		{
+			_fsmtrie_error(f, "can't copy node: %s",
+					strerror(errno));
+			goto out;
+		}
+	}
+	else
+	{
+		/* compiling once afterwards beats updating links per key */
+		f->flags &= ~(FSMTRIE_AC_LINKS | FSMTRIE_AC_COMPILED);
+		_fsmtrie_symdel_drop(f);
+	}
+
+	for (nkeys = 0; (rc = cb(&k, &keylen, &str, cbdata)) == 1; nkeys++)
+	{
+		if (k == NULL)
+		{
+			_fsmtrie_error(f, "empty key");
+			goto out;
+		}
+		if (f->max_len > 0 && keylen > f->max_len)
+		{
+			_fsmtrie_error(f, "key too long (%zu > %d)",
+					keylen, f->max_len);
+			goto out;
+		}
+		key = (const unsigned char *)k;
+
+		for (lcp = 0; lcp < keylen && lcp < plen &&
+				key[lcp] == path[lcp]; lcp++)
+			;
+		if (lcp == keylen ? keylen < plen :
+				lcp < plen && key[lcp] < path[lcp])
+		{
+			_fsmtrie_error(f, "key %zu is out of order", nkeys);
+			goto out;
+		}
+
+		/* the common prefix was validated with the previous key */
+		if (f->mode == fsmtrie_mode_ascii)
+		{
+			for (n = lcp; n < keylen; n++)
+			{
+				if ((int)key[n] > f->nrnodes - 1)
+				{
+					_fsmtrie_error(f, "\"%d\" value at "
+							"position %zu out of "
+							"range", (int)key[n],
+							n);
+					goto out;
+				}
+			}
+		}
+		if (!_fsmtrie_load_grow(f, &nodes, &path, &size, keylen))
+		{
+			goto out;
+		}
+		if (f->dawg != NULL)
+		{
+			/* the DAWG keeps the path of the previous key itself */
+			memcpy(&path[lcp], &key[lcp], keylen - lcp);
+			plen = keylen;
+			if (!_fsmtrie_dawg_insert(f, k, keylen, str, func))
+			{
+				/* error set by _fsmtrie_dawg_insert() */
+				goto out;
+			}
+			continue;
+		}
+
+		if (fresh > lcp)
+		{
+			fresh = SIZE_MAX;
+		}
+		added = NULL;
+		added_p = NULL;
+		for (n = lcp, node = nodes[lcp]; n < keylen; n++)
+		{
+			next = n < fresh ? _fsmtrie_child(node, key[n]) :
+				NULL;
+			if (next != NULL && f->rcu != NULL)
+			{
+				next = _fsmtrie_rcu_own(f, node, key[n],
+						next);
+				if (next == NULL)
+				{
+					_fsmtrie_error(f,
+							"can't copy node: %s",
+							strerror(errno));
+					goto out;
+				}
+			}
+			else if (next == NULL)
+			{
+				if ((next = _fsmtrie_node_add(f, node,
+							key[n])) == NULL)
+				{
+					/* error set by _fsmtrie_node_add() */
+					goto out;
+				}
+				if (fresh == SIZE_MAX)
+				{
+					fresh = n + 1;
+				}
+				if (added == NULL)
+				{
+					added = node;
+					added_p = &key[n];
+				}
+			}
+			path[n] = key[n];
+			nodes[n + 1] = node = next;
+		}
+		plen = keylen;
+
+		/* duplicates keep the first key's string, like inserts */
+		if (node->type & FSMTRIE_NODE_LEAF)
+		{
+			continue;
+		}
+		node->type |= (FSMTRIE_NODE_LEAF | FSMTRIE_NODE_OUTPUT);
+
+		/* RCU links are kept up to date, see _fsmtrie_insert() */
+		if (f->rcu != NULL)
+		{
+			_fsmtrie_rcu_key(node)->type |= (FSMTRIE_NODE_LEAF |
+					FSMTRIE_NODE_OUTPUT);
+			if (f->flags & FSMTRIE_AC_LINKS)
+			{
+				_fsmtrie_ac_add(f, added, added_p,
+						&key[keylen], node);
+			}
+		}
+		if (str)
+		{
+			node->str = _fsmtrie_arena_strdup(&f->arena, str);
+			if (node->str == NULL)
+			{
+				_fsmtrie_error(f, "can't add node str: %s",
+						strerror(errno));
+				goto out;
+			}
+		}
+		f->key_cnt++;
+	}
+	if (rc != 0)
+	{
+		_fsmtrie_error(f, "key %zu: key source failed", nkeys);
+		goto out;
+	}
+	ok = true;
+
+out:
+	free(nodes);
+	free(path);
+	return (ok);
+}
+
+bool
+fsmtrie_bulk_load(struct fsmtrie *f,
+		int (*cb)(const char **, size_t *, const char **, void *),
+		void *cbdata)
+{
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	return (_fsmtrie_bulk_load(f, cb, cbdata, __func__));
+}
+
+static int
+_fsmtrie_load_array_next(const char **key, size_t *keylen, const char **str,
+		void *data)
+{
+	struct _fsmtrie_load_array *a = data;
+
+	if (a->n == a->nkeys)
+	{
+		return (0);
+	}
+	*key = a->keys[a->n];
+	*keylen = *key != NULL ? strlen(*key) : 0;
+	*str = a->strs != NULL ? a->strs[a->n] : NULL;
+	a->n++;
+
+	return (1);
+}
+
+bool
+fsmtrie_bulk_load_array(struct fsmtrie *f, const char * const *keys,
+		const char * const *strs, size_t nkeys)
+{
+	struct _fsmtrie_load_array a = { keys, strs, nkeys, 0 };
+
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	return (_fsmtrie_bulk_load(f, _fsmtrie_load_array_next, &a, __func__));
+}
+
+static int
+_fsmtrie_load_fd_next(const char **key, size_t *keylen, const char **str,
+		void *data)
+{
+	struct _fsmtrie_load_fd *r = data;
+	char *nl, *buf;
+	ssize_t n;
+
+	*str = NULL;
+	for (;;)
+	{
+		nl = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+		if (nl != NULL || (r->eof && r->pos < r->len))
+		{
+			*key = r->buf + r->pos;
+			*keylen = (nl != NULL ? nl : r->buf + r->len) - *key;
+			r->pos += *keylen + (nl != NULL);
+			if (*keylen == 0)
+			{
+				/* skip empty lines */
+				continue;
+			}
+			return (1);
+		}
+		if (r->eof)
+		{
+			return (0);
+		}
+
+		/* keep the partial line, the key handed out last is done */
+		memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+		r->len -= r->pos;
+		r->pos = 0;
+		if (r->len == r->size)
+		{
+			if ((buf = realloc(r->buf, r->size * 2)) == NULL)
+			{
+				r->err = errno;
+				return (-1);
+			}
+			r->buf = buf;
+			r->size *= 2;
+		}
+
+		n = read(r->fd, r->buf + r->len, r->size - r->len);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			r->err = errno;
+			return (-1);
+		}
+		r->eof = n == 0;
+		r->len += n;
+	}
+}
+
+bool
+fsmtrie_bulk_load_fd(struct fsmtrie *f, int fd)
+{
+	struct _fsmtrie_load_fd r;
+	bool ok;
+
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	memset(&r, 0, sizeof (r));
+	r.fd = fd;
+	r.size = FSMTRIE_LOAD_BUFSIZ;
+	if ((r.buf = malloc(r.size)) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate buffer: %s",
+				strerror(errno));
+		return (false);
+	}
+
+	ok = _fsmtrie_bulk_load(f, _fsmtrie_load_fd_next, &r, __func__);
+	if (!ok && r.err != 0)
+	{
+		_fsmtrie_error(f, "can't read keys: %s", strerror(r.err));
+	}
+	free(r.buf);
+
+	return (ok);
+}
@@ -0,0 +1,663 @@
+/*
+ * Fast String Matcher LOUDS Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * Level-order unary degree sequence (Jacobson, "Space-efficient Static
+ * Trees and Graphs", 1989) of a trie.
+ *
+ * Nodes are numbered in level order, the root being 0, and each node in
+ * turn is written as one 1 bit per child followed by a 0 bit, so the tree
+ * takes two bits per node. The k-th 1 bit stands for node k + 1 and the
+ * children of node n follow the n-th 0 bit: with select0(n) the position
+ * of that bit, they are the nodes select0(n) - n + 2 onward, one per 1 bit
+ * up to the next 0 bit. Labels are kept in level order as well, so the
+ * labels of the children of a node are contiguous and sorted.
+ *
+ * The bit vectors have a rank directory of one count per block of
+ * FSMTRIE_LOUDS_BLOCK bits (a sixteenth of a bit per bit), select0() starts
+ * from the block holding every FSMTRIE_LOUDS_ZSAMPLE-th 0 bit. Leaves and
+ * leaves with a string are bit vectors too, leaf strings are packed back to
+ * back with the offset of every FSMTRIE_LOUDS_SBLOCK-th one.
+ */
+
+#define FSMTRIE_LOUDS_BLOCK	512	/* bits per rank directory entry */
+#define FSMTRIE_LOUDS_ZSAMPLE	512	/* 0 bits per select0() sample */
+#define FSMTRIE_LOUDS_SBLOCK	16	/* strings per offset */
+
+/* \cond */
+/* a bit vector with a rank directory */
+struct _fsmtrie_louds_bv
+{
+	uint64_t *bits;
+	uint32_t *rank;			/* 1 bits before every block */
+	uint64_t nbits;
+};
+
+struct fsmtrie_louds
+{
+	struct _fsmtrie_louds_bv tree;	/* degree of every node */
+	uint32_t *zsel;			/* block of every sampled 0 bit */
+	struct _fsmtrie_louds_bv leaf;	/* node is a leaf */
+	struct _fsmtrie_louds_bv hstr;	/* leaf has a string */
+	uint8_t *labels;		/* label of every node but the root */
+	char *strs;			/* leaf strings */
+	uint64_t *soff;			/* offsets of every block of strings */
+	size_t strs_len;
+	uint32_t nnodes;
+	uint32_t nstrs;
+	bool pm;			/* FSMTRIE_PM_OK */
+};
+
+/* an encoding being written, see _fsmtrie_louds_build() */
+struct _fsmtrie_louds_build
+{
+	struct fsmtrie_buf queue;	/* references of nodes, level order */
+	struct fsmtrie_buf tree, leaf, hstr;
+	uint64_t ntree, nleaf, nhstr;
+	struct fsmtrie_buf labels;
+	struct fsmtrie_buf strs, soff;
+	size_t strs_len;
+	uint32_t nnodes, nstrs;
+};
+/* \endcond */
+
+/* number of 1 bits before position pos */
+static inline uint64_t
+_fsmtrie_louds_rank(const struct _fsmtrie_louds_bv *bv, uint64_t pos)
+{
+	uint64_t w, r;
+
+	r = bv->rank[pos / FSMTRIE_LOUDS_BLOCK];
+	for (w = pos / FSMTRIE_LOUDS_BLOCK * (FSMTRIE_LOUDS_BLOCK / 64);
+			w < pos / 64; w++)
+	{
+		r += __builtin_popcountll(bv->bits[w]);
+	}
+	if (pos % 64)
+	{
+		r += __builtin_popcountll(bv->bits[pos / 64] &
+				((1ULL << (pos % 64)) - 1));
+	}
+	return (r);
+}
+
+static inline bool
+_fsmtrie_louds_bit(const struct _fsmtrie_louds_bv *bv, uint64_t pos)
+{
+	return ((bv->bits[pos / 64] >> (pos % 64)) & 1);
+}
+
+/* position of the j-th 0 bit of the tree, j > 0 */
+static uint64_t
+_fsmtrie_louds_select0(const struct fsmtrie_louds *l, uint64_t j)
+{
+	const struct _fsmtrie_louds_bv *bv = &l->tree;
+	uint64_t b, w, word, nblocks;
+	int z;
+
+	/* the block, 0 bits before a block are its bits that aren't 1 */
+	nblocks = bv->nbits / FSMTRIE_LOUDS_BLOCK + 1;
+	b = l->zsel[(j - 1) / FSMTRIE_LOUDS_ZSAMPLE];
+	while (b + 1 < nblocks &&
+			(b + 1) * FSMTRIE_LOUDS_BLOCK - bv->rank[b + 1] < j)
+	{
+		b++;
+	}
+	j -= b * FSMTRIE_LOUDS_BLOCK - bv->rank[b];
+
+	/* the word, then the bit */
+	for (w = b * (FSMTRIE_LOUDS_BLOCK / 64); ; w++)
+	{
+		word = ~bv->bits[w];
+		z = __builtin_popcountll(word);
+		if (j <= (uint64_t)z)
+		{
+			break;
+		}
+		j -= z;
+	}
+	while (--j > 0)
+	{
+		word &= word - 1;
+	}
+	return (w * 64 + __builtin_ctzll(word));
+}
+
+/* position of the first 0 bit of the tree at or after pos */
+static inline uint64_t
+_fsmtrie_louds_next0(const struct _fsmtrie_louds_bv *bv, uint64_t pos)
+{
+	uint64_t w, word;
+
+	/* every node ends in a 0 bit, so there is one */
+	w = pos / 64;
+	word = ~bv->bits[w] >> (pos % 64);
+	if (word != 0)
+	{
+		return (pos + __builtin_ctzll(word));
+	}
+	for (w++; (word = ~bv->bits[w]) == 0; w++)
+		;
+	return (w * 64 + __builtin_ctzll(word));
+}
+
+/* the child of node n with label c, FSMTRIE_INONE if none */
+static uint32_t
+_fsmtrie_louds_child(const struct fsmtrie_louds *l, uint32_t n,
+		unsigned int c)
+{
+	uint64_t start;
+	uint32_t lo, hi, mid, end;
+
+	start = n == 0 ? 0 : _fsmtrie_louds_select0(l, n) + 1;
+	lo = start - n + 1;
+	end = hi = lo + (_fsmtrie_louds_next0(&l->tree, start) - start);
+	while (lo < hi)
+	{
+		mid = lo + (hi - lo) / 2;
+		if (l->labels[mid] < c)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if (lo < end && l->labels[lo] == c)
+	{
+		return (lo);
+	}
+	return (FSMTRIE_INONE);
+}
+
+static inline bool
+_fsmtrie_louds_leaf(const struct fsmtrie_louds *l, uint32_t n)
+{
+	return (_fsmtrie_louds_bit(&l->leaf, n));
+}
+
+/* the string of leaf n, NULL if none */
+static const char *
+_fsmtrie_louds_str(const struct fsmtrie_louds *l, uint32_t n)
+{
+	const char *p;
+	uint64_t r;
+
+	r = _fsmtrie_louds_rank(&l->leaf, n);
+	if (!_fsmtrie_louds_bit(&l->hstr, r))
+	{
+		return (NULL);
+	}
+	r = _fsmtrie_louds_rank(&l->hstr, r);
+	p = &l->strs[l->soff[r / FSMTRIE_LOUDS_SBLOCK]];
+	for (r %= FSMTRIE_LOUDS_SBLOCK; r > 0; r--)
+	{
+		p += strlen(p) + 1;
+	}
+	return (p);
+}
+
+/* append a bit to bit vector b holding *nbits bits */
+static bool
+_fsmtrie_louds_push(struct fsmtrie_buf *b, uint64_t *nbits, bool bit)
+{
+	uint64_t *w;
+
+	if (*nbits % 64 == 0)
+	{
+		w = _fsmtrie_buf_reserve(b, (*nbits / 64 + 1) * sizeof (*w));
+		if (w == NULL)
+		{
+			return (false);
+		}
+		w[*nbits / 64] = 0;
+	}
+	if (bit)
+	{
+		((uint64_t *)b->p)[*nbits / 64] |= 1ULL << (*nbits % 64);
+	}
+	(*nbits)++;
+	return (true);
+}
+
+/* append a leaf string */
+static bool
+_fsmtrie_louds_str_add(struct _fsmtrie_louds_build *b, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	uint64_t *soff;
+
+	if (b->nstrs % FSMTRIE_LOUDS_SBLOCK == 0)
+	{
+		soff = _fsmtrie_buf_reserve(&b->soff,
+				(b->nstrs / FSMTRIE_LOUDS_SBLOCK + 1) *
+				sizeof (*soff));
+		if (soff == NULL)
+		{
+			return (false);
+		}
+		soff[b->nstrs / FSMTRIE_LOUDS_SBLOCK] = b->strs_len;
+	}
+	if (_fsmtrie_buf_reserve(&b->strs, b->strs_len + len) == NULL)
+	{
+		return (false);
+	}
+	memcpy((char *)b->strs.p + b->strs_len, str, len);
+	b->strs_len += len;
+	b->nstrs++;
+	return (true);
+}
+
+/* encode the trie seen through view v in level order */
+static bool
+_fsmtrie_louds_build(struct _fsmtrie_louds_build *b,
+		const struct fsmtrie_view *v)
+{
+	fsmtrie_ref_t n, child;
+	const char *str;
+	uint8_t *labels;
+	bool leaf;
+	uint32_t i;
+	int c;
+
+	if (_fsmtrie_buf_reserve(&b->queue, sizeof (n)) == NULL ||
+			_fsmtrie_buf_reserve(&b->labels, 1) == NULL)
+	{
+		return (false);
+	}
+	((fsmtrie_ref_t *)b->queue.p)[0] = _fsmtrie_view_root(v);
+	((uint8_t *)b->labels.p)[0] = 0;
+	b->nnodes = 1;
+
+	for (i = 0; i < b->nnodes; i++)
+	{
+		n = ((fsmtrie_ref_t *)b->queue.p)[i];
+
+		leaf = _fsmtrie_view_leaf(v, n);
+		if (!_fsmtrie_louds_push(&b->leaf, &b->nleaf, leaf))
+		{
+			return (false);
+		}
+		if (leaf)
+		{
+			str = _fsmtrie_view_str(v, n);
+			if (!_fsmtrie_louds_push(&b->hstr, &b->nhstr,
+						str != NULL) ||
+					(str != NULL &&
+					 !_fsmtrie_louds_str_add(b, str)))
+			{
+				return (false);
+			}
+		}
+
+		for (c = 0; (c = _fsmtrie_view_next(v, n, c, &child)) >= 0;
+				c++)
+		{
+			if (b->nnodes >= UINT32_MAX / 2)
+			{
+				errno = EFBIG;
+				return (false);
+			}
+			if (_fsmtrie_buf_reserve(&b->queue, (b->nnodes + 1) *
+						sizeof (n)) == NULL ||
+					(labels = _fsmtrie_buf_reserve(
+						&b->labels,
+						b->nnodes + 1)) == NULL ||
+					!_fsmtrie_louds_push(&b->tree,
+						&b->ntree, true))
+			{
+				return (false);
+			}
+			((fsmtrie_ref_t *)b->queue.p)[b->nnodes] = child;
+			labels[b->nnodes++] = c;
+		}
+		if (!_fsmtrie_louds_push(&b->tree, &b->ntree, false))
+		{
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/* take over the bits of a built bit vector and index them */
+static bool
+_fsmtrie_louds_bv_index(struct _fsmtrie_louds_bv *bv, struct fsmtrie_buf *b,
+		uint64_t nbits)
+{
+	uint64_t blk, w, r, nwords;
+	void *p;
+
+	/* the bits written and the rest of the last word, or a word of 0 */
+	nwords = nbits / 64 + 1;
+	if (_fsmtrie_buf_reserve(b, nwords * sizeof (uint64_t)) == NULL)
+	{
+		return (false);
+	}
+	if (nbits % 64 == 0)
+	{
+		((uint64_t *)b->p)[nwords - 1] = 0;
+	}
+	if ((p = realloc(b->p, nwords * sizeof (uint64_t))) != NULL)
+	{
+		b->p = p;
+	}
+	bv->bits = b->p;
+	bv->nbits = nbits;
+	b->p = NULL;
+
+	bv->rank = malloc((nbits / FSMTRIE_LOUDS_BLOCK + 1) *
+			sizeof (*bv->rank));
+	if (bv->rank == NULL)
+	{
+		return (false);
+	}
+	for (blk = 0, r = 0; blk <= nbits / FSMTRIE_LOUDS_BLOCK; blk++)
+	{
+		bv->rank[blk] = r;
+		for (w = blk * (FSMTRIE_LOUDS_BLOCK / 64);
+				w < (blk + 1) * (FSMTRIE_LOUDS_BLOCK / 64) &&
+				w < nwords; w++)
+		{
+			r += __builtin_popcountll(bv->bits[w]);
+		}
+	}
+	return (true);
+}
+
+/* sample the block of every FSMTRIE_LOUDS_ZSAMPLE-th 0 bit of the tree */
+static bool
+_fsmtrie_louds_zsel(struct fsmtrie_louds *l)
+{
+	const struct _fsmtrie_louds_bv *bv = &l->tree;
+	uint64_t b, j, nblocks;
+	uint32_t k;
+
+	/* one 0 bit per node */
+	l->zsel = malloc(((l->nnodes - 1) / FSMTRIE_LOUDS_ZSAMPLE + 1) *
+			sizeof (*l->zsel));
+	if (l->zsel == NULL)
+	{
+		return (false);
+	}
+	nblocks = bv->nbits / FSMTRIE_LOUDS_BLOCK + 1;
+	for (k = 0, b = 0; k <= (l->nnodes - 1) / FSMTRIE_LOUDS_ZSAMPLE; k++)
+	{
+		j = (uint64_t)k * FSMTRIE_LOUDS_ZSAMPLE + 1;
+		while (b + 1 < nblocks &&
+				(b + 1) * FSMTRIE_LOUDS_BLOCK -
+				bv->rank[b + 1] < j)
+		{
+			b++;
+		}
+		l->zsel[k] = b;
+	}
+	return (true);
+}
+
+static void
+_fsmtrie_louds_shrink(void **p, size_t size)
+{
+	void *q;
+
+	if (size > 0 && (q = realloc(*p, size)) != NULL)
+	{
+		*p = q;
+	}
+}
+
+static bool
+_fsmtrie_louds_finish(struct fsmtrie_louds *l,
+		struct _fsmtrie_louds_build *b)
+{
+	l->nnodes = b->nnodes;
+	l->nstrs = b->nstrs;
+	l->strs_len = b->strs_len;
+
+	_fsmtrie_louds_shrink(&b->labels.p, b->nnodes);
+	l->labels = b->labels.p;
+	b->labels.p = NULL;
+	_fsmtrie_louds_shrink(&b->strs.p, b->strs_len);
+	l->strs = b->strs.p;
+	b->strs.p = NULL;
+	_fsmtrie_louds_shrink(&b->soff.p,
+			(b->nstrs + FSMTRIE_LOUDS_SBLOCK - 1) /
+			FSMTRIE_LOUDS_SBLOCK * sizeof (*l->soff));
+	l->soff = b->soff.p;
+	b->soff.p = NULL;
+
+	return (_fsmtrie_louds_bv_index(&l->tree, &b->tree, b->ntree) &&
+			_fsmtrie_louds_bv_index(&l->leaf, &b->leaf, b->nleaf) &&
+			_fsmtrie_louds_bv_index(&l->hstr, &b->hstr, b->nhstr) &&
+			_fsmtrie_louds_zsel(l));
+}
+
+struct fsmtrie_louds *
+fsmtrie_louds_export(struct fsmtrie *f)
+{
+	struct _fsmtrie_louds_build b;
+	struct fsmtrie_louds *l;
+	struct fsmtrie_view view;
+	struct fsmtrie_rcu_pin pin;
+	bool ok;
+
+	if (f == NULL)
+	{
+		return (NULL);
+	}
+
+	if (_fsmtrie_root(f) == NULL && f->img == NULL && f->dawg == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (NULL);
+	}
+
+	if (f->mode != fsmtrie_mode_ascii && f->mode != fsmtrie_mode_eascii)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				__func__, _mode_to_str(f->mode));
+		return (NULL);
+	}
+
+	if (f->dawg != NULL && !_fsmtrie_dawg_seal(f))
+	{
+		/* error set by _fsmtrie_dawg_seal() */
+		return (NULL);
+	}
+
+	if ((l = calloc(1, sizeof (*l))) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate LOUDS trie: %s",
+				strerror(errno));
+		return (NULL);
+	}
+	l->pm = f->flags & FSMTRIE_PM_OK;
+
+	memset(&b, 0, sizeof (b));
+	_fsmtrie_rcu_enter(f, &pin);
+	_fsmtrie_view_init(&view, f);
+	ok = _fsmtrie_louds_build(&b, &view);
+	_fsmtrie_rcu_exit(&pin);
+	free(b.queue.p);
+
+	if (!ok || !_fsmtrie_louds_finish(l, &b))
+	{
+		_fsmtrie_error(f, "can't encode LOUDS trie: %s",
+				strerror(errno));
+		free(b.tree.p);
+		free(b.leaf.p);
+		free(b.hstr.p);
+		free(b.labels.p);
+		free(b.strs.p);
+		free(b.soff.p);
+		fsmtrie_louds_destroy(&l);
+		return (NULL);
+	}
+
+	return (l);
+}
+
+static int
+_fsmtrie_louds_search(const struct fsmtrie_louds *l, const char *key,
+		size_t keylen, const char **str)
+{
+	const unsigned char *p, *end;
+	uint32_t n;
+
+	if (l == NULL || key == NULL)
+	{
+		return (-1);
+	}
+
+	*str = NULL;
+	end = (const unsigned char *)key + keylen;
+	for (p = (const unsigned char *)key, n = 0; p < end; p++)
+	{
+		if ((n = _fsmtrie_louds_child(l, n, *p)) == FSMTRIE_INONE)
+		{
+			/* no match */
+			return (0);
+		}
+	}
+	if (_fsmtrie_louds_leaf(l, n))
+	{
+		*str = _fsmtrie_louds_str(l, n);
+		return (1);
+	}
+	return (l->pm ? 1 : 0);
+}
+
+int
+fsmtrie_louds_search(struct fsmtrie_louds *l, const char *key,
+		const char **str)
+{
+	return (_fsmtrie_louds_search(l, key, key != NULL ? strlen(key) : 0,
+				str));
+}
+
+int
+fsmtrie_louds_search_n(struct fsmtrie_louds *l, const char *key,
+		size_t keylen, const char **str)
+{
+	return (_fsmtrie_louds_search(l, key, keylen, str));
+}
+
+/*
+ * Without failure links (four bytes a node), a substring search walks the
+ * trie from every offset of the subject in turn, which takes time
+ * proportional to the subject times the depth of the trie.
+ */
+static int
+_fsmtrie_louds_search_substring(const struct fsmtrie_louds *l,
+		const char *str, size_t len,
+		void (*cb)(const char *, int, void *), void *cbdata)
+{
+	const unsigned char *s = (const unsigned char *)str;
+	size_t off, i;
+	uint32_t n;
+
+	if (l == NULL || str == NULL || cb == NULL)
+	{
+		return (-1);
+	}
+
+	for (off = 0; off < len; off++)
+	{
+		for (i = off, n = 0; i < len; i++)
+		{
+			if ((n = _fsmtrie_louds_child(l, n, s[i])) ==
+					FSMTRIE_INONE)
+			{
+				break;
+			}
+			if (_fsmtrie_louds_leaf(l, n))
+			{
+				cb(_fsmtrie_louds_str(l, n), (int)off, cbdata);
+			}
+		}
+	}
+	return (1);
+}
+
+int
+fsmtrie_louds_search_substring(struct fsmtrie_louds *l, const char *str,
+		void (*cb)(const char *, int, void *), void *cbdata)
+{
+	return (_fsmtrie_louds_search_substring(l, str,
+				str != NULL ? strlen(str) : 0, cb, cbdata));
+}
+
+int
+fsmtrie_louds_search_substring_n(struct fsmtrie_louds *l, const char *str,
+		size_t len, void (*cb)(const char *, int, void *),
+		void *cbdata)
+{
+	return (_fsmtrie_louds_search_substring(l, str, len, cb, cbdata));
+}
+
+uint32_t
+fsmtrie_louds_get_nodecnt(struct fsmtrie_louds *l)
+{
+	/* not counting the root, like fsmtrie_get_nodecnt() */
+	return (l->nnodes - 1);
+}
+
+size_t
+fsmtrie_louds_get_size(struct fsmtrie_louds *l)
+{
+	const struct _fsmtrie_louds_bv *bvs[] = { &l->tree, &l->leaf,
+		&l->hstr };
+	size_t size;
+	int i;
+
+	size = sizeof (*l) + l->nnodes + l->strs_len +
+		(l->nstrs + FSMTRIE_LOUDS_SBLOCK - 1) / FSMTRIE_LOUDS_SBLOCK *
+		sizeof (*l->soff) +
+		((l->nnodes - 1) / FSMTRIE_LOUDS_ZSAMPLE + 1) *
+		sizeof (*l->zsel);
+	for (i = 0; i < 3; i++)
+	{
+		size += (bvs[i]->nbits / 64 + 1) * sizeof (uint64_t) +
+			(bvs[i]->nbits / FSMTRIE_LOUDS_BLOCK + 1) *
+			sizeof (uint32_t);
+	}
+	return (size);
+}
+
+void
+fsmtrie_louds_destroy(struct fsmtrie_louds **l)
+{
+	if (*l == NULL)
+	{
+		return;
+	}
+	free((*l)->tree.bits);
+	free((*l)->tree.rank);
+	free((*l)->zsel);
+	free((*l)->leaf.bits);
+	free((*l)->leaf.rank);
+	free((*l)->hstr.bits);
+	free((*l)->hstr.rank);
+	free((*l)->labels);
+	free((*l)->strs);
+	free((*l)->soff);
+	free(*l);
+	*l = NULL;
+}
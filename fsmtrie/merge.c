@@ -0,0 +1,492 @@
+/*
+ * Fast String Matcher Merging and Parallel Construction Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * Two tries are merged by walking them from the root at once. Wherever the
+ * source has a child the destination lacks, the source's whole subtree is
+ * grafted as is; elsewhere the walk goes on below. The source's arena is
+ * handed over to the destination first, so grafted nodes and leaf strings
+ * stay where they are.
+ *
+ * The parallel builder partitions keys by their leading byte (or token),
+ * so the tries built by different threads have nothing in common below the
+ * root and merging them mostly comes down to grafting root children.
+ */
+
+/* key groups: one per leading byte or token hash, one for the empty key */
+#define FSMTRIE_PAR_GROUPS	257
+
+/* \cond */
+struct _fsmtrie_par
+{
+	const char * const *keys;
+	const uint32_t * const *tkeys;	/* token keys, if any */
+	const size_t *keylens;		/* lengths of token keys */
+	const char * const *strs;
+	size_t *order;			/* key indexes, grouped */
+	size_t start[FSMTRIE_PAR_GROUPS + 1];	/* groups in order */
+	unsigned int groups[FSMTRIE_PAR_GROUPS];	/* largest first */
+	unsigned int next;		/* next entry of groups to build */
+	pthread_mutex_t lock;
+	bool failed;
+	size_t err_key;			/* key that failed */
+	char err[BUFSIZ];		/* why it failed */
+};
+
+struct _fsmtrie_par_worker
+{
+	struct _fsmtrie_par *par;
+	struct fsmtrie *shard;		/* trie built by the worker */
+	pthread_t thread;
+	bool started;
+};
+/* \endcond */
+
+static void
+_fsmtrie_merge_leaf(struct fsmtrie *dst, fsmtrie_node_t *d,
+		const fsmtrie_node_t *s)
+{
+	if ((s->type & FSMTRIE_NODE_LEAF) == 0)
+	{
+		return;
+	}
+	if (d->type & FSMTRIE_NODE_LEAF)
+	{
+		/* a duplicate key, dst's string stays */
+		dst->key_cnt--;
+		if (dst->mode == fsmtrie_mode_token)
+		{
+			/* token tries count a node per key */
+			dst->node_cnt--;
+		}
+		return;
+	}
+	d->type |= (FSMTRIE_NODE_LEAF | FSMTRIE_NODE_OUTPUT);
+	d->str = s->str;
+}
+
+static bool
+_fsmtrie_merge_node(struct fsmtrie *dst, fsmtrie_node_t *d,
+		fsmtrie_node_t *s)
+{
+	fsmtrie_node_t *dchild, *schild;
+	int c;
+
+	_fsmtrie_merge_leaf(dst, d, s);
+	for (c = _fsmtrie_child_next(s, 0, &schild); c >= 0;
+			c = _fsmtrie_child_next(s, c + 1, &schild))
+	{
+		if ((dchild = _fsmtrie_child(d, c)) != NULL)
+		{
+			/* the source node is superseded by dst's */
+			dst->node_cnt--;
+			if (!_fsmtrie_merge_node(dst, dchild, schild))
+			{
+				return (false);
+			}
+		}
+		else if (!_fsmtrie_tab_add(&dst->arena, d, c, schild))
+		{
+			_fsmtrie_error(dst, "can't add node: %s",
+					strerror(errno));
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+/*
+ * Token nodes keep their children inline and move when they grow, so the
+ * reference to the destination node is updated in place.
+ */
+static bool
+_fsmtrie_merge_token(struct fsmtrie *dst, struct fsmtrie *src,
+		fsmtrie_node_t **dp, fsmtrie_node_t *s)
+{
+	fsmtrie_node_t *d = *dp;
+	bool root = s == src->root;
+	size_t n, nnodes, idx;
+	int rc;
+
+	_fsmtrie_merge_leaf(dst, d, s);
+	nnodes = root ? src->nrnodes : s->nnodes;
+	for (n = 0; n < nnodes; n++)
+	{
+		rc = _fsmtrie_get_token_idx(&dst->arena, &d,
+				root ? dst->nrnodes : d->nnodes,
+				s->nodes[n]->tval, true, &idx);
+		*dp = d;
+		if (rc < 0)
+		{
+			_fsmtrie_error(dst, "can't insert token into node");
+			return (false);
+		}
+		if (rc > 0)
+		{
+			d->nodes[idx] = s->nodes[n];
+			if (root)
+			{
+				dst->nrnodes++;
+			}
+			else
+			{
+				d->nnodes++;
+			}
+		}
+		else if (!_fsmtrie_merge_token(dst, src, &d->nodes[idx],
+					s->nodes[n]))
+		{
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+bool
+fsmtrie_merge(struct fsmtrie *dst, struct fsmtrie **src)
+{
+	struct fsmtrie *s;
+	bool ok;
+
+	if (dst == NULL || src == NULL || *src == NULL)
+	{
+		return (false);
+	}
+	s = *src;
+
+	if (s == dst)
+	{
+		_fsmtrie_error(dst, "can't merge an fsmtrie into itself");
+		return (false);
+	}
+	if (dst->img != NULL || s->img != NULL)
+	{
+		_fsmtrie_error(dst,
+				"%s() is incompatible with a read-only fsmtrie",
+				__func__);
+		return (false);
+	}
+	if (dst->dawg != NULL || s->dawg != NULL)
+	{
+		_fsmtrie_error(dst, "%s() is incompatible with DAWG fsmtries",
+				__func__);
+		return (false);
+	}
+	if (dst->root == NULL || s->root == NULL)
+	{
+		_fsmtrie_error(dst, "uninitialized trie");
+		return (false);
+	}
+	if (dst->rcu != NULL || s->rcu != NULL)
+	{
+		_fsmtrie_error(dst, "%s() is incompatible with RCU fsmtries",
+				__func__);
+		return (false);
+	}
+	if (dst->mode != s->mode)
+	{
+		_fsmtrie_error(dst, "can't merge %s mode fsmtrie into %s mode "
+				"fsmtrie", _mode_to_str(s->mode),
+				_mode_to_str(dst->mode));
+		return (false);
+	}
+	if (dst->max_len > 0 && (s->max_len == 0 || s->max_len > dst->max_len))
+	{
+		_fsmtrie_error(dst, "source keys may be too long (max %d)",
+				dst->max_len);
+		return (false);
+	}
+
+	/* from here on the source is taken apart, whatever happens */
+	_fsmtrie_arena_merge(&dst->arena, &s->arena);
+	dst->key_cnt += s->key_cnt;
+	dst->node_cnt += s->node_cnt;
+	if (s->depth > dst->depth)
+	{
+		dst->depth = s->depth;
+	}
+	if (dst->mode == fsmtrie_mode_token)
+	{
+		ok = _fsmtrie_merge_token(dst, s, &dst->root, s->root);
+	}
+	else
+	{
+		ok = _fsmtrie_merge_node(dst, dst->root, s->root);
+	}
+
+	/* The trie needs Aho-Corasick info updated after insertion. */
+	dst->flags &= ~(FSMTRIE_AC_LINKS | FSMTRIE_AC_COMPILED);
+	_fsmtrie_symdel_drop(dst);
+
+	fsmtrie_destroy(src);
+	return (ok);
+}
+
+static void *
+_fsmtrie_par_work(void *arg)
+{
+	struct _fsmtrie_par_worker *w = arg;
+	struct _fsmtrie_par *par = w->par;
+	unsigned int g;
+	size_t n, k;
+	bool ok;
+
+	while ((g = __atomic_fetch_add(&par->next, 1, __ATOMIC_RELAXED)) <
+			FSMTRIE_PAR_GROUPS)
+	{
+		g = par->groups[g];
+		for (n = par->start[g]; n < par->start[g + 1]; n++)
+		{
+			k = par->order[n];
+			if (par->tkeys != NULL)
+			{
+				ok = fsmtrie_insert_token(w->shard,
+						(uint32_t *)(uintptr_t)
+						par->tkeys[k], par->keylens[k],
+						par->strs ? par->strs[k] : NULL);
+			}
+			else
+			{
+				ok = fsmtrie_insert(w->shard, par->keys[k],
+						par->strs ? par->strs[k] : NULL);
+			}
+			if (ok)
+			{
+				continue;
+			}
+
+			/* the error is kept with the shard in this thread */
+			pthread_mutex_lock(&par->lock);
+			if (!par->failed)
+			{
+				par->failed = true;
+				par->err_key = k;
+				snprintf(par->err, sizeof (par->err), "%s",
+						fsmtrie_get_error(w->shard));
+			}
+			__atomic_store_n(&par->next, FSMTRIE_PAR_GROUPS,
+					__ATOMIC_RELAXED);
+			pthread_mutex_unlock(&par->lock);
+			return (NULL);
+		}
+	}
+
+	return (NULL);
+}
+
+static unsigned int
+_fsmtrie_par_group(const struct _fsmtrie_par *par, size_t k)
+{
+	if (par->tkeys != NULL)
+	{
+		return (par->keylens[k] > 0 ?
+				par->tkeys[k][0] % (FSMTRIE_PAR_GROUPS - 1) :
+				FSMTRIE_PAR_GROUPS - 1);
+	}
+	return (par->keys[k] != NULL && par->keys[k][0] != '\0' ?
+			(unsigned char)par->keys[k][0] :
+			FSMTRIE_PAR_GROUPS - 1);
+}
+
+static bool
+_fsmtrie_insert_parallel(struct fsmtrie *f, struct _fsmtrie_par *par,
+		size_t nkeys, unsigned int nthreads, const char *func)
+{
+	struct _fsmtrie_par_worker *workers;
+	struct fsmtrie_opt o;
+	char err_buf[BUFSIZ];
+	size_t n, fill[FSMTRIE_PAR_GROUPS];
+	unsigned int g, i, t;
+	long ncpus;
+	bool ok = true;
+
+	if (f->img != NULL)
+	{
+		_fsmtrie_error(f,
+				"%s() is incompatible with a read-only fsmtrie",
+				func);
+		return (false);
+	}
+	if (f->dawg != NULL)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with DAWG fsmtries",
+				func);
+		return (false);
+	}
+	if (f->root == NULL)
+	{
+		_fsmtrie_error(f, "uninitialized trie");
+		return (false);
+	}
+	if ((f->mode == fsmtrie_mode_token) != (par->tkeys != NULL))
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+				func, _mode_to_str(f->mode));
+		return (false);
+	}
+	if (f->rcu != NULL)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with RCU fsmtries",
+				func);
+		return (false);
+	}
+
+	if (nthreads == 0)
+	{
+		ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? ncpus : 1;
+	}
+	if (nthreads > FSMTRIE_PAR_GROUPS)
+	{
+		nthreads = FSMTRIE_PAR_GROUPS;
+	}
+
+	/* group the keys, counting sort style */
+	if ((par->order = malloc((nkeys ? nkeys : 1) *
+					sizeof (*par->order))) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate key order: %s",
+				strerror(errno));
+		return (false);
+	}
+	for (n = 0; n < nkeys; n++)
+	{
+		par->start[_fsmtrie_par_group(par, n) + 1]++;
+	}
+	for (g = 0; g < FSMTRIE_PAR_GROUPS; g++)
+	{
+		par->start[g + 1] += par->start[g];
+		fill[g] = par->start[g];
+	}
+	for (n = 0; n < nkeys; n++)
+	{
+		par->order[fill[_fsmtrie_par_group(par, n)]++] = n;
+	}
+
+	/* build the large groups first so the small ones fill the gaps */
+	for (g = 0; g < FSMTRIE_PAR_GROUPS; g++)
+	{
+		for (i = g; i > 0 && par->start[par->groups[i - 1] + 1] -
+				par->start[par->groups[i - 1]] <
+				par->start[g + 1] - par->start[g]; i--)
+		{
+			par->groups[i] = par->groups[i - 1];
+		}
+		par->groups[i] = g;
+	}
+
+	if ((workers = calloc(nthreads, sizeof (*workers))) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate workers: %s",
+				strerror(errno));
+		free(par->order);
+		return (false);
+	}
+	memset(&o, 0, sizeof (o));
+	o.mode = f->mode;
+	o.max_len = f->max_len;
+	for (t = 0; t < nthreads; t++)
+	{
+		workers[t].par = par;
+		workers[t].shard = fsmtrie_init(&o, err_buf, sizeof (err_buf));
+		if (workers[t].shard == NULL)
+		{
+			_fsmtrie_error(f, "%s", err_buf);
+			ok = false;
+			goto out;
+		}
+	}
+
+	/* the calling thread is a worker too, and the only one if need be */
+	pthread_mutex_init(&par->lock, NULL);
+	for (t = 1; t < nthreads; t++)
+	{
+		workers[t].started = pthread_create(&workers[t].thread, NULL,
+				_fsmtrie_par_work, &workers[t]) == 0;
+	}
+	_fsmtrie_par_work(&workers[0]);
+	for (t = 1; t < nthreads; t++)
+	{
+		if (workers[t].started)
+		{
+			pthread_join(workers[t].thread, NULL);
+		}
+	}
+	pthread_mutex_destroy(&par->lock);
+
+	if (par->failed)
+	{
+		_fsmtrie_error(f, "key %zu: %s", par->err_key, par->err);
+		ok = false;
+		goto out;
+	}
+	for (t = 0; t < nthreads && ok; t++)
+	{
+		/* error set by fsmtrie_merge() */
+		ok = fsmtrie_merge(f, &workers[t].shard);
+	}
+
+out:
+	for (t = 0; t < nthreads; t++)
+	{
+		fsmtrie_destroy(&workers[t].shard);
+	}
+	free(workers);
+	free(par->order);
+	return (ok);
+}
+
+bool
+fsmtrie_insert_parallel(struct fsmtrie *f, const char * const *keys,
+		const char * const *strs, size_t nkeys, unsigned int nthreads)
+{
+	struct _fsmtrie_par par;
+
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	memset(&par, 0, sizeof (par));
+	par.keys = keys;
+	par.strs = strs;
+	return (_fsmtrie_insert_parallel(f, &par, nkeys, nthreads, __func__));
+}
+
+bool
+fsmtrie_insert_token_parallel(struct fsmtrie *f, const uint32_t * const *keys,
+		const size_t *keylens, const char * const *strs, size_t nkeys,
+		unsigned int nthreads)
+{
+	struct _fsmtrie_par par;
+
+	if (f == NULL)
+	{
+		return (false);
+	}
+
+	memset(&par, 0, sizeof (par));
+	par.tkeys = keys;
+	par.keylens = keylens;
+	par.strs = strs;
+	return (_fsmtrie_insert_parallel(f, &par, nkeys, nthreads, __func__));
+}
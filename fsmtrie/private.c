@@ -16,6 +16,8 @@
  *  limitations under the License.
  */
 
+#include <stdarg.h>
+
 #include "private.h"
 
 const char *
@@ -33,3 +35,31 @@ _mode_to_str(fsmtrie_mode mode)
 			return ("UNKNOWN");
 	}
 }
+
+/* \cond */
+/* the calling thread's last error and the fsmtrie it belongs to */
+struct _fsmtrie_err
+{
+	const struct fsmtrie *f;
+	char buf[BUFSIZ];
+};
+/* \endcond */
+
+static __thread struct _fsmtrie_err _fsmtrie_err;
+
+void
+_fsmtrie_error(const struct fsmtrie *f, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(_fsmtrie_err.buf, sizeof (_fsmtrie_err.buf), fmt, ap);
+	va_end(ap);
+	_fsmtrie_err.f = f;
+}
+
+const char *
+_fsmtrie_get_error(const struct fsmtrie *f)
+{
+	return (_fsmtrie_err.f == f ? _fsmtrie_err.buf : "");
+}
@@ -27,12 +27,23 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <stdint.h>
+#include <pthread.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "fsmtrie.h"
 
 /* forward */
 struct fsmtrie;
 
+/* hint that memory is about to be read */
+#ifdef __GNUC__
+#define FSMTRIE_PREFETCH(p)	__builtin_prefetch(p)
+#else
+#define FSMTRIE_PREFETCH(p)	((void)(p))
+#endif
+
 /* size of an ASCII trie node, represents 128 ASCII code points */
 #define FSMTRIE_SIZE_ASCII	128
 /* size of an Extended ASCII trie node, represents 256 ASCII code points */
@@ -54,23 +65,378 @@ struct fsmtrie_opt
 	uint8_t flags;
 #define FSMTRIE_PM_OK           0x01    /* partial matches ok (ignore leaf) */
 #define FSMTRIE_AC_COMPILED     0x02    /* Aho-Corasick metadata up to date */
+#define FSMTRIE_AC_DFA          0x04    /* build a full transition table */
+#define FSMTRIE_RCU             0x08    /* copy-on-write updates */
+#define FSMTRIE_AC_LINKS        0x10    /* suffix and dictionary links valid */
+#define FSMTRIE_APPROX_LEV      0x20    /* approx search by Levenshtein DFA */
+#define FSMTRIE_DOUBLE_ARRAY    0x40    /* images carry a double array */
+#define FSMTRIE_DAWG            0x80    /* keys kept as a minimal automaton */
 	uint32_t max_len;		/* max key length (0 == unlimited) */
+	uint8_t approx_index;		/* deletions indexed (0 == no index) */
+	uint32_t approx_prefix;		/* key bytes indexed (0 == all) */
+};
+
+/*
+ * ASCII and Extended ASCII nodes keep their children in an adaptive child
+ * table (after the Adaptive Radix Tree's Node4/Node16/Node48/Node256). A
+ * node starts without a table and the table is replaced by the next larger
+ * kind whenever it fills up, so the common case of a node with one or two
+ * children costs a few dozen bytes rather than a full 128 or 256 pointer
+ * array.
+ */
+#define FSMTRIE_TAB4		0	/* up to 4 sorted keys */
+#define FSMTRIE_TAB16		1	/* up to 16 sorted keys */
+#define FSMTRIE_TAB48		2	/* 256 byte index into 48 slots */
+#define FSMTRIE_TABFULL		3	/* directly indexed */
+
+#define FSMTRIE_TAB4_MAX	4
+#define FSMTRIE_TAB16_MAX	16
+#define FSMTRIE_TAB48_MAX	48
+#define FSMTRIE_TABFULL_MAX	256
+
+/* common header of all child tables */
+struct fsmtrie_tab
+{
+	uint8_t kind;			/* FSMTRIE_TAB* */
+	uint16_t cnt;			/* number of children in table */
+};
+
+struct fsmtrie_tab4
+{
+	struct fsmtrie_tab hdr;
+	uint8_t keys[FSMTRIE_TAB4_MAX];
+	struct fsmtrie_node *nodes[FSMTRIE_TAB4_MAX];
+};
+
+struct fsmtrie_tab16
+{
+	struct fsmtrie_tab hdr;
+	uint8_t keys[FSMTRIE_TAB16_MAX];
+	struct fsmtrie_node *nodes[FSMTRIE_TAB16_MAX];
+};
+
+struct fsmtrie_tab48
+{
+	struct fsmtrie_tab hdr;
+	uint8_t index[FSMTRIE_TABFULL_MAX];	/* slot + 1, 0 if empty */
+	struct fsmtrie_node *nodes[FSMTRIE_TAB48_MAX];
+};
+
+struct fsmtrie_tabfull
+{
+	struct fsmtrie_tab hdr;
+	struct fsmtrie_node *nodes[FSMTRIE_TABFULL_MAX];
+};
+
+/*
+ * Per-trie node arena. Allocations are rounded up to FSMTRIE_ARENA_GRAIN and
+ * served from slabs dedicated to their size class; the largest class holds a
+ * full child table, anything bigger gets a slab of its own.
+ */
+#define FSMTRIE_ARENA_GRAIN	16
+#define FSMTRIE_ARENA_CLASSES	((sizeof (struct fsmtrie_tabfull) + \
+				FSMTRIE_ARENA_GRAIN - 1) / FSMTRIE_ARENA_GRAIN)
+#define FSMTRIE_ARENA_SLAB_FIRST	4096	/* first slab of a class */
+#define FSMTRIE_ARENA_SLAB	(64 * 1024)	/* largest regular slab */
+#define FSMTRIE_ARENA_SLAB_MIN	4		/* objects per slab, at least */
+
+struct fsmtrie_slab;
+
+struct fsmtrie_arena
+{
+	struct fsmtrie_slab *slabs;	/* every slab owned by the arena */
+	size_t bytes;			/* total size of all slabs */
+	void *free[FSMTRIE_ARENA_CLASSES];	/* freed objects per class */
+	uint8_t *cur[FSMTRIE_ARENA_CLASSES];	/* bump pointer per class */
+	uint8_t *end[FSMTRIE_ARENA_CLASSES];	/* end of current slab */
+	uint8_t grow[FSMTRIE_ARENA_CLASSES];	/* slab doublings per class */
+};
+
+/*
+ * Failure tree links of a node, see _fsmtrie_ac_tree_add(). Only tries
+ * whose links are kept up to date by inserts and deletes need them, so
+ * they are allocated when a node is first linked.
+ */
+struct fsmtrie_ftree
+{
+	struct fsmtrie_node *fchild;	/* first node with a suffix link here */
+	struct fsmtrie_node *fnext;	/* next node with the same suffix */
+	struct fsmtrie_node *fprev;	/* previous node with the same suffix */
+};
+
+/* RCU bookkeeping of a node of an RCU trie, see struct fsmtrie_rcu */
+struct fsmtrie_rcu_node
+{
+	uint64_t gen;			/* generation that created it */
+	struct fsmtrie_node *key;	/* its key node */
+	struct fsmtrie_node *older;	/* node it replaced, if any */
+};
+
+/* what a key node has beyond other nodes, see struct fsmtrie_rcu */
+struct fsmtrie_rcu_key
+{
+	struct fsmtrie_ftree tree;	/* first, key nodes are linked */
+	struct fsmtrie_node *parent;	/* parent key node */
+	struct fsmtrie_node *newest;	/* newest copy of its node */
 };
 
 /* an fsmtrie node */
 struct fsmtrie_node
 {
 	struct fsmtrie_node *suffix;	/* longest proper suffix node, if any */
+	struct fsmtrie_node *dict;	/* longest proper suffix leaf, if any */
+	union
+	{
+		struct fsmtrie_ftree *tree;	/* failure tree, once linked */
+		struct fsmtrie_rcu_node *rcu;	/* nodes of RCU tries */
+		struct fsmtrie_rcu_key *key;	/* key nodes */
+	} aux;
 	uint8_t type;			/* type of node */
-	fsmtrie_mode mode;		/* copied from root parent */
 	uint8_t flags;			/* copied from root parent */
+	fsmtrie_mode mode;		/* copied from root parent */
+	uint32_t state;			/* DFA state (premultiplied) */
+	uint32_t depth;			/* length of the node's key */
 	char *str;			/* optional leaf node string */
+	struct fsmtrie_tab *tab;	/* child table (ASCII and EASCII only) */
 	uint32_t tval;			/* only used for tokens */
-	uint16_t nnodes;		/* number of child nodes allocated */
-	struct fsmtrie_node *nodes[]; 	/* a trie node */
+	uint16_t nnodes;		/* number of token child nodes allocated */
+	struct fsmtrie_node *nodes[]; 	/* token child nodes */
 };
 typedef struct fsmtrie_node fsmtrie_node_t;
 
+/*
+ * Aho-Corasick DFA. Rather than following suffix links on a mismatch, every
+ * state has a transition for every input byte, so substring search is a
+ * single table lookup per byte.
+ *
+ * To keep the table small, input bytes are mapped to classes first: bytes
+ * whose columns of the table are identical share a class, and a row has
+ * nclasses entries rather than 256. All bytes that label no edge share a
+ * class, their transitions lead back to the root. A state other than the
+ * root is only entered through the label of its node though, so the column
+ * of a label byte has its node's state and no other column can match it.
+ * Rows are thus one entry wider than the number of distinct label bytes,
+ * 41 entries for a trie of domain names over a-z, 0-9, '-', '.' and '_'.
+ *
+ * State numbers are premultiplied by nclasses, so the next state is simply
+ * delta[state + classes[byte]]. Output states are numbered first, so a state
+ * below mlim means there are matches to report.
+ */
+struct fsmtrie_dfa
+{
+	uint8_t classes[256];		/* byte to class */
+	uint32_t nclasses;		/* number of classes */
+	uint32_t nstates;		/* number of states */
+	uint32_t start;			/* root state */
+	uint32_t mlim;			/* states below this are outputs */
+	uint32_t *delta;		/* nstates * nclasses transitions */
+	struct fsmtrie_node **nodes;	/* trie node of each state */
+};
+
+/*
+ * A trie image is a relocatable, pointer-free rendering of a trie that can be
+ * written to disk with fsmtrie_save() and searched in place after mapping it
+ * back in with fsmtrie_open_mmap().
+ *
+ * Nodes are stored in breadth-first order, root first, so the children of
+ * every node occupy a contiguous run of node records ordered by label. All
+ * references (children, Aho-Corasick suffix and dictionary links and leaf
+ * strings) are 32-bit indices or offsets. The image is laid out as:
+ *
+ *	header | node records | labels | leaf strings
+ *
+ * where labels holds the label of the edge into each node (one byte for ASCII
+ * and EASCII, four for token tries) and leaf strings are NUL-terminated and
+ * referenced by offset. Images are written in host byte order.
+ *
+ * ASCII and EASCII images of tries with FSMTRIE_DOUBLE_ARRAY end in a double
+ * array of their transitions as well:
+ *
+ *	... | leaf strings | bases | slots
+ *
+ * The child of node n labelled c is the node in slot bases[n] + c, provided
+ * it is a child of n labelled c at all: rather than a CHECK array naming the
+ * owner of every slot, the contiguous children of n tell. There are 256
+ * slots past the largest base, so every byte has a slot to look at.
+ */
+#define FSMTRIE_IMAGE_MAGIC	"FSMTRIE"
+#define FSMTRIE_IMAGE_VERSION	4
+#define FSMTRIE_IMAGE_BYTEORDER	0x01020304
+#define FSMTRIE_INONE		UINT32_MAX	/* no such node or string */
+
+struct fsmtrie_image_hdr
+{
+	char magic[8];			/* FSMTRIE_IMAGE_MAGIC */
+	uint32_t version;		/* FSMTRIE_IMAGE_VERSION */
+	uint32_t byteorder;		/* FSMTRIE_IMAGE_BYTEORDER */
+	uint32_t mode;			/* fsmtrie_mode */
+	uint32_t flags;			/* FSMTRIE_PM_OK, FSMTRIE_AC_COMPILED */
+	uint32_t max_len;		/* max key length (0 == no max) */
+	uint32_t nrnodes;		/* node table size in trie */
+	uint64_t node_cnt;		/* fsmtrie_get_nodecnt() */
+	uint64_t key_cnt;		/* fsmtrie_get_keycnt() */
+	uint64_t nnodes;		/* node records in the image */
+	uint64_t nodes_off;		/* offset of node records */
+	uint64_t labels_off;		/* offset of labels */
+	uint64_t strs_off;		/* offset of leaf strings */
+	uint64_t strs_len;		/* size of leaf strings */
+	uint64_t da_off;		/* offset of bases (0 == no array) */
+	uint64_t da_slots;		/* number of slots */
+	uint64_t size;			/* size of the whole image */
+};
+
+struct fsmtrie_inode
+{
+	uint32_t child;			/* index of first child */
+	uint32_t nchild;		/* number of children */
+	uint32_t suffix;		/* longest proper suffix node */
+	uint32_t dict;			/* longest proper suffix leaf */
+	uint32_t str;			/* leaf string offset */
+	uint32_t depth;			/* length of the node's key */
+	uint8_t type;			/* FSMTRIE_NODE_* */
+	uint8_t pad[3];
+};
+
+/* a trie image mapped or loaded into memory */
+struct fsmtrie_image
+{
+	const struct fsmtrie_image_hdr *hdr;
+	const struct fsmtrie_inode *nodes;
+	const uint8_t *labels;		/* ASCII and EASCII labels */
+	const uint32_t *tlabels;	/* token labels */
+	const char *strs;
+	const uint32_t *da_base;	/* double array, NULL if none */
+	const uint32_t *da_slot;
+	void *map;			/* mapping backing the image */
+	size_t map_len;
+	void *buf;			/* memory backing a frozen image */
+};
+
+/*
+ * The keys of an ASCII or EASCII trie built with FSMTRIE_DAWG, kept as a
+ * minimal deterministic acyclic automaton (a DAWG) rather than a tree: keys
+ * sharing a suffix share the states that spell it. Keys are inserted in
+ * ascending order and Daciuk's incremental algorithm registers every state
+ * once the keys below it are complete, replacing it by an equivalent state
+ * registered before if there is one, see dawg.c.
+ *
+ * A state of the automaton no longer stands for a single key prefix, so
+ * leaf strings can't hang off states. Keys are numbered in ascending order
+ * instead, and every transition counts the keys numbered before it within
+ * its state: the key ending at the state, if any, and the keys below the
+ * transitions of smaller labels. The sum of the counts along the path of a
+ * key is its number (a minimal perfect hash of the keys), which indexes the
+ * leaf strings.
+ *
+ * Leaf strings are kept back to back, each preceded by a byte telling
+ * whether the key has one at all, and the offset of every
+ * FSMTRIE_DAWG_SBLOCK-th string is kept to find them. Keys past the last
+ * one inserted with a string have no entry.
+ */
+#define FSMTRIE_DAWG_SBLOCK	16
+
+struct fsmtrie_dstate
+{
+	uint32_t first;			/* index of first transition */
+	uint16_t ntrans;		/* number of transitions */
+	uint8_t accept;			/* a key ends here */
+	uint8_t pad;
+};
+
+/* build state of a DAWG, see dawg.c */
+struct fsmtrie_dawg_build;
+
+struct fsmtrie_dawg
+{
+	struct fsmtrie_dstate *states;
+	uint32_t nstates, astates;
+	uint8_t *labels;		/* label of every transition */
+	uint32_t *targets;		/* target state of every transition */
+	uint32_t *before;		/* keys numbered before the transition */
+	uint32_t ntrans, atrans;
+	uint32_t root;			/* root state, once sealed */
+	uint32_t nkeys;
+	char *strs;			/* leaf strings */
+	size_t strs_len, strs_size;
+	uint64_t *soff;			/* offsets of every block of strings */
+	uint32_t asoff;
+	uint32_t nstrs;			/* keys with an entry in strs */
+	struct fsmtrie_dawg_build *build;	/* NULL once sealed */
+};
+
+/*
+ * RCU (read-copy-update) state of a trie opened with FSMTRIE_RCU.
+ *
+ * Readers only ever see published versions of the trie, which are never
+ * modified. Inserts path-copy the nodes they touch into the
+ * generation being built (nodes created in the current generation are
+ * private to the writer and modified in place) and fsmtrie_publish() makes
+ * the new version visible by swapping a single pointer. Nodes that were
+ * replaced by copies are retired and returned to the arena once every
+ * reader that might still see them is gone.
+ *
+ * Aho-Corasick links can't point at nodes that get copied, so every node
+ * has a key node standing for its key across all its copies. Key nodes
+ * aren't part of any version: they hold the writer's links, kept up to date
+ * as keys come and go, and each change is copied over to the newest copy of
+ * the node, path-copying it first if it's published. The links of trie
+ * nodes point at key nodes, and readers follow them to the newest copy that
+ * is no newer than the version they see (see _fsmtrie_link()).
+ * The generation and key node of a node and what a key node adds to a node
+ * are kept in records hanging off the node, so other tries don't pay for
+ * them.
+ *
+ * Grace periods are tracked with a two-phase epoch: a reader bumps the
+ * counter of the current epoch's parity on entry and drops it on exit, and
+ * the writer only advances the epoch once no reader of the previous epoch
+ * is left. Counters are striped over cache line sized slots so readers on
+ * different CPUs don't contend.
+ */
+#define FSMTRIE_RCU_SLOTS	32
+
+struct fsmtrie_rcu_slot
+{
+	uint64_t cnt[2];		/* readers per epoch parity */
+	uint8_t pad[48];
+};
+
+/* a published version of the trie */
+struct fsmtrie_snap
+{
+	uint64_t gen;			/* generation of the version */
+	struct fsmtrie_node *root;	/* root node */
+	struct fsmtrie_snap *next;	/* retired versions */
+};
+
+/* arena objects and versions retired in the same epoch */
+struct fsmtrie_rcu_batch
+{
+	void **objs;			/* arena objects */
+	size_t *sizes;			/* their sizes */
+	size_t nobjs, aobjs;
+	struct fsmtrie_snap *snaps;
+};
+
+struct fsmtrie_rcu
+{
+	struct fsmtrie_rcu_slot slots[FSMTRIE_RCU_SLOTS];
+	uint64_t epoch;			/* current epoch */
+	struct fsmtrie_snap *snap;	/* published version */
+	uint64_t gen;			/* generation being built */
+	struct fsmtrie_rcu_batch unlinked;	/* replaced, not yet published */
+	struct fsmtrie_rcu_batch cur;	/* retired in the current epoch */
+	struct fsmtrie_rcu_batch prev;	/* retired in the previous epoch */
+	struct fsmtrie_node **path;	/* key nodes being copied */
+	size_t apath;
+};
+
+/* a reader's hold on the published version, see _fsmtrie_rcu_enter() */
+struct fsmtrie_rcu_pin
+{
+	struct fsmtrie_rcu_slot *slot;	/* NULL if trie isn't RCU */
+	unsigned int parity;
+};
+
 /* the fsmtrie and associated metadata */
 struct fsmtrie
 {
@@ -81,11 +447,783 @@ struct fsmtrie
 	uint32_t max_len;		/* max key length (0 == no max) */
 	fsmtrie_mode mode;		/* mode of operation */
 	uint8_t flags;			/* control flags */
-	char err_buf[BUFSIZ];		/* error messages go here */
-	uint8_t pad[1];			/* pad to even bb */
+	struct fsmtrie_arena arena;	/* nodes, tables and strings */
+	struct fsmtrie_image *img;	/* read-only image, replaces root */
+	struct fsmtrie_dfa *dfa;	/* Aho-Corasick DFA, if built */
+	pthread_mutex_t lock;		/* serializes lazy compilation */
+	fsmtrie_node_t *wroot;		/* root inserts go to (RCU) */
+	struct fsmtrie_rcu *rcu;	/* RCU state, NULL unless FSMTRIE_RCU */
+	uint64_t prunes;		/* deletes that freed nodes */
+	uint32_t depth;			/* deepest node ever added */
+	uint8_t approx_index;		/* see fsmtrie_opt_set_approx_index() */
+	uint32_t approx_prefix;
+	struct fsmtrie_symdel *symdel;	/* approximate search index, if built */
+	struct fsmtrie_dawg *dawg;	/* minimal automaton, replaces root */
+};
+
+/* a streaming substring scanner */
+struct fsmtrie_scanner
+{
+	struct fsmtrie *f;		/* trie being scanned for */
+	fsmtrie_node_t *node;		/* current node (live trie) */
+	uint32_t inode;			/* current node (image) */
+	uint64_t gen;			/* version scanned (RCU) */
+	uint64_t prunes;		/* f->prunes when last fed */
+	uint64_t off;			/* bytes consumed so far */
+	void (*cb)(const char *, uint64_t, void *);
+	void *cbdata;
 };
 
 /* convert mode to a string */
 const char * _mode_to_str(fsmtrie_mode mode);
 
+/*
+ * Record an error for fsmtrie_get_error(). Errors are kept per thread, so
+ * concurrent searches never write to the fsmtrie itself.
+ */
+void _fsmtrie_error(const struct fsmtrie *f, const char *fmt, ...)
+#ifdef __GNUC__
+	__attribute__((format(printf, 2, 3)))
+#endif
+	;
+
+/* the calling thread's last error on f, "" if there is none */
+const char *_fsmtrie_get_error(const struct fsmtrie *f);
+
+/*
+ * Compute Aho-Corasick metadata. Returns false, with the error set, if the
+ * links can't be computed; they are computed again next time.
+ */
+bool _fsmtrie_ac_compile(struct fsmtrie *f);
+
+/* update the Aho-Corasick metadata of a linked trie after an insert */
+void _fsmtrie_ac_add(struct fsmtrie *f, fsmtrie_node_t *parent,
+		const unsigned char *p, const unsigned char *end,
+		fsmtrie_node_t *leaf);
+
+/*
+ * Update the Aho-Corasick metadata of a linked trie after a delete: leaf
+ * lost its key and the npruned nodes in pruned (in path order, leaf last
+ * if it is among them) are about to be removed.
+ */
+void _fsmtrie_ac_del(struct fsmtrie *f, fsmtrie_node_t *leaf,
+		fsmtrie_node_t * const *pruned, size_t npruned);
+
+/* compute Aho-Corasick metadata unless it is up to date, thread-safe */
+bool _fsmtrie_ac_ensure(struct fsmtrie *f);
+
+/* build the Aho-Corasick DFA from compiled suffix links */
+bool _fsmtrie_dfa_build(struct fsmtrie *f);
+
+/* release an Aho-Corasick DFA */
+void _fsmtrie_dfa_free(struct fsmtrie_dfa *dfa);
+
+/* image counterparts of the search functions */
+int _fsmtrie_image_search(struct fsmtrie *f, const char *key, size_t keylen,
+		const char **str);
+int _fsmtrie_image_search_token(struct fsmtrie *f, const uint32_t *key,
+		size_t keylen, const char **str);
+void _fsmtrie_image_print_leaves(struct fsmtrie *f);
+
+/* run a scanner over a buffer of an image's subject */
+void _fsmtrie_image_scan(struct fsmtrie_scanner *s, const unsigned char *buf,
+		size_t len);
+
+/* unmap an image */
+void _fsmtrie_image_close(struct fsmtrie_image *img);
+
+/* allocate zeroed memory from an arena */
+void *_fsmtrie_arena_alloc(struct fsmtrie_arena *a, size_t size);
+
+/* return memory of the specified size to an arena */
+void _fsmtrie_arena_free(struct fsmtrie_arena *a, void *p, size_t size);
+
+/* resize an arena allocation, new memory is zeroed */
+void *_fsmtrie_arena_realloc(struct fsmtrie_arena *a, void *p,
+		size_t old_size, size_t new_size);
+
+/* copy a string into an arena */
+char *_fsmtrie_arena_strdup(struct fsmtrie_arena *a, const char *str);
+
+/* move every allocation of src over to dst, leaving src empty */
+void _fsmtrie_arena_merge(struct fsmtrie_arena *dst,
+		struct fsmtrie_arena *src);
+
+/* release all memory held by an arena */
+void _fsmtrie_arena_destroy(struct fsmtrie_arena *a);
+
+/* copy a child table, see _fsmtrie_rcu_own() */
+struct fsmtrie_tab *_fsmtrie_tab_copy(struct fsmtrie_arena *a,
+		const struct fsmtrie_tab *t, size_t *size);
+
+/* replace the existing child of an ASCII or EASCII node at code point c */
+void _fsmtrie_tab_set(fsmtrie_node_t *node, unsigned int c,
+		fsmtrie_node_t *child);
+
+/* set up RCU state for a trie whose root was just created */
+bool _fsmtrie_rcu_init(struct fsmtrie *f);
+
+/* release RCU state and every retired version */
+void _fsmtrie_rcu_free(struct fsmtrie *f);
+
+/* pin the published version of an RCU trie, see _fsmtrie_rcu_enter() */
+void _fsmtrie_rcu_pin(struct fsmtrie_rcu *rcu, struct fsmtrie_rcu_pin *pin);
+
+/*
+ * Make node, reached from parent through code point c (or the root if
+ * parent is NULL), private to the generation being built, copying it if it
+ * belongs to a published version. Returns the node to modify or NULL.
+ */
+fsmtrie_node_t *_fsmtrie_rcu_own(struct fsmtrie *f, fsmtrie_node_t *parent,
+		unsigned int c, fsmtrie_node_t *node);
+
+/*
+ * Free an arena object that was removed from the version being built once
+ * no reader can see it anymore.
+ */
+void _fsmtrie_rcu_unlink(struct fsmtrie *f, void *p, size_t size);
+
+/*
+ * Set up the RCU bookkeeping and the key node of a new node, the child of
+ * parent through code point c (parent is NULL for the root). Returns false
+ * if they can't be allocated.
+ */
+bool _fsmtrie_rcu_node(struct fsmtrie *f, fsmtrie_node_t *parent,
+		unsigned int c, fsmtrie_node_t *node);
+
+/*
+ * Free a node removed from the version being built, along with its RCU
+ * bookkeeping and key node, once no reader can see it anymore.
+ */
+void _fsmtrie_rcu_unlink_node(struct fsmtrie *f, fsmtrie_node_t *node);
+
+/*
+ * Copy the Aho-Corasick links of a key node over to the newest copy of its
+ * node, copying that first if it's published. Returns false if it can't.
+ */
+bool _fsmtrie_rcu_sync(struct fsmtrie *f, fsmtrie_node_t *key);
+
+/*
+ * Find the index of a token among the children of a token node, optionally
+ * making room for it (which may move the node), see fsmtrie_insert_token().
+ */
+int _fsmtrie_get_token_idx(struct fsmtrie_arena *a, fsmtrie_node_t **nodep,
+		size_t nodecnt, uint32_t token, bool do_insert, size_t *pidx);
+
+/* allocation size of a token node with room for nnodes children */
+size_t _fsmtrie_token_node_size(size_t nnodes);
+
+/* look up the child of a token node, NULL if there is none */
+fsmtrie_node_t *_fsmtrie_token_child(const struct fsmtrie *f,
+		const fsmtrie_node_t *node, uint32_t token);
+
+/* create a child of an ASCII or EASCII node of f, sets the error on failure */
+fsmtrie_node_t *_fsmtrie_node_add(struct fsmtrie *f, fsmtrie_node_t *parent,
+		unsigned int c);
+
+/* add a child to an ASCII or EASCII node, growing its child table */
+bool _fsmtrie_tab_add(struct fsmtrie_arena *a, fsmtrie_node_t *node,
+		unsigned int c, fsmtrie_node_t *child);
+
+/*
+ * Remove the child of an ASCII or EASCII node at code point c, shrinking
+ * its child table (or releasing it along with the last child).
+ */
+void _fsmtrie_tab_del(struct fsmtrie_arena *a, fsmtrie_node_t *node,
+		unsigned int c);
+
+/* allocation size of a child table of the specified kind */
+size_t _fsmtrie_tab_size(uint8_t kind);
+
+/*
+ * Enter a read-side critical section: nodes of the version seen by the
+ * caller are not reclaimed before _fsmtrie_rcu_exit(). Does nothing for
+ * tries that aren't RCU.
+ */
+static inline void
+_fsmtrie_rcu_enter(const struct fsmtrie *f, struct fsmtrie_rcu_pin *pin)
+{
+	pin->slot = NULL;
+	if (f->rcu != NULL)
+	{
+		_fsmtrie_rcu_pin(f->rcu, pin);
+	}
+}
+
+static inline void
+_fsmtrie_rcu_exit(struct fsmtrie_rcu_pin *pin)
+{
+	if (pin->slot != NULL)
+	{
+		__atomic_sub_fetch(&pin->slot->cnt[pin->parity], 1,
+				__ATOMIC_RELEASE);
+	}
+}
+
+/* root of the published version, safe to call from readers */
+static inline fsmtrie_node_t *
+_fsmtrie_root(const struct fsmtrie *f)
+{
+	return (__atomic_load_n(&f->root, __ATOMIC_ACQUIRE));
+}
+
+/*
+ * Follow a suffix or dictionary link of a node of the version of generation
+ * gen. RCU links lead to key nodes, and from there to the newest copy of the
+ * node that is no newer than the version. Other tries link to nodes directly
+ * and pass 0.
+ */
+static inline fsmtrie_node_t *
+_fsmtrie_link(fsmtrie_node_t *link, uint64_t gen)
+{
+	fsmtrie_node_t *node;
+
+	if (gen == 0 || link == NULL)
+	{
+		return (link);
+	}
+	node = __atomic_load_n(&link->aux.key->newest, __ATOMIC_ACQUIRE);
+	while (node->aux.rcu->gen > gen)
+	{
+		node = node->aux.rcu->older;
+	}
+
+	return (node);
+}
+
+/* key node of a node of an RCU trie, writer only */
+static inline fsmtrie_node_t *
+_fsmtrie_rcu_key(const fsmtrie_node_t *node)
+{
+	return (node->aux.rcu->key);
+}
+
+/* root of the version inserts go to, writer only */
+static inline fsmtrie_node_t *
+_fsmtrie_wroot(const struct fsmtrie *f)
+{
+	return (f->rcu != NULL ? f->wroot : f->root);
+}
+
+/*
+ * Look up the child of an ASCII or EASCII node at code point c. Returns NULL
+ * if there is none.
+ */
+static inline fsmtrie_node_t *
+_fsmtrie_child(const fsmtrie_node_t *node, unsigned int c)
+{
+	const struct fsmtrie_tab *t = node->tab;
+	unsigned int n;
+
+	if (t == NULL)
+	{
+		return (NULL);
+	}
+
+	switch (t->kind)
+	{
+		case FSMTRIE_TAB4:
+		{
+			const struct fsmtrie_tab4 *t4 = (const void *)t;
+
+			for (n = 0; n < t->cnt; n++)
+			{
+				if (t4->keys[n] == c)
+				{
+					return (t4->nodes[n]);
+				}
+			}
+			return (NULL);
+		}
+		case FSMTRIE_TAB16:
+		{
+			const struct fsmtrie_tab16 *t16 = (const void *)t;
+#ifdef __SSE2__
+			/* compare all 16 keys at once */
+			__m128i cmp = _mm_cmpeq_epi8(_mm_set1_epi8((char)c),
+				_mm_loadu_si128((const __m128i *)t16->keys));
+			unsigned int mask = _mm_movemask_epi8(cmp) &
+				((1U << t->cnt) - 1);
+
+			return (mask ? t16->nodes[__builtin_ctz(mask)] : NULL);
+#else
+			for (n = 0; n < t->cnt; n++)
+			{
+				if (t16->keys[n] == c)
+				{
+					return (t16->nodes[n]);
+				}
+			}
+			return (NULL);
+#endif
+		}
+		case FSMTRIE_TAB48:
+		{
+			const struct fsmtrie_tab48 *t48 = (const void *)t;
+
+			if (c >= FSMTRIE_TABFULL_MAX || t48->index[c] == 0)
+			{
+				return (NULL);
+			}
+			return (t48->nodes[t48->index[c] - 1]);
+		}
+		default:
+		{
+			const struct fsmtrie_tabfull *tf = (const void *)t;
+
+			if (c >= FSMTRIE_TABFULL_MAX)
+			{
+				return (NULL);
+			}
+			return (tf->nodes[c]);
+		}
+	}
+}
+
+/*
+ * Find the child of an ASCII or EASCII node with the smallest code point that
+ * is greater than or equal to c. Returns the code point and stores the child
+ * in *child, or returns -1 if there is none. Children are visited in code
+ * point order, same as a scan of a fully populated node.
+ */
+static inline int
+_fsmtrie_child_next(const fsmtrie_node_t *node, int c, fsmtrie_node_t **child)
+{
+	const struct fsmtrie_tab *t = node->tab;
+	unsigned int n;
+
+	if (t == NULL)
+	{
+		return (-1);
+	}
+
+	switch (t->kind)
+	{
+		case FSMTRIE_TAB4:
+		case FSMTRIE_TAB16:
+		{
+			const uint8_t *keys;
+			struct fsmtrie_node * const *nodes;
+
+			if (t->kind == FSMTRIE_TAB4)
+			{
+				keys = ((const struct fsmtrie_tab4 *)t)->keys;
+				nodes = ((const struct fsmtrie_tab4 *)t)->nodes;
+			}
+			else
+			{
+				keys = ((const struct fsmtrie_tab16 *)t)->keys;
+				nodes = ((const struct fsmtrie_tab16 *)t)->nodes;
+			}
+			for (n = 0; n < t->cnt; n++)
+			{
+				if (keys[n] >= c)
+				{
+					*child = nodes[n];
+					return (keys[n]);
+				}
+			}
+			return (-1);
+		}
+		case FSMTRIE_TAB48:
+		{
+			const struct fsmtrie_tab48 *t48 = (const void *)t;
+
+			for (; c < FSMTRIE_TABFULL_MAX; c++)
+			{
+				if (t48->index[c] != 0)
+				{
+					*child = t48->nodes[t48->index[c] - 1];
+					return (c);
+				}
+			}
+			return (-1);
+		}
+		default:
+		{
+			const struct fsmtrie_tabfull *tf = (const void *)t;
+
+			for (; c < FSMTRIE_TABFULL_MAX; c++)
+			{
+				if (tf->nodes[c] != NULL)
+				{
+					*child = tf->nodes[c];
+					return (c);
+				}
+			}
+			return (-1);
+		}
+	}
+}
+
+/*
+ * Look up the image node index of the child of node n with label c, or
+ * FSMTRIE_INONE.
+ */
+static inline uint32_t
+_fsmtrie_image_child(const struct fsmtrie_image *img, uint32_t n, unsigned int c)
+{
+	const struct fsmtrie_inode *node = &img->nodes[n];
+	const uint8_t *labels = &img->labels[node->child];
+	uint32_t lo, hi, mid;
+
+	if (img->da_base != NULL)
+	{
+		/* an empty slot holds FSMTRIE_INONE, out of every range */
+		lo = img->da_slot[img->da_base[n] + c];
+		return (lo - node->child < node->nchild &&
+				img->labels[lo] == c ? lo : FSMTRIE_INONE);
+	}
+
+	if (node->nchild <= 8)
+	{
+		for (lo = 0; lo < node->nchild; lo++)
+		{
+			if (labels[lo] == c)
+			{
+				return (node->child + lo);
+			}
+		}
+		return (FSMTRIE_INONE);
+	}
+
+	for (lo = 0, hi = node->nchild; lo < hi; )
+	{
+		mid = lo + (hi - lo) / 2;
+		if (labels[mid] < c)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if (lo < node->nchild && labels[lo] == c)
+	{
+		return (node->child + lo);
+	}
+	return (FSMTRIE_INONE);
+}
+
+/* the leaf string of image node n, or NULL */
+static inline const char *
+_fsmtrie_image_str(const struct fsmtrie_image *img, uint32_t n)
+{
+	uint32_t off = img->nodes[n].str;
+
+	return (off == FSMTRIE_INONE ? NULL : &img->strs[off]);
+}
+
+/*
+ * Look up the transition of DAWG state s with label c, or FSMTRIE_INONE.
+ * Transitions of a state are ordered by label.
+ */
+static inline uint32_t
+_fsmtrie_dawg_trans(const struct fsmtrie_dawg *d, uint32_t s, unsigned int c)
+{
+	const struct fsmtrie_dstate *state = &d->states[s];
+	const uint8_t *labels = &d->labels[state->first];
+	uint32_t lo, hi, mid;
+
+	if (state->ntrans <= 8)
+	{
+		for (lo = 0; lo < state->ntrans; lo++)
+		{
+			if (labels[lo] == c)
+			{
+				return (state->first + lo);
+			}
+		}
+		return (FSMTRIE_INONE);
+	}
+
+	for (lo = 0, hi = state->ntrans; lo < hi; )
+	{
+		mid = lo + (hi - lo) / 2;
+		if (labels[mid] < c)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if (lo < state->ntrans && labels[lo] == c)
+	{
+		return (state->first + lo);
+	}
+	return (FSMTRIE_INONE);
+}
+
+/* the leaf string of the key numbered num, or NULL */
+static inline const char *
+_fsmtrie_dawg_str(const struct fsmtrie_dawg *d, uint32_t num)
+{
+	const char *p;
+	uint32_t i;
+
+	if (num >= d->nstrs)
+	{
+		return (NULL);
+	}
+	p = &d->strs[d->soff[num / FSMTRIE_DAWG_SBLOCK]];
+	for (i = num % FSMTRIE_DAWG_SBLOCK; i > 0; i--)
+	{
+		p += *p ? strlen(p + 1) + 2 : 1;
+	}
+	return (*p ? p + 1 : NULL);
+}
+
+/*
+ * A read-only view of an ASCII or EASCII trie, whatever its representation.
+ * Search algorithms that only need to walk the trie (such as approximate
+ * search) are written against a view so they serve live tries, images and
+ * DAWGs alike. Nodes are identified by opaque references. A DAWG reference
+ * carries the number of the first key at or below the node next to its
+ * state, as a state is reached by many paths.
+ */
+typedef uint64_t fsmtrie_ref_t;
+#define FSMTRIE_REF_NONE	UINT64_MAX
+
+#define FSMTRIE_DREF(num, s)	(((fsmtrie_ref_t)(num) << 32) | (s))
+#define FSMTRIE_DREF_NUM(n)	((uint32_t)((n) >> 32))
+#define FSMTRIE_DREF_STATE(n)	((uint32_t)(n))
+
+struct fsmtrie_view
+{
+	const struct fsmtrie *f;
+	const struct fsmtrie_image *img;	/* NULL for live tries */
+	const struct fsmtrie_dawg *dawg;	/* NULL unless a sealed DAWG */
+	fsmtrie_node_t *root;		/* root of the version walked */
+};
+
+static inline void
+_fsmtrie_view_init(struct fsmtrie_view *v, const struct fsmtrie *f)
+{
+	v->f = f;
+	v->img = f->img;
+	v->dawg = f->dawg;
+	v->root = _fsmtrie_root(f);
+}
+
+static inline fsmtrie_ref_t
+_fsmtrie_view_root(const struct fsmtrie_view *v)
+{
+	if (v->img != NULL)
+	{
+		return (0);
+	}
+	if (v->dawg != NULL)
+	{
+		return (FSMTRIE_DREF(0, v->dawg->root));
+	}
+	return ((fsmtrie_ref_t)(uintptr_t)v->root);
+}
+
+/*
+ * Find the child of node n with the smallest label greater than or equal to
+ * c. Returns the label and stores the child in *child, or returns -1.
+ */
+static inline int
+_fsmtrie_view_next(const struct fsmtrie_view *v, fsmtrie_ref_t n, int c,
+		fsmtrie_ref_t *child)
+{
+	if (v->img != NULL)
+	{
+		const struct fsmtrie_inode *node = &v->img->nodes[n];
+		uint32_t i;
+
+		for (i = 0; i < node->nchild; i++)
+		{
+			if (v->img->labels[node->child + i] >= c)
+			{
+				*child = node->child + i;
+				return (v->img->labels[node->child + i]);
+			}
+		}
+		return (-1);
+	}
+	else if (v->dawg != NULL)
+	{
+		const struct fsmtrie_dawg *d = v->dawg;
+		const struct fsmtrie_dstate *state =
+			&d->states[FSMTRIE_DREF_STATE(n)];
+		uint32_t t;
+
+		for (t = state->first; t < state->first + state->ntrans; t++)
+		{
+			if (d->labels[t] >= c)
+			{
+				*child = FSMTRIE_DREF(FSMTRIE_DREF_NUM(n) +
+						d->before[t], d->targets[t]);
+				return (d->labels[t]);
+			}
+		}
+		return (-1);
+	}
+	else
+	{
+		fsmtrie_node_t *next;
+
+		c = _fsmtrie_child_next((fsmtrie_node_t *)(uintptr_t)n, c,
+				&next);
+		if (c >= 0)
+		{
+			*child = (fsmtrie_ref_t)(uintptr_t)next;
+		}
+		return (c);
+	}
+}
+
+/* look up the child of node n with label c, FSMTRIE_REF_NONE if none */
+static inline fsmtrie_ref_t
+_fsmtrie_view_child(const struct fsmtrie_view *v, fsmtrie_ref_t n,
+		unsigned int c)
+{
+	fsmtrie_node_t *child;
+	uint32_t i;
+
+	if (v->img != NULL)
+	{
+		i = _fsmtrie_image_child(v->img, n, c);
+		return (i == FSMTRIE_INONE ? FSMTRIE_REF_NONE : i);
+	}
+	if (v->dawg != NULL)
+	{
+		i = _fsmtrie_dawg_trans(v->dawg, FSMTRIE_DREF_STATE(n), c);
+		return (i == FSMTRIE_INONE ? FSMTRIE_REF_NONE :
+				FSMTRIE_DREF(FSMTRIE_DREF_NUM(n) +
+					v->dawg->before[i],
+					v->dawg->targets[i]));
+	}
+	child = _fsmtrie_child((fsmtrie_node_t *)(uintptr_t)n, c);
+	return (child == NULL ? FSMTRIE_REF_NONE :
+			(fsmtrie_ref_t)(uintptr_t)child);
+}
+
+static inline bool
+_fsmtrie_view_leaf(const struct fsmtrie_view *v, fsmtrie_ref_t n)
+{
+	if (v->img != NULL)
+	{
+		return (v->img->nodes[n].type & FSMTRIE_NODE_LEAF);
+	}
+	if (v->dawg != NULL)
+	{
+		return (v->dawg->states[FSMTRIE_DREF_STATE(n)].accept);
+	}
+	return (((fsmtrie_node_t *)(uintptr_t)n)->type & FSMTRIE_NODE_LEAF);
+}
+
+static inline const char *
+_fsmtrie_view_str(const struct fsmtrie_view *v, fsmtrie_ref_t n)
+{
+	if (v->img != NULL)
+	{
+		return (_fsmtrie_image_str(v->img, n));
+	}
+	if (v->dawg != NULL)
+	{
+		/* the number of a node without a key is the next key's */
+		return (_fsmtrie_view_leaf(v, n) ?
+				_fsmtrie_dawg_str(v->dawg,
+					FSMTRIE_DREF_NUM(n)) : NULL);
+	}
+	return (((fsmtrie_node_t *)(uintptr_t)n)->str);
+}
+
+/* a growable scratch buffer */
+struct fsmtrie_buf
+{
+	void *p;
+	size_t size;
+};
+
+/* scratch space of approximate searches, kept between calls */
+struct fsmtrie_asearch_ctx
+{
+	struct fsmtrie_buf stack;	/* per depth state of the walk */
+	struct fsmtrie_buf matrix;	/* sparse matrix entries */
+	struct fsmtrie_buf edits;	/* strings one edit away */
+	struct fsmtrie_buf cand;	/* candidate keys of the index */
+	struct fsmtrie_buf lev_states;	/* Levenshtein automaton, see lev.c */
+	struct fsmtrie_buf lev_delta;
+	struct fsmtrie_buf lev_hash[2];
+	struct fsmtrie_buf lev_key;
+};
+
+/* make room for size bytes in b, keeping its contents; NULL if out of memory */
+void *_fsmtrie_buf_reserve(struct fsmtrie_buf *b, size_t size);
+
+/*
+ * Approximate search by Levenshtein automaton, see lev.c. Nodes deeper than
+ * depth aren't visited. Returns false if the automaton could not be built.
+ * Distances are kept in bytes, so larger bounds are left to the matrix.
+ */
+#define FSMTRIE_APPROX_LEV_MAX	254
+bool _fsmtrie_approx_lev(struct fsmtrie_asearch_ctx *ctx,
+		const struct fsmtrie_view *view, const unsigned char *key,
+		int keylen, int max_dist, uint32_t depth,
+		void (*cb)(const char *, int, void *), void *cbdata);
+
+/*
+ * Symmetric deletion index of approximate search, see symdel.c. Built by
+ * fsmtrie_compile() for tries with fsmtrie_opt_set_approx_index() and
+ * dropped by every update, searches without one walk the trie instead.
+ */
+#define FSMTRIE_APPROX_INDEX_MAX	2
+
+struct fsmtrie_symdel
+{
+	int max_dist;			/* deletions indexed per key */
+	uint32_t prefix;		/* key bytes indexed (0 == all) */
+	uint64_t *fps;			/* variant of every slot, 0 if free */
+	uint32_t *slots;		/* list of every slot */
+	uint32_t mask;			/* number of slots - 1 */
+	size_t nkeys;
+	unsigned char *keys;		/* key bytes, back to back */
+	size_t *koff;			/* nkeys + 1 offsets into keys */
+	const char **strs;		/* leaf string of every key */
+	uint32_t *lists;		/* nlists + 1 offsets into ids */
+	uint32_t *ids;			/* keys of every variant, ascending */
+};
+
+/* build the index of f unless there is one, sets the error on failure */
+bool _fsmtrie_symdel_build(struct fsmtrie *f);
+
+/* drop the index of f after an update, writer only */
+void _fsmtrie_symdel_drop(struct fsmtrie *f);
+
+/* approximate search by index, max_dist at most the deletions indexed */
+bool _fsmtrie_approx_symdel(struct fsmtrie_asearch_ctx *ctx,
+		const struct fsmtrie_symdel *sd, const unsigned char *key,
+		int keylen, int max_dist,
+		void (*cb)(const char *, int, void *), void *cbdata);
+
+/*
+ * Approximate search for a batch of keys by a walk of the trie shared by
+ * all of them, see abatch.c. Returns false if out of memory.
+ */
+bool _fsmtrie_approx_batch(const struct fsmtrie_view *view,
+		const char * const *keys, size_t nkeys, int max_dist,
+		uint32_t depth, void (*cb)(size_t, const char *, int, void *),
+		void *cbdata);
+
+/*
+ * DAWG tries, see dawg.c. Keys are added by _fsmtrie_dawg_insert() in
+ * ascending order until the DAWG is sealed, which the first search (or
+ * fsmtrie_compile()) does, thread-safe; searches of an unsealed DAWG must
+ * seal it first.
+ */
+struct fsmtrie_dawg *_fsmtrie_dawg_new(void);
+void _fsmtrie_dawg_free(struct fsmtrie_dawg *d);
+bool _fsmtrie_dawg_insert(struct fsmtrie *f, const char *key, size_t keylen,
+		const char *str, const char *func);
+bool _fsmtrie_dawg_seal(struct fsmtrie *f);
+int _fsmtrie_dawg_search(struct fsmtrie *f, const char *key, size_t keylen,
+		const char **str);
+void _fsmtrie_dawg_print_leaves(struct fsmtrie *f);
+
 #endif
@@ -0,0 +1,483 @@
+/*
+ * Fast String Matcher RCU Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/* reader slot of the calling thread, 0 until it is first needed */
+static __thread unsigned int _fsmtrie_rcu_tid;
+static unsigned int _fsmtrie_rcu_ntids;
+
+void
+_fsmtrie_rcu_pin(struct fsmtrie_rcu *rcu, struct fsmtrie_rcu_pin *pin)
+{
+	uint64_t epoch;
+
+	if (_fsmtrie_rcu_tid == 0)
+	{
+		_fsmtrie_rcu_tid = __atomic_add_fetch(&_fsmtrie_rcu_ntids, 1,
+				__ATOMIC_RELAXED);
+	}
+	pin->slot = &rcu->slots[_fsmtrie_rcu_tid % FSMTRIE_RCU_SLOTS];
+
+	/*
+	 * If the writer advanced the epoch between reading it and announcing
+	 * ourselves, it may not have seen us: announce again under the new
+	 * epoch. Nothing has been read from the trie yet.
+	 */
+	for (;;)
+	{
+		epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST);
+		pin->parity = epoch & 1;
+		__atomic_add_fetch(&pin->slot->cnt[pin->parity], 1,
+				__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) == epoch)
+		{
+			return;
+		}
+		__atomic_sub_fetch(&pin->slot->cnt[pin->parity], 1,
+				__ATOMIC_RELEASE);
+	}
+}
+
+/* number of readers in an epoch of the specified parity */
+static uint64_t
+_fsmtrie_rcu_readers(struct fsmtrie_rcu *rcu, unsigned int parity)
+{
+	uint64_t n = 0;
+	size_t i;
+
+	for (i = 0; i < FSMTRIE_RCU_SLOTS; i++)
+	{
+		n += __atomic_load_n(&rcu->slots[i].cnt[parity],
+				__ATOMIC_SEQ_CST);
+	}
+
+	return (n);
+}
+
+/*
+ * Add an arena object to a batch. If the batch can't grow the object stays
+ * allocated until the arena is destroyed.
+ */
+static void
+_fsmtrie_rcu_retire(struct fsmtrie_rcu_batch *b, void *p, size_t size)
+{
+	void **objs;
+	size_t *sizes, n;
+
+	if (b->nobjs == b->aobjs)
+	{
+		n = b->aobjs ? b->aobjs * 2 : 64;
+		if ((objs = realloc(b->objs, n * sizeof (*objs))) == NULL)
+		{
+			return;
+		}
+		b->objs = objs;
+		if ((sizes = realloc(b->sizes, n * sizeof (*sizes))) == NULL)
+		{
+			return;
+		}
+		b->sizes = sizes;
+		b->aobjs = n;
+	}
+	b->objs[b->nobjs] = p;
+	b->sizes[b->nobjs] = size;
+	b->nobjs++;
+}
+
+/* move everything retired in src over to dst */
+static void
+_fsmtrie_rcu_batch_move(struct fsmtrie_rcu_batch *dst,
+		struct fsmtrie_rcu_batch *src)
+{
+	struct fsmtrie_rcu_batch tmp;
+	struct fsmtrie_snap *snap;
+	size_t n;
+
+	if (dst->nobjs == 0 && dst->snaps == NULL)
+	{
+		tmp = *dst;
+		*dst = *src;
+		*src = tmp;
+		return;
+	}
+	for (n = 0; n < src->nobjs; n++)
+	{
+		_fsmtrie_rcu_retire(dst, src->objs[n], src->sizes[n]);
+	}
+	src->nobjs = 0;
+	while ((snap = src->snaps) != NULL)
+	{
+		src->snaps = snap->next;
+		snap->next = dst->snaps;
+		dst->snaps = snap;
+	}
+}
+
+/* free everything in a batch, keeping its arrays for reuse */
+static void
+_fsmtrie_rcu_batch_release(struct fsmtrie *f, struct fsmtrie_rcu_batch *b)
+{
+	struct fsmtrie_snap *snap;
+	size_t n;
+
+	for (n = 0; n < b->nobjs; n++)
+	{
+		_fsmtrie_arena_free(&f->arena, b->objs[n], b->sizes[n]);
+	}
+	b->nobjs = 0;
+	while ((snap = b->snaps) != NULL)
+	{
+		b->snaps = snap->next;
+		free(snap);
+	}
+}
+
+/*
+ * Advance the epoch as far as readers allow, freeing what was retired in
+ * epochs nobody is reading anymore. Never waits.
+ */
+static void
+_fsmtrie_rcu_reclaim(struct fsmtrie *f)
+{
+	struct fsmtrie_rcu *rcu = f->rcu;
+	struct fsmtrie_rcu_batch tmp;
+	int n;
+
+	/* order the publishing stores before the reader counts */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	/*
+	 * prev was retired before the current epoch began, so only readers
+	 * from the previous epoch can still see it. Once those are gone it
+	 * is freed and the current epoch becomes the previous one. Without
+	 * readers around this happens twice and cur is freed right away.
+	 */
+	for (n = 0; n < 2; n++)
+	{
+		if (_fsmtrie_rcu_readers(rcu, (rcu->epoch + 1) & 1) != 0)
+		{
+			return;
+		}
+		_fsmtrie_rcu_batch_release(f, &rcu->prev);
+		tmp = rcu->prev;
+		rcu->prev = rcu->cur;
+		rcu->cur = tmp;
+		__atomic_store_n(&rcu->epoch, rcu->epoch + 1,
+				__ATOMIC_SEQ_CST);
+	}
+}
+
+fsmtrie_node_t *
+_fsmtrie_rcu_own(struct fsmtrie *f, fsmtrie_node_t *parent, unsigned int c,
+		fsmtrie_node_t *node)
+{
+	struct fsmtrie_rcu *rcu = f->rcu;
+	struct fsmtrie_rcu_node *rn = node->aux.rcu, *crn;
+	fsmtrie_node_t *copy;
+	size_t tsize = 0;
+
+	if (rn->gen == rcu->gen)
+	{
+		return (node);
+	}
+
+	if ((copy = _fsmtrie_arena_alloc(&f->arena, sizeof (*copy))) == NULL)
+	{
+		return (NULL);
+	}
+	if ((crn = _fsmtrie_arena_alloc(&f->arena, sizeof (*crn))) == NULL)
+	{
+		_fsmtrie_arena_free(&f->arena, copy, sizeof (*copy));
+		return (NULL);
+	}
+	memcpy(copy, node, sizeof (*copy));
+	copy->aux.rcu = crn;
+	crn->gen = rcu->gen;
+	crn->key = rn->key;
+	crn->older = node;
+	if (node->tab != NULL)
+	{
+		copy->tab = _fsmtrie_tab_copy(&f->arena, node->tab, &tsize);
+		if (copy->tab == NULL)
+		{
+			_fsmtrie_arena_free(&f->arena, crn, sizeof (*crn));
+			_fsmtrie_arena_free(&f->arena, copy, sizeof (*copy));
+			return (NULL);
+		}
+	}
+
+	/* the parent is private already, nobody sees this yet */
+	if (parent == NULL)
+	{
+		f->wroot = copy;
+	}
+	else
+	{
+		_fsmtrie_tab_set(parent, c, copy);
+	}
+	__atomic_store_n(&rn->key->aux.key->newest, copy, __ATOMIC_RELEASE);
+
+	/* published versions keep using the originals until they retire */
+	_fsmtrie_rcu_retire(&rcu->unlinked, node, sizeof (*node));
+	_fsmtrie_rcu_retire(&rcu->unlinked, rn, sizeof (*rn));
+	if (node->tab != NULL)
+	{
+		_fsmtrie_rcu_retire(&rcu->unlinked, node->tab, tsize);
+	}
+
+	return (copy);
+}
+
+void
+_fsmtrie_rcu_unlink(struct fsmtrie *f, void *p, size_t size)
+{
+	_fsmtrie_rcu_retire(&f->rcu->unlinked, p, size);
+}
+
+bool
+_fsmtrie_rcu_node(struct fsmtrie *f, fsmtrie_node_t *parent, unsigned int c,
+		fsmtrie_node_t *node)
+{
+	struct fsmtrie_rcu_node *rn;
+	struct fsmtrie_rcu_key *rk;
+	fsmtrie_node_t *key;
+
+	rn = _fsmtrie_arena_alloc(&f->arena, sizeof (*rn));
+	key = _fsmtrie_arena_alloc(&f->arena, sizeof (*key));
+	rk = _fsmtrie_arena_alloc(&f->arena, sizeof (*rk));
+	if (rn == NULL || key == NULL || rk == NULL)
+	{
+		_fsmtrie_arena_free(&f->arena, rn, sizeof (*rn));
+		_fsmtrie_arena_free(&f->arena, key, sizeof (*key));
+		_fsmtrie_arena_free(&f->arena, rk, sizeof (*rk));
+		return (false);
+	}
+	rn->gen = f->rcu->gen;
+	rn->key = key;
+	node->aux.rcu = rn;
+
+	key->type = node->type;
+	key->depth = node->depth;
+	key->tval = c;
+	key->aux.key = rk;
+	rk->parent = parent != NULL ? _fsmtrie_rcu_key(parent) : NULL;
+	rk->newest = node;
+
+	return (true);
+}
+
+void
+_fsmtrie_rcu_unlink_node(struct fsmtrie *f, fsmtrie_node_t *node)
+{
+	struct fsmtrie_rcu_node *rn = node->aux.rcu;
+
+	/* readers may still follow links to the key node */
+	_fsmtrie_rcu_unlink(f, rn->key->aux.key, sizeof (*rn->key->aux.key));
+	_fsmtrie_rcu_unlink(f, rn->key, sizeof (*rn->key));
+	_fsmtrie_rcu_unlink(f, rn, sizeof (*rn));
+	_fsmtrie_rcu_unlink(f, node, sizeof (*node));
+}
+
+/*
+ * Make the newest copy of the node of a key node private to the generation
+ * being built, along with the published nodes above it.
+ */
+static fsmtrie_node_t *
+_fsmtrie_rcu_own_key(struct fsmtrie *f, fsmtrie_node_t *key)
+{
+	struct fsmtrie_rcu *rcu = f->rcu;
+	fsmtrie_node_t *k, *node, **path;
+	size_t n = 0, size;
+
+	/* copies go top down, from below the deepest private node */
+	for (k = key; k != NULL &&
+			k->aux.key->newest->aux.rcu->gen != rcu->gen;
+			k = k->aux.key->parent)
+	{
+		if (n == rcu->apath)
+		{
+			size = rcu->apath ? rcu->apath * 2 : 64;
+			path = realloc(rcu->path, size * sizeof (*path));
+			if (path == NULL)
+			{
+				return (NULL);
+			}
+			rcu->path = path;
+			rcu->apath = size;
+		}
+		rcu->path[n++] = k;
+	}
+	node = k != NULL ? k->aux.key->newest : NULL;
+	while (n-- > 0)
+	{
+		k = rcu->path[n];
+		if ((node = _fsmtrie_rcu_own(f, node, k->tval,
+						k->aux.key->newest)) == NULL)
+		{
+			return (NULL);
+		}
+	}
+
+	return (key->aux.key->newest);
+}
+
+bool
+_fsmtrie_rcu_sync(struct fsmtrie *f, fsmtrie_node_t *key)
+{
+	fsmtrie_node_t *node = key->aux.key->newest;
+
+	if (node->suffix == key->suffix && node->dict == key->dict &&
+			node->type == key->type)
+	{
+		return (true);
+	}
+	if (node->aux.rcu->gen != f->rcu->gen &&
+			(node = _fsmtrie_rcu_own_key(f, key)) == NULL)
+	{
+		return (false);
+	}
+	node->suffix = key->suffix;
+	node->dict = key->dict;
+	node->type = key->type;
+
+	return (true);
+}
+
+bool
+_fsmtrie_rcu_init(struct fsmtrie *f)
+{
+	struct fsmtrie_rcu *rcu;
+	void *p;
+
+	if (posix_memalign(&p, sizeof (struct fsmtrie_rcu_slot),
+				sizeof (*rcu)) != 0)
+	{
+		return (false);
+	}
+	rcu = memset(p, 0, sizeof (*rcu));
+	if ((rcu->snap = calloc(1, sizeof (*rcu->snap))) == NULL)
+	{
+		free(rcu);
+		return (false);
+	}
+	f->rcu = rcu;
+	f->wroot = f->root;
+
+	/* the empty trie is the first version */
+	rcu->gen = 1;
+	if (!_fsmtrie_rcu_node(f, NULL, 0, f->root) || !_fsmtrie_ac_compile(f))
+	{
+		free(rcu->snap);
+		free(rcu);
+		f->rcu = NULL;
+		f->wroot = NULL;
+		return (false);
+	}
+	rcu->snap->gen = rcu->gen++;
+	rcu->snap->root = f->root;
+
+	return (true);
+}
+
+void
+_fsmtrie_rcu_free(struct fsmtrie *f)
+{
+	struct fsmtrie_rcu *rcu = f->rcu;
+	struct fsmtrie_rcu_batch *batches[3];
+	size_t n;
+
+	if (rcu == NULL)
+	{
+		return;
+	}
+
+	/* retired objects live in the arena, which is going away anyway */
+	batches[0] = &rcu->unlinked;
+	batches[1] = &rcu->cur;
+	batches[2] = &rcu->prev;
+	for (n = 0; n < 3; n++)
+	{
+		batches[n]->nobjs = 0;
+		_fsmtrie_rcu_batch_release(f, batches[n]);
+		free(batches[n]->objs);
+		free(batches[n]->sizes);
+	}
+
+	free(rcu->path);
+	free(rcu->snap);
+	free(rcu);
+	f->rcu = NULL;
+	f->wroot = NULL;
+}
+
+bool
+fsmtrie_publish(struct fsmtrie *f)
+{
+	struct fsmtrie_rcu *rcu;
+	struct fsmtrie_snap *snap, *old;
+
+	if (f == NULL)
+	{
+		return (false);
+	}
+	if (f->rcu == NULL)
+	{
+		_fsmtrie_error(f, "%s() requires an RCU fsmtrie", __func__);
+		return (false);
+	}
+	rcu = f->rcu;
+	old = rcu->snap;
+
+	/* every insert copies the root, nothing changed if it didn't */
+	if (f->wroot != old->root)
+	{
+		if ((snap = calloc(1, sizeof (*snap))) == NULL)
+		{
+			_fsmtrie_error(f, "can't allocate version: %s",
+					strerror(errno));
+			return (false);
+		}
+
+		/*
+		 * Inserts and deletes keep the links up to date, this only
+		 * relinks the trie after one of them couldn't.
+		 */
+		if (!_fsmtrie_ac_compile(f))
+		{
+			/* error set by _fsmtrie_ac_compile() */
+			free(snap);
+			return (false);
+		}
+
+		snap->gen = rcu->gen;
+		snap->root = f->wroot;
+		__atomic_store_n(&f->root, snap->root, __ATOMIC_RELEASE);
+		__atomic_store_n(&rcu->snap, snap, __ATOMIC_RELEASE);
+
+		/* new nodes are now shared, inserts copy them from here on */
+		rcu->gen++;
+		_fsmtrie_rcu_batch_move(&rcu->cur, &rcu->unlinked);
+		old->next = rcu->cur.snaps;
+		rcu->cur.snaps = old;
+	}
+
+	_fsmtrie_rcu_reclaim(f);
+
+	return (true);
+}
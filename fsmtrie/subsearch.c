@@ -77,10 +77,177 @@ _fsmtrie_nodeq_dequeue(struct _fsmtrie_nodeq *q) {
         return n;
 }
 
+/*
+ * The links of RCU tries are maintained on key nodes (see struct fsmtrie_rcu)
+ * rather than on the nodes readers see, everything below works on those.
+ */
+static fsmtrie_node_t *
+_fsmtrie_ac_key(const struct fsmtrie *f, fsmtrie_node_t *node)
+{
+        return f->rcu != NULL ? _fsmtrie_rcu_key(node) : node;
+}
+
+static fsmtrie_node_t *
+_fsmtrie_ac_root(const struct fsmtrie *f)
+{
+        return _fsmtrie_ac_key(f, _fsmtrie_wroot(f));
+}
+
+static fsmtrie_node_t *
+_fsmtrie_ac_child(const struct fsmtrie *f, fsmtrie_node_t *node, int c)
+{
+        fsmtrie_node_t *child;
+
+        if (f->rcu == NULL)
+                return _fsmtrie_child(node, c);
+        child = _fsmtrie_child(node->aux.key->newest, c);
+        return child != NULL ? _fsmtrie_rcu_key(child) : NULL;
+}
+
+static int
+_fsmtrie_ac_child_next(const struct fsmtrie *f, fsmtrie_node_t *node, int c,
+                        fsmtrie_node_t **child)
+{
+        if (f->rcu == NULL)
+                return _fsmtrie_child_next(node, c, child);
+        c = _fsmtrie_child_next(node->aux.key->newest, c, child);
+        if (c >= 0)
+                *child = _fsmtrie_rcu_key(*child);
+        return c;
+}
+
+/*
+ * Update the Aho-Corasick metadata of a node. Under RCU the change goes on
+ * to a private copy of the node, published versions are left alone; if that
+ * copy can't be made the next fsmtrie_publish() relinks the whole trie.
+ */
 static void
-_fsmtrie_ac_compile(struct fsmtrie *f)
+_fsmtrie_ac_set(struct fsmtrie *f, fsmtrie_node_t *node,
+                        fsmtrie_node_t *suffix, fsmtrie_node_t *dict,
+                        uint8_t type)
+{
+        node->suffix = suffix;
+        node->dict = dict;
+        node->type = type;
+        if (f->rcu != NULL && !_fsmtrie_rcu_sync(f, node))
+                f->flags &= ~FSMTRIE_AC_LINKS;
+}
+
+/*
+ * Besides its suffix link, every node keeps the list of nodes whose suffix
+ * links point at it: the suffix links walked backwards form the failure
+ * tree, and the nodes under a node in that tree are exactly the nodes whose
+ * keys end with its key. That is what lets an insert find the few nodes
+ * whose links it changes.
+ */
+static void
+_fsmtrie_ac_tree_add(fsmtrie_node_t *node)
+{
+        struct fsmtrie_ftree *t = node->aux.tree, *st = node->suffix->aux.tree;
+
+        t->fprev = NULL;
+        t->fnext = st->fchild;
+        if (st->fchild != NULL)
+                st->fchild->aux.tree->fprev = node;
+        st->fchild = node;
+}
+
+static void
+_fsmtrie_ac_tree_del(fsmtrie_node_t *node)
+{
+        struct fsmtrie_ftree *t = node->aux.tree;
+
+        if (t->fprev != NULL)
+                t->fprev->aux.tree->fnext = t->fnext;
+        else
+                node->suffix->aux.tree->fchild = t->fnext;
+        if (t->fnext != NULL)
+                t->fnext->aux.tree->fprev = t->fprev;
+}
+
+/*
+ * Empty the failure tree under a node about to be linked, giving it room
+ * for the links first if it never had any.
+ */
+static bool
+_fsmtrie_ac_tree_init(struct fsmtrie *f, fsmtrie_node_t *node)
 {
-        fsmtrie_node_t *node, *child, *suffix;
+        if (node->aux.tree == NULL)
+        {
+                node->aux.tree = _fsmtrie_arena_alloc(&f->arena,
+                                sizeof (*node->aux.tree));
+                if (node->aux.tree == NULL)
+                        return false;
+        }
+        node->aux.tree->fchild = NULL;
+        return true;
+}
+
+/*
+ * Next node of a preorder walk of the failure tree under top, skipping the
+ * nodes under node unless descend is set.
+ */
+static fsmtrie_node_t *
+_fsmtrie_ac_tree_next(fsmtrie_node_t *top, fsmtrie_node_t *node, bool descend)
+{
+        if (descend && node->aux.tree->fchild != NULL)
+                return node->aux.tree->fchild;
+        for (; node != top; node = node->suffix)
+        {
+                if (node->aux.tree->fnext != NULL)
+                        return node->aux.tree->fnext;
+        }
+        return NULL;
+}
+
+/* longest proper suffix of the child reached from node through c */
+static fsmtrie_node_t *
+_fsmtrie_ac_suffix(struct fsmtrie *f, fsmtrie_node_t *node, int c)
+{
+        fsmtrie_node_t *link, *next;
+
+        for (link = node->suffix; link; link = link->suffix)
+        {
+                if ((next = _fsmtrie_ac_child(f, link, c)) != NULL)
+                        return next;
+        }
+        return _fsmtrie_ac_root(f);
+}
+
+/*
+ * Point the suffix link of a node at suffix. The dictionary link skips over
+ * the suffixes that aren't leaves: it is the suffix itself if that is a
+ * leaf, otherwise the suffix's own dictionary link.
+ */
+static void
+_fsmtrie_ac_point(struct fsmtrie *f, fsmtrie_node_t *node,
+                        fsmtrie_node_t *suffix)
+{
+        fsmtrie_node_t *root = _fsmtrie_ac_root(f);
+        uint8_t type;
+
+        if (node->type & FSMTRIE_NODE_LEAF)
+                type = node->type | FSMTRIE_NODE_OUTPUT;
+        else
+                type = node->type & ~FSMTRIE_NODE_OUTPUT;
+        if (suffix != root && (suffix->type & FSMTRIE_NODE_OUTPUT))
+                type |= FSMTRIE_NODE_OUTPUT;
+
+        _fsmtrie_ac_set(f, node, suffix,
+                        (suffix->type & FSMTRIE_NODE_LEAF) ?
+                        suffix : suffix->dict, type);
+}
+
+/*
+ * Compute the links of every node, breadth-first so that a node's suffixes
+ * are done before the node itself. Returns false if the queue or the
+ * failure tree can't be allocated or the queue overflows, leaving the links
+ * half done.
+ */
+static bool
+_fsmtrie_ac_link(struct fsmtrie *f)
+{
+        fsmtrie_node_t *root, *node, *child;
         struct _fsmtrie_nodeq queue;
         int c;
 
@@ -88,87 +255,365 @@ _fsmtrie_ac_compile(struct fsmtrie *f)
          * During the traversal, the queue will contain less than two
          * levels of the trie. Each level of the trie contains at most
          * a number of nodes equal to the leaf nodes (inserted strings)
-         * in the trie. This provides an upper bound for the queue length.
+         * in the trie. This provides an upper bound for the queue length,
+         * plus room for the root node.
          */
-        assert(_fsmtrie_nodeq_init(&queue, 2 * f->node_cnt));
+        if (!_fsmtrie_nodeq_init(&queue, 2 * f->node_cnt + 2))
+                return false;
 
         /*
          * The root node has no proper suffix. The single-character
          * nodes have no nonempty proper suffixes, but the root node
          * is their empty proper suffix.
          */
-        f->root->suffix = NULL;
-        for (c = 0; c < f->nrnodes; c++)
+        root = _fsmtrie_ac_root(f);
+        root->suffix = NULL;
+        root->dict = NULL;
+        if (!_fsmtrie_ac_tree_init(f, root))
         {
-                if (f->root->nodes[c] == NULL)
-                        continue;
-                f->root->nodes[c]->suffix = f->root;
-                assert(_fsmtrie_nodeq_enqueue(&queue, f->root->nodes[c]));
+                _fsmtrie_nodeq_destroy(&queue);
+                return false;
         }
+        (void)_fsmtrie_nodeq_enqueue(&queue, root);
 
         while (!_fsmtrie_nodeq_empty(&queue))
         {
                 node = _fsmtrie_nodeq_dequeue(&queue);
                 assert(node != NULL);
-                for (c = 0; c < f->nrnodes; c++) {
+                for (c = _fsmtrie_ac_child_next(f, node, 0, &child); c >= 0;
+                                c = _fsmtrie_ac_child_next(f, node, c + 1,
+                                        &child)) {
 
-                        if (node->nodes[c] == NULL)
-                                continue;
+                        /* only if node_cnt is off */
+                        if (!_fsmtrie_nodeq_enqueue(&queue, child))
+                        {
+                                _fsmtrie_nodeq_destroy(&queue);
+                                errno = EOVERFLOW;
+                                return false;
+                        }
 
-                        child = node->nodes[c];
-                        assert(_fsmtrie_nodeq_enqueue(&queue, child));
+                        /*
+                         *  Nothing points at the child yet: the nodes
+                         *  whose suffix it is are deeper.
+                         */
+                        if (!_fsmtrie_ac_tree_init(f, child))
+                        {
+                                _fsmtrie_nodeq_destroy(&queue);
+                                return false;
+                        }
+                        _fsmtrie_ac_point(f, child,
+                                        _fsmtrie_ac_suffix(f, node, c));
+                        _fsmtrie_ac_tree_add(child);
+                }
+        }
+        _fsmtrie_nodeq_destroy(&queue);
 
-                        child->suffix = f->root;
-                        if (child->type & FSMTRIE_NODE_LEAF)
-                                child->type |= FSMTRIE_NODE_OUTPUT;
-                        else
-                                child->type &= ~FSMTRIE_NODE_OUTPUT;
+        return true;
+}
 
+/*
+ * Link the new node reached from parent through c. Before that, every
+ * longer node whose key now ends with the new node's key has to fall back
+ * to it. Such a node is the c child of some node X ending with the parent's
+ * key, which makes X the parent itself or a node under it in the failure
+ * tree. If X already had a c child, the nodes under X have c children that
+ * end with that one and their suffixes are at least as long as it, so the
+ * walk skips them.
+ */
+static bool
+_fsmtrie_ac_add_node(struct fsmtrie *f, fsmtrie_node_t *parent, int c,
+                        fsmtrie_node_t *node)
+{
+        fsmtrie_node_t *x, *child, **moved = NULL, **tmp;
+        size_t n, nmoved = 0, amoved = 0;
+        bool descend;
 
-                        /*
-                         *  Traverse the parent's suffixes to find the longest
-                         *  suffix for the child node.
-                         */
-                        for (suffix = node->suffix; suffix; suffix = suffix->suffix)
+        /*
+         * Moving nodes around the failure tree while walking it would make
+         * the walk lose its way, so collect them first.
+         */
+        for (x = _fsmtrie_ac_tree_next(parent, parent, true); x != NULL;
+                        x = _fsmtrie_ac_tree_next(parent, x, descend))
+        {
+                child = _fsmtrie_ac_child(f, x, c);
+                descend = child == NULL;
+                if (child == NULL || child->suffix->depth >= node->depth)
+                        continue;
+                if (nmoved == amoved)
+                {
+                        amoved = amoved ? amoved * 2 : 16;
+                        tmp = realloc(moved, amoved * sizeof (*moved));
+                        if (tmp == NULL)
                         {
-                                if (suffix->nodes[c] == NULL)
-                                        continue;
-                                child->suffix = suffix->nodes[c];
-                                if (child->suffix->type & FSMTRIE_NODE_OUTPUT)
-                                        child->type |= FSMTRIE_NODE_OUTPUT;
-                                break;
+                                free(moved);
+                                return false;
                         }
+                        moved = tmp;
+                }
+                moved[nmoved++] = child;
+        }
+
+        if (!_fsmtrie_ac_tree_init(f, node))
+        {
+                free(moved);
+                return false;
+        }
+        _fsmtrie_ac_point(f, node, _fsmtrie_ac_suffix(f, parent, c));
+        _fsmtrie_ac_tree_add(node);
+
+        for (n = 0; n < nmoved; n++)
+        {
+                _fsmtrie_ac_tree_del(moved[n]);
+                _fsmtrie_ac_point(f, moved[n], node);
+                _fsmtrie_ac_tree_add(moved[n]);
+        }
+        free(moved);
+
+        return true;
+}
+
+void
+_fsmtrie_ac_add(struct fsmtrie *f, fsmtrie_node_t *parent,
+                        const unsigned char *p, const unsigned char *end,
+                        fsmtrie_node_t *leaf)
+{
+        fsmtrie_node_t *root = _fsmtrie_ac_root(f), *node;
+        bool descend;
 
+        /*
+         * A new empty key would be the dictionary link of almost every
+         * node, start over instead.
+         */
+        leaf = _fsmtrie_ac_key(f, leaf);
+        if (leaf == root)
+        {
+                f->flags &= ~FSMTRIE_AC_LINKS;
+                return;
+        }
+
+        /* the new nodes, shortest first */
+        if (parent != NULL)
+                parent = _fsmtrie_ac_key(f, parent);
+        for (; parent != NULL && p < end; p++)
+        {
+                node = _fsmtrie_ac_child(f, parent, *p);
+                if (!_fsmtrie_ac_add_node(f, parent, *p, node))
+                {
+                        f->flags &= ~FSMTRIE_AC_LINKS;
+                        return;
                 }
+                parent = node;
+        }
+
+        /*
+         * The new leaf is the dictionary link of the nodes under it in the
+         * failure tree, down to and including the next leaves, and they now
+         * have output. The nodes under those leaves link to them.
+         */
+        for (node = _fsmtrie_ac_tree_next(leaf, leaf, true); node != NULL;
+                        node = _fsmtrie_ac_tree_next(leaf, node, descend))
+        {
+                descend = (node->type & FSMTRIE_NODE_LEAF) == 0;
+                _fsmtrie_ac_set(f, node, node->suffix, leaf,
+                                node->type | FSMTRIE_NODE_OUTPUT);
         }
-        _fsmtrie_nodeq_destroy(&queue);
-        f->flags |= FSMTRIE_AC_COMPILED;
 }
 
-int
-fsmtrie_search_substring(struct fsmtrie *f, const char *str,
-                        void (*cb)(const char *, int, void *), void *cbdata)
+void
+_fsmtrie_ac_del(struct fsmtrie *f, fsmtrie_node_t *leaf,
+                        fsmtrie_node_t * const *pruned, size_t npruned)
 {
-        fsmtrie_node_t *node, *next, *n;
-        const unsigned char *c;
+        fsmtrie_node_t *root = _fsmtrie_ac_root(f), *node, *next, *x;
+        bool descend;
 
-	if (f->mode == fsmtrie_mode_token)
-	{
-		snprintf(f->err_buf,
-			sizeof (f->err_buf),
-			"%s() is incompatible with %s mode fsmtrie",
-			__func__, _mode_to_str(f->mode));
-		return (-1);
-	}
+        leaf = _fsmtrie_ac_key(f, leaf);
+        if (leaf == root)
+        {
+                f->flags &= ~FSMTRIE_AC_LINKS;
+                return;
+        }
+
+        /*
+         * The nodes under the old leaf in the failure tree, down to and
+         * including the next leaves, fall back to its own dictionary link
+         * and may lose their output. Preorder gets to every node after its
+         * suffix, which is what the new links are computed from. A pruned
+         * leaf's own links don't matter anymore.
+         */
+        if (npruned == 0)
+                _fsmtrie_ac_point(f, leaf, leaf->suffix);
+        for (node = _fsmtrie_ac_tree_next(leaf, leaf, true); node != NULL;
+                        node = _fsmtrie_ac_tree_next(leaf, node, descend))
+        {
+                descend = (node->type & FSMTRIE_NODE_LEAF) == 0;
+                _fsmtrie_ac_point(f, node, node->suffix);
+        }
+
+        /*
+         * The suffix of a pruned node is the longest suffix left of the
+         * nodes linking to it. None of them changes its dictionary link or
+         * output, pruned nodes aren't leaves. Deepest first, a pruned node
+         * may be the suffix of a deeper one.
+         */
+        while (npruned-- > 0)
+        {
+                x = _fsmtrie_ac_key(f, pruned[npruned]);
+                _fsmtrie_ac_tree_del(x);
+                for (node = x->aux.tree->fchild; node != NULL; node = next)
+                {
+                        next = node->aux.tree->fnext;
+                        _fsmtrie_ac_point(f, node, x->suffix);
+                        _fsmtrie_ac_tree_add(node);
+                }
+        }
+}
+
+bool
+_fsmtrie_ac_compile(struct fsmtrie *f)
+{
+        if ((f->flags & FSMTRIE_AC_LINKS) == 0 && !_fsmtrie_ac_link(f))
+        {
+                /* the next compile starts over, nothing uses the links */
+                f->flags &= ~(FSMTRIE_AC_LINKS | FSMTRIE_AC_COMPILED);
+                _fsmtrie_error(f, "can't link Aho-Corasick metadata: %s",
+                                strerror(errno));
+                return false;
+        }
+
+        /*
+         * If the table can't be built, search follows suffix links. RCU
+         * tries always do, a table would have to be rebuilt per version.
+         */
+        if ((f->flags & FSMTRIE_AC_DFA) && f->rcu == NULL)
+                (void)_fsmtrie_dfa_build(f);
 
-        assert(f->root);
+        /* publish the metadata to readers checking the flag without lock,
+         * RCU tries never clear it */
+        if ((f->flags & (FSMTRIE_AC_COMPILED | FSMTRIE_AC_LINKS)) !=
+                        (FSMTRIE_AC_COMPILED | FSMTRIE_AC_LINKS))
+                __atomic_or_fetch(&f->flags,
+                                FSMTRIE_AC_COMPILED | FSMTRIE_AC_LINKS,
+                                __ATOMIC_RELEASE);
 
+        return true;
+}
+
+bool
+_fsmtrie_ac_ensure(struct fsmtrie *f)
+{
+        bool ok = true;
+
+        if (__atomic_load_n(&f->flags, __ATOMIC_ACQUIRE) &
+                        FSMTRIE_AC_COMPILED)
+                return true;
+
+        /* concurrent readers may race to get here, only one compiles */
+        pthread_mutex_lock(&f->lock);
         if ((f->flags & FSMTRIE_AC_COMPILED) == 0)
-                _fsmtrie_ac_compile(f);
+                ok = _fsmtrie_ac_compile(f);
+        pthread_mutex_unlock(&f->lock);
+
+        return ok;
+}
+
+bool
+fsmtrie_compile(struct fsmtrie *f)
+{
+        if (f == NULL)
+        {
+                return (false);
+        }
+        if (_fsmtrie_root(f) == NULL && f->img == NULL && f->dawg == NULL)
+        {
+                _fsmtrie_error(f, "uninitialized trie");
+                return (false);
+        }
+
+        /* images are saved compiled, token tries have nothing to compile */
+        if (f->dawg != NULL)
+        {
+                /* nor do DAWGs, which only take no further keys */
+                if (!_fsmtrie_dawg_seal(f))
+                {
+                        /* error set by _fsmtrie_dawg_seal() */
+                        return (false);
+                }
+        }
+        else if (f->img == NULL && f->mode != fsmtrie_mode_token &&
+                        !_fsmtrie_ac_ensure(f))
+        {
+                /* error set by _fsmtrie_ac_compile() */
+                return (false);
+        }
+
+        /* frozen tries keep their options, and so get an index too */
+        if (f->approx_index > 0 && f->mode != fsmtrie_mode_token &&
+                        !_fsmtrie_symdel_build(f))
+        {
+                /* error set by _fsmtrie_symdel_build() */
+                return (false);
+        }
+
+        return (true);
+}
+
+/*
+ * Report every match ending at offset end of the stream, given the node
+ * reached after consuming the byte before it. Links are followed in the
+ * version of generation gen, see _fsmtrie_link().
+ */
+static void
+_fsmtrie_report_matches(const struct fsmtrie_scanner *s, fsmtrie_node_t *node,
+                        uint64_t gen, uint64_t end)
+{
+        fsmtrie_node_t *n;
+
+        /*
+         *  The node itself may be a match, after that the dictionary
+         *  links lead straight from one matching suffix to the next.
+         */
+        n = (node->type & FSMTRIE_NODE_LEAF) ? node :
+                _fsmtrie_link(node->dict, gen);
+        for (; n; n = _fsmtrie_link(n->dict, gen))
+        {
+                s->cb(n->str, end - n->depth, s->cbdata);
+        }
+}
 
-        node = f->root;
-        for (c = (unsigned char *)str; *c; c++) {
-                next = node->nodes[(int)*c];
+/*
+ * Scan driven by the DFA, one table lookup per byte. Starts in the specified
+ * state and returns the state reached.
+ */
+static uint32_t
+_fsmtrie_dfa_scan(struct fsmtrie_scanner *s, const struct fsmtrie_dfa *dfa,
+                        uint32_t state, const unsigned char *buf, size_t len)
+{
+        const uint32_t *delta = dfa->delta;
+        const uint8_t *classes = dfa->classes;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                state = delta[state + classes[buf[i]]];
+                if (state < dfa->mlim)
+                        _fsmtrie_report_matches(s,
+                                dfa->nodes[state / dfa->nclasses], 0,
+                                s->off + i + 1);
+        }
+        s->node = dfa->nodes[state / dfa->nclasses];
+
+        return (state);
+}
+
+/* scan following suffix links, in the version of generation gen (RCU) */
+static void
+_fsmtrie_nfa_scan(struct fsmtrie_scanner *s, fsmtrie_node_t *root,
+                        uint64_t gen, const unsigned char *buf, size_t len)
+{
+        fsmtrie_node_t *node = s->node, *next;
+        size_t i;
+
+        for (i = 0; i < len; i++) {
+                next = _fsmtrie_child(node, buf[i]);
 
                 /*
                  * If our current path does not continue, walk the list of
@@ -177,36 +622,215 @@ fsmtrie_search_substring(struct fsmtrie *f, const char *str,
                  */
                 while (next == NULL)
                 {
-                        node = node->suffix;
+                        node = _fsmtrie_link(node->suffix, gen);
                         if (node == NULL)
-                                next = f->root;
+                                next = root;
                         else
-                                next = node->nodes[(int)*c];
+                                next = _fsmtrie_child(node, buf[i]);
                 }
                 node = next;
 
                 if (node->type & FSMTRIE_NODE_OUTPUT)
+                        _fsmtrie_report_matches(s, node, gen,
+                                        s->off + i + 1);
+        }
+        s->node = node;
+}
+
+static void
+_fsmtrie_scanner_start(struct fsmtrie_scanner *s, struct fsmtrie *f,
+                void (*cb)(const char *, uint64_t, void *), void *cbdata)
+{
+        s->f = f;
+        s->node = _fsmtrie_root(f);
+        s->inode = 0;
+        s->gen = 0;
+        s->prunes = f->prunes;
+        s->off = 0;
+        s->cb = cb;
+        s->cbdata = cbdata;
+}
+
+/*
+ * Scan the published version of an RCU trie. The node a scanner stopped at
+ * may have been reclaimed since, so a scanner that last ran on an older
+ * version starts over at the root of the current one.
+ */
+static void
+_fsmtrie_rcu_scan(struct fsmtrie_scanner *s, const unsigned char *buf,
+                        size_t len)
+{
+        struct fsmtrie_rcu_pin pin;
+        const struct fsmtrie_snap *snap;
+
+        _fsmtrie_rcu_enter(s->f, &pin);
+        snap = __atomic_load_n(&s->f->rcu->snap, __ATOMIC_ACQUIRE);
+        if (s->gen != snap->gen)
+        {
+                s->gen = snap->gen;
+                s->node = snap->root;
+        }
+        _fsmtrie_nfa_scan(s, snap->root, snap->gen, buf, len);
+        _fsmtrie_rcu_exit(&pin);
+}
+
+/*
+ * Scanners hold the automaton state as a trie node (or image node index)
+ * rather than a DFA state, nodes don't move when the trie grows or the DFA
+ * is rebuilt.
+ */
+static int
+_fsmtrie_scan(struct fsmtrie_scanner *s, const unsigned char *buf, size_t len)
+{
+        struct fsmtrie *f = s->f;
+
+        if (f->img != NULL)
+        {
+                _fsmtrie_image_scan(s, buf, len);
+        }
+        else if (f->rcu != NULL)
+        {
+                _fsmtrie_rcu_scan(s, buf, len);
+        }
+        else
+        {
+                if (!_fsmtrie_ac_ensure(f))
                 {
-                        /*
-                         *  Traverse the suffix list. Any leaf node on this
-                         *  list is a match.
-                         */
-                        for (n = node; n; n = n->suffix)
-                        {
-                                if (n->type & FSMTRIE_NODE_LEAF) {
-					/*
-					 * amoff is the offset in the subject
-					 * string of the first character after
-					 * the match. moff is the offset of
-					 * the match string in the subject
-					 * string.
-					 */
-					int amoff = (int)(c - (unsigned char *)str) + 1;
-					int moff = amoff - strlen(n->str);
-                                        cb(n->str, moff, cbdata);
-				}
-                        }
+                        /* error set by _fsmtrie_ac_compile() */
+                        return (-1);
                 }
+
+                /* the node the scanner stopped at may have been deleted */
+                if (s->prunes != f->prunes)
+                {
+                        s->prunes = f->prunes;
+                        s->node = f->root;
+                }
+
+                if (f->dfa != NULL)
+                        (void)_fsmtrie_dfa_scan(s, f->dfa, s->node->state,
+                                        buf, len);
+                else
+                        _fsmtrie_nfa_scan(s, f->root, 0, buf, len);
+        }
+        s->off += len;
+
+        return (1);
+}
+
+static bool
+_fsmtrie_scanner_check(struct fsmtrie *f, const char *func)
+{
+	if (f->mode == fsmtrie_mode_token)
+	{
+		_fsmtrie_error(f, "%s() is incompatible with %s mode fsmtrie",
+			func, _mode_to_str(f->mode));
+		return (false);
+	}
+	if (f->dawg != NULL)
+	{
+		/* a DAWG state has no single suffix link */
+		_fsmtrie_error(f, "%s() is incompatible with DAWG fsmtries",
+			func);
+		return (false);
+	}
+	return (true);
+}
+
+/* adapts the stream callback to the fsmtrie_search_substring() one */
+struct _fsmtrie_substring_cb
+{
+        void (*cb)(const char *, int, void *);
+        void *cbdata;
+};
+
+static void
+_fsmtrie_substring_report(const char *str, uint64_t off, void *data)
+{
+        struct _fsmtrie_substring_cb *sc = data;
+
+        sc->cb(str, (int)off, sc->cbdata);
+}
+
+static int
+_fsmtrie_search_substring(struct fsmtrie *f, const char *str, size_t len,
+                        void (*cb)(const char *, int, void *), void *cbdata,
+                        const char *func)
+{
+        struct fsmtrie_scanner s;
+        struct _fsmtrie_substring_cb sc;
+
+        if (!_fsmtrie_scanner_check(f, func))
+        {
+                return (-1);
         }
-	return (1);
+
+        sc.cb = cb;
+        sc.cbdata = cbdata;
+        _fsmtrie_scanner_start(&s, f, _fsmtrie_substring_report, &sc);
+
+        return (_fsmtrie_scan(&s, (const unsigned char *)str, len));
+}
+
+int
+fsmtrie_search_substring(struct fsmtrie *f, const char *str,
+                        void (*cb)(const char *, int, void *), void *cbdata)
+{
+        return (_fsmtrie_search_substring(f, str, strlen(str), cb, cbdata,
+                                __func__));
+}
+
+int
+fsmtrie_search_substring_n(struct fsmtrie *f, const char *str, size_t len,
+                        void (*cb)(const char *, int, void *), void *cbdata)
+{
+        return (_fsmtrie_search_substring(f, str, len, cb, cbdata, __func__));
+}
+
+struct fsmtrie_scanner *
+fsmtrie_scanner_init(struct fsmtrie *f,
+                void (*cb)(const char *, uint64_t, void *), void *cbdata)
+{
+        struct fsmtrie_scanner *s;
+
+        if (!_fsmtrie_scanner_check(f, __func__))
+        {
+                return (NULL);
+        }
+
+        s = calloc(1, sizeof (*s));
+        if (s == NULL)
+        {
+                _fsmtrie_error(f, "can't allocate scanner: %s",
+                                strerror(errno));
+                return (NULL);
+        }
+        _fsmtrie_scanner_start(s, f, cb, cbdata);
+
+        return (s);
+}
+
+int
+fsmtrie_scanner_feed(struct fsmtrie_scanner *s, const void *buf, size_t len)
+{
+        return (_fsmtrie_scan(s, buf, len));
+}
+
+void
+fsmtrie_scanner_reset(struct fsmtrie_scanner *s)
+{
+        _fsmtrie_scanner_start(s, s->f, s->cb, s->cbdata);
+}
+
+uint64_t
+fsmtrie_scanner_get_offset(struct fsmtrie_scanner *s)
+{
+        return (s->off);
+}
+
+void
+fsmtrie_scanner_destroy(struct fsmtrie_scanner **s)
+{
+        free(*s);
+        *s = NULL;
 }
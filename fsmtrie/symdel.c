@@ -0,0 +1,610 @@
+/*
+ * Fast String Matcher Symmetric Deletion Index Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+/*
+ * Two strings within an edit distance of k can be made equal by deleting at
+ * most k characters from each (a substitution or a transposition costs one
+ * deletion on either side, an insertion or a deletion one on one side).
+ * The index maps every string obtained by deleting up to k characters from
+ * a key to the keys it was obtained from, so the keys within k of a query
+ * are among those listed under the query's own deletion variants: a few
+ * exact lookups instead of a walk of the trie. Candidates are then sorted
+ * back into key order and their distance computed, as variants admit
+ * strings up to 2k apart.
+ *
+ * Variants are kept as 64-bit hashes in an open addressing table, each slot
+ * naming a list of keys in one array; a trie of the variants themselves
+ * would take a dozen nodes per variant. Variants that happen to share a
+ * hash merely share a list, their keys are checked all the same.
+ *
+ * Only the first prefix bytes of keys and queries are varied: prefixes of
+ * strings within k of each other are themselves within k, so lookups still
+ * find every match, at the cost of more candidates to check. This bounds
+ * the variants of long keys, whose count grows with the k-th power of their
+ * length.
+ */
+
+/* \cond */
+/* state of an index build */
+struct _fsmtrie_symdel_build
+{
+	struct fsmtrie_symdel *sd;
+	struct fsmtrie_buf pairs;	/* (list, key) of every variant */
+	size_t npairs;
+	struct fsmtrie_buf last;	/* last key + 1 listed per list */
+	uint32_t nlists;
+	uint32_t id;			/* key being indexed */
+};
+
+/* state of a lookup */
+struct _fsmtrie_symdel_query
+{
+	const struct fsmtrie_symdel *sd;
+	struct fsmtrie_buf *buf;
+	uint32_t *cand;			/* keys listed under the variants */
+	size_t ncand;
+};
+/* \endcond */
+
+#define FSMTRIE_SYMDEL_FNV_BASIS	14695981039346656037ULL
+#define FSMTRIE_SYMDEL_FNV_PRIME	1099511628211ULL
+
+/* continue hash h over p[from..to), except for position skip */
+static uint64_t
+_fsmtrie_symdel_hash(uint64_t h, const unsigned char *p, int from, int to,
+		int skip)
+{
+	int i;
+
+	for (i = from; i < to; i++)
+	{
+		if (i != skip)
+		{
+			h = (h ^ p[i]) * FSMTRIE_SYMDEL_FNV_PRIME;
+		}
+	}
+	return (h);
+}
+
+/* first slot of the probe sequence of fp */
+static inline uint32_t
+_fsmtrie_symdel_slot(const struct fsmtrie_symdel *sd, uint64_t fp)
+{
+	return ((uint32_t)(fp ^ (fp >> 32)) & sd->mask);
+}
+
+/*
+ * Call fn with the hash of every string obtained by deleting up to max_dist
+ * of the plen bytes of p, path being room for plen + 1 hashes. Deleting
+ * either of two equal adjacent bytes gives the same string, only the first
+ * is deleted. Hashes are never 0. Returns false if fn does.
+ */
+static bool
+_fsmtrie_symdel_variants(uint64_t *path, const unsigned char *p, int plen,
+		int max_dist, bool (*fn)(void *, uint64_t), void *arg)
+{
+	uint64_t h;
+	int i, j;
+
+	/* the hashes of the undeleted prefixes are shared by all variants */
+	path[0] = FSMTRIE_SYMDEL_FNV_BASIS;
+	for (i = 0; i < plen; i++)
+	{
+		path[i + 1] = _fsmtrie_symdel_hash(path[i], p, i, i + 1, -1);
+	}
+
+	for (i = -1; i < plen; i++)
+	{
+		if (i >= 0 && (max_dist < 1 || (i > 0 && p[i] == p[i - 1])))
+		{
+			continue;
+		}
+		h = i < 0 ? path[plen] :
+			_fsmtrie_symdel_hash(path[i], p, i + 1, plen, -1);
+		if (!fn(arg, h ? h : 1))
+		{
+			return (false);
+		}
+
+		for (j = i + 1; i >= 0 && max_dist > 1 && j < plen; j++)
+		{
+			if (j > i + 1 && p[j] == p[j - 1])
+			{
+				continue;
+			}
+			h = _fsmtrie_symdel_hash(path[i], p, i + 1, plen, j);
+			if (!fn(arg, h ? h : 1))
+			{
+				return (false);
+			}
+		}
+	}
+
+	return (true);
+}
+
+/* double the slots of the table under construction */
+static bool
+_fsmtrie_symdel_rehash(struct fsmtrie_symdel *sd)
+{
+	uint32_t size = sd->fps != NULL ? (sd->mask + 1) * 2 : 1024;
+	uint64_t *fps;
+	uint32_t *slots, n, s;
+
+	if (size == 0)
+	{
+		errno = ENOMEM;
+		return (false);
+	}
+	fps = calloc(size, sizeof (*fps));
+	slots = malloc((size_t)size * sizeof (*slots));
+	if (fps == NULL || slots == NULL)
+	{
+		free(fps);
+		free(slots);
+		return (false);
+	}
+
+	for (n = 0; sd->fps != NULL && n <= sd->mask; n++)
+	{
+		if (sd->fps[n] == 0)
+		{
+			continue;
+		}
+		s = (uint32_t)(sd->fps[n] ^ (sd->fps[n] >> 32)) & (size - 1);
+		for (; fps[s] != 0; s = (s + 1) & (size - 1))
+			;
+		fps[s] = sd->fps[n];
+		slots[s] = sd->slots[n];
+	}
+	free(sd->fps);
+	free(sd->slots);
+	sd->fps = fps;
+	sd->slots = slots;
+	sd->mask = size - 1;
+
+	return (true);
+}
+
+/* list the key being indexed under variant fp */
+static bool
+_fsmtrie_symdel_post(void *arg, uint64_t fp)
+{
+	struct _fsmtrie_symdel_build *b = arg;
+	struct fsmtrie_symdel *sd = b->sd;
+	uint32_t *last, *pair, s, l;
+
+	for (s = _fsmtrie_symdel_slot(sd, fp); sd->fps[s] != 0 &&
+			sd->fps[s] != fp; s = (s + 1) & sd->mask)
+		;
+	if (sd->fps[s] == 0)
+	{
+		last = _fsmtrie_buf_reserve(&b->last,
+				((size_t)b->nlists + 1) * sizeof (*last));
+		if (last == NULL || b->nlists == UINT32_MAX - 1)
+		{
+			return (false);
+		}
+		last[b->nlists] = 0;
+		sd->fps[s] = fp;
+		sd->slots[s] = b->nlists++;
+	}
+	l = sd->slots[s];
+
+	/* the same variant may come from several deletions */
+	last = b->last.p;
+	if (last[l] == b->id + 1)
+	{
+		return (true);
+	}
+	last[l] = b->id + 1;
+
+	pair = _fsmtrie_buf_reserve(&b->pairs,
+			(b->npairs + 1) * 2 * sizeof (*pair));
+	if (pair == NULL || b->npairs == UINT32_MAX)
+	{
+		return (false);
+	}
+	pair[2 * b->npairs] = l;
+	pair[2 * b->npairs + 1] = b->id;
+	b->npairs++;
+
+	/* keep the table at most half full */
+	if ((size_t)b->nlists * 2 > sd->mask &&
+			!_fsmtrie_symdel_rehash(sd))
+	{
+		return (false);
+	}
+
+	return (true);
+}
+
+/* list the keys of f in the order of a walk of the trie */
+static bool
+_fsmtrie_symdel_keys(struct fsmtrie *f, struct fsmtrie_symdel *sd)
+{
+	struct fsmtrie_buf keys = { NULL, 0 }, koff = { NULL, 0 },
+		strs = { NULL, 0 };
+	struct fsmtrie_view view;
+	fsmtrie_ref_t *nodes, node, child;
+	unsigned char *path;
+	int *chars, c;
+	size_t n = (size_t)f->depth + 1, len = 0;
+	uint32_t i = 0;
+	bool ok = false;
+
+	nodes = malloc(n * sizeof (*nodes));
+	chars = malloc(n * sizeof (*chars));
+	path = malloc(n);
+	if (nodes == NULL || chars == NULL || path == NULL ||
+			!_fsmtrie_buf_reserve(&koff, sizeof (size_t)))
+	{
+		goto out;
+	}
+	((size_t *)koff.p)[0] = 0;
+
+	/* live tries and frozen ones alike */
+	_fsmtrie_view_init(&view, f);
+	node = _fsmtrie_view_root(&view);
+	chars[0] = 0;
+	while (true)
+	{
+		c = _fsmtrie_view_next(&view, node, chars[i], &child);
+		if (c < 0)
+		{
+			if (i == 0)
+			{
+				break;
+			}
+			node = nodes[--i];
+			continue;
+		}
+		chars[i] = c + 1;
+		path[i] = c;
+		nodes[i++] = node;
+		node = child;
+		chars[i] = 0;
+
+		if (!_fsmtrie_view_leaf(&view, node))
+		{
+			continue;
+		}
+		if (sd->nkeys == UINT32_MAX ||
+				!_fsmtrie_buf_reserve(&keys, len + i) ||
+				!_fsmtrie_buf_reserve(&koff,
+					(sd->nkeys + 2) * sizeof (size_t)) ||
+				!_fsmtrie_buf_reserve(&strs,
+					(sd->nkeys + 1) * sizeof (char *)))
+		{
+			goto out;
+		}
+		memcpy((unsigned char *)keys.p + len, path, i);
+		len += i;
+		((size_t *)koff.p)[sd->nkeys + 1] = len;
+		((const char **)strs.p)[sd->nkeys++] =
+			_fsmtrie_view_str(&view, node);
+	}
+	sd->keys = keys.p;
+	sd->koff = koff.p;
+	sd->strs = strs.p;
+	keys.p = koff.p = strs.p = NULL;
+	ok = true;
+
+out:
+	free(keys.p);
+	free(koff.p);
+	free(strs.p);
+	free(nodes);
+	free(chars);
+	free(path);
+	return (ok);
+}
+
+static void
+_fsmtrie_symdel_free(struct fsmtrie_symdel *sd)
+{
+	if (sd == NULL)
+	{
+		return;
+	}
+	free(sd->fps);
+	free(sd->slots);
+	free(sd->keys);
+	free(sd->koff);
+	free(sd->strs);
+	free(sd->lists);
+	free(sd->ids);
+	free(sd);
+}
+
+static struct fsmtrie_symdel *
+_fsmtrie_symdel_new(struct fsmtrie *f)
+{
+	struct _fsmtrie_symdel_build b;
+	struct fsmtrie_symdel *sd;
+	uint64_t *path = NULL;
+	const unsigned char *key;
+	uint32_t *pair, l;
+	size_t n, len, plen;
+
+	memset(&b, 0, sizeof (b));
+	if ((sd = calloc(1, sizeof (*sd))) == NULL)
+	{
+		_fsmtrie_error(f, "can't allocate index: %s", strerror(errno));
+		return (NULL);
+	}
+	sd->max_dist = f->approx_index;
+	sd->prefix = f->approx_prefix;
+	b.sd = sd;
+
+	if (!_fsmtrie_symdel_rehash(sd) || !_fsmtrie_symdel_keys(f, sd) ||
+			(path = malloc(((size_t)f->depth + 1) *
+				sizeof (*path))) == NULL)
+	{
+		goto nomem;
+	}
+
+	/* the pairs come out sorted by key */
+	for (n = 0; n < sd->nkeys; n++)
+	{
+		key = &sd->keys[sd->koff[n]];
+		len = sd->koff[n + 1] - sd->koff[n];
+		plen = sd->prefix > 0 && sd->prefix < len ? sd->prefix : len;
+		b.id = n;
+		if (!_fsmtrie_symdel_variants(path, key, plen, sd->max_dist,
+					_fsmtrie_symdel_post, &b))
+		{
+			goto nomem;
+		}
+	}
+
+	/* counting sort by list, each list stays sorted */
+	sd->lists = calloc((size_t)b.nlists + 1, sizeof (*sd->lists));
+	sd->ids = malloc((b.npairs ? b.npairs : 1) * sizeof (*sd->ids));
+	if (sd->lists == NULL || sd->ids == NULL)
+	{
+		goto nomem;
+	}
+	pair = b.pairs.p;
+	for (n = 0; n < b.npairs; n++)
+	{
+		sd->lists[pair[2 * n] + 1]++;
+	}
+	for (l = 0; l < b.nlists; l++)
+	{
+		sd->lists[l + 1] += sd->lists[l];
+	}
+	for (n = 0; n < b.npairs; n++)
+	{
+		sd->ids[sd->lists[pair[2 * n]]++] = pair[2 * n + 1];
+	}
+	for (l = b.nlists; l > 0; l--)
+	{
+		sd->lists[l] = sd->lists[l - 1];
+	}
+	sd->lists[0] = 0;
+
+	free(path);
+	free(b.pairs.p);
+	free(b.last.p);
+	return (sd);
+
+nomem:
+	_fsmtrie_error(f, "can't allocate index: %s", strerror(errno));
+	free(path);
+	free(b.pairs.p);
+	free(b.last.p);
+	_fsmtrie_symdel_free(sd);
+	return (NULL);
+}
+
+bool
+_fsmtrie_symdel_build(struct fsmtrie *f)
+{
+	struct fsmtrie_symdel *sd;
+
+	if (__atomic_load_n(&f->symdel, __ATOMIC_ACQUIRE) != NULL)
+	{
+		return (true);
+	}
+
+	/* concurrent compiles may race to get here, only one builds */
+	pthread_mutex_lock(&f->lock);
+	if ((sd = f->symdel) == NULL)
+	{
+		if ((sd = _fsmtrie_symdel_new(f)) != NULL)
+		{
+			__atomic_store_n(&f->symdel, sd, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&f->lock);
+
+	return (sd != NULL);
+}
+
+void
+_fsmtrie_symdel_drop(struct fsmtrie *f)
+{
+	struct fsmtrie_symdel *sd;
+
+	/*
+	 * RCU tries never get an index and may be searched during updates,
+	 * so leave the pointer alone; readers load it atomically.
+	 */
+	if (f->rcu != NULL ||
+			(sd = __atomic_load_n(&f->symdel, __ATOMIC_RELAXED)) == NULL)
+	{
+		return;
+	}
+	__atomic_store_n(&f->symdel, NULL, __ATOMIC_RELEASE);
+	_fsmtrie_symdel_free(sd);
+}
+
+/* gather the keys listed under variant fp */
+static bool
+_fsmtrie_symdel_gather(void *arg, uint64_t fp)
+{
+	struct _fsmtrie_symdel_query *q = arg;
+	const struct fsmtrie_symdel *sd = q->sd;
+	uint32_t s, l, cnt;
+
+	for (s = _fsmtrie_symdel_slot(sd, fp); sd->fps[s] != fp;
+			s = (s + 1) & sd->mask)
+	{
+		if (sd->fps[s] == 0)
+		{
+			return (true);
+		}
+	}
+	l = sd->slots[s];
+	cnt = sd->lists[l + 1] - sd->lists[l];
+	q->cand = _fsmtrie_buf_reserve(q->buf,
+			(q->ncand + cnt) * sizeof (*q->cand));
+	if (q->cand == NULL)
+	{
+		return (false);
+	}
+	memcpy(&q->cand[q->ncand], &sd->ids[sd->lists[l]],
+			cnt * sizeof (*q->cand));
+	q->ncand += cnt;
+
+	return (true);
+}
+
+static int
+_fsmtrie_symdel_id_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x < y ? -1 : x > y);
+}
+
+/*
+ * Optimal string alignment distance of a and b (see _fsmtrie_approx_sim()),
+ * or max_dist + 1 if it exceeds max_dist. Only the band of entries within
+ * max_dist of the diagonal is computed, in rows of blen + 1 entries, three
+ * of which rows must hold.
+ */
+static int
+_fsmtrie_symdel_dist(int *rows, const unsigned char *a, int alen,
+		const unsigned char *b, int blen, int max_dist)
+{
+	int *r2 = rows, *r1 = rows + blen + 1, *r = rows + 2 * (blen + 1);
+	int *swap, i, j, lo, hi, v, min;
+
+	for (j = 0; j <= blen; j++)
+	{
+		r1[j] = j <= max_dist ? j : max_dist + 1;
+	}
+	for (i = 1; i <= alen; i++)
+	{
+		lo = i - max_dist > 1 ? i - max_dist : 1;
+		hi = i + max_dist < blen ? i + max_dist : blen;
+		r[lo - 1] = lo == 1 && i <= max_dist ? i : max_dist + 1;
+		min = r[lo - 1];
+		for (j = lo; j <= hi; j++)
+		{
+			v = r1[j - 1] + (a[i - 1] != b[j - 1]);
+			if (r1[j] + 1 < v)
+			{
+				v = r1[j] + 1;
+			}
+			if (r[j - 1] + 1 < v)
+			{
+				v = r[j - 1] + 1;
+			}
+			if (i > 1 && j > 1 && a[i - 1] == b[j - 2] &&
+					a[i - 2] == b[j - 1] &&
+					r2[j - 2] + 1 < v)
+			{
+				v = r2[j - 2] + 1;
+			}
+			r[j] = v <= max_dist ? v : max_dist + 1;
+			min = r[j] < min ? r[j] : min;
+		}
+		if (hi < blen)
+		{
+			r[hi + 1] = max_dist + 1;
+		}
+		if (min > max_dist)
+		{
+			return (max_dist + 1);
+		}
+		swap = r2;
+		r2 = r1;
+		r1 = r;
+		r = swap;
+	}
+
+	return (r1[blen]);
+}
+
+bool
+_fsmtrie_approx_symdel(struct fsmtrie_asearch_ctx *ctx,
+		const struct fsmtrie_symdel *sd, const unsigned char *key,
+		int keylen, int max_dist,
+		void (*cb)(const char *, int, void *), void *cbdata)
+{
+	struct _fsmtrie_symdel_query q = { sd, &ctx->cand, NULL, 0 };
+	uint64_t *path;
+	const unsigned char *k;
+	int plen, klen, d, *rows;
+	size_t n;
+
+	plen = sd->prefix > 0 && sd->prefix < (uint32_t)keylen ?
+		(int)sd->prefix : keylen;
+	path = _fsmtrie_buf_reserve(&ctx->stack,
+			((size_t)plen + 1) * sizeof (*path));
+	rows = _fsmtrie_buf_reserve(&ctx->matrix,
+			3 * ((size_t)keylen + 1) * sizeof (*rows));
+	if (path == NULL || rows == NULL ||
+			!_fsmtrie_symdel_variants(path, key, plen, max_dist,
+				_fsmtrie_symdel_gather, &q))
+	{
+		return (false);
+	}
+
+	/* keys are numbered in the order a walk of the trie visits them */
+	if (q.ncand > 1)
+	{
+		qsort(q.cand, q.ncand, sizeof (*q.cand),
+				_fsmtrie_symdel_id_cmp);
+	}
+	for (n = 0; n < q.ncand; n++)
+	{
+		if (n > 0 && q.cand[n] == q.cand[n - 1])
+		{
+			continue;
+		}
+		k = &sd->keys[sd->koff[q.cand[n]]];
+		klen = sd->koff[q.cand[n] + 1] - sd->koff[q.cand[n]];
+		if (klen - keylen > max_dist || keylen - klen > max_dist)
+		{
+			continue;
+		}
+		d = _fsmtrie_symdel_dist(rows, k, klen, key, keylen, max_dist);
+		if (d <= max_dist)
+		{
+			cb(sd->strs[q.cand[n]], d, cbdata);
+		}
+	}
+
+	return (true);
+}
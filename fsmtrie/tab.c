@@ -0,0 +1,287 @@
+/*
+ * Fast String Matcher Adaptive Child Table Implementation
+ *
+ *  Copyright (c) 2015-2017 by Farsight Security, Inc.
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "private.h"
+
+size_t
+_fsmtrie_tab_size(uint8_t kind)
+{
+	switch (kind)
+	{
+		case FSMTRIE_TAB4:
+			return (sizeof (struct fsmtrie_tab4));
+		case FSMTRIE_TAB16:
+			return (sizeof (struct fsmtrie_tab16));
+		case FSMTRIE_TAB48:
+			return (sizeof (struct fsmtrie_tab48));
+		default:
+			return (sizeof (struct fsmtrie_tabfull));
+	}
+}
+
+/* capacity of a child table of the specified kind */
+static unsigned int
+_fsmtrie_tab_max(uint8_t kind)
+{
+	switch (kind)
+	{
+		case FSMTRIE_TAB4:
+			return (FSMTRIE_TAB4_MAX);
+		case FSMTRIE_TAB16:
+			return (FSMTRIE_TAB16_MAX);
+		case FSMTRIE_TAB48:
+			return (FSMTRIE_TAB48_MAX);
+		default:
+			return (FSMTRIE_TABFULL_MAX);
+	}
+}
+
+static struct fsmtrie_tab *
+_fsmtrie_tab_new(struct fsmtrie_arena *a, uint8_t kind)
+{
+	struct fsmtrie_tab *t;
+
+	t = _fsmtrie_arena_alloc(a, _fsmtrie_tab_size(kind));
+	if (t == NULL)
+	{
+		return (NULL);
+	}
+	t->kind = kind;
+
+	return (t);
+}
+
+/*
+ * Insert a child into a table known to have room for it. Sorted tables are
+ * kept in code point order.
+ */
+static void
+_fsmtrie_tab_put(struct fsmtrie_tab *t, unsigned int c, fsmtrie_node_t *child)
+{
+	unsigned int n, pos;
+	uint8_t *keys;
+	fsmtrie_node_t **nodes;
+
+	switch (t->kind)
+	{
+		case FSMTRIE_TAB4:
+		case FSMTRIE_TAB16:
+			if (t->kind == FSMTRIE_TAB4)
+			{
+				keys = ((struct fsmtrie_tab4 *)t)->keys;
+				nodes = ((struct fsmtrie_tab4 *)t)->nodes;
+			}
+			else
+			{
+				keys = ((struct fsmtrie_tab16 *)t)->keys;
+				nodes = ((struct fsmtrie_tab16 *)t)->nodes;
+			}
+			for (pos = 0; pos < t->cnt && keys[pos] < c; pos++)
+				;
+			memmove(&keys[pos + 1], &keys[pos], t->cnt - pos);
+			memmove(&nodes[pos + 1], &nodes[pos],
+					sizeof (*nodes) * (t->cnt - pos));
+			keys[pos] = c;
+			nodes[pos] = child;
+			break;
+		case FSMTRIE_TAB48:
+		{
+			struct fsmtrie_tab48 *t48 = (struct fsmtrie_tab48 *)t;
+
+			for (n = 0; t48->nodes[n] != NULL; n++)
+				;
+			t48->nodes[n] = child;
+			t48->index[c] = n + 1;
+			break;
+		}
+		default:
+			((struct fsmtrie_tabfull *)t)->nodes[c] = child;
+			break;
+	}
+	t->cnt++;
+}
+
+bool
+_fsmtrie_tab_add(struct fsmtrie_arena *a, fsmtrie_node_t *node, unsigned int c,
+		fsmtrie_node_t *child)
+{
+	struct fsmtrie_tab *t = node->tab, *grown;
+	fsmtrie_node_t *gchild;
+	int gc;
+
+	if (t == NULL)
+	{
+		if ((t = _fsmtrie_tab_new(a, FSMTRIE_TAB4)) == NULL)
+		{
+			return (false);
+		}
+		node->tab = t;
+	}
+	else if (t->cnt == _fsmtrie_tab_max(t->kind))
+	{
+		/* full, move everything over to the next larger kind */
+		if ((grown = _fsmtrie_tab_new(a, t->kind + 1)) == NULL)
+		{
+			return (false);
+		}
+		for (gc = _fsmtrie_child_next(node, 0, &gchild); gc >= 0;
+				gc = _fsmtrie_child_next(node, gc + 1, &gchild))
+		{
+			_fsmtrie_tab_put(grown, gc, gchild);
+		}
+		_fsmtrie_arena_free(a, t, _fsmtrie_tab_size(t->kind));
+		node->tab = t = grown;
+	}
+
+	_fsmtrie_tab_put(t, c, child);
+
+	return (true);
+}
+
+struct fsmtrie_tab *
+_fsmtrie_tab_copy(struct fsmtrie_arena *a, const struct fsmtrie_tab *t,
+		size_t *size)
+{
+	struct fsmtrie_tab *copy;
+
+	*size = _fsmtrie_tab_size(t->kind);
+	if ((copy = _fsmtrie_arena_alloc(a, *size)) == NULL)
+	{
+		return (NULL);
+	}
+	memcpy(copy, t, *size);
+
+	return (copy);
+}
+
+void
+_fsmtrie_tab_set(fsmtrie_node_t *node, unsigned int c, fsmtrie_node_t *child)
+{
+	struct fsmtrie_tab *t = node->tab;
+	unsigned int n;
+
+	switch (t->kind)
+	{
+		case FSMTRIE_TAB4:
+		case FSMTRIE_TAB16:
+		{
+			const uint8_t *keys;
+			fsmtrie_node_t **nodes;
+
+			if (t->kind == FSMTRIE_TAB4)
+			{
+				keys = ((struct fsmtrie_tab4 *)t)->keys;
+				nodes = ((struct fsmtrie_tab4 *)t)->nodes;
+			}
+			else
+			{
+				keys = ((struct fsmtrie_tab16 *)t)->keys;
+				nodes = ((struct fsmtrie_tab16 *)t)->nodes;
+			}
+			for (n = 0; keys[n] != c; n++)
+				;
+			nodes[n] = child;
+			break;
+		}
+		case FSMTRIE_TAB48:
+		{
+			struct fsmtrie_tab48 *t48 = (struct fsmtrie_tab48 *)t;
+
+			t48->nodes[t48->index[c] - 1] = child;
+			break;
+		}
+		default:
+			((struct fsmtrie_tabfull *)t)->nodes[c] = child;
+			break;
+	}
+}
+
+void
+_fsmtrie_tab_del(struct fsmtrie_arena *a, fsmtrie_node_t *node, unsigned int c)
+{
+	struct fsmtrie_tab *t = node->tab, *shrunk;
+	fsmtrie_node_t *gchild;
+	unsigned int n;
+	int gc;
+
+	switch (t->kind)
+	{
+		case FSMTRIE_TAB4:
+		case FSMTRIE_TAB16:
+		{
+			uint8_t *keys;
+			fsmtrie_node_t **nodes;
+
+			if (t->kind == FSMTRIE_TAB4)
+			{
+				keys = ((struct fsmtrie_tab4 *)t)->keys;
+				nodes = ((struct fsmtrie_tab4 *)t)->nodes;
+			}
+			else
+			{
+				keys = ((struct fsmtrie_tab16 *)t)->keys;
+				nodes = ((struct fsmtrie_tab16 *)t)->nodes;
+			}
+			for (n = 0; keys[n] != c; n++)
+				;
+			memmove(&keys[n], &keys[n + 1], t->cnt - n - 1);
+			memmove(&nodes[n], &nodes[n + 1],
+					sizeof (*nodes) * (t->cnt - n - 1));
+			nodes[t->cnt - 1] = NULL;
+			break;
+		}
+		case FSMTRIE_TAB48:
+		{
+			struct fsmtrie_tab48 *t48 = (struct fsmtrie_tab48 *)t;
+
+			t48->nodes[t48->index[c] - 1] = NULL;
+			t48->index[c] = 0;
+			break;
+		}
+		default:
+			((struct fsmtrie_tabfull *)t)->nodes[c] = NULL;
+			break;
+	}
+	t->cnt--;
+
+	if (t->cnt == 0)
+	{
+		_fsmtrie_arena_free(a, t, _fsmtrie_tab_size(t->kind));
+		node->tab = NULL;
+		return;
+	}
+
+	/*
+	 * Move over to the next smaller kind once it would be half full, so
+	 * a node going back and forth around a boundary doesn't convert its
+	 * table every time. Staying put is fine if that fails.
+	 */
+	if (t->kind == FSMTRIE_TAB4 ||
+			t->cnt > _fsmtrie_tab_max(t->kind - 1) / 2 ||
+			(shrunk = _fsmtrie_tab_new(a, t->kind - 1)) == NULL)
+	{
+		return;
+	}
+	for (gc = _fsmtrie_child_next(node, 0, &gchild); gc >= 0;
+			gc = _fsmtrie_child_next(node, gc + 1, &gchild))
+	{
+		_fsmtrie_tab_put(shrunk, gc, gchild);
+	}
+	_fsmtrie_arena_free(a, t, _fsmtrie_tab_size(t->kind));
+	node->tab = shrunk;
+}
@@ -0,0 +1,777 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <check.h>
+#include "fsmtrie.h"
+
+static const char *keys[] = {
+	"foo",
+	"bar",
+	"brad",
+	"brady",
+	"foobarbaz",
+	"farsightsecurity",
+	"sigh",
+	"fsi",
+	"fsizn",
+	"love",
+	"hate",
+	"dogs",
+	0 };
+
+static void asearch_report(const char *str, int dist, void *data)
+{
+	ck_assert_str_eq(str, "farsightsecurity");
+	ck_assert_int_eq(dist, 2);
+	(*(int *)data)++;
+}
+
+static void subsearch_report(const char *str, int off, void *data)
+{
+	if (!strcmp(str, "sigh"))
+	{
+		ck_assert_int_eq(off, 3);
+	}
+	else if (!strcmp(str, "farsightsecurity"))
+	{
+		ck_assert_int_eq(off, 0);
+	}
+	else
+	{
+		ck_abort_msg("unknown str: %s\n", str);
+	}
+	(*(int *)data)++;
+}
+
+static void collect_report(const char *str, int n, void *data)
+{
+	char match[128];
+
+	snprintf(match, sizeof (match), "%s:%d ", str, n);
+	strcat((char *)data, match);
+}
+
+static void count_report(const char *str, int off, void *data)
+{
+	(*(int *)data)++;
+}
+
+/* save a trie to a temporary file and map it back in */
+static fsmtrie_t
+save_and_open(fsmtrie_t fsmtrie, char *path)
+{
+	fsmtrie_t image;
+	char err_buf[BUFSIZ];
+	int fd;
+
+	strcpy(path, "test-trie-image.XXXXXX");
+	ck_assert_int_ne(fd = mkstemp(path), -1);
+	close(fd);
+
+	ck_assert_int_eq(fsmtrie_save(fsmtrie, path), 1);
+	ck_assert_ptr_ne(image = fsmtrie_open_mmap(path, err_buf,
+				sizeof (err_buf)), NULL);
+
+	return (image);
+}
+
+START_TEST(test_trie_image)
+{
+	int n, matches;
+	const char *str;
+	fsmtrie_t fsmtrie, image;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ], path[64];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_ascii), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_maxlength(opt, 64), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_partialmatch(opt, true), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+	}
+
+	image = save_and_open(fsmtrie, path);
+	fsmtrie_destroy(&fsmtrie);
+
+	ck_assert_int_eq(fsmtrie_get_keycnt(image), n);
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search(image, keys[n], &str), 1);
+		ck_assert_str_eq(str, keys[n]);
+	}
+	ck_assert_int_eq(fsmtrie_search(image, "cats", &str), 0);
+	ck_assert_int_eq(fsmtrie_search(image, "bradyy", &str), 0);
+
+	/* partial match mode is preserved */
+	ck_assert_int_eq(fsmtrie_search(image, "foob", &str), 1);
+	ck_assert_ptr_eq(str, NULL);
+
+	matches = 0;
+	ck_assert_int_eq(fsmtrie_search_approx(image, "tarsightsecuritz", 2,
+		asearch_report, &matches), 1);
+	ck_assert_int_eq(matches, 1);
+
+	matches = 0;
+	ck_assert_int_eq(fsmtrie_search_substring(image, "farsightsecurity",
+		subsearch_report, &matches), 1);
+	ck_assert_int_eq(matches, 2);
+
+	/* images are read-only */
+	ck_assert_int_eq(fsmtrie_insert(image, "cats", "cats"), 0);
+
+	fsmtrie_destroy(&image);
+	unlink(path);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_image_token)
+{
+	int n;
+	const char *str;
+	fsmtrie_t fsmtrie, image;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ], path[64];
+	uint32_t tokens[3][3] = {
+		{ 4000000000U, 2, 3 },
+		{ 1, 2, 3 },
+		{ 1, 2, 4 },
+	};
+	uint32_t missing[3] = { 1, 3, 3 };
+	char *toknames[3] = { "t1", "t2", "t3" };
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	for (n = 0; n < 3; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert_token(fsmtrie, tokens[n], 3,
+					toknames[n]), 1);
+	}
+
+	image = save_and_open(fsmtrie, path);
+	fsmtrie_destroy(&fsmtrie);
+
+	for (n = 0; n < 3; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search_token(image, tokens[n], 3,
+					&str), 1);
+		ck_assert_str_eq(str, toknames[n]);
+	}
+	ck_assert_int_eq(fsmtrie_search_token(image, missing, 3, &str), 0);
+	ck_assert_int_eq(fsmtrie_search_token(image, tokens[0], 2, &str), 0);
+	ck_assert_int_eq(fsmtrie_insert_token(image, missing, 3, NULL), 0);
+
+	fsmtrie_destroy(&image);
+	unlink(path);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_freeze)
+{
+	int n, matches;
+	const char *str;
+	fsmtrie_t fsmtrie, image;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ], path[64];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_ascii), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_approx_index(opt, 2), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+	}
+	ck_assert_int_eq(fsmtrie_compile(fsmtrie), 1);
+	ck_assert_int_eq(fsmtrie_freeze(fsmtrie), 1);
+	ck_assert_int_eq(fsmtrie_freeze(fsmtrie), 1);
+
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), n);
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, keys[n], &str), 1);
+		ck_assert_str_eq(str, keys[n]);
+	}
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "cats", &str), 0);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "foob", &str), 0);
+
+	/* by the rebuilt index, and by walking the frozen trie */
+	for (n = 1; n <= 3; n++)
+	{
+		matches = 0;
+		ck_assert_int_eq(fsmtrie_search_approx(fsmtrie,
+				"tarsightsecuritz", n, asearch_report,
+				&matches), 1);
+		ck_assert_int_eq(matches, n >= 2);
+	}
+
+	matches = 0;
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, "farsightsecurity",
+		subsearch_report, &matches), 1);
+	ck_assert_int_eq(matches, 2);
+
+	/* frozen tries are read-only, and save as images */
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "cats", "cats"), 0);
+	ck_assert_int_eq(fsmtrie_delete(fsmtrie, "foo"), -1);
+	image = save_and_open(fsmtrie, path);
+	ck_assert_int_eq(fsmtrie_search(image, "brady", &str), 1);
+	ck_assert_str_eq(str, "brady");
+
+	fsmtrie_destroy(&image);
+	unlink(path);
+	fsmtrie_destroy(&fsmtrie);
+
+	/* RCU readers may be walking the nodes */
+	ck_assert_int_eq(fsmtrie_opt_set_approx_index(opt, 0), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_rcu(opt, true), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_freeze(fsmtrie), 0);
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_image_double_array)
+{
+	int n, m, t, len;
+	unsigned int seed = 3;
+	bool on;
+	const char *str, *ref;
+	fsmtrie_t fsmtrie, frozen, image;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ], path[64];
+	static char keys[2048][16], query[24];
+	static char matches[16384], matches_ref[16384];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_eascii), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_partialmatch(opt, true), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_double_array(opt, true), 1);
+	ck_assert_int_eq(fsmtrie_opt_get_double_array(opt, &on), 1);
+	ck_assert_int_eq(on, true);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_ptr_ne(frozen = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	/* dense and sparse nodes, bytes of either half */
+	for (n = 0; n < 2048; n++)
+	{
+		len = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 12;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = m == 0 || n % 2 ? 1 + seed / 65536 % 255 :
+				"ab\xe9"[seed / 65536 % 3];
+		}
+		keys[n][len] = '\0';
+		ck_assert_int_ge(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 0);
+		ck_assert_int_ge(fsmtrie_insert(frozen, keys[n], keys[n]), 0);
+	}
+	image = save_and_open(fsmtrie, path);
+	ck_assert_int_eq(fsmtrie_freeze(frozen), 1);
+
+	for (n = 0; n < 2048; n++)
+	{
+		strcpy(query, keys[n]);
+		for (t = 0; t < 3; t++)
+		{
+			/* the key, a prefix of it and a miss */
+			if (t == 1)
+			{
+				query[strlen(query) / 2] = '\0';
+			}
+			else if (t == 2)
+			{
+				query[0] ^= 0x80;
+			}
+			m = fsmtrie_search(fsmtrie, query, &ref);
+			ck_assert_int_eq(fsmtrie_search(image, query, &str), m);
+			ck_assert_ptr_eq(str == NULL, ref == NULL);
+			if (ref != NULL)
+			{
+				ck_assert_str_eq(str, ref);
+			}
+			ck_assert_int_eq(fsmtrie_search(frozen, query, &str), m);
+		}
+	}
+
+	for (n = 0; n < 2048; n += 97)
+	{
+		matches_ref[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx(fsmtrie, keys[n], 1,
+				collect_report, matches_ref), 1);
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx(frozen, keys[n], 1,
+				collect_report, matches), 1);
+		ck_assert_str_eq(matches, matches_ref);
+
+		query[0] = 'x';
+		strcpy(&query[1], keys[n]);
+		strcat(query, "y");
+		matches_ref[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, query,
+				collect_report, matches_ref), 1);
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_substring(image, query,
+				collect_report, matches), 1);
+		ck_assert_str_eq(matches, matches_ref);
+	}
+
+	fsmtrie_destroy(&image);
+	unlink(path);
+	fsmtrie_destroy(&frozen);
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+static int
+key_cmp(const void *a, const void *b)
+{
+	return (strcmp((const char *)a, (const char *)b));
+}
+
+START_TEST(test_trie_dawg)
+{
+	static const char *suffixes[] = { ".com", ".co.uk", "-login.com",
+		".net" };
+	int n, m, t, len, dist;
+	unsigned int seed = 5;
+	bool on;
+	const char *str, *ref, *batch[4];
+	int results[4];
+	fsmtrie_t fsmtrie, dawg;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ], path[64];
+	static char keys[2048][24], query[32];
+	static char matches[16384], matches_ref[16384];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_ascii), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_approx_index(opt, 2), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_dawg(opt, true), 1);
+	ck_assert_int_eq(fsmtrie_opt_get_dawg(opt, &on), 1);
+	ck_assert_int_eq(on, true);
+	ck_assert_ptr_ne(dawg = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	/* domain names, sharing a few suffixes */
+	for (n = 0; n < 2048; n++)
+	{
+		len = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 8;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "abcde"[seed / 65536 % 5];
+		}
+		strcpy(&keys[n][len], suffixes[seed / 65536 % 4]);
+	}
+	qsort(keys, 2048, sizeof (keys[0]), key_cmp);
+
+	/* every third key without a string */
+	for (n = 0; n < 2048; n++)
+	{
+		str = n % 3 ? keys[n] : NULL;
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], str), 1);
+		ck_assert_int_eq(fsmtrie_insert(dawg, keys[n], str), 1);
+		ck_assert_int_eq(fsmtrie_insert(dawg, keys[n], "dup"), 1);
+	}
+	ck_assert_int_eq(fsmtrie_insert(dawg, "aaaa", NULL), 0);
+	ck_assert_int_eq(fsmtrie_compile(fsmtrie), 1);
+	ck_assert_int_eq(fsmtrie_compile(dawg), 1);
+	ck_assert_int_eq(fsmtrie_insert(dawg, "zzzz", NULL), 0);
+
+	ck_assert_int_eq(fsmtrie_get_keycnt(dawg),
+			fsmtrie_get_keycnt(fsmtrie));
+	ck_assert_int_lt(fsmtrie_get_nodecnt(dawg) * 4,
+			fsmtrie_get_nodecnt(fsmtrie));
+
+	for (n = 0; n < 2048; n++)
+	{
+		strcpy(query, keys[n]);
+		for (t = 0; t < 3; t++)
+		{
+			/* the key, a prefix of it and a miss */
+			if (t == 1)
+			{
+				query[strlen(query) / 2] = '\0';
+			}
+			else if (t == 2)
+			{
+				query[0] = 'f';
+			}
+			m = fsmtrie_search(fsmtrie, query, &ref);
+			ck_assert_int_eq(fsmtrie_search(dawg, query, &str), m);
+			ck_assert_ptr_eq(str == NULL, ref == NULL);
+			if (ref != NULL)
+			{
+				ck_assert_str_eq(str, ref);
+			}
+		}
+	}
+	for (n = 0; n < 4; n++)
+	{
+		batch[n] = keys[n * 500 + 1];
+	}
+	ck_assert_int_eq(fsmtrie_search_batch(dawg, batch, 4, results, NULL),
+			1);
+	for (n = 0; n < 4; n++)
+	{
+		ck_assert_int_eq(results[n], 1);
+	}
+
+	/* by the index, by edits and by walking the automaton */
+	for (n = 0; n < 2048; n += 61)
+	{
+		for (dist = 1; dist <= 3; dist++)
+		{
+			matches_ref[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_approx(fsmtrie,
+					keys[n], dist, collect_report,
+					matches_ref), 1);
+			matches[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_approx(dawg, keys[n],
+					dist, collect_report, matches), 1);
+			ck_assert_str_eq(matches, matches_ref);
+		}
+	}
+
+	/* a node of a DAWG isn't a single key prefix */
+	ck_assert_int_eq(fsmtrie_search_substring(dawg, keys[0],
+		collect_report, matches), -1);
+	ck_assert_int_eq(fsmtrie_delete(dawg, keys[0]), -1);
+	strcpy(path, "test-trie-image.XXXXXX");
+	ck_assert_int_eq(fsmtrie_save(dawg, path), 0);
+	ck_assert_int_eq(fsmtrie_freeze(dawg), 1);
+
+	fsmtrie_destroy(&dawg);
+	fsmtrie_destroy(&fsmtrie);
+
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_ptr_eq(fsmtrie_init(opt, err_buf, sizeof (err_buf)), NULL);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_louds)
+{
+	static const char *suffixes[] = { ".com", ".co.uk", "-login.com",
+		".net" };
+	int n, m, t, len, count, count_ref;
+	unsigned int seed = 7;
+	size_t strs_len = 0;
+	const char *str, *ref;
+	fsmtrie_t fsmtrie, dawg;
+	fsmtrie_louds_t louds, louds2;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	static char keys[2048][24], query[32], subject[96];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_ascii), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_dawg(opt, true), 1);
+	ck_assert_ptr_ne(dawg = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	/* domain names, sharing a few suffixes, every third without a string */
+	for (n = 0; n < 2048; n++)
+	{
+		len = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 8;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "abcde"[seed / 65536 % 5];
+		}
+		strcpy(&keys[n][len], suffixes[seed / 65536 % 4]);
+	}
+	qsort(keys, 2048, sizeof (keys[0]), key_cmp);
+	for (n = 0; n < 2048; n++)
+	{
+		str = n % 3 ? keys[n] : NULL;
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], str), 1);
+		ck_assert_int_eq(fsmtrie_insert(dawg, keys[n], str), 1);
+		strs_len += str != NULL ? strlen(str) + 1 : 0;
+	}
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "zz.net", "copy"), 1);
+	ck_assert_int_eq(fsmtrie_insert(dawg, "zz.net", "copy"), 1);
+	strs_len += strlen("copy") + 1;
+
+	ck_assert_ptr_ne(louds = fsmtrie_louds_export(fsmtrie), NULL);
+	ck_assert_int_eq(fsmtrie_louds_get_nodecnt(louds),
+			fsmtrie_get_nodecnt(fsmtrie));
+	/* about a byte and a half per node, next to the strings */
+	ck_assert_int_lt(fsmtrie_louds_get_size(louds),
+			fsmtrie_louds_get_nodecnt(louds) * 3 / 2 + strs_len +
+			512);
+
+	for (n = 0; n < 2048; n++)
+	{
+		strcpy(query, keys[n]);
+		for (t = 0; t < 3; t++)
+		{
+			/* the key, a prefix of it and a miss */
+			if (t == 1)
+			{
+				query[strlen(query) / 2] = '\0';
+			}
+			else if (t == 2)
+			{
+				query[0] = 'f';
+			}
+			m = fsmtrie_search(fsmtrie, query, &ref);
+			ck_assert_int_eq(fsmtrie_louds_search(louds, query,
+					&str), m);
+			ck_assert_ptr_eq(str == NULL, ref == NULL);
+			if (ref != NULL)
+			{
+				ck_assert_str_eq(str, ref);
+			}
+		}
+	}
+	ck_assert_int_eq(fsmtrie_louds_search_n(louds, keys[5],
+				strlen(keys[5]) - 1, &str), 0);
+	ck_assert_int_eq(fsmtrie_louds_search(louds, "\xe9.com", &str), 0);
+	ck_assert_int_eq(fsmtrie_louds_search(louds, NULL, &str), -1);
+
+	/* the same matches, found without failure links */
+	for (n = 0; n < 2048; n += 97)
+	{
+		strcpy(subject, "x");
+		strcat(subject, keys[n]);
+		strcat(subject, keys[(n * 7) % 2048]);
+		strcat(subject, "y");
+		strcat(subject, keys[2047 - n]);
+		count_ref = 0;
+		ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, subject,
+					count_report, &count_ref), 1);
+		count = 0;
+		ck_assert_int_eq(fsmtrie_louds_search_substring(louds,
+					subject, count_report, &count), 1);
+		ck_assert_int_ge(count_ref, 3);
+		ck_assert_int_eq(count, count_ref);
+	}
+
+	/* frozen and DAWG fsmtries encode to the same trie */
+	ck_assert_int_eq(fsmtrie_freeze(fsmtrie), 1);
+	ck_assert_ptr_ne(louds2 = fsmtrie_louds_export(fsmtrie), NULL);
+	ck_assert_int_eq(fsmtrie_louds_get_size(louds2),
+			fsmtrie_louds_get_size(louds));
+	fsmtrie_louds_destroy(&louds2);
+	ck_assert_ptr_ne(louds2 = fsmtrie_louds_export(dawg), NULL);
+	ck_assert_int_eq(fsmtrie_louds_get_nodecnt(louds2),
+			fsmtrie_louds_get_nodecnt(louds));
+	for (n = 0; n < 2048; n++)
+	{
+		/* a DAWG keeps the string of the first of duplicate keys */
+		ck_assert_int_eq(fsmtrie_search(dawg, keys[n], &ref), 1);
+		ck_assert_int_eq(fsmtrie_louds_search(louds2, keys[n], &str),
+				1);
+		ck_assert_ptr_eq(str == NULL, ref == NULL);
+		if (ref != NULL)
+		{
+			ck_assert_str_eq(str, ref);
+		}
+	}
+	fsmtrie_louds_destroy(&louds2);
+	ck_assert_ptr_eq(louds2, NULL);
+
+	/* the LOUDS trie is a copy */
+	fsmtrie_destroy(&dawg);
+	fsmtrie_destroy(&fsmtrie);
+	ck_assert_int_eq(fsmtrie_louds_search(louds, "zz.net", &str), 1);
+	ck_assert_str_eq(str, "copy");
+	fsmtrie_louds_destroy(&louds);
+
+	/* partial matches */
+	ck_assert_int_eq(fsmtrie_opt_set_dawg(opt, false), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_partialmatch(opt, true), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "farsightsecurity", NULL), 1);
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "foo", "bar"), 1);
+	ck_assert_ptr_ne(louds = fsmtrie_louds_export(fsmtrie), NULL);
+	ck_assert_int_eq(fsmtrie_louds_search(louds, "farsi", &str), 1);
+	ck_assert_ptr_eq(str, NULL);
+	ck_assert_int_eq(fsmtrie_louds_search(louds, "farsy", &str), 0);
+	fsmtrie_louds_destroy(&louds);
+	fsmtrie_destroy(&fsmtrie);
+
+	ck_assert_int_eq(fsmtrie_opt_set_partialmatch(opt, false), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_ptr_eq(fsmtrie_louds_export(fsmtrie), NULL);
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+/*
+ * Flip bits of every byte of the image of fsmtrie in turn: the image must
+ * either fail to open or be searchable without going out of bounds.
+ */
+static void
+corrupt_and_search(fsmtrie_t fsmtrie)
+{
+	fsmtrie_t image;
+	const char *str;
+	char err_buf[BUFSIZ], path[64];
+	static const unsigned char masks[] = { 0x01, 0x80 };
+	unsigned char *buf;
+	long len, off;
+	size_t m;
+	FILE *fp;
+	int n, matches = 0, opened = 0;
+
+	image = save_and_open(fsmtrie, path);
+	fsmtrie_destroy(&image);
+	ck_assert_ptr_ne(fp = fopen(path, "rb"), NULL);
+	ck_assert_int_eq(fseek(fp, 0, SEEK_END), 0);
+	ck_assert_int_gt(len = ftell(fp), 0);
+	rewind(fp);
+	ck_assert_ptr_ne(buf = malloc(len), NULL);
+	ck_assert_int_eq(fread(buf, 1, len, fp), len);
+	fclose(fp);
+
+	for (off = 0; off < len; off++)
+	{
+		for (m = 0; m < sizeof (masks); m++)
+		{
+			buf[off] ^= masks[m];
+			ck_assert_ptr_ne(fp = fopen(path, "wb"), NULL);
+			ck_assert_int_eq(fwrite(buf, 1, len, fp), len);
+			fclose(fp);
+			buf[off] ^= masks[m];
+
+			image = fsmtrie_open_mmap(path, err_buf,
+					sizeof (err_buf));
+			if (image == NULL)
+			{
+				continue;
+			}
+			opened++;
+			for (n = 0; keys[n]; n++)
+			{
+				(void)fsmtrie_search(image, keys[n], &str);
+			}
+			(void)fsmtrie_search_approx(image, "tarsightsecuritz",
+					2, count_report, &matches);
+			(void)fsmtrie_search_substring(image,
+					"brady loves farsightsecurity dogs",
+					count_report, &matches);
+			fsmtrie_destroy(&image);
+		}
+	}
+	/* flipped leaf strings and counts still open */
+	ck_assert_int_gt(opened, 0);
+
+	free(buf);
+	unlink(path);
+}
+
+START_TEST(test_trie_image_corrupt)
+{
+	int n;
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_ascii), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+	}
+	ck_assert_int_eq(fsmtrie_compile(fsmtrie), 1);
+	corrupt_and_search(fsmtrie);
+	fsmtrie_destroy(&fsmtrie);
+
+	/* and so must the double array */
+	ck_assert_int_eq(fsmtrie_opt_set_double_array(opt, true), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+	}
+	ck_assert_int_eq(fsmtrie_compile(fsmtrie), 1);
+	corrupt_and_search(fsmtrie);
+
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_image_invalid)
+{
+	char err_buf[BUFSIZ];
+	char path[64];
+	FILE *fp;
+	int fd;
+
+	ck_assert_ptr_eq(fsmtrie_open_mmap("/nonexistent/fsmtrie.img",
+				err_buf, sizeof (err_buf)), NULL);
+
+	strcpy(path, "test-trie-image.XXXXXX");
+	ck_assert_int_ne(fd = mkstemp(path), -1);
+	ck_assert_ptr_ne(fp = fdopen(fd, "w"), NULL);
+	fprintf(fp, "this is not a trie image, not by a long shot\n"
+			"not even close to being one, really\n"
+			"and it is padded out to exceed a header\n");
+	fclose(fp);
+
+	ck_assert_ptr_eq(fsmtrie_open_mmap(path, err_buf, sizeof (err_buf)),
+			NULL);
+	ck_assert_str_eq(err_buf, "not an fsmtrie image");
+	unlink(path);
+}
+END_TEST
+
+int main(void)
+{
+	int number_failed;
+	Suite *s;
+	TCase *tc_core;
+	SRunner *sr;
+
+	s = suite_create("fsmtrie_trie");
+	tc_core = tcase_create("core");
+	tcase_add_test(tc_core, test_trie_image);
+	tcase_add_test(tc_core, test_trie_image_token);
+	tcase_add_test(tc_core, test_trie_freeze);
+	tcase_add_test(tc_core, test_trie_image_double_array);
+	tcase_add_test(tc_core, test_trie_dawg);
+	tcase_add_test(tc_core, test_trie_louds);
+	tcase_add_test(tc_core, test_trie_image_invalid);
+	tcase_add_test(tc_core, test_trie_image_corrupt);
+	suite_add_tcase(s, tc_core);
+
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
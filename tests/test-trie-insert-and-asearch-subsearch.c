@@ -52,6 +52,85 @@ static void subsearch_report_trial2(const char *str, int off, void *data)
 	}
 }
 
+static void subsearch_report_count(const char *str, int off, void *data)
+{
+	(void)str;
+	(void)off;
+	(*(int *)data)++;
+}
+
+static void subsearch_report_collect(const char *str, int off, void *data)
+{
+	char *matches = (char *)data;
+	char match[128];
+
+	snprintf(match, sizeof (match), "%s@%d ", str, off);
+	strcat(matches, match);
+}
+
+static void scanner_report_collect(const char *str, uint64_t off, void *data)
+{
+	char *matches = (char *)data;
+	char match[128];
+
+	snprintf(match, sizeof (match), "%s@%llu ", str,
+			(unsigned long long)off);
+	strcat(matches, match);
+}
+
+static void asearch_report_collect(const char *str, int dist, void *data)
+{
+	char *matches = (char *)data;
+	char match[128];
+
+	snprintf(match, sizeof (match), "%s:%d ", str, dist);
+	strcat(matches, match);
+}
+
+static void asearch_batch_collect(size_t key, const char *str, int dist,
+		void *data)
+{
+	char (*matches)[2048] = data;
+	char match[128];
+
+	snprintf(match, sizeof (match), "%s:%d ", str, dist);
+	strcat(matches[key], match);
+}
+
+/* optimal string alignment distance, the textbook way */
+static int osa_dist(const char *a, const char *b)
+{
+	int d[80][80], i, j, la = strlen(a), lb = strlen(b), v;
+
+	for (i = 0; i <= la; i++)
+	{
+		for (j = 0; j <= lb; j++)
+		{
+			if (i == 0 || j == 0)
+			{
+				d[i][j] = i + j;
+				continue;
+			}
+			v = d[i - 1][j - 1] + (a[i - 1] != b[j - 1]);
+			if (d[i - 1][j] + 1 < v)
+				v = d[i - 1][j] + 1;
+			if (d[i][j - 1] + 1 < v)
+				v = d[i][j - 1] + 1;
+			if (i > 1 && j > 1 && a[i - 1] == b[j - 2] &&
+					a[i - 2] == b[j - 1] &&
+					d[i - 2][j - 2] + 1 < v)
+				v = d[i - 2][j - 2] + 1;
+			d[i][j] = v;
+		}
+	}
+	return (d[la][lb]);
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return (strcmp(*(const char * const *)a, *(const char * const *)b));
+}
+
 START_TEST(test_trie_insert_and_asearch_subsearch)
 {
 	int n;
@@ -107,6 +186,823 @@ START_TEST(test_trie_insert_and_asearch_subsearch)
 }
 END_TEST
 
+START_TEST(test_trie_asearch)
+{
+	int n, m, len, dist, d;
+	unsigned int seed = 5;
+	bool on;
+	fsmtrie_t fsmtrie, fsmtrie_lev;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	static char keys[512][72], query[72];
+	static char matches[65536], matches_ref[65536];
+	char *sorted[512], match[128];
+
+	/*
+	 * Keys around 64 bytes long take both the bit-parallel path and the
+	 * general one, both must agree with the distance computed directly,
+	 * and so must the automaton.
+	 */
+	for (n = 0; n < 512; n++)
+	{
+		len = n < 256 ? 1 + (seed = seed * 1103515245 + 12345) /
+			65536 % 8 : 60 + (seed = seed * 1103515245 + 12345) /
+			65536 % 10;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "aab"[seed / 65536 % 3];
+		}
+		keys[n][len] = '\0';
+		sorted[n] = keys[n];
+	}
+	qsort(sorted, 512, sizeof (*sorted), cmp_str);
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_maxlength(opt, 72), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_approx_automaton(opt, true), 1);
+	ck_assert_int_eq(fsmtrie_opt_get_approx_automaton(opt, &on), 1);
+	ck_assert_int_eq(on, true);
+	ck_assert_ptr_ne(fsmtrie_lev = fsmtrie_init(opt, err_buf,
+				sizeof (err_buf)), NULL);
+	for (n = 0; n < 512; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie_lev, keys[n], keys[n]),
+				1);
+	}
+
+	for (n = 0; n < 512; n += 3)
+	{
+		/* a key with a couple of edits */
+		strcpy(query, keys[n]);
+		len = strlen(query);
+		for (m = 0; m < 2; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			d = seed / 65536 % len;
+			if (d + 1 < len && m == 0)
+			{
+				query[d] = query[d + 1];
+				query[d + 1] = keys[n][d];
+			}
+			else
+			{
+				query[d] = query[d] == 'a' ? 'b' : 'a';
+			}
+		}
+
+		for (dist = 0; dist <= 3; dist++)
+		{
+			matches[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_approx(fsmtrie, query,
+				dist, asearch_report_collect, matches), 1);
+
+			/* matches are reported in key order, once each */
+			matches_ref[0] = '\0';
+			for (m = 0; m < 512; m++)
+			{
+				if (m > 0 && !strcmp(sorted[m], sorted[m - 1]))
+				{
+					continue;
+				}
+				if ((d = osa_dist(sorted[m], query)) <= dist)
+				{
+					snprintf(match, sizeof (match),
+							"%s:%d ", sorted[m], d);
+					strcat(matches_ref, match);
+				}
+			}
+			ck_assert_str_eq(matches, matches_ref);
+
+			matches[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_approx(fsmtrie_lev,
+				query, dist, asearch_report_collect, matches),
+				1);
+			ck_assert_str_eq(matches, matches_ref);
+		}
+	}
+
+	/* no match is within a negative distance */
+	matches[0] = '\0';
+	ck_assert_int_eq(fsmtrie_search_approx(fsmtrie_lev, keys[0], -1,
+				asearch_report_collect, matches), 1);
+	ck_assert_str_eq(matches, "");
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_destroy(&fsmtrie_lev);
+}
+END_TEST
+
+START_TEST(test_trie_asearch_ctx)
+{
+	int n, lev;
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	fsmtrie_asearch_ctx_t ctx;
+	char err_buf[BUFSIZ];
+	static char key[1024], matches[4096], matches_ref[4096];
+	const char *queries[] = {
+		"foo",
+		"fxrsightsecurity",
+		"brady",
+		"",
+	0 };
+
+	/* no max_len: the walk is bounded by the deepest key */
+	ck_assert_ptr_ne(ctx = fsmtrie_asearch_ctx_init(), NULL);
+	for (lev = 0; lev < 2; lev++)
+	{
+		ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+		ck_assert_int_eq(fsmtrie_opt_set_mode(opt,
+					fsmtrie_mode_eascii), 1);
+		ck_assert_int_eq(fsmtrie_opt_set_approx_automaton(opt, lev),
+				1);
+		ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf,
+					sizeof (err_buf)), NULL);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, "foo", "foo"), 1);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, "fo", "fo"), 1);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, "farsightsecurity",
+					"farsightsecurity"), 1);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, "brad", "brad"), 1);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, "f", "f"), 1);
+
+		/* the same context, across searches and trie growth */
+		for (n = 0; n < 3; n++)
+		{
+			matches[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_approx_ctx(fsmtrie, ctx,
+					queries[n], strlen(queries[n]), 2,
+					asearch_report_collect, matches), 1);
+			matches_ref[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_approx(fsmtrie,
+					queries[n], 2, asearch_report_collect,
+					matches_ref), 1);
+			ck_assert_str_eq(matches, matches_ref);
+		}
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx_ctx(fsmtrie, ctx, "fxo",
+				3, 1, asearch_report_collect, matches), 1);
+		ck_assert_str_eq(matches, "fo:1 foo:1 ");
+
+		memset(key, 'a', sizeof (key) - 1);
+		key[sizeof (key) - 1] = '\0';
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, key, "long"), 1);
+		key[500] = 'b';
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx_ctx(fsmtrie, ctx, key,
+				strlen(key), 1, asearch_report_collect,
+				matches), 1);
+		ck_assert_str_eq(matches, "long:1 ");
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx_ctx(fsmtrie, ctx,
+				queries[3], 0, 2, asearch_report_collect,
+				matches), 1);
+		ck_assert_str_eq(matches, "f:1 fo:2 ");
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx_ctx(fsmtrie, ctx,
+				queries[3], 0, 1, asearch_report_collect,
+				matches), 1);
+		ck_assert_str_eq(matches, "f:1 ");
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx_ctx(fsmtrie, ctx, "of",
+				2, 1, asearch_report_collect, matches), 1);
+		ck_assert_str_eq(matches, "f:1 fo:1 ");
+
+		fsmtrie_opt_destroy(&opt);
+		fsmtrie_destroy(&fsmtrie);
+	}
+	fsmtrie_asearch_ctx_destroy(&ctx);
+	ck_assert_ptr_eq(ctx, NULL);
+}
+END_TEST
+
+START_TEST(test_trie_asearch_index)
+{
+	int n, m, t, len, dist, d, max_dist;
+	unsigned int seed = 7;
+	uint32_t prefix;
+	fsmtrie_t fsmtrie[2];
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	static char keys[512][72], query[72];
+	static char matches[65536], matches_ref[65536];
+	char *sorted[512], match[128];
+
+	for (n = 0; n < 512; n++)
+	{
+		len = n < 256 ? 1 + (seed = seed * 1103515245 + 12345) /
+			65536 % 8 : 60 + (seed = seed * 1103515245 + 12345) /
+			65536 % 10;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "aab"[seed / 65536 % 3];
+		}
+		keys[n][len] = '\0';
+		sorted[n] = keys[n];
+	}
+	qsort(sorted, 512, sizeof (*sorted), cmp_str);
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_approx_index(opt, 3), 0);
+	ck_assert_int_eq(fsmtrie_opt_set_approx_index(opt, -1), 0);
+	ck_assert_int_eq(fsmtrie_opt_set_approx_index(opt, 2), 1);
+	ck_assert_int_eq(fsmtrie_opt_get_approx_index(opt, &max_dist), 1);
+	ck_assert_int_eq(max_dist, 2);
+
+	/* the index can't follow RCU updates */
+	ck_assert_int_eq(fsmtrie_opt_set_rcu(opt, true), 1);
+	ck_assert_ptr_eq(fsmtrie_init(opt, err_buf, sizeof (err_buf)), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_rcu(opt, false), 1);
+
+	/* whole keys, and only the first 3 bytes of them */
+	for (t = 0; t < 2; t++)
+	{
+		ck_assert_int_eq(fsmtrie_opt_set_approx_index_prefix(opt,
+					t * 3), 1);
+		ck_assert_int_eq(fsmtrie_opt_get_approx_index_prefix(opt,
+					&prefix), 1);
+		ck_assert_int_eq(prefix, t * 3);
+		ck_assert_ptr_ne(fsmtrie[t] = fsmtrie_init(opt, err_buf,
+					sizeof (err_buf)), NULL);
+		for (n = 0; n < 512; n++)
+		{
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie[t], keys[n],
+						keys[n]), 1);
+		}
+		ck_assert_int_eq(fsmtrie_compile(fsmtrie[t]), 1);
+	}
+
+	for (n = 0; n < 512; n += 3)
+	{
+		strcpy(query, keys[n]);
+		len = strlen(query);
+		for (m = 0; m < 2; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			d = seed / 65536 % len;
+			if (d + 1 < len && m == 0)
+			{
+				query[d] = query[d + 1];
+				query[d + 1] = keys[n][d];
+			}
+			else
+			{
+				query[d] = query[d] == 'a' ? 'b' : 'a';
+			}
+		}
+
+		for (dist = 0; dist <= 3; dist++)
+		{
+			matches_ref[0] = '\0';
+			for (m = 0; m < 512; m++)
+			{
+				if (m > 0 && !strcmp(sorted[m], sorted[m - 1]))
+				{
+					continue;
+				}
+				if ((d = osa_dist(sorted[m], query)) <= dist)
+				{
+					snprintf(match, sizeof (match),
+							"%s:%d ", sorted[m], d);
+					strcat(matches_ref, match);
+				}
+			}
+			for (t = 0; t < 2; t++)
+			{
+				matches[0] = '\0';
+				ck_assert_int_eq(fsmtrie_search_approx(
+						fsmtrie[t], query, dist,
+						asearch_report_collect,
+						matches), 1);
+				ck_assert_str_eq(matches, matches_ref);
+			}
+		}
+	}
+
+	/* updates drop the index until the next compile */
+	for (t = 0; t < 2; t++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie[t], "bbbb", "bbbb"), 1);
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie[t], sorted[0]), 1);
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx(fsmtrie[t], "bbabb", 2,
+				asearch_report_collect, matches), 1);
+		ck_assert_ptr_ne(strstr(matches, "bbbb:1 "), NULL);
+		ck_assert_int_eq(fsmtrie_compile(fsmtrie[t]), 1);
+		matches_ref[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx(fsmtrie[t], "bbabb", 2,
+				asearch_report_collect, matches_ref), 1);
+		ck_assert_str_eq(matches, matches_ref);
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_approx(fsmtrie[t], sorted[0],
+				1, asearch_report_collect, matches), 1);
+		snprintf(match, sizeof (match), "%s:0 ", sorted[0]);
+		ck_assert_ptr_eq(strstr(matches, match), NULL);
+		fsmtrie_destroy(&fsmtrie[t]);
+	}
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_asearch_batch)
+{
+	int n, m, len, dist;
+	unsigned int seed = 11;
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	static char keys[128][16], queries[64][16];
+	static char matches[64][2048], matches_ref[2048];
+	const char *qp[64];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_eascii), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	for (n = 0; n < 128; n++)
+	{
+		seed = seed * 1103515245 + 12345;
+		len = 1 + seed / 65536 % 10;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "aabc"[seed / 65536 % 4];
+		}
+		keys[n][len] = '\0';
+		ck_assert_int_ge(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 0);
+	}
+
+	/* keys, their prefixes and edits of them, duplicates and "" */
+	for (n = 0; n < 64; n++)
+	{
+		seed = seed * 1103515245 + 12345;
+		strcpy(queries[n], keys[seed / 65536 % 128]);
+		len = strlen(queries[n]);
+		seed = seed * 1103515245 + 12345;
+		m = seed / 65536 % (len + 1);
+		if (n % 4 == 1)
+		{
+			queries[n][m] = '\0';
+		}
+		else if (n % 4 == 2 && m < len)
+		{
+			queries[n][m] = "abcd"[n / 4 % 4];
+		}
+		else if (n % 4 == 3)
+		{
+			strcpy(queries[n], queries[n - 1]);
+		}
+		qp[n] = queries[n];
+	}
+	queries[0][0] = '\0';
+
+	for (dist = 0; dist <= 3; dist++)
+	{
+		memset(matches, 0, sizeof (matches));
+		ck_assert_int_eq(fsmtrie_search_approx_batch(fsmtrie, qp, 64,
+				dist, asearch_batch_collect, matches), 1);
+		for (n = 0; n < 64; n++)
+		{
+			matches_ref[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_approx(fsmtrie, qp[n],
+					dist, asearch_report_collect,
+					matches_ref), 1);
+			ck_assert_str_eq(matches[n], matches_ref);
+		}
+	}
+
+	memset(matches, 0, sizeof (matches));
+	ck_assert_int_eq(fsmtrie_search_approx_batch(fsmtrie, qp, 64, -1,
+			asearch_batch_collect, matches), 1);
+	ck_assert_int_eq(fsmtrie_search_approx_batch(fsmtrie, qp, 0, 2,
+			asearch_batch_collect, matches), 1);
+	for (n = 0; n < 64; n++)
+	{
+		ck_assert_str_eq(matches[n], "");
+	}
+	qp[5] = NULL;
+	ck_assert_int_eq(fsmtrie_search_approx_batch(fsmtrie, qp, 64, 1,
+			asearch_batch_collect, matches), -1);
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_subsearch_dfa)
+{
+	int n, m;
+	bool on;
+	fsmtrie_t fsmtrie, fsmtrie_dfa;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	char matches[4096], matches_dfa[4096], subject[256];
+	int count, count_dfa;
+	const char *keys[] = {
+		"he",
+		"she",
+		"his",
+		"hers",
+		"s",
+		"ushers",
+		"\xe4\xf6",
+	0 };
+	const char *subjects[] = {
+		"ushers",
+		"she sells his hershey bars",
+		"hhhhhhhsssshhhhhhheeeeeeerrrrs",
+		"\xe4\xf6\xe4\xf6 hers \xff",
+		"no match here? there",
+		"",
+	0 };
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_eascii), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_dfa(opt, true), 1);
+	ck_assert_int_eq(fsmtrie_opt_get_dfa(opt, &on), 1);
+	ck_assert_int_eq(on, true);
+	ck_assert_ptr_ne(fsmtrie_dfa = fsmtrie_init(opt, err_buf,
+				sizeof (err_buf)), NULL);
+
+	/* insert in two rounds so the DFA is rebuilt after the first search */
+	for (m = 0; m < 2; m++)
+	{
+		for (n = 0; keys[n]; n++)
+		{
+			if (n % 2 != m)
+			{
+				continue;
+			}
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n],
+						keys[n]), 1);
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie_dfa, keys[n],
+						keys[n]), 1);
+		}
+		for (n = 0; subjects[n]; n++)
+		{
+			matches[0] = matches_dfa[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_substring(fsmtrie,
+				subjects[n], subsearch_report_collect,
+				matches), 1);
+			ck_assert_int_eq(fsmtrie_search_substring(fsmtrie_dfa,
+				subjects[n], subsearch_report_collect,
+				matches_dfa), 1);
+			ck_assert_str_eq(matches_dfa, matches);
+		}
+	}
+
+	matches_dfa[0] = '\0';
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie_dfa, "ushers",
+		subsearch_report_collect, matches_dfa), 1);
+	ck_assert_str_eq(matches_dfa, "s@1 she@1 he@2 ushers@0 hers@2 s@5 ");
+
+	/* every byte labels an edge, none shares a class */
+	for (n = 0; n < 256; n++)
+	{
+		subject[n] = n;
+		ck_assert_int_ge(fsmtrie_insert_n(fsmtrie, &subject[n], 1,
+					NULL), 0);
+		ck_assert_int_ge(fsmtrie_insert_n(fsmtrie_dfa, &subject[n], 1,
+					NULL), 0);
+	}
+	count = count_dfa = 0;
+	ck_assert_int_eq(fsmtrie_search_substring_n(fsmtrie, subject, 256,
+				subsearch_report_count, &count), 1);
+	ck_assert_int_eq(fsmtrie_search_substring_n(fsmtrie_dfa, subject, 256,
+				subsearch_report_count, &count_dfa), 1);
+	ck_assert_int_eq(count, 256);
+	ck_assert_int_eq(count_dfa, count);
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_destroy(&fsmtrie_dfa);
+}
+END_TEST
+
+START_TEST(test_trie_subsearch_incremental)
+{
+	int n, m, len;
+	unsigned int seed = 1;
+	fsmtrie_t fsmtrie, fsmtrie_ref;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	static char matches[65536], matches_ref[65536];
+	char keys[256][9], subject[97];
+
+	/*
+	 * Keys over a tiny alphabet overlap in every possible way. After
+	 * each insert into a compiled trie, searching it must give what a
+	 * trie compiled from scratch gives.
+	 */
+	for (n = 0; n < 256; n++)
+	{
+		len = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 8;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "aab"[seed / 65536 % 3];
+		}
+		keys[n][len] = '\0';
+	}
+	for (m = 0; m < (int)sizeof (subject) - 1; m++)
+	{
+		seed = seed * 1103515245 + 12345;
+		subject[m] = "aabc"[seed / 65536 % 4];
+	}
+	subject[m] = '\0';
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	for (n = 0; n < 256; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, subject,
+			subsearch_report_collect, matches), 1);
+
+		ck_assert_ptr_ne(fsmtrie_ref = fsmtrie_init(opt, err_buf,
+					sizeof (err_buf)), NULL);
+		for (m = n; m >= 0; m--)
+		{
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie_ref, keys[m],
+						keys[m]), 1);
+		}
+		matches_ref[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_substring(fsmtrie_ref, subject,
+			subsearch_report_collect, matches_ref), 1);
+		ck_assert_str_eq(matches, matches_ref);
+		fsmtrie_destroy(&fsmtrie_ref);
+	}
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_subsearch_delete)
+{
+	int n, m, k, len, dfa;
+	unsigned int seed = 7;
+	fsmtrie_t fsmtrie, fsmtrie_ref;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	static char matches[65536], matches_ref[65536];
+	char keys[256][9], subject[97];
+
+	/*
+	 * Same as above the other way around: after each delete from a
+	 * compiled trie, searching it must give what a trie compiled from
+	 * the remaining keys gives, and it must have as many nodes.
+	 */
+	for (n = 0; n < 256; n++)
+	{
+		len = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 8;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "aab"[seed / 65536 % 3];
+		}
+		keys[n][len] = '\0';
+	}
+	for (m = 0; m < (int)sizeof (subject) - 1; m++)
+	{
+		seed = seed * 1103515245 + 12345;
+		subject[m] = "aabc"[seed / 65536 % 4];
+	}
+	subject[m] = '\0';
+
+	for (dfa = 0; dfa < 2; dfa++)
+	{
+		ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+		ck_assert_int_eq(fsmtrie_opt_set_dfa(opt, dfa), 1);
+		ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf,
+					sizeof (err_buf)), NULL);
+		for (n = 0; n < 256; n++)
+		{
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n],
+						keys[n]), 1);
+		}
+		ck_assert_int_eq(fsmtrie_compile(fsmtrie), 1);
+
+		for (n = 0; n < 256; n++)
+		{
+			/* duplicates are gone with their first copy */
+			for (k = 0; k < n && strcmp(keys[k], keys[n]); k++)
+				;
+			ck_assert_int_eq(fsmtrie_delete(fsmtrie, keys[n]),
+					k == n);
+			matches[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_substring(fsmtrie,
+				subject, subsearch_report_collect, matches), 1);
+
+			ck_assert_ptr_ne(fsmtrie_ref = fsmtrie_init(opt,
+						err_buf, sizeof (err_buf)), NULL);
+			for (m = n + 1; m < 256; m++)
+			{
+				for (k = 0; k <= n && strcmp(keys[k], keys[m]);
+						k++)
+					;
+				if (k > n)
+				{
+					ck_assert_int_eq(fsmtrie_insert(
+						fsmtrie_ref, keys[m], keys[m]),
+						1);
+				}
+			}
+			matches_ref[0] = '\0';
+			ck_assert_int_eq(fsmtrie_search_substring(fsmtrie_ref,
+				subject, subsearch_report_collect,
+				matches_ref), 1);
+			ck_assert_str_eq(matches, matches_ref);
+			ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie),
+					fsmtrie_get_nodecnt(fsmtrie_ref));
+			ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie),
+					fsmtrie_get_keycnt(fsmtrie_ref));
+			fsmtrie_destroy(&fsmtrie_ref);
+		}
+
+		fsmtrie_opt_destroy(&opt);
+		fsmtrie_destroy(&fsmtrie);
+	}
+}
+END_TEST
+
+START_TEST(test_trie_subsearch_rcu)
+{
+	int n, m, k, d, len, live[256];
+	unsigned int seed = 11;
+	fsmtrie_t fsmtrie, fsmtrie_ref;
+	fsmtrie_opt_t opt, opt_rcu;
+	char err_buf[BUFSIZ];
+	static char matches[65536], matches_ref[65536], published[65536];
+	char keys[256][9], subject[97];
+
+	/*
+	 * RCU inserts and deletes keep the links up to date on copies of the
+	 * nodes: until the next publish searches must give what they gave
+	 * before, and after it what a trie compiled from the remaining keys
+	 * gives.
+	 */
+	for (n = 0; n < 256; n++)
+	{
+		len = 1 + (seed = seed * 1103515245 + 12345) / 65536 % 8;
+		for (m = 0; m < len; m++)
+		{
+			seed = seed * 1103515245 + 12345;
+			keys[n][m] = "aab"[seed / 65536 % 3];
+		}
+		keys[n][len] = '\0';
+	}
+	for (m = 0; m < (int)sizeof (subject) - 1; m++)
+	{
+		seed = seed * 1103515245 + 12345;
+		subject[m] = "aabc"[seed / 65536 % 4];
+	}
+	subject[m] = '\0';
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_ptr_ne(opt_rcu = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_rcu(opt_rcu, true), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt_rcu, err_buf,
+				sizeof (err_buf)), NULL);
+	published[0] = '\0';
+	for (n = 0; n < 256; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+		live[n] = 1;
+		if (n % 3 == 2)
+		{
+			d = (seed = seed * 1103515245 + 12345) / 65536 % n;
+			for (m = 0, k = 0; m <= n; m++)
+			{
+				if (strcmp(keys[m], keys[d]) == 0)
+				{
+					k |= live[m];
+					live[m] = 0;
+				}
+			}
+			ck_assert_int_eq(fsmtrie_delete(fsmtrie, keys[d]), k);
+		}
+
+		matches[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, subject,
+			subsearch_report_collect, matches), 1);
+		ck_assert_str_eq(matches, published);
+		if (n % 2 == 0)
+		{
+			continue;
+		}
+
+		ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+		published[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, subject,
+			subsearch_report_collect, published), 1);
+
+		ck_assert_ptr_ne(fsmtrie_ref = fsmtrie_init(opt, err_buf,
+					sizeof (err_buf)), NULL);
+		for (m = 0; m <= n; m++)
+		{
+			if (live[m])
+			{
+				ck_assert_int_eq(fsmtrie_insert(fsmtrie_ref,
+						keys[m], keys[m]), 1);
+			}
+		}
+		matches_ref[0] = '\0';
+		ck_assert_int_eq(fsmtrie_search_substring(fsmtrie_ref, subject,
+			subsearch_report_collect, matches_ref), 1);
+		ck_assert_str_eq(published, matches_ref);
+		fsmtrie_destroy(&fsmtrie_ref);
+	}
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_opt_destroy(&opt_rcu);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_scanner)
+{
+	int n, dfa;
+	size_t chunk, off;
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	fsmtrie_scanner_t scanner;
+	char err_buf[BUFSIZ];
+	char matches[4096];
+	/* an embedded NUL must not stop the scan */
+	const char stream[] = "ushers\0farsight hersheys";
+	const char *keys[] = {
+		"he",
+		"she",
+		"hers",
+		"ushers",
+		"sigh",
+		"farsight",
+	0 };
+
+	for (dfa = 0; dfa < 2; dfa++)
+	{
+		ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+		ck_assert_int_eq(fsmtrie_opt_set_mode(opt,
+					fsmtrie_mode_eascii), 1);
+		ck_assert_int_eq(fsmtrie_opt_set_dfa(opt, dfa), 1);
+		ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf,
+					sizeof (err_buf)), NULL);
+		for (n = 0; keys[n]; n++)
+		{
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n],
+						keys[n]), 1);
+		}
+
+		ck_assert_ptr_ne(scanner = fsmtrie_scanner_init(fsmtrie,
+					scanner_report_collect, matches), NULL);
+
+		/* matches must not depend on how the stream is split up */
+		for (chunk = 1; chunk <= sizeof (stream); chunk++)
+		{
+			matches[0] = '\0';
+			fsmtrie_scanner_reset(scanner);
+			for (off = 0; off < sizeof (stream) - 1; off += chunk)
+			{
+				ck_assert_int_eq(fsmtrie_scanner_feed(scanner,
+					stream + off, off + chunk <
+					sizeof (stream) - 1 ? chunk :
+					sizeof (stream) - 1 - off), 1);
+			}
+			ck_assert_int_eq(fsmtrie_scanner_get_offset(scanner),
+					sizeof (stream) - 1);
+			ck_assert_str_eq(matches, "she@1 he@2 ushers@0 hers@2 "
+					"sigh@10 farsight@7 he@16 hers@16 "
+					"she@19 he@20 ");
+		}
+
+		fsmtrie_scanner_destroy(&scanner);
+		ck_assert_ptr_eq(scanner, NULL);
+		fsmtrie_opt_destroy(&opt);
+		fsmtrie_destroy(&fsmtrie);
+	}
+
+	/* scanners are not available for token tries */
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_ptr_eq(fsmtrie_scanner_init(fsmtrie, scanner_report_collect,
+				matches), NULL);
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
 int main(void)
 {
 	int number_failed;
@@ -117,6 +1013,15 @@ int main(void)
 	s = suite_create("fsmtrie_trie");
 	tc_core = tcase_create("core");
 	tcase_add_test(tc_core, test_trie_insert_and_asearch_subsearch);
+	tcase_add_test(tc_core, test_trie_asearch);
+	tcase_add_test(tc_core, test_trie_asearch_ctx);
+	tcase_add_test(tc_core, test_trie_asearch_index);
+	tcase_add_test(tc_core, test_trie_asearch_batch);
+	tcase_add_test(tc_core, test_trie_subsearch_dfa);
+	tcase_add_test(tc_core, test_trie_subsearch_incremental);
+	tcase_add_test(tc_core, test_trie_subsearch_delete);
+	tcase_add_test(tc_core, test_trie_subsearch_rcu);
+	tcase_add_test(tc_core, test_trie_scanner);
 	suite_add_tcase(s, tc_core);
 
 	sr = srunner_create(s);
@@ -234,6 +234,405 @@ START_TEST(test_trie_insert_and_search_utf8)
 }
 END_TEST
 
+START_TEST(test_trie_insert_and_search_wide)
+{
+	int n, m;
+	const char *str;
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	char key[4];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_eascii), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	/* Grow the root and one of its children through every child table
+	 * kind, checking the whole set of keys after every insertion.
+	 */
+	for (n = 1; n < 256; n++)
+	{
+		key[0] = n;
+		key[1] = '\0';
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, key, NULL), 1);
+		key[0] = 'x';
+		key[1] = 256 - n;
+		key[2] = '\0';
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, key, NULL), 1);
+
+		for (m = 1; m <= n; m++)
+		{
+			key[0] = m;
+			key[1] = '\0';
+			ck_assert_int_eq(fsmtrie_search(fsmtrie, key, &str), 1);
+			key[0] = 'x';
+			key[1] = 256 - m;
+			key[2] = '\0';
+			ck_assert_int_eq(fsmtrie_search(fsmtrie, key, &str), 1);
+		}
+		if (n < 255)
+		{
+			/* not inserted yet */
+			key[0] = 'x';
+			key[1] = 255 - n;
+			key[2] = '\0';
+			ck_assert_int_eq(fsmtrie_search(fsmtrie, key, &str), 0);
+		}
+	}
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 2 * 255);
+	ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 2 * 255);
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+static void search_n_report(const char *str, int off, void *data)
+{
+	char *matches = (char *)data;
+	char match[64];
+
+	snprintf(match, sizeof (match), "%s@%d ", str ? str : "-", off);
+	strcat(matches, match);
+}
+
+START_TEST(test_trie_insert_and_search_n)
+{
+	const char *str;
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ], matches[256];
+	/* binary keys, note the embedded NULs */
+	const char k1[] = { 'a', '\0', 'b' };
+	const char k2[] = { '\0', '\0' };
+	const char k3[] = { '\xff', '\0', '\x01' };
+	const char subject[] = { 'a', '\0', 'b', '\0', '\0', '\0', '\xff',
+		'\0', '\x01' };
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_eascii), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_maxlength(opt, 8), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	ck_assert_int_eq(fsmtrie_insert_n(fsmtrie, k1, sizeof (k1), "k1"), 1);
+	ck_assert_int_eq(fsmtrie_insert_n(fsmtrie, k2, sizeof (k2), NULL), 1);
+	ck_assert_int_eq(fsmtrie_insert_n(fsmtrie, k3, sizeof (k3), "k3"), 1);
+	ck_assert_int_eq(fsmtrie_insert_n(fsmtrie, "abcdefghi", 9, NULL), 0);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 3);
+
+	ck_assert_int_eq(fsmtrie_search_n(fsmtrie, k1, sizeof (k1), &str), 1);
+	ck_assert_str_eq(str, "k1");
+	ck_assert_int_eq(fsmtrie_search_n(fsmtrie, k2, sizeof (k2), &str), 1);
+	ck_assert_ptr_eq(str, NULL);
+	ck_assert_int_eq(fsmtrie_search_n(fsmtrie, k1, 2, &str), 0);
+	/* the NUL-terminated API only sees the part before the first NUL */
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, k1, &str), 0);
+
+	/* match offsets come from the key length, not from str */
+	matches[0] = '\0';
+	ck_assert_int_eq(fsmtrie_search_substring_n(fsmtrie, subject,
+		sizeof (subject), search_n_report, matches), 1);
+	ck_assert_str_eq(matches, "k1@0 -@3 -@4 k3@6 ");
+
+	matches[0] = '\0';
+	ck_assert_int_eq(fsmtrie_search_approx_n(fsmtrie, k3, 2, 1,
+		search_n_report, matches), 1);
+	ck_assert_str_eq(matches, "-@1 k3@1 ");
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_delete)
+{
+	int rcu;
+	const char *str;
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	const char *keys[] = { "dog", "dogs", "do", "cat", "catalog", 0 };
+	const char bkey[] = { 'a', '\0', 'b' };
+	uint32_t t1[] = { 1, 2, 3 }, t2[] = { 1, 4 };
+	int n;
+
+	for (rcu = 0; rcu < 2; rcu++)
+	{
+		ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+		ck_assert_int_eq(fsmtrie_opt_set_mode(opt,
+					fsmtrie_mode_eascii), 1);
+		ck_assert_int_eq(fsmtrie_opt_set_rcu(opt, rcu), 1);
+		ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf,
+					sizeof (err_buf)), NULL);
+		for (n = 0; keys[n]; n++)
+		{
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n],
+						keys[n]), 1);
+		}
+		ck_assert_int_eq(fsmtrie_insert_n(fsmtrie, bkey,
+					sizeof (bkey), NULL), 1);
+		if (rcu)
+		{
+			ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+		}
+		ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 14);
+
+		/* nodes nothing else needs go with the key */
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "dogs"), 1);
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "dogs"), 0);
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "d"), 0);
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "dogsled"), 0);
+		ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 13);
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "do"), 1);
+		ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 13);
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "catalog"), 1);
+		ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 9);
+		ck_assert_int_eq(fsmtrie_delete_n(fsmtrie, bkey, 2), 0);
+		ck_assert_int_eq(fsmtrie_delete_n(fsmtrie, bkey,
+					sizeof (bkey)), 1);
+		ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 6);
+		ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 2);
+
+		/* RCU deletes become visible with the next version */
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "dogs", &str), rcu);
+		if (rcu)
+		{
+			ck_assert_str_eq(str, "dogs");
+			ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+		}
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "dogs", &str), 0);
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "do", &str), 0);
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "catalog", &str), 0);
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "dog", &str), 1);
+		ck_assert_str_eq(str, "dog");
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "cat", &str), 1);
+		ck_assert_str_eq(str, "cat");
+
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "dog"), 1);
+		ck_assert_int_eq(fsmtrie_delete(fsmtrie, "cat"), 1);
+		ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 0);
+		ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 0);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, "dogs", "again"), 1);
+		if (rcu)
+		{
+			ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+		}
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "dogs", &str), 1);
+		ck_assert_str_eq(str, "again");
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, "cat", &str), 0);
+		ck_assert_int_eq(fsmtrie_delete_token(fsmtrie, t2, 2), -1);
+
+		fsmtrie_opt_destroy(&opt);
+		fsmtrie_destroy(&fsmtrie);
+	}
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_insert_token(fsmtrie, t1, 3, "t1"), 1);
+	ck_assert_int_eq(fsmtrie_insert_token(fsmtrie, t1, 2, "t1/2"), 1);
+	ck_assert_int_eq(fsmtrie_insert_token(fsmtrie, t2, 2, "t2"), 1);
+	ck_assert_int_eq(fsmtrie_delete(fsmtrie, "dog"), -1);
+	ck_assert_int_eq(fsmtrie_delete_token(fsmtrie, t1, 1), 0);
+	ck_assert_int_eq(fsmtrie_delete_token(fsmtrie, t1, 3), 1);
+	ck_assert_int_eq(fsmtrie_delete_token(fsmtrie, t1, 3), 0);
+	ck_assert_int_eq(fsmtrie_search_token(fsmtrie, t1, 3, &str), 0);
+	ck_assert_int_eq(fsmtrie_search_token(fsmtrie, t1, 2, &str), 1);
+	ck_assert_str_eq(str, "t1/2");
+	ck_assert_int_eq(fsmtrie_delete_token(fsmtrie, t1, 2), 1);
+	ck_assert_int_eq(fsmtrie_search_token(fsmtrie, t2, 2, &str), 1);
+	ck_assert_str_eq(str, "t2");
+	ck_assert_int_eq(fsmtrie_delete_token(fsmtrie, t2, 2), 1);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 0);
+	ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), 0);
+	ck_assert_int_eq(fsmtrie_insert_token(fsmtrie, t1, 3, "t1"), 1);
+	ck_assert_int_eq(fsmtrie_search_token(fsmtrie, t1, 3, &str), 1);
+	ck_assert_str_eq(str, "t1");
+	ck_assert_int_eq(fsmtrie_search_token(fsmtrie, t2, 2, &str), 0);
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_bulk_load)
+{
+	int n, fds[2];
+	const char *str;
+	fsmtrie_t fsmtrie, fsmtrie_ref;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ], matches[256];
+	const char *keys[] = { "a", "ab", "ab", "abc", "abd", "b", "ba",
+		"bab", "bb", "c" };
+	const char *strs[] = { "1", "2", "3", "4", "5", "6", "7", "8", "9",
+		"10" };
+	const char *unsorted[] = { "d", "da", "cz" };
+	const char lines[] = "e\nea\n\neb\nf";
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_ptr_ne(fsmtrie_ref = fsmtrie_init(opt, err_buf,
+				sizeof (err_buf)), NULL);
+
+	/* the path of a key already in the trie is looked up, not re-added */
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "abd", NULL), 1);
+	ck_assert_int_eq(fsmtrie_bulk_load_array(fsmtrie, keys, strs, 10), 1);
+	for (n = 0; n < 10; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie_ref, keys[n], strs[n]),
+				1);
+	}
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 9);
+	ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie),
+			fsmtrie_get_nodecnt(fsmtrie_ref));
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "ab", &str), 1);
+	ck_assert_str_eq(str, "2");
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "abd", &str), 1);
+	ck_assert_ptr_eq(str, NULL);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "bab", &str), 1);
+	ck_assert_str_eq(str, "8");
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "ba", &str), 1);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "bc", &str), 0);
+
+	/* keys before the out of order one stay */
+	ck_assert_int_eq(fsmtrie_bulk_load_array(fsmtrie, unsorted, NULL, 3),
+			0);
+	ck_assert_ptr_ne(strstr(fsmtrie_get_error(fsmtrie), "out of order"),
+			NULL);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "da", &str), 1);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "cz", &str), 0);
+
+	ck_assert_int_eq(pipe(fds), 0);
+	ck_assert_int_eq(write(fds[1], lines, sizeof (lines) - 1),
+			sizeof (lines) - 1);
+	close(fds[1]);
+	ck_assert_int_eq(fsmtrie_bulk_load_fd(fsmtrie, fds[0]), 1);
+	close(fds[0]);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 15);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "ea", &str), 1);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "f", &str), 1);
+
+	/* substring search compiles the loaded trie */
+	matches[0] = '\0';
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, "xbabx",
+		search_n_report, matches), 1);
+	ck_assert_str_eq(matches, "6@1 7@1 1@2 8@1 2@2 6@3 ");
+
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_destroy(&fsmtrie_ref);
+
+	/* RCU tries copy the published nodes on the way */
+	ck_assert_int_eq(fsmtrie_opt_set_rcu(opt, true), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_bulk_load_array(fsmtrie, keys, NULL, 5), 1);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "abc", &str), 0);
+	ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+	ck_assert_int_eq(fsmtrie_bulk_load_array(fsmtrie, keys + 5, NULL, 5),
+			1);
+	ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+	for (n = 0; n < 10; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, keys[n], &str), 1);
+	}
+	fsmtrie_destroy(&fsmtrie);
+
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_search_batch)
+{
+	int n, results[200], result;
+	const char *str, *strs[200];
+	const char *keys[200];
+	const uint32_t *tkeys[200];
+	uint32_t tokens[200][2];
+	size_t tkeylens[200];
+	char keybufs[200][16];
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_ascii), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_partialmatch(opt, true), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+
+	/* insert every third key, search for all of them and some prefixes */
+	for (n = 0; n < 200; n++)
+	{
+		snprintf(keybufs[n], sizeof (keybufs[n]), "key%d.example", n);
+		if (n % 3 == 0)
+		{
+			ck_assert_int_eq(fsmtrie_insert(fsmtrie, keybufs[n],
+						keybufs[n]), 1);
+		}
+		if (n % 7 == 0)
+		{
+			keybufs[n][4] = '\0';
+		}
+		keys[n] = keybufs[n];
+	}
+	ck_assert_int_eq(fsmtrie_search_batch(fsmtrie, keys, 200, results,
+				strs), 1);
+	for (n = 0; n < 200; n++)
+	{
+		result = fsmtrie_search(fsmtrie, keys[n], &str);
+		ck_assert_int_eq(results[n], result);
+		ck_assert_ptr_eq(strs[n], str);
+	}
+
+	/* errors are per key */
+	keys[5] = NULL;
+	keys[6] = "\x80";
+	ck_assert_int_eq(fsmtrie_search_batch(fsmtrie, keys, 10, results,
+				NULL), -1);
+	ck_assert_int_eq(results[5], -1);
+	ck_assert_int_eq(results[6], -1);
+	ck_assert_int_eq(results[3], 1);
+	ck_assert_int_eq(results[4], 0);
+
+	fsmtrie_destroy(&fsmtrie);
+
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_partialmatch(opt, false), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	for (n = 0; n < 200; n++)
+	{
+		tokens[n][0] = n % 10;
+		tokens[n][1] = 4000000000U - n;
+		if (n % 3 == 0)
+		{
+			ck_assert_int_eq(fsmtrie_insert_token(fsmtrie,
+						tokens[n], 2, keybufs[n]), 1);
+		}
+		tkeys[n] = tokens[n];
+		tkeylens[n] = n % 5 ? 2 : 1;
+	}
+	ck_assert_int_eq(fsmtrie_search_token_batch(fsmtrie, tkeys, tkeylens,
+				200, results, strs), 1);
+	for (n = 0; n < 200; n++)
+	{
+		result = fsmtrie_search_token(fsmtrie, tkeys[n], tkeylens[n],
+				&str);
+		ck_assert_int_eq(results[n], result);
+		ck_assert_ptr_eq(strs[n], str);
+	}
+	ck_assert_int_eq(fsmtrie_search_batch(fsmtrie, keys, 10, results,
+				NULL), -1);
+
+	fsmtrie_opt_destroy(&opt);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
 int main(void) {
 	int number_failed;
 	Suite *s;
@@ -246,6 +645,11 @@ int main(void) {
 	tcase_add_test(tc_core, test_trie_insert_and_search_ml);
 	tcase_add_test(tc_core, test_trie_insert_and_search_utf8);
 	tcase_add_test(tc_core, test_trie_insert_and_search_token);
+	tcase_add_test(tc_core, test_trie_insert_and_search_wide);
+	tcase_add_test(tc_core, test_trie_insert_and_search_n);
+	tcase_add_test(tc_core, test_trie_delete);
+	tcase_add_test(tc_core, test_trie_bulk_load);
+	tcase_add_test(tc_core, test_trie_search_batch);
 	suite_add_tcase(s, tc_core);
 
 	sr = srunner_create(s);
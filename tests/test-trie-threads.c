@@ -0,0 +1,593 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <check.h>
+#include "fsmtrie.h"
+
+#define NTHREADS	8
+#define NROUNDS		200
+
+static const char *keys[] = {
+	"foo",
+	"bar",
+	"brad",
+	"brady",
+	"foobarbaz",
+	"farsightsecurity",
+	"sigh",
+	"fsi",
+	"fsizn",
+	"love",
+	"hate",
+	"dogs",
+	0 };
+
+static const char *text = "xxfarsightsecurityxxfoobarbazxxlovedogs";
+
+/* matches of keys in text: farsightsecurity, sigh, foo, foobarbaz, bar,
+ * love, dogs
+ */
+#define TEXT_MATCHES	7
+
+struct worker
+{
+	fsmtrie_t fsmtrie;
+	int id;
+	bool rcu;
+	int failed;
+};
+
+static void count_report(const char *str, int off, void *data)
+{
+	(void)str;
+	(void)off;
+	(*(int *)data)++;
+}
+
+static void scan_report(const char *str, uint64_t off, void *data)
+{
+	(void)str;
+	(void)off;
+	(*(int *)data)++;
+}
+
+/*
+ * Assertions only work from the main thread, so workers count their
+ * failures and the test checks the count once they are joined.
+ */
+static void *
+worker(void *arg)
+{
+	struct worker *w = arg;
+	const char *strs[12], *str;
+	int results[12], n, round, matches;
+	fsmtrie_scanner_t scanner;
+	const char *bad = "\xff";
+
+	for (round = 0; round < NROUNDS; round++)
+	{
+		matches = 0;
+		if (fsmtrie_search_substring(w->fsmtrie, text, count_report,
+					&matches) != 1 ||
+				matches != TEXT_MATCHES)
+		{
+			w->failed++;
+		}
+
+		for (n = 0; keys[n]; n++)
+		{
+			if (fsmtrie_search(w->fsmtrie, keys[n], &str) != 1 ||
+					strcmp(str, keys[n]) != 0)
+			{
+				w->failed++;
+			}
+		}
+
+		if (fsmtrie_search_batch(w->fsmtrie, keys, 12, results,
+					strs) != 1)
+		{
+			w->failed++;
+		}
+		for (n = 0; n < 12; n++)
+		{
+			if (results[n] != 1 || strcmp(strs[n], keys[n]) != 0)
+			{
+				w->failed++;
+			}
+		}
+
+		matches = 0;
+		if (fsmtrie_search_approx(w->fsmtrie, "fxrsightsecurity", 1,
+					count_report, &matches) != 1 ||
+				matches != 1)
+		{
+			w->failed++;
+		}
+
+		matches = 0;
+		scanner = fsmtrie_scanner_init(w->fsmtrie, scan_report,
+				&matches);
+		if (scanner == NULL)
+		{
+			w->failed++;
+			continue;
+		}
+		for (n = 0; text[n]; n++)
+		{
+			fsmtrie_scanner_feed(scanner, &text[n], 1);
+		}
+		fsmtrie_scanner_destroy(&scanner);
+
+		/* RCU scanners start over when a new version is published */
+		if (w->rcu ? matches > TEXT_MATCHES : matches != TEXT_MATCHES)
+		{
+			w->failed++;
+		}
+
+		/* only odd workers fail, the others never see an error */
+		if (w->id % 2)
+		{
+			if (fsmtrie_search(w->fsmtrie, bad, &str) != -1 ||
+					*fsmtrie_get_error(w->fsmtrie) == '\0')
+			{
+				w->failed++;
+			}
+		}
+		else if (*fsmtrie_get_error(w->fsmtrie) != '\0')
+		{
+			w->failed++;
+		}
+	}
+
+	return (NULL);
+}
+
+static void
+run_workers_rcu(fsmtrie_t fsmtrie, bool rcu)
+{
+	struct worker workers[NTHREADS];
+	pthread_t threads[NTHREADS];
+	int n;
+
+	for (n = 0; n < NTHREADS; n++)
+	{
+		workers[n].fsmtrie = fsmtrie;
+		workers[n].id = n;
+		workers[n].rcu = rcu;
+		workers[n].failed = 0;
+		ck_assert_int_eq(pthread_create(&threads[n], NULL, worker,
+					&workers[n]), 0);
+	}
+	for (n = 0; n < NTHREADS; n++)
+	{
+		ck_assert_int_eq(pthread_join(threads[n], NULL), 0);
+		ck_assert_int_eq(workers[n].failed, 0);
+	}
+}
+
+static void
+run_workers(fsmtrie_t fsmtrie)
+{
+	run_workers_rcu(fsmtrie, false);
+}
+
+static fsmtrie_t
+build_opt(bool dfa, bool rcu)
+{
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+	int n;
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_ascii), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_maxlength(opt, 64), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_dfa(opt, dfa), 1);
+	ck_assert_int_eq(fsmtrie_opt_set_rcu(opt, rcu), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+			NULL);
+	fsmtrie_opt_free(opt);
+
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], keys[n]), 1);
+	}
+	if (rcu)
+	{
+		ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+	}
+
+	return (fsmtrie);
+}
+
+static fsmtrie_t
+build(bool dfa)
+{
+	return (build_opt(dfa, false));
+}
+
+/* keys the RCU writer adds, none of them occurs in text */
+#define NWRITES		2000
+#define WRITE_BATCH	16
+
+static char writes[NWRITES][16];
+
+struct writer
+{
+	fsmtrie_t fsmtrie;
+	int failed;
+};
+
+static void *
+writer(void *arg)
+{
+	struct writer *w = arg;
+	int n;
+
+	for (n = 0; n < NWRITES; n++)
+	{
+		if (fsmtrie_insert(w->fsmtrie, writes[n], writes[n]) != 1)
+		{
+			w->failed++;
+		}
+		if ((n + 1) % WRITE_BATCH == 0 &&
+				fsmtrie_publish(w->fsmtrie) != 1)
+		{
+			w->failed++;
+		}
+	}
+	if (fsmtrie_publish(w->fsmtrie) != 1)
+	{
+		w->failed++;
+	}
+
+	return (NULL);
+}
+
+static void
+run_writer(bool dfa)
+{
+	fsmtrie_t fsmtrie;
+	struct writer w;
+	pthread_t thread;
+	const char *str;
+	int n;
+
+	for (n = 0; n < NWRITES; n++)
+	{
+		snprintf(writes[n], sizeof (writes[n]), "q%dq%d", n % 97, n);
+	}
+
+	fsmtrie = build_opt(dfa, true);
+	w.fsmtrie = fsmtrie;
+	w.failed = 0;
+	ck_assert_int_eq(pthread_create(&thread, NULL, writer, &w), 0);
+	run_workers_rcu(fsmtrie, true);
+	ck_assert_int_eq(pthread_join(thread, NULL), 0);
+	ck_assert_int_eq(w.failed, 0);
+
+	for (n = 0; n < NWRITES; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, writes[n], &str), 1);
+		ck_assert_str_eq(str, writes[n]);
+	}
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), NWRITES + 12);
+	fsmtrie_destroy(&fsmtrie);
+}
+
+START_TEST(test_trie_threads_compiled)
+{
+	fsmtrie_t fsmtrie;
+
+	fsmtrie = build(false);
+	ck_assert_int_eq(fsmtrie_compile(fsmtrie), 1);
+	run_workers(fsmtrie);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_threads_lazy)
+{
+	fsmtrie_t fsmtrie;
+
+	/* the workers race to compile the trie on their first search */
+	fsmtrie = build(false);
+	run_workers(fsmtrie);
+	fsmtrie_destroy(&fsmtrie);
+
+	fsmtrie = build(true);
+	run_workers(fsmtrie);
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_threads_errors)
+{
+	fsmtrie_t fsmtrie;
+	uint32_t token[] = { 1, 2, 3 };
+	const char *str;
+
+	ck_assert_int_eq(fsmtrie_compile(NULL), 0);
+
+	fsmtrie = build(false);
+	ck_assert_int_eq(fsmtrie_search_token(fsmtrie, token, 3, &str), -1);
+	ck_assert_str_ne(fsmtrie_get_error(fsmtrie), "");
+
+	/* the error belongs to this thread, not to the workers */
+	run_workers(fsmtrie);
+	ck_assert_str_ne(fsmtrie_get_error(fsmtrie), "");
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+START_TEST(test_trie_threads_rcu)
+{
+	/* readers never stop while the writer inserts and publishes */
+	run_writer(false);
+	run_writer(true);
+}
+END_TEST
+
+static void count_scan(const char *str, uint64_t off, void *data)
+{
+	(void)off;
+	if (str != NULL && strcmp(str, "lovedogs") == 0)
+	{
+		(*(int *)data)++;
+	}
+}
+
+START_TEST(test_trie_rcu)
+{
+	fsmtrie_t fsmtrie;
+	fsmtrie_opt_t opt;
+	fsmtrie_scanner_t scanner;
+	char err_buf[BUFSIZ];
+	const char *str;
+	uint32_t nodes;
+	int matches;
+	bool on;
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_int_eq(fsmtrie_opt_get_rcu(opt, &on), 1);
+	ck_assert_int_eq(on, 0);
+	ck_assert_int_eq(fsmtrie_opt_set_rcu(opt, true), 1);
+	ck_assert_int_eq(fsmtrie_opt_get_rcu(opt, &on), 1);
+	ck_assert_int_eq(on, 1);
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_ptr_eq(fsmtrie_init(opt, err_buf, sizeof (err_buf)), NULL);
+	fsmtrie_opt_free(opt);
+
+	fsmtrie = build(false);
+	ck_assert_int_eq(fsmtrie_publish(fsmtrie), 0);
+	ck_assert_str_ne(fsmtrie_get_error(fsmtrie), "");
+	fsmtrie_destroy(&fsmtrie);
+
+	fsmtrie = build_opt(false, true);
+	nodes = fsmtrie_get_nodecnt(fsmtrie);
+
+	/* nothing is visible before it is published */
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "lovedogs", "lovedogs"), 1);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "lovedogs", &str), 0);
+	matches = 0;
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, text, count_report,
+				&matches), 1);
+	ck_assert_int_eq(matches, TEXT_MATCHES);
+
+	/* copies replace nodes, they don't add to them */
+	ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+	ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie), nodes + 4);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "lovedogs", &str), 1);
+	ck_assert_str_eq(str, "lovedogs");
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "love", &str), 1);
+	matches = 0;
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, text, count_report,
+				&matches), 1);
+	ck_assert_int_eq(matches, TEXT_MATCHES + 1);
+
+	/* duplicates and empty publications change nothing */
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "lovedogs", NULL), 1);
+	ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 13);
+
+	/* a scanner starts over on the new version */
+	matches = 0;
+	ck_assert_ptr_ne(scanner = fsmtrie_scanner_init(fsmtrie, count_scan,
+				&matches), NULL);
+	ck_assert_int_eq(fsmtrie_scanner_feed(scanner, "xxlove", 6), 1);
+	ck_assert_int_eq(fsmtrie_insert(fsmtrie, "dogsx", NULL), 1);
+	ck_assert_int_eq(fsmtrie_publish(fsmtrie), 1);
+	ck_assert_int_eq(fsmtrie_scanner_feed(scanner, "dogs", 4), 1);
+	ck_assert_int_eq(matches, 0);
+	ck_assert_int_eq(fsmtrie_scanner_feed(scanner, "xxlovedogs", 10), 1);
+	ck_assert_int_eq(matches, 1);
+	fsmtrie_scanner_destroy(&scanner);
+
+	fsmtrie_destroy(&fsmtrie);
+}
+END_TEST
+
+#define NPARALLEL	5000
+
+START_TEST(test_trie_insert_parallel)
+{
+	int n, m, matches, matches_ref;
+	const char *str, *bad[] = { "ok", "b\xc8" };
+	static char buf[NPARALLEL][16];
+	static const char *pkeys[NPARALLEL];
+	static uint32_t tokens[NPARALLEL][4];
+	static const uint32_t *tkeys[NPARALLEL];
+	static size_t tkeylens[NPARALLEL];
+	const uint32_t missing[] = { 97 };
+	fsmtrie_t fsmtrie, fsmtrie_ref;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+
+	/* every leading byte, with duplicates and keys that are prefixes */
+	for (n = 0; n < NPARALLEL; n++)
+	{
+		snprintf(buf[n], sizeof (buf[n]), "%c%d", 1 + n % 127,
+				(n * 7919) % (NPARALLEL / 2));
+		pkeys[n] = buf[n];
+		for (m = 0; m < 4; m++)
+		{
+			tokens[n][m] = (n * 31 + m * 17) % 97;
+		}
+		tkeys[n] = tokens[n];
+		tkeylens[n] = 1 + n % 4;
+	}
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_ptr_ne(fsmtrie_ref = fsmtrie_init(opt, err_buf,
+				sizeof (err_buf)), NULL);
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie, keys[n], NULL), 1);
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie_ref, keys[n], NULL), 1);
+	}
+	for (n = 0; n < NPARALLEL; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(fsmtrie_ref, pkeys[n], pkeys[n]),
+				1);
+	}
+	ck_assert_int_eq(fsmtrie_insert_parallel(fsmtrie, pkeys, pkeys,
+				NPARALLEL, NTHREADS), 1);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie),
+			fsmtrie_get_keycnt(fsmtrie_ref));
+	ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie),
+			fsmtrie_get_nodecnt(fsmtrie_ref));
+	for (n = 0; n < NPARALLEL; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, pkeys[n], &str), 1);
+		ck_assert_str_eq(str, pkeys[n]);
+	}
+	matches = matches_ref = 0;
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, text,
+				count_report, &matches), 1);
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie_ref, text,
+				count_report, &matches_ref), 1);
+	ck_assert_int_eq(matches, matches_ref);
+
+	/* nothing is inserted if a key is invalid */
+	n = fsmtrie_get_keycnt(fsmtrie);
+	ck_assert_int_eq(fsmtrie_insert_parallel(fsmtrie, bad, NULL, 2, 2), 0);
+	ck_assert_ptr_ne(strstr(fsmtrie_get_error(fsmtrie), "key 1:"), NULL);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), n);
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "ok", &str), 0);
+	ck_assert_int_eq(fsmtrie_insert_token_parallel(fsmtrie, tkeys,
+				tkeylens, NULL, NPARALLEL, 0), 0);
+
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_destroy(&fsmtrie_ref);
+
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_token), 1);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_ptr_ne(fsmtrie_ref = fsmtrie_init(opt, err_buf,
+				sizeof (err_buf)), NULL);
+	for (n = 0; n < NPARALLEL; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert_token(fsmtrie_ref,
+					tokens[n], tkeylens[n], NULL), 1);
+	}
+	ck_assert_int_eq(fsmtrie_insert_token_parallel(fsmtrie, tkeys,
+				tkeylens, NULL, NPARALLEL, NTHREADS), 1);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie),
+			fsmtrie_get_keycnt(fsmtrie_ref));
+	ck_assert_int_eq(fsmtrie_get_nodecnt(fsmtrie),
+			fsmtrie_get_nodecnt(fsmtrie_ref));
+	for (n = 0; n < NPARALLEL; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search_token(fsmtrie, tokens[n],
+					tkeylens[n], &str), 1);
+	}
+	ck_assert_int_eq(fsmtrie_search_token(fsmtrie, missing, 1, &str), 0);
+
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_destroy(&fsmtrie_ref);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+START_TEST(test_trie_merge)
+{
+	int n;
+	const char *str;
+	fsmtrie_t fsmtrie, src;
+	fsmtrie_opt_t opt;
+	char err_buf[BUFSIZ];
+
+	ck_assert_ptr_ne(opt = fsmtrie_opt_init(), NULL);
+	ck_assert_ptr_ne(fsmtrie = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_ptr_ne(src = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_insert(n % 2 ? src : fsmtrie, keys[n],
+					"first"), 1);
+	}
+	ck_assert_int_eq(fsmtrie_insert(src, "foo", "second"), 1);
+	ck_assert_int_eq(fsmtrie_insert(src, "fo", "second"), 1);
+
+	ck_assert_int_eq(fsmtrie_merge(fsmtrie, &fsmtrie), 0);
+	ck_assert_int_eq(fsmtrie_merge(fsmtrie, &src), 1);
+	ck_assert_ptr_eq(src, NULL);
+	ck_assert_int_eq(fsmtrie_get_keycnt(fsmtrie), 13);
+	for (n = 0; keys[n]; n++)
+	{
+		ck_assert_int_eq(fsmtrie_search(fsmtrie, keys[n], &str), 1);
+		ck_assert_str_eq(str, "first");
+	}
+	ck_assert_int_eq(fsmtrie_search(fsmtrie, "fo", &str), 1);
+	ck_assert_str_eq(str, "second");
+	n = 0;
+	ck_assert_int_eq(fsmtrie_search_substring(fsmtrie, text, count_report,
+				&n), 1);
+	ck_assert_int_eq(n, TEXT_MATCHES + 1);
+
+	/* only fsmtries of the same mode merge */
+	ck_assert_int_eq(fsmtrie_opt_set_mode(opt, fsmtrie_mode_eascii), 1);
+	ck_assert_ptr_ne(src = fsmtrie_init(opt, err_buf, sizeof (err_buf)),
+	    NULL);
+	ck_assert_int_eq(fsmtrie_merge(fsmtrie, &src), 0);
+	ck_assert_ptr_ne(src, NULL);
+
+	fsmtrie_destroy(&src);
+	fsmtrie_destroy(&fsmtrie);
+	fsmtrie_opt_destroy(&opt);
+}
+END_TEST
+
+int main(void)
+{
+	int number_failed;
+	Suite *s;
+	TCase *tc_core;
+	SRunner *sr;
+
+	s = suite_create("fsmtrie_trie");
+	tc_core = tcase_create("core");
+	tcase_set_timeout(tc_core, 60);
+	tcase_add_test(tc_core, test_trie_threads_compiled);
+	tcase_add_test(tc_core, test_trie_threads_lazy);
+	tcase_add_test(tc_core, test_trie_threads_errors);
+	tcase_add_test(tc_core, test_trie_threads_rcu);
+	tcase_add_test(tc_core, test_trie_rcu);
+	tcase_add_test(tc_core, test_trie_insert_parallel);
+	tcase_add_test(tc_core, test_trie_merge);
+	suite_add_tcase(s, tc_core);
+
+	sr = srunner_create(s);
+
+	srunner_run_all(sr, CK_NORMAL);
+	number_failed = srunner_ntests_failed(sr);
+	srunner_free(sr);
+	return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}